@@ -0,0 +1,774 @@
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "utils/camera.h"
+#include "utils/model.h"
+#include "utils/thread_pool.h"
+#include "utils/timing_stats.h"
+#include "utils/vk.h"
+#include "utils/vk_allocator.h"
+#include "utils/vk_upload.h"
+
+namespace {
+
+constexpr char kUsage[] =
+    "Usage: utils_bench [--report=PATH] [--max-faces=N] [--no-vulkan]\n"
+    "                   [OBJ files...]";
+
+constexpr char kSyntheticObjPath[] = "utils_bench_model.obj";
+constexpr char kSyntheticMtlPath[] = "utils_bench_model.mtl";
+
+constexpr int kLoadRepetitions = 3;
+
+constexpr int kSyntheticFaceCounts[] = {
+    1000, 10000, 100000, 1000000, 10000000 };
+
+constexpr int kCameraIterations = 1000000;
+constexpr int kCameraBatchSize = 1024;
+constexpr int kCameraBatchIterations = 1000;
+
+constexpr int kCreateIterations = 1000;
+
+constexpr VkDeviceSize kCreateBufferSizes[] = {
+    256, 64 * 1024, 4 * 1024 * 1024, 128 * 1024 * 1024 };
+
+constexpr uint32_t kCreateImageExtents[] = { 256, 1024, 4096 };
+
+constexpr VkDeviceSize kUploadSizes[] = {
+    4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024 };
+
+// Every upload size copies about this much in total, in at least
+// kMinUploadIterations uploads.
+constexpr VkDeviceSize kUploadBytesPerSize = 512ull * 1024 * 1024;
+constexpr int kMinUploadIterations = 8;
+
+using Clock = std::chrono::steady_clock;
+
+double GetMilliseconds(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// One line of the report: a benchmark name, the numbers it measured and, for
+// benchmarks that time every iteration, the latency distribution.
+struct BenchmarkResult {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> strings;
+  std::vector<std::pair<std::string, double>> values;
+
+  bool has_latency = false;
+  utils::TimingStats latency;
+};
+
+struct BenchOptions {
+  std::string report_path;
+  int max_face_count = 10000000;
+  bool vulkan = true;
+  std::vector<std::string> obj_paths;
+};
+
+// Strips `prefix` off the front of `arg`. Leaves `arg` alone and returns false
+// if it doesn't start with `prefix`.
+bool ConsumePrefix(std::string_view prefix, std::string_view* arg) {
+  if (arg->substr(0, prefix.size()) != prefix)
+    return false;
+
+  arg->remove_prefix(prefix.size());
+  return true;
+}
+
+bool ParseOptions(int argc, char** argv, BenchOptions* options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+
+    if (ConsumePrefix("--report=", &arg)) {
+      if (arg.empty())
+        return false;
+      options->report_path = std::string(arg);
+    } else if (ConsumePrefix("--max-faces=", &arg)) {
+      auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(),
+                                          options->max_face_count);
+      if (error != std::errc() || end != arg.data() + arg.size() ||
+          options->max_face_count <= 0) {
+        return false;
+      }
+    } else if (arg == "--no-vulkan") {
+      options->vulkan = false;
+    } else if (ConsumePrefix("--", &arg)) {
+      return false;
+    } else {
+      options->obj_paths.push_back(argv[i]);
+    }
+  }
+  return true;
+}
+
+// Paths come from the command line, so they may hold anything.
+void WriteJsonString(std::string_view value, std::ostream* strm) {
+  *strm << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      *strm << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      *strm << escaped;
+    } else {
+      *strm << c;
+    }
+  }
+  *strm << '"';
+}
+
+// Writes the results as a JSON array with one object per result.
+bool WriteReport(const std::vector<BenchmarkResult>& results,
+                 std::ostream* strm) {
+  // Enough digits for byte counts to come out exact.
+  *strm << std::setprecision(15);
+
+  *strm << "[\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchmarkResult& result = results[i];
+
+    *strm << "  { \"name\": \"" << result.name << "\"";
+    for (const auto& [key, value] : result.strings) {
+      *strm << ", \"" << key << "\": ";
+      WriteJsonString(value, strm);
+    }
+    for (const auto& [key, value] : result.values) {
+      *strm << ", \"" << key << "\": " << value;
+    }
+    if (result.has_latency) {
+      *strm << ", \"latency\": { \"samples\": " << result.latency.sample_count
+            << ", \"mean_ms\": " << result.latency.mean_ms
+            << ", \"p50_ms\": " << result.latency.p50_ms
+            << ", \"p95_ms\": " << result.latency.p95_ms
+            << ", \"p99_ms\": " << result.latency.p99_ms
+            << ", \"max_ms\": " << result.latency.max_ms << " }";
+    }
+    *strm << (i + 1 < results.size() ? " },\n" : " }\n");
+  }
+  *strm << "]" << std::endl;
+
+  return static_cast<bool>(*strm);
+}
+
+// Writes a square grid of about `face_count` quads. Every other row uses
+// negative indices and switches material, to exercise all the paths the
+// loader supports.
+bool WriteSyntheticObj(int face_count, size_t* file_size) {
+  std::ofstream mtl_strm(kSyntheticMtlPath);
+  if (!mtl_strm.is_open())
+    return false;
+
+  mtl_strm << "newmtl white\nKa 0.5 0.5 0.5\nKd 0.7 0.7 0.7\n";
+  mtl_strm << "newmtl red\nKa 0.6 0.06 0.05\nKd 0.6 0.06 0.05\n";
+  mtl_strm.close();
+
+  std::ofstream strm(kSyntheticObjPath, std::ios::binary);
+  if (!strm.is_open())
+    return false;
+
+  int side = 1;
+  while (side * side < face_count)
+    ++side;
+
+  strm << "mtllib " << kSyntheticMtlPath << "\n";
+
+  char line[128];
+  for (int y = 0; y <= side; ++y) {
+    for (int x = 0; x <= side; ++x) {
+      snprintf(line, sizeof(line), "v %.4f %.4f 0.0000\n", x * 0.01f,
+               y * 0.01f);
+      strm << line;
+    }
+  }
+
+  int row_size = side + 1;
+  int vertex_count = row_size * row_size;
+
+  for (int y = 0; y < side; ++y) {
+    strm << (y % 2 == 0 ? "usemtl white\n" : "usemtl red\n");
+
+    for (int x = 0; x < side; ++x) {
+      int v0 = y * row_size + x + 1;
+      int v1 = v0 + 1;
+      int v2 = v1 + row_size;
+      int v3 = v0 + row_size;
+
+      if (y % 2 == 1) {
+        v0 -= vertex_count + 1;
+        v1 -= vertex_count + 1;
+        v2 -= vertex_count + 1;
+        v3 -= vertex_count + 1;
+      }
+      snprintf(line, sizeof(line), "f %d %d %d %d\n", v0, v1, v2, v3);
+      strm << line;
+    }
+  }
+
+  *file_size = static_cast<size_t>(strm.tellp());
+  return static_cast<bool>(strm);
+}
+
+// Single threaded when `thread_pool` is null.
+bool BenchmarkLoadModel(const std::string& path, size_t file_size,
+                        utils::ThreadPool* thread_pool,
+                        std::vector<BenchmarkResult>* results) {
+  double best_seconds = 0.0;
+  utils::Model model;
+
+  for (int i = 0; i < kLoadRepetitions; ++i) {
+    auto start = Clock::now();
+    if (!utils::LoadModel(path, &model, false, thread_pool)) {
+      std::cerr << "Could not load " << path << "." << std::endl;
+      return false;
+    }
+    double seconds = GetMilliseconds(start, Clock::now()) / 1000.0;
+
+    if (i == 0 || seconds < best_seconds)
+      best_seconds = seconds;
+  }
+
+  double megabytes = static_cast<double>(file_size) / (1024.0 * 1024.0);
+  int thread_count = thread_pool ? thread_pool->GetThreadCount() : 1;
+
+  BenchmarkResult result;
+  result.name = "load_model";
+  result.strings = { { "path", path } };
+  result.values = {
+      { "threads", thread_count },
+      { "triangles", static_cast<double>(model.index_buffer.size() / 3) },
+      { "bytes", static_cast<double>(file_size) },
+      { "seconds", best_seconds },
+      { "mb_per_s", megabytes / best_seconds } };
+  results->push_back(result);
+  return true;
+}
+
+bool BenchmarkLoadModelFile(const std::string& path,
+                            utils::ThreadPool* thread_pool,
+                            std::vector<BenchmarkResult>* results) {
+  std::ifstream strm(path, std::ios::ate | std::ios::binary);
+  if (!strm.is_open()) {
+    std::cerr << "Could not open " << path << "." << std::endl;
+    return false;
+  }
+  size_t file_size = static_cast<size_t>(strm.tellg());
+
+  return BenchmarkLoadModel(path, file_size, nullptr, results) &&
+         BenchmarkLoadModel(path, file_size, thread_pool, results);
+}
+
+bool BenchmarkSyntheticModels(int max_face_count,
+                              utils::ThreadPool* thread_pool,
+                              std::vector<BenchmarkResult>* results) {
+  bool success = true;
+
+  for (int face_count : kSyntheticFaceCounts) {
+    if (face_count > max_face_count)
+      break;
+
+    size_t file_size;
+    if (!WriteSyntheticObj(face_count, &file_size)) {
+      std::cerr << "Could not write synthetic model." << std::endl;
+      success = false;
+      break;
+    }
+    if (!BenchmarkLoadModel(kSyntheticObjPath, file_size, nullptr, results) ||
+        !BenchmarkLoadModel(kSyntheticObjPath, file_size, thread_pool,
+                            results)) {
+      success = false;
+      break;
+    }
+    results->back().values.push_back({ "faces", face_count });
+    results->rbegin()[1].values.push_back({ "faces", face_count });
+  }
+
+  std::remove(kSyntheticObjPath);
+  std::remove(kSyntheticMtlPath);
+
+  return success;
+}
+
+BenchmarkResult MakeRateResult(const char* name, int iterations,
+                               double milliseconds) {
+  BenchmarkResult result;
+  result.name = name;
+  result.values = {
+      { "iterations", iterations },
+      { "ns_per_call", milliseconds * 1e6 / iterations },
+      { "calls_per_s", iterations / (milliseconds / 1000.0) } };
+  return result;
+}
+
+void BenchmarkCamera(std::vector<BenchmarkResult>* results) {
+  // Keeps the compiler from dropping the matrices that are never used.
+  volatile float sink = 0.f;
+
+  // A moving camera rebuilds its view matrix on every GetViewMat() call.
+  utils::Camera camera;
+  camera.StartMovement(utils::Camera::Direction::kPosZ, 1.f);
+  camera.StartMovement(utils::Camera::Direction::kPosYaw, 0.5f);
+
+  auto start = Clock::now();
+  for (int i = 0; i < kCameraIterations; ++i) {
+    camera.Tick(1000.f / 60.f);
+    sink = sink + camera.GetViewMat()[3][0];
+  }
+  results->push_back(MakeRateResult("camera_tick_view_mat",
+                                    kCameraIterations,
+                                    GetMilliseconds(start, Clock::now())));
+
+  // A still camera returns its cached matrix.
+  utils::Camera still_camera;
+  still_camera.GetViewMat();
+
+  start = Clock::now();
+  for (int i = 0; i < kCameraIterations; ++i) {
+    still_camera.Tick(1000.f / 60.f);
+    sink = sink + still_camera.GetViewMat()[3][0];
+  }
+  results->push_back(MakeRateResult("camera_tick_cached_view_mat",
+                                    kCameraIterations,
+                                    GetMilliseconds(start, Clock::now())));
+
+  std::vector<utils::Camera> cameras(kCameraBatchSize);
+  for (size_t i = 0; i < cameras.size(); ++i) {
+    cameras[i].SetPosition(glm::vec3(static_cast<float>(i), 0.f, 0.f));
+    cameras[i].StartMovement(utils::Camera::Direction::kPosPitch, 0.1f);
+  }
+  std::vector<glm::mat4> view_proj_mats(kCameraBatchSize);
+  glm::mat4 proj_mat(1.f);
+
+  start = Clock::now();
+  for (int i = 0; i < kCameraBatchIterations; ++i) {
+    utils::TickCameras(cameras.data(), cameras.size(), 1000.f / 60.f,
+                       proj_mat, view_proj_mats.data());
+    sink = sink + view_proj_mats[i % kCameraBatchSize][3][0];
+  }
+  BenchmarkResult batch_result = MakeRateResult(
+      "tick_cameras", kCameraBatchIterations * kCameraBatchSize,
+      GetMilliseconds(start, Clock::now()));
+  batch_result.values.push_back({ "batch_size", kCameraBatchSize });
+  results->push_back(batch_result);
+}
+
+// A compute or graphics queue on the first discrete GPU, or the first GPU if
+// there isn't one. Nothing is presented, so no extensions are enabled.
+struct HeadlessDevice {
+  VkInstance instance = VK_NULL_HANDLE;
+  VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+  VkDevice device = VK_NULL_HANDLE;
+  uint32_t queue_family_index = 0;
+  VkQueue queue = VK_NULL_HANDLE;
+  std::string device_name;
+
+  bool Init();
+  void Destroy();
+};
+
+bool HeadlessDevice::Init() {
+  VkApplicationInfo app_info{};
+  app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+  app_info.pApplicationName = "utils_bench";
+  app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+  app_info.pEngineName = "No Engine";
+  app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
+  app_info.apiVersion = VK_API_VERSION_1_1;
+
+  VkInstanceCreateInfo instance_info{};
+  instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  instance_info.pApplicationInfo = &app_info;
+
+  if (vkCreateInstance(&instance_info, nullptr, &instance) != VK_SUCCESS) {
+    std::cerr << "Could not create instance." << std::endl;
+    return false;
+  }
+
+  uint32_t physical_device_count = 0;
+  vkEnumeratePhysicalDevices(instance, &physical_device_count, nullptr);
+  std::vector<VkPhysicalDevice> physical_devices(physical_device_count);
+  vkEnumeratePhysicalDevices(instance, &physical_device_count,
+                             physical_devices.data());
+
+  for (VkPhysicalDevice candidate : physical_devices) {
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(candidate, &queue_family_count,
+                                             nullptr);
+    std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(candidate, &queue_family_count,
+                                             queue_families.data());
+
+    // Graphics and compute queues can always do transfers too.
+    int candidate_queue_family = -1;
+    for (uint32_t i = 0; i < queue_family_count; ++i) {
+      if (queue_families[i].queueFlags &
+              (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) {
+        candidate_queue_family = static_cast<int>(i);
+        break;
+      }
+    }
+    if (candidate_queue_family < 0)
+      continue;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(candidate, &properties);
+
+    bool is_discrete =
+        properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+    if (physical_device == VK_NULL_HANDLE || is_discrete) {
+      physical_device = candidate;
+      queue_family_index = static_cast<uint32_t>(candidate_queue_family);
+      device_name = properties.deviceName;
+    }
+    if (is_discrete)
+      break;
+  }
+
+  if (physical_device == VK_NULL_HANDLE) {
+    std::cerr << "Could not find a suitable physical device." << std::endl;
+    return false;
+  }
+
+  float queue_priority = 1.f;
+
+  VkDeviceQueueCreateInfo queue_info{};
+  queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+  queue_info.queueFamilyIndex = queue_family_index;
+  queue_info.queueCount = 1;
+  queue_info.pQueuePriorities = &queue_priority;
+
+  VkDeviceCreateInfo device_info{};
+  device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  device_info.queueCreateInfoCount = 1;
+  device_info.pQueueCreateInfos = &queue_info;
+
+  if (vkCreateDevice(physical_device, &device_info, nullptr, &device) !=
+          VK_SUCCESS) {
+    std::cerr << "Could not create logical device." << std::endl;
+    return false;
+  }
+
+  vkGetDeviceQueue(device, queue_family_index, 0, &queue);
+  return true;
+}
+
+void HeadlessDevice::Destroy() {
+  if (device != VK_NULL_HANDLE)
+    vkDestroyDevice(device, nullptr);
+  if (instance != VK_NULL_HANDLE)
+    vkDestroyInstance(instance, nullptr);
+}
+
+BenchmarkResult MakeLatencyResult(const char* name, const char* path,
+                                  const utils::SampleHistory& samples) {
+  BenchmarkResult result;
+  result.name = name;
+  result.strings = { { "path", path } };
+  result.has_latency = true;
+  result.latency = samples.GetStats();
+  return result;
+}
+
+// Times creating and binding each buffer, with and without the sub-allocator.
+// The buffers are destroyed outside the timed section.
+bool BenchmarkCreateBuffer(const HeadlessDevice& device,
+                           utils::vk::MemoryAllocator* allocator,
+                           std::vector<BenchmarkResult>* results) {
+  for (VkDeviceSize size : kCreateBufferSizes) {
+    VkBufferCreateInfo buffer_info{};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    utils::SampleHistory allocator_samples(kCreateIterations);
+    utils::SampleHistory dedicated_samples(kCreateIterations);
+
+    for (int i = 0; i < kCreateIterations; ++i) {
+      VkBuffer buffer;
+      utils::vk::Allocation allocation;
+
+      auto start = Clock::now();
+      if (!utils::vk::CreateBuffer(buffer_info,
+                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                   device.device, allocator, buffer,
+                                   allocation)) {
+        std::cerr << "Could not create buffer." << std::endl;
+        return false;
+      }
+      allocator_samples.Add(GetMilliseconds(start, Clock::now()));
+
+      vkDestroyBuffer(device.device, buffer, nullptr);
+      allocator->Free(allocation);
+
+      VkDeviceMemory memory;
+
+      start = Clock::now();
+      if (!utils::vk::CreateBuffer(buffer_info,
+                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                   device.physical_device, device.device,
+                                   buffer, memory)) {
+        std::cerr << "Could not create buffer." << std::endl;
+        return false;
+      }
+      dedicated_samples.Add(GetMilliseconds(start, Clock::now()));
+
+      vkDestroyBuffer(device.device, buffer, nullptr);
+      vkFreeMemory(device.device, memory, nullptr);
+    }
+
+    results->push_back(
+        MakeLatencyResult("create_buffer", "allocator", allocator_samples));
+    results->back().values.push_back({ "bytes", static_cast<double>(size) });
+
+    results->push_back(
+        MakeLatencyResult("create_buffer", "dedicated", dedicated_samples));
+    results->back().values.push_back({ "bytes", static_cast<double>(size) });
+  }
+  return true;
+}
+
+// Same as above for optimally tiled, sampled RGBA8 images.
+bool BenchmarkCreateImage(const HeadlessDevice& device,
+                          utils::vk::MemoryAllocator* allocator,
+                          std::vector<BenchmarkResult>* results) {
+  for (uint32_t extent : kCreateImageExtents) {
+    VkImageCreateInfo image_info{};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.extent.width = extent;
+    image_info.extent.height = extent;
+    image_info.extent.depth = 1;
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT |
+                       VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    utils::SampleHistory allocator_samples(kCreateIterations);
+    utils::SampleHistory dedicated_samples(kCreateIterations);
+
+    for (int i = 0; i < kCreateIterations; ++i) {
+      VkImage image;
+      utils::vk::Allocation allocation;
+
+      auto start = Clock::now();
+      if (!utils::vk::CreateImage(image_info,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                  device.device, allocator, image,
+                                  allocation)) {
+        std::cerr << "Could not create image." << std::endl;
+        return false;
+      }
+      allocator_samples.Add(GetMilliseconds(start, Clock::now()));
+
+      vkDestroyImage(device.device, image, nullptr);
+      allocator->Free(allocation);
+
+      VkDeviceMemory memory;
+
+      start = Clock::now();
+      if (!utils::vk::CreateImage(image_info,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                  device.physical_device, device.device,
+                                  image, memory)) {
+        std::cerr << "Could not create image." << std::endl;
+        return false;
+      }
+      dedicated_samples.Add(GetMilliseconds(start, Clock::now()));
+
+      vkDestroyImage(device.device, image, nullptr);
+      vkFreeMemory(device.device, memory, nullptr);
+    }
+
+    results->push_back(
+        MakeLatencyResult("create_image", "allocator", allocator_samples));
+    results->back().values.push_back({ "extent", extent });
+
+    results->push_back(
+        MakeLatencyResult("create_image", "dedicated", dedicated_samples));
+    results->back().values.push_back({ "extent", extent });
+  }
+  return true;
+}
+
+// Times uploads through the staging ring into a device local buffer, each
+// one waited on before the next, so the latency includes the submission.
+// Uploads bigger than the ring are split into several batches.
+bool BenchmarkUpload(const HeadlessDevice& device,
+                     utils::vk::MemoryAllocator* allocator,
+                     std::vector<BenchmarkResult>* results) {
+  utils::vk::UploadManager upload_manager;
+  if (!upload_manager.Init(device.device, allocator,
+                           device.queue_family_index, device.queue)) {
+    std::cerr << "Could not initialize upload manager." << std::endl;
+    return false;
+  }
+
+  bool success = true;
+
+  for (VkDeviceSize size : kUploadSizes) {
+    VkBufferCreateInfo buffer_info{};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkBuffer buffer;
+    utils::vk::Allocation allocation;
+    if (!utils::vk::CreateBuffer(buffer_info,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                 device.device, allocator, buffer,
+                                 allocation)) {
+      std::cerr << "Could not create upload buffer." << std::endl;
+      success = false;
+      break;
+    }
+
+    std::vector<char> data(static_cast<size_t>(size), 1);
+
+    int iterations = std::max(kMinUploadIterations,
+                              static_cast<int>(kUploadBytesPerSize / size));
+    utils::SampleHistory samples(iterations);
+
+    // The first upload pays for the command buffers being set up.
+    success = upload_manager.UploadToBuffer(data.data(), size, buffer) &&
+              upload_manager.Wait();
+
+    double total_milliseconds = 0.0;
+    for (int i = 0; i < iterations && success; ++i) {
+      auto start = Clock::now();
+      success = upload_manager.UploadToBuffer(data.data(), size, buffer) &&
+                upload_manager.Wait();
+      double milliseconds = GetMilliseconds(start, Clock::now());
+
+      samples.Add(milliseconds);
+      total_milliseconds += milliseconds;
+    }
+
+    vkDestroyBuffer(device.device, buffer, nullptr);
+    allocator->Free(allocation);
+
+    if (!success) {
+      std::cerr << "Could not upload buffer." << std::endl;
+      break;
+    }
+
+    double gigabytes = static_cast<double>(size) * iterations /
+        (1024.0 * 1024.0 * 1024.0);
+
+    BenchmarkResult result =
+        MakeLatencyResult("staging_upload", "upload_manager", samples);
+    result.values = {
+        { "bytes", static_cast<double>(size) },
+        { "iterations", iterations },
+        { "gb_per_s", gigabytes / (total_milliseconds / 1000.0) } };
+    results->push_back(result);
+  }
+
+  upload_manager.Destroy();
+  return success;
+}
+
+bool BenchmarkVulkan(std::vector<BenchmarkResult>* results) {
+  HeadlessDevice device;
+  if (!device.Init()) {
+    device.Destroy();
+    return false;
+  }
+
+  BenchmarkResult device_result;
+  device_result.name = "vulkan_device";
+  device_result.strings = { { "device", device.device_name } };
+  results->push_back(device_result);
+
+  utils::vk::MemoryAllocator allocator;
+  if (!allocator.Init(device.physical_device, device.device)) {
+    std::cerr << "Could not initialize memory allocator." << std::endl;
+    device.Destroy();
+    return false;
+  }
+
+  bool success = BenchmarkCreateBuffer(device, &allocator, results) &&
+                 BenchmarkCreateImage(device, &allocator, results) &&
+                 BenchmarkUpload(device, &allocator, results);
+
+  allocator.Destroy();
+  device.Destroy();
+  return success;
+}
+
+}  // namespace
+
+// With no OBJ files, benchmarks loading synthetic grids of increasing size.
+// Otherwise benchmarks loading the OBJ files given on the command line. The
+// camera, allocation and upload benchmarks always run, the last two unless
+// --no-vulkan is given. The report is a JSON array written to stdout, or to
+// the file given with --report.
+int main(int argc, char** argv) {
+  BenchOptions options;
+  if (!ParseOptions(argc, argv, &options)) {
+    std::cerr << kUsage << std::endl;
+    return -1;
+  }
+
+  utils::ThreadPool thread_pool;
+  std::vector<BenchmarkResult> results;
+  bool success = true;
+
+  if (options.obj_paths.empty()) {
+    success = BenchmarkSyntheticModels(options.max_face_count, &thread_pool,
+                                       &results);
+  } else {
+    for (const std::string& path : options.obj_paths) {
+      if (!BenchmarkLoadModelFile(path, &thread_pool, &results)) {
+        success = false;
+        break;
+      }
+    }
+  }
+
+  BenchmarkCamera(&results);
+
+  if (options.vulkan && !BenchmarkVulkan(&results))
+    success = false;
+
+  std::ofstream file_strm;
+  std::ostream* strm = &std::cout;
+
+  if (!options.report_path.empty()) {
+    file_strm.open(options.report_path, std::ios::trunc);
+    if (!file_strm.is_open()) {
+      std::cerr << "Could not open " << options.report_path << "."
+                << std::endl;
+      return -1;
+    }
+    strm = &file_strm;
+  }
+
+  // Whatever ran before a failure is still reported.
+  if (!WriteReport(results, strm)) {
+    std::cerr << "Could not write benchmark report." << std::endl;
+    return -1;
+  }
+
+  return success ? 0 : -1;
+}
\ No newline at end of file
@@ -5,16 +5,32 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <optional>
 #include <set>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "utils/camera.h"
+#include "utils/cpu_profiler.h"
+#include "utils/image_writer.h"
+#include "utils/mesh_simplifier.h"
 #include "utils/model.h"
 #include "utils/vk.h"
+#include "utils/vk_pipeline_cache.h"
 
 namespace {
 
@@ -22,22 +38,273 @@ const char* kRequiredValidationLayers[] = {
   "VK_LAYER_KHRONOS_validation"
 };
 
+// VK_KHR_swapchain is added on top of these unless running headless.
 const char* kRequiredDeviceExtensions[] = {
-  VK_KHR_SWAPCHAIN_EXTENSION_NAME
+  VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
 };
 
-constexpr int kShadowTextureWidth = 1024;
-constexpr int kShadowTextureHeight = 1024;
+struct ShadowQualityTier {
+  // Width and height of each cubemap face.
+  uint32_t resolution;
+
+  // Falls back to D16, which every device supports, if the device can't
+  // sample or render to it.
+  VkFormat depth_format;
+
+  // Hardware compared taps per fragment, see shader.frag.
+  int pcf_tap_count;
+};
+
+// From cheapest to best looking. AppOptions::shadow_quality indexes this.
+constexpr ShadowQualityTier kShadowQualityTiers[] = {
+  { 256, VK_FORMAT_D16_UNORM, 1 },
+  { 512, VK_FORMAT_D16_UNORM, 4 },
+  { 1024, VK_FORMAT_D32_SFLOAT, 8 },
+  { 2048, VK_FORMAT_D32_SFLOAT, 12 },
+  { 4096, VK_FORMAT_D32_SFLOAT, 20 }
+};
+static_assert(std::size(kShadowQualityTiers) == App::kShadowQualityTierCount);
+
+// The outer PCF taps are this many texels away from the sample direction.
+constexpr float kShadowPcfRadiusTexels = 1.5f;
+
+// The adaptive shadow quality only drops a tier once this many consecutive
+// frames have gone over the GPU budget, so that a single slow frame doesn't
+// trigger the stall of recreating the cubemap.
+constexpr int kShadowQualityDowngradeFrameCount = 60;
+
+constexpr uint32_t kShadowCubemapFaceCount = 6;
 
 constexpr float kShadowPassNearPlane = 0.01f;
 constexpr float kShadowPassFarPlane = 10.f;
 
-constexpr int kMaxFramesInFlight = 3;
+// When set, the scene pass command buffers are recorded once per swap chain
+// and only submitted each frame. The camera matrices still change every frame
+// through the per-frame uniform buffers.
+constexpr bool kPrerecordCommandBuffers = true;
+
+// Uses the interleaved utils::PackedVertex layout instead of one vertex
+// stream per attribute.
+constexpr bool kUsePackedVertices = true;
+
+constexpr char kModelPath[] = "cornell_box.obj";
+
+// Cooked from kModelPath on the first run and rebuilt whenever the OBJ or MTL
+// file changes. Only used with kUsePackedVertices, since it stores the packed
+// layout.
+constexpr char kMeshCachePath[] = "cornell_box.meshcache";
+
+// Loaded in Init() and written back in Destroy(). Ignored if it was saved by a
+// different device or driver.
+constexpr char kPipelineCachePath[] = "pipeline_cache.bin";
+
+// What a hot reload rebuilds when one of the watched files changes.
+constexpr uint32_t kReloadScenePipeline = 1 << 0;
+constexpr uint32_t kReloadShadowPipeline = 1 << 1;
+constexpr uint32_t kReloadCullPipeline = 1 << 2;
+constexpr uint32_t kReloadClusterPipeline = 1 << 3;
+constexpr uint32_t kReloadGeometry = 1 << 4;
+
+struct WatchedShader {
+  const char* path;
+  uint32_t reload_flags;
+};
+
+// Every shader a pipeline is built from, whether or not the current options
+// use it.
+constexpr WatchedShader kWatchedShaders[] = {
+  { "shader_vert.spv", kReloadScenePipeline },
+  { "shader_frag.spv", kReloadScenePipeline },
+  { "depth_prepass_vert.spv", kReloadScenePipeline },
+  { "shadow_vert.spv", kReloadShadowPipeline },
+  { "shadow_multiview_vert.spv", kReloadShadowPipeline },
+  { "shadow_frag.spv", kReloadShadowPipeline },
+  { "cull_comp.spv", kReloadCullPipeline },
+  { "cluster_comp.spv", kReloadClusterPipeline }
+};
+
+constexpr double kHotReloadPollInterval = 0.25;
+
+// The shadow command buffer is recorded once and submitted with whichever
+// frame finds the shadow map dirty, so it can't use a frame's slot.
+constexpr int kShadowProfilerSlot = App::kMaxFramesInFlight;
+
+// The scene pass of each frame in flight culls into the cull view slot of
+// the same index, and the shadow views take the slots after those, light by
+// light.
+constexpr int kShadowCullViewSlot = App::kMaxFramesInFlight;
+constexpr int kCullViewSlotCount = App::kMaxFramesInFlight +
+    kShadowCubemapFaceCount * App::kMaxShadowedLights;
+
+// Has to match local_size_x in cull.comp.
+constexpr uint32_t kCullGroupSize = 64;
+
+struct CullPushConstants {
+  glm::vec4 bounding_sphere;
+
+  // The error of each LOD, see utils::MeshLod.
+  glm::vec4 lod_errors;
+
+  // When w is non-zero, LODs go by the distance from xyz rather than by the
+  // view depth, for views whose projection isn't a perspective one.
+  glm::vec4 lod_origin;
+  uint32_t view_slot;
+  uint32_t instance_count;
+  uint32_t lod_count;
+  uint32_t lod_bias;
+
+  // Turns an error over a view depth into pixels over
+  // kLodErrorThresholdPixels.
+  float lod_scale;
+};
+
+// The cull pass picks the coarsest LOD whose error covers less than this on
+// screen.
+constexpr float kLodErrorThresholdPixels = 1.f;
+
+// Shadow faces go this many LODs coarser, since a shadow hides the detail
+// that the lit surface shows.
+constexpr uint32_t kShadowLodBias = 1;
+
+// Offset of the first of the kMaxLodCount draws of a cull view slot.
+VkDeviceSize GetDrawOffset(int view_slot) {
+  return sizeof(VkDrawIndexedIndirectCommand) * App::kMaxLodCount * view_slot;
+}
+
+constexpr float kSceneFieldOfViewDegrees = 45.f;
+constexpr float kSceneNearPlane = 0.1f;
+constexpr float kSceneFarPlane = 100.f;
+
+// The view frustum is cut into kClusterGridX x kClusterGridY screen tiles and
+// kClusterGridZ depth slices, each with a list of the lights reaching into it.
+// Have to match cluster.comp and shader.frag.
+constexpr uint32_t kClusterGridX = 16;
+constexpr uint32_t kClusterGridY = 9;
+constexpr uint32_t kClusterGridZ = 24;
+constexpr uint32_t kClusterCount =
+    kClusterGridX * kClusterGridY * kClusterGridZ;
+constexpr uint32_t kMaxLightsPerCluster = 32;
+
+// Has to match local_size_x in cluster.comp.
+constexpr uint32_t kClusterGroupSize = 64;
+
+struct ClusterPushConstants {
+  // Tangents of half the field of view in x and y, then the near and far
+  // planes.
+  glm::vec4 projection;
+  uint32_t light_count;
+};
+
+// Where a shadowed light sits in its instance, just under the ceiling.
+const glm::vec3 kShadowedLightOffset(0.f, 1.9f, 0.f);
+
+// The lights after the shadowed ones are small enough that only a few of them
+// reach into any one cluster.
+constexpr float kExtraLightRadius = 1.5f;
+
+const glm::vec3 kExtraLightColors[] = {
+  glm::vec3(1.f, 0.4f, 0.3f),
+  glm::vec3(0.3f, 1.f, 0.4f),
+  glm::vec3(0.3f, 0.5f, 1.f),
+  glm::vec3(1.f, 0.9f, 0.4f),
+  glm::vec3(0.8f, 0.4f, 1.f),
+  glm::vec3(0.4f, 1.f, 1.f)
+};
+
+// Spreads consecutive integers over [0, 1), so that the extra lights land in
+// the same places on every run.
+float HashToUnitFloat(uint32_t value) {
+  value ^= value >> 16;
+  value *= 0x7feb352du;
+  value ^= value >> 15;
+  value *= 0x846ca68bu;
+  value ^= value >> 16;
+  return static_cast<float>(value >> 8) / 16777216.f;
+}
+
+constexpr double kGpuTimingsPrintInterval = 1.0;
 
 constexpr float kPi = glm::pi<float>();
 
 constexpr float kStrafeSpeed = 3.f;
 
+// The keyboard controlled directions, each with its own bit in
+// App::held_directions_.
+constexpr utils::Camera::Direction kKeyDirections[] = {
+  utils::Camera::Direction::kNegX,
+  utils::Camera::Direction::kPosX
+};
+
+// How often the simulation thread steps the camera, independent of the frame
+// rate.
+constexpr double kSimulationTickSeconds = 1.0 / 120.0;
+
+uint32_t GetDirectionBit(utils::Camera::Direction direction) {
+  return 1u << static_cast<uint32_t>(direction);
+}
+
+// Distance between neighbouring instances. The Cornell box is 2 units wide.
+constexpr float kInstanceSpacing = 2.5f;
+
+// The instances are laid out in rows going back from the first one, which
+// stays at the origin around the light.
+int GetInstanceRowSize(int instance_count) {
+  return static_cast<int>(
+      std::ceil(std::sqrt(static_cast<float>(instance_count))));
+}
+
+glm::vec3 GetInstanceOffset(int instance, int row_size) {
+  return glm::vec3(static_cast<float>(instance % row_size) * kInstanceSpacing,
+                   0.f,
+                   -static_cast<float>(instance / row_size) * kInstanceSpacing);
+}
+
+struct CameraPathSegment {
+  utils::Camera::Direction direction;
+
+  // Per second of benchmark time.
+  float speed;
+  int frame_count;
+};
+
+// Strafes left and right, turns and moves in and out, ending up where it
+// started.
+constexpr CameraPathSegment kBenchmarkCameraPath[] = {
+  { utils::Camera::Direction::kNegX, 0.5f, 120 },
+  { utils::Camera::Direction::kPosX, 0.5f, 240 },
+  { utils::Camera::Direction::kNegX, 0.5f, 120 },
+  { utils::Camera::Direction::kPosYaw, 0.25f, 120 },
+  { utils::Camera::Direction::kNegYaw, 0.25f, 120 },
+  { utils::Camera::Direction::kNegZ, 0.5f, 120 },
+  { utils::Camera::Direction::kPosZ, 0.5f, 120 }
+};
+
+// The camera moves by this much benchmark time per frame, however long the
+// frame actually took, so every run draws the same images.
+constexpr float kBenchmarkFrameSeconds = 1.f / 60.f;
+
+// Drawn before the camera path starts and left out of the report, since they
+// include pipeline and driver warm-up.
+constexpr int kBenchmarkWarmupFrameCount = 60;
+
+constexpr int GetBenchmarkPathFrameCount() {
+  int frame_count = 0;
+  for (const CameraPathSegment& segment : kBenchmarkCameraPath) {
+    frame_count += segment.frame_count;
+  }
+  return frame_count;
+}
+
+void WriteTimingStatsJson(const utils::TimingStats& stats,
+                          std::ostream* strm) {
+  *strm << "{ \"samples\": " << stats.sample_count
+        << ", \"mean_ms\": " << stats.mean_ms
+        << ", \"p50_ms\": " << stats.p50_ms
+        << ", \"p95_ms\": " << stats.p95_ms
+        << ", \"p99_ms\": " << stats.p99_ms
+        << ", \"max_ms\": " << stats.max_ms << " }";
+}
+
 std::vector<const char*> GetRequiredValidationLayers() {
   return std::vector<const char*>(
       kRequiredValidationLayers,
@@ -45,21 +312,37 @@ std::vector<const char*> GetRequiredValidationLayers() {
           sizeof(kRequiredValidationLayers) / sizeof(const char*));
 }
 
-std::vector<const char*> GetRequiredInstanceExtensions() {
-  uint32_t glfw_ext_count = 0;
-  const char** glfw_exts = glfwGetRequiredInstanceExtensions(&glfw_ext_count);
+std::vector<const char*> GetRequiredInstanceExtensions(bool presents) {
+  std::vector<const char*> extensions;
 
-  std::vector<const char*> extensions(glfw_exts, glfw_exts + glfw_ext_count);
+  if (presents) {
+    uint32_t glfw_ext_count = 0;
+    const char** glfw_exts =
+        glfwGetRequiredInstanceExtensions(&glfw_ext_count);
+    extensions.assign(glfw_exts, glfw_exts + glfw_ext_count);
+  }
   extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
 
   return extensions;
 }
 
-std::vector<const char*> GetRequiredDeviceExtensions() {
-  return std::vector<const char*>(
+std::vector<const char*> GetRequiredDeviceExtensions(bool presents) {
+  std::vector<const char*> extensions(
       kRequiredDeviceExtensions,
       kRequiredDeviceExtensions +
           sizeof(kRequiredDeviceExtensions) / sizeof(const char*));
+
+  if (presents)
+    extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+
+  return extensions;
+}
+
+double GetTimeInSeconds() {
+  // Rather than glfwGetTime(), which needs GLFW to be initialized.
+  std::chrono::duration<double> time =
+      std::chrono::steady_clock::now().time_since_epoch();
+  return time.count();
 }
 
 VKAPI_ATTR VkBool32 VKAPI_CALL DebugCallback(
@@ -98,9 +381,15 @@ QueueIndices FindQueueIndices(VkPhysicalDevice physical_device,
     if ((family.queueFlags & VK_QUEUE_GRAPHICS_BIT) == 1)
       indices.graphics_queue_index = i;
 
+    // Without a surface nothing is presented, so the graphics queue stands in
+    // for the present queue.
     VkBool32 present_support = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, i, surface,
-                                         &present_support);
+    if (surface == VK_NULL_HANDLE) {
+      present_support = indices.graphics_queue_index == i;
+    } else {
+      vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, i, surface,
+                                           &present_support);
+    }
 
     if (present_support)
       indices.present_queue_index = i;
@@ -112,17 +401,49 @@ QueueIndices FindQueueIndices(VkPhysicalDevice physical_device,
   return indices;
 }
 
-bool IsPhysicalDeviceSuitable(VkPhysicalDevice physical_device,
-                              VkSurfaceKHR surface) {
-  QueueIndices queue_indices = FindQueueIndices(physical_device, surface);
-  if (!FoundQueueIndices(queue_indices))
-    return false;
+// Prefers a family that only supports transfers, since those usually map onto
+// a dedicated copy engine. Otherwise falls back to the graphics family.
+uint32_t FindTransferQueueIndex(VkPhysicalDevice physical_device,
+                                uint32_t graphics_queue_index) {
+  uint32_t count;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, nullptr);
 
-  if (!utils::vk::SupportsDeviceExtensions(physical_device,
-                                           GetRequiredDeviceExtensions())) {
-    return false;
+  std::vector<VkQueueFamilyProperties> families(count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count,
+                                           families.data());
+
+  for (uint32_t i = 0; i < families.size(); ++i) {
+    VkQueueFlags flags = families[i].queueFlags;
+    if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+        !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+      return i;
+    }
   }
+  return graphics_queue_index;
+}
+
+// The frame pacer waits on a timeline semaphore. Querying the feature needs
+// vkGetPhysicalDeviceFeatures2, which is core in Vulkan 1.1.
+bool SupportsTimelineSemaphores(VkPhysicalDevice physical_device) {
+  VkPhysicalDeviceProperties phys_device_props;
+  vkGetPhysicalDeviceProperties(physical_device, &phys_device_props);
+  if (phys_device_props.apiVersion < VK_API_VERSION_1_1)
+    return false;
+
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features{};
+  timeline_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
 
+  VkPhysicalDeviceFeatures2 features2{};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features2.pNext = &timeline_features;
+  vkGetPhysicalDeviceFeatures2(physical_device, &features2);
+
+  return timeline_features.timelineSemaphore == VK_TRUE;
+}
+
+// Whether `surface` can be presented to at all.
+bool SupportsSurface(VkPhysicalDevice physical_device, VkSurfaceKHR surface) {
   uint32_t surface_formats_count;
   vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface,
                                        &surface_formats_count, nullptr);
@@ -132,7 +453,24 @@ bool IsPhysicalDeviceSuitable(VkPhysicalDevice physical_device,
   uint32_t present_modes_count;
   vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface,
                                             &present_modes_count, nullptr);
-  if (present_modes_count == 0)
+  return present_modes_count > 0;
+}
+
+// `surface` is null when running headless.
+bool IsPhysicalDeviceSuitable(VkPhysicalDevice physical_device,
+                              VkSurfaceKHR surface) {
+  QueueIndices queue_indices = FindQueueIndices(physical_device, surface);
+  if (!FoundQueueIndices(queue_indices))
+    return false;
+
+  bool presents = surface != VK_NULL_HANDLE;
+
+  if (!utils::vk::SupportsDeviceExtensions(
+          physical_device, GetRequiredDeviceExtensions(presents))) {
+    return false;
+  }
+
+  if (presents && !SupportsSurface(physical_device, surface))
     return false;
 
   VkPhysicalDeviceFeatures features;
@@ -140,10 +478,24 @@ bool IsPhysicalDeviceSuitable(VkPhysicalDevice physical_device,
   if (!features.samplerAnisotropy)
     return false;
 
+  // Each indirect draw finds its visible instances through firstInstance.
+  if (!features.drawIndirectFirstInstance)
+    return false;
+
+  // The shadow maps of all the lights are sampled through one cubemap array.
+  if (!features.imageCubeArray)
+    return false;
+
+  if (!SupportsTimelineSemaphores(physical_device))
+    return false;
+
   return true;
 }
 
-VkSampleCountFlagBits ChooseMsaaSampleCount(VkPhysicalDevice physical_device) {
+// Returns the highest sample count of at most `requested_count` that both the
+// color and the depth attachments support.
+VkSampleCountFlagBits ChooseMsaaSampleCount(VkPhysicalDevice physical_device,
+                                            int requested_count) {
   VkPhysicalDeviceProperties phys_device_props;
   vkGetPhysicalDeviceProperties(physical_device, &phys_device_props);
 
@@ -151,10 +503,10 @@ VkSampleCountFlagBits ChooseMsaaSampleCount(VkPhysicalDevice physical_device) {
       phys_device_props.limits.framebufferColorSampleCounts &
       phys_device_props.limits.framebufferDepthSampleCounts;
 
-  if (sample_count_flags & VK_SAMPLE_COUNT_4_BIT) {
-    return VK_SAMPLE_COUNT_4_BIT;
-  } else if (sample_count_flags & VK_SAMPLE_COUNT_2_BIT) {
-    return VK_SAMPLE_COUNT_2_BIT;
+  // The flag bits are the sample counts themselves.
+  for (int count = 64; count > 1; count /= 2) {
+    if (count <= requested_count && (sample_count_flags & count))
+      return static_cast<VkSampleCountFlagBits>(count);
   }
   return VK_SAMPLE_COUNT_1_BIT;
 }
@@ -178,7 +530,8 @@ VkSurfaceFormatKHR ChooseSurfaceFormat(VkPhysicalDevice physical_device,
 }
 
 VkPresentModeKHR ChoosePresentMode(VkPhysicalDevice physical_device,
-                                   VkSurfaceKHR surface) {
+                                   VkSurfaceKHR surface,
+                                   VkPresentModeKHR preferred_mode) {
   uint32_t present_mode_count;
   vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface,
                                             &present_mode_count, nullptr);
@@ -189,7 +542,7 @@ VkPresentModeKHR ChoosePresentMode(VkPhysicalDevice physical_device,
                                             present_modes.data());
 
   for (const auto& mode : present_modes) {
-    if (mode == VK_PRESENT_MODE_MAILBOX_KHR)
+    if (mode == preferred_mode)
       return mode;
   }
   return VK_PRESENT_MODE_FIFO_KHR;
@@ -228,24 +581,179 @@ VkFormat FindDepthFormat(VkPhysicalDevice physical_device) {
       VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT, physical_device);
 }
 
+// Multiview lets the shadow pass render all six cubemap faces in a single
+// render pass. It is core in Vulkan 1.1, so devices that only support 1.0 fall
+// back to one render pass per face.
+bool SupportsMultiview(VkPhysicalDevice physical_device) {
+  VkPhysicalDeviceProperties phys_device_props;
+  vkGetPhysicalDeviceProperties(physical_device, &phys_device_props);
+  if (phys_device_props.apiVersion < VK_API_VERSION_1_1)
+    return false;
+
+  VkPhysicalDeviceMultiviewProperties multiview_props{};
+  multiview_props.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_PROPERTIES;
+
+  VkPhysicalDeviceProperties2 phys_device_props2{};
+  phys_device_props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  phys_device_props2.pNext = &multiview_props;
+  vkGetPhysicalDeviceProperties2(physical_device, &phys_device_props2);
+  if (multiview_props.maxMultiviewViewCount < kShadowCubemapFaceCount)
+    return false;
+
+  VkPhysicalDeviceMultiviewFeatures multiview_features{};
+  multiview_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES;
+
+  VkPhysicalDeviceFeatures2 features2{};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features2.pNext = &multiview_features;
+  vkGetPhysicalDeviceFeatures2(physical_device, &features2);
+
+  return multiview_features.multiview == VK_TRUE;
+}
+
+// Runs `job` for every index in [0, count) on `thread_pool`. Returns whether
+// all of them succeeded.
+bool RunRecordingJobs(size_t count, const std::function<bool(size_t)>& job,
+                      utils::ThreadPool* thread_pool) {
+  std::atomic<bool> succeeded = true;
+  thread_pool->ParallelFor(count, 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if (!job(i))
+        succeeded = false;
+    }
+  });
+  return succeeded;
+}
+
+// Secondary command buffers are recorded from pool tasks, and a command pool
+// may only be used by one thread at a time, so each job gets its own pool.
+bool CreateRecordingJobCommandPool(VkDevice device, uint32_t queue_index,
+                                   uint32_t command_buffer_count,
+                                   VkCommandPool* command_pool,
+                                   VkCommandBuffer* command_buffers) {
+  VkCommandPoolCreateInfo command_pool_info{};
+  command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  command_pool_info.queueFamilyIndex = queue_index;
+  command_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+  if (vkCreateCommandPool(device, &command_pool_info, nullptr, command_pool)
+          != VK_SUCCESS) {
+    return false;
+  }
+
+  VkCommandBufferAllocateInfo command_buffer_info{};
+  command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  command_buffer_info.commandPool = *command_pool;
+  command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+  command_buffer_info.commandBufferCount = command_buffer_count;
+
+  return vkAllocateCommandBuffers(device, &command_buffer_info,
+                                  command_buffers) == VK_SUCCESS;
+}
+
+// Leaves `framebuffer` unspecified when it is VK_NULL_HANDLE, so that the
+// buffer can be executed in any framebuffer of `render_pass`.
+bool BeginRenderPassCommandBuffer(VkCommandBuffer command_buffer,
+                                  VkRenderPass render_pass, uint32_t subpass,
+                                  VkFramebuffer framebuffer,
+                                  VkCommandBufferUsageFlags flags) {
+  VkCommandBufferInheritanceInfo inheritance_info{};
+  inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritance_info.renderPass = render_pass;
+  inheritance_info.subpass = subpass;
+  inheritance_info.framebuffer = framebuffer;
+
+  VkCommandBufferBeginInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags =
+      flags | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  begin_info.pInheritanceInfo = &inheritance_info;
+
+  return vkBeginCommandBuffer(command_buffer, &begin_info) == VK_SUCCESS;
+}
+
+// Dynamic state isn't inherited from the primary, so every secondary buffer
+// sets its own.
+void SetViewportAndScissor(VkCommandBuffer command_buffer, VkExtent2D extent) {
+  VkViewport viewport{};
+  viewport.x = 0.f;
+  viewport.y = 0.f;
+  viewport.width = static_cast<float>(extent.width);
+  viewport.height = static_cast<float>(extent.height);
+  viewport.minDepth = 0.f;
+  viewport.maxDepth = 1.f;
+
+  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+  VkRect2D scissor{};
+  scissor.offset = {0, 0};
+  scissor.extent = extent;
+
+  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+}
+
+// For attachments that never leave the render pass. Tile-based GPUs can
+// keep these on chip without backing them with memory at all, so lazily
+// allocated memory is preferred where there is any.
+bool CreateTransientAttachmentImage(const VkImageCreateInfo& image_info,
+                                    VkDevice device,
+                                    utils::vk::MemoryAllocator* allocator,
+                                    VkImage& image,
+                                    utils::vk::Allocation& allocation) {
+  if (utils::vk::CreateImage(image_info,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                                 VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
+                             device, allocator, image, allocation)) {
+    return true;
+  }
+  return utils::vk::CreateImage(image_info,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device,
+                                allocator, image, allocation);
+}
+
 }  // namespace
 
-bool App::Init() {
-  glfwInit();
+bool App::Init(const AppOptions& options) {
+  options_ = options;
+  frames_in_flight_ = options_.latency_mode == LatencyMode::kLowLatency ?
+      1 : std::clamp(options_.frames_in_flight, 2, kMaxFramesInFlight);
+
+  AddCpuPhases();
 
-  glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-  glfwWindowHint(GLFW_SCALE_TO_MONITOR , GL_TRUE);
+  // GLFW isn't initialized at all when headless, since it fails on machines
+  // without a display.
+  if (!options_.headless) {
+    glfwInit();
 
-  window_ = glfwCreateWindow(800, 600, "Vulkan Application", nullptr, nullptr);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_SCALE_TO_MONITOR , GL_TRUE);
 
-  glfwSetWindowUserPointer(window_, this);
-  glfwSetFramebufferSizeCallback(window_, GlfwFramebufferResized);
-  glfwSetKeyCallback(window_, GlfwKeyCallback);
+    window_ = glfwCreateWindow(800, 600, "Vulkan Application", nullptr,
+                               nullptr);
+
+    glfwSetWindowUserPointer(window_, this);
+    glfwSetFramebufferSizeCallback(window_, GlfwFramebufferResized);
+    glfwSetKeyCallback(window_, GlfwKeyCallback);
+  }
 
-if (!utils::LoadModel("cornell_box.obj", &model_))
+  if (!LoadSceneGeometry())
     return false;
 
   camera_.SetPosition(glm::vec3(0.f, 1.f, 4.f));
+  PublishSimulationSnapshot();
+
+  // One shadowed light in each of the first instances, which is also as many
+  // as there are cubemaps in the shadow map array.
+  int instance_count = std::max(options_.instance_count, 1);
+  int shadowed_light_count = std::min(
+      {std::max(options_.light_count, 1), kMaxShadowedLights, instance_count});
+  int row_size = GetInstanceRowSize(instance_count);
+  for (int i = 0; i < shadowed_light_count; ++i) {
+    shadow_light_positions_.push_back(GetInstanceOffset(i, row_size) +
+                                      kShadowedLightOffset);
+  }
 
   if (!InitInstanceAndSurface())
     return false;
@@ -256,30 +764,67 @@ if (!utils::LoadModel("cornell_box.obj", &model_))
   if (!CreateDevice())
     return false;
 
-  if (!CreateSwapChain())
+  if (!CreateGpuProfiler())
     return false;
 
+  if (options_.headless) {
+    if (!CreateOffscreenImages())
+      return false;
+  } else {
+    if (!CreateSwapChain())
+      return false;
+  }
+
   if (!CreateScenePassResources())
     return false;
 
+  SelectShadowQualityTier(options_.shadow_quality);
+
   if (!CreateShadowPassResources())
     return false;
 
+  if (!CreatePipelines())
+    return false;
+
   if (!CreateCommandPool())
     return false;
 
   if (!CreateCommandBuffers())
     return false;
 
-  if (!CreateDescriptorSets())
+  if (!CreateShadowCommandBuffer())
+    return false;
+
+  if (!CreateRecordingJobCommandBuffers())
     return false;
 
   if (!CreateVertexBuffers())
     return false;
 
+  if (!CreateDrawBuffers())
+    return false;
+
+  if (!CreateMaterialBuffer())
+    return false;
+
+  if (!CreateLightBuffers())
+    return false;
+
+  if (!CreateDescriptorSets())
+    return false;
+
+  if (options_.headless && !CreateReadbackBuffers())
+    return false;
+
+  if (!RecordStaticCommandBuffers())
+    return false;
+
   if (!CreateSyncObjects())
     return false;
 
+  if (options_.hot_reload)
+    WatchReloadableFiles();
+
   return true;
 }
 
@@ -292,19 +837,44 @@ void App::GlfwKeyCallback(GLFWwindow* window, int key, int scancode, int action,
                           int mods) {
   auto app = reinterpret_cast<App*>(glfwGetWindowUserPointer(window));
 
-  if (key == GLFW_KEY_A) {
-    if (action == GLFW_PRESS)
-      app->camera_.StartMovement(utils::Camera::Direction::kNegX, kStrafeSpeed);
-    else if (action == GLFW_RELEASE)
-      app->camera_.StopMovement(utils::Camera::Direction::kNegX);
-  }
+  // The benchmark drives the camera itself.
+  if (app->options_.benchmark)
+    return;
+
+  uint32_t bit = 0;
+  if (key == GLFW_KEY_A)
+    bit = GetDirectionBit(utils::Camera::Direction::kNegX);
+  else if (key == GLFW_KEY_D)
+    bit = GetDirectionBit(utils::Camera::Direction::kPosX);
+
+  // The camera itself belongs to the simulation thread.
+  if (action == GLFW_PRESS)
+    app->held_directions_.fetch_or(bit);
+  else if (action == GLFW_RELEASE)
+    app->held_directions_.fetch_and(~bit);
+}
 
-  if (key == GLFW_KEY_D) {
-    if (action == GLFW_PRESS)
-      app->camera_.StartMovement(utils::Camera::Direction::kPosX, kStrafeSpeed);
-    else if (action == GLFW_RELEASE)
-      app->camera_.StopMovement(utils::Camera::Direction::kPosX);
+bool App::LoadSceneGeometry() {
+  if (kUsePackedVertices && mesh_cache_.Open(kMeshCachePath)) {
+    const utils::Material* materials = mesh_cache_.GetMaterials();
+    model_.materials.assign(materials,
+                            materials + mesh_cache_.GetMaterialCount());
+    model_.source_paths = mesh_cache_.GetSourcePaths();
+    return true;
   }
+
+  if (!utils::LoadModel(kModelPath, &model_, true, &thread_pool_))
+    return false;
+
+  // The whole chain is cooked, so that AppOptions::lod_count can change
+  // without the cache going stale.
+  utils::GenerateLods(&model_, kMaxLodCount);
+
+  // Without a cache the next start-up just has to parse the OBJ file again.
+  if (kUsePackedVertices && !utils::WriteMeshCache(model_, kMeshCachePath))
+    std::cerr << "Could not write mesh cache." << std::endl;
+
+  return true;
 }
 
 bool App::InitInstanceAndSurface() {
@@ -319,12 +889,12 @@ bool App::InitInstanceAndSurface() {
   app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
   app_info.pEngineName = "No Engine";
   app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-  app_info.apiVersion = VK_API_VERSION_1_0;
+  app_info.apiVersion = VK_API_VERSION_1_1;
 
   std::vector<const char*> validation_layers =
       GetRequiredValidationLayers();
   std::vector<const char*> instance_extensions =
-      GetRequiredInstanceExtensions();
+      GetRequiredInstanceExtensions(!options_.headless);
 
   VkDebugUtilsMessengerCreateInfoEXT debug_messenger_info{};
   debug_messenger_info.sType =
@@ -362,6 +932,11 @@ bool App::InitInstanceAndSurface() {
     return false;
   }
 
+  if (options_.headless) {
+    surface_ = VK_NULL_HANDLE;
+    return true;
+  }
+
   if (glfwCreateWindowSurface(instance_, window_, nullptr, &surface_)
           != VK_SUCCESS) {
     std::cerr << "Could not create surface." << std::endl;
@@ -396,15 +971,18 @@ bool App::CreateDevice() {
   QueueIndices queue_indices = FindQueueIndices(physical_device_, surface_);
   graphics_queue_index_ = queue_indices.graphics_queue_index.value();
   present_queue_index_ = queue_indices.present_queue_index.value();
+  transfer_queue_index_ = FindTransferQueueIndex(physical_device_,
+                                                 graphics_queue_index_);
 
   std::set<uint32_t> unique_queue_indices = {
-    graphics_queue_index_, present_queue_index_
+    graphics_queue_index_, present_queue_index_, transfer_queue_index_
   };
 
+  // Has to outlive the loop since the create infos point at it.
+  float priority = 1.0f;
+
   std::vector<VkDeviceQueueCreateInfo> queue_infos;
   for (uint32_t queue_index : unique_queue_indices) {
-    float priority = 1.0f;
-
     VkDeviceQueueCreateInfo queue_info{};
     queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
     queue_info.queueFamilyIndex = queue_index;
@@ -413,10 +991,35 @@ bool App::CreateDevice() {
     queue_infos.push_back(queue_info);
   }
 
+  VkPhysicalDeviceFeatures supported_features;
+  vkGetPhysicalDeviceFeatures(physical_device_, &supported_features);
+
+  // Without it, the draws of each LOD are recorded one at a time.
+  supports_multi_draw_indirect_ =
+      supported_features.multiDrawIndirect == VK_TRUE;
+
   VkPhysicalDeviceFeatures phys_device_features{};
   phys_device_features.samplerAnisotropy = VK_TRUE;
-
-  std::vector<const char*> device_extensions = GetRequiredDeviceExtensions();
+  phys_device_features.drawIndirectFirstInstance = VK_TRUE;
+  phys_device_features.imageCubeArray = VK_TRUE;
+  phys_device_features.multiDrawIndirect = supported_features.multiDrawIndirect;
+
+  use_multiview_shadow_pass_ = SupportsMultiview(physical_device_);
+
+  VkPhysicalDeviceMultiviewFeatures multiview_features{};
+  multiview_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES;
+  multiview_features.multiview = VK_TRUE;
+
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features{};
+  timeline_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+  timeline_features.timelineSemaphore = VK_TRUE;
+  if (use_multiview_shadow_pass_)
+    timeline_features.pNext = &multiview_features;
+
+  std::vector<const char*> device_extensions =
+      GetRequiredDeviceExtensions(!options_.headless);
   std::vector<const char*> validation_layers = GetRequiredValidationLayers();
 
   VkDeviceCreateInfo device_info{};
@@ -430,6 +1033,7 @@ bool App::CreateDevice() {
   device_info.enabledLayerCount = static_cast<uint32_t>(
       validation_layers.size());
   device_info.ppEnabledLayerNames = validation_layers.data();
+  device_info.pNext = &timeline_features;
 
   if (vkCreateDevice(physical_device_, &device_info, nullptr, &device_)
           != VK_SUCCESS) {
@@ -439,13 +1043,106 @@ bool App::CreateDevice() {
 
   vkGetDeviceQueue(device_, graphics_queue_index_, 0, &graphics_queue_);
   vkGetDeviceQueue(device_, present_queue_index_, 0, &present_queue_);
+  vkGetDeviceQueue(device_, transfer_queue_index_, 0, &transfer_queue_);
+
+  msaa_sample_count_ =
+      ChooseMsaaSampleCount(physical_device_, options_.msaa_sample_count);
+
+  if (!allocator_.Init(physical_device_, device_)) {
+    std::cerr << "Could not create memory allocator." << std::endl;
+    return false;
+  }
+
+  if (!upload_manager_.Init(device_, &allocator_, transfer_queue_index_,
+                            transfer_queue_)) {
+    std::cerr << "Could not create upload manager." << std::endl;
+    return false;
+  }
+
+  if (!utils::vk::CreatePipelineCacheFromFile(kPipelineCachePath,
+                                              physical_device_, device_,
+                                              &pipeline_cache_)) {
+    std::cerr << "Could not create pipeline cache." << std::endl;
+    return false;
+  }
+
+  if (!frame_pacer_.Init(device_)) {
+    std::cerr << "Could not create frame pacer." << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+void App::AddCpuPhases() {
+  cpu_phases_.frame = cpu_profiler_.AddPhase("frame");
+  cpu_phases_.sample_input = cpu_profiler_.AddPhase("sample_input");
+  cpu_phases_.wait_frame = cpu_profiler_.AddPhase("wait_frame");
+  cpu_phases_.acquire = cpu_profiler_.AddPhase("acquire");
+  cpu_phases_.wait_image = cpu_profiler_.AddPhase("wait_image");
+  cpu_phases_.update_ubo = cpu_profiler_.AddPhase("update_ubo");
+  cpu_phases_.record = cpu_profiler_.AddPhase("record");
+  cpu_phases_.submit = cpu_profiler_.AddPhase("submit");
+  cpu_phases_.present = cpu_profiler_.AddPhase("present");
+}
+
+bool App::CreateGpuProfiler() {
+  shadow_cull_scope_ = gpu_profiler_.AddScope("shadow_cull");
+  shadow_to_attachment_scope_ =
+      gpu_profiler_.AddScope("shadow_to_attachment_layout");
+
+  // The multiview shadow pass renders every face of a light in one render
+  // pass.
+  for (int i = 0; i < shadow_light_positions_.size(); ++i) {
+    std::string light_name = "shadow_light_" + std::to_string(i);
+    if (use_multiview_shadow_pass_) {
+      shadow_face_scopes_.push_back(gpu_profiler_.AddScope(light_name));
+      continue;
+    }
+    for (uint32_t j = 0; j < kShadowCubemapFaceCount; ++j) {
+      shadow_face_scopes_.push_back(gpu_profiler_.AddScope(
+          light_name + "_face_" + std::to_string(j)));
+    }
+  }
+
+  shadow_to_sampled_scope_ =
+      gpu_profiler_.AddScope("shadow_to_sampled_layout");
+  scene_cull_scope_ = gpu_profiler_.AddScope("scene_cull");
+  scene_clusters_scope_ = gpu_profiler_.AddScope("scene_clusters");
+  scene_pass_scope_ = gpu_profiler_.AddScope("scene_pass");
+
+  readback_scope_ = -1;
+  if (options_.headless)
+    readback_scope_ = gpu_profiler_.AddScope("readback");
+
+  bool timings_requested = options_.print_gpu_timings ||
+      !options_.gpu_timings_csv_path.empty() || options_.benchmark;
+
+  // A benchmark reports on every frame of the camera path.
+  int history_size = utils::vk::GpuProfiler::kDefaultHistorySize;
+  if (options_.benchmark)
+    history_size = GetBenchmarkPathFrameCount();
+
+  // Rendering works the same without timestamps, there is just nothing to
+  // report.
+  if (!gpu_profiler_.Init(physical_device_, device_, graphics_queue_index_,
+                          kMaxFramesInFlight + 1, history_size)) {
+    if (timings_requested)
+      std::cerr << "GPU timestamps are not supported." << std::endl;
+    return true;
+  }
 
-  msaa_sample_count_ = ChooseMsaaSampleCount(physical_device_);
+  if (!options_.gpu_timings_csv_path.empty() &&
+      !gpu_profiler_.OpenCsv(options_.gpu_timings_csv_path)) {
+    std::cerr << "Could not open " << options_.gpu_timings_csv_path << "."
+              << std::endl;
+    return false;
+  }
 
   return true;
 }
 
-bool App::CreateSwapChain() {
+bool App::CreateSwapChain(VkSwapchainKHR old_swap_chain) {
   VkSurfaceCapabilitiesKHR surface_capabilities;
   vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device_, surface_,
                                             &surface_capabilities);
@@ -459,7 +1156,8 @@ bool App::CreateSwapChain() {
                                                           surface_);
   swap_chain_image_format_ = surface_format.format;
 
-  VkPresentModeKHR present_mode = ChoosePresentMode(physical_device_, surface_);
+  VkPresentModeKHR present_mode = ChoosePresentMode(physical_device_, surface_,
+                                                    options_.present_mode);
 
   VkSwapchainCreateInfoKHR swap_chain_info{};
   swap_chain_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -474,6 +1172,7 @@ bool App::CreateSwapChain() {
   swap_chain_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
   swap_chain_info.presentMode = present_mode;
   swap_chain_info.clipped = VK_TRUE;
+  swap_chain_info.oldSwapchain = old_swap_chain;
 
   if (graphics_queue_index_ != present_queue_index_) {
     uint32_t indices[] = { graphics_queue_index_, present_queue_index_ };
@@ -519,27 +1218,158 @@ bool App::CreateSwapChain() {
   return true;
 }
 
-bool App::CreateScenePassResources() {
-  if (!CreateRenderPass())
-    return false;
-
-  if (!CreatePipeline())
-    return false;
+bool App::CreateOffscreenImages() {
+  swap_chain_extent_.width = options_.headless_width;
+  swap_chain_extent_.height = options_.headless_height;
+
+  // Byte order matches what WritePng() expects, and the resolve writes
+  // sRGB-encoded values just like it would to a presentable image.
+  swap_chain_image_format_ = VK_FORMAT_R8G8B8A8_SRGB;
+
+  // One image per frame in flight, so that a frame can be rendered while the
+  // previous one is still being copied out.
+  swap_chain_images_.resize(frames_in_flight_);
+  swap_chain_image_views_.resize(frames_in_flight_);
+  offscreen_image_allocations_.resize(frames_in_flight_);
+
+  for (int i = 0; i < frames_in_flight_; ++i) {
+    VkImageCreateInfo image_info{};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.extent.width = swap_chain_extent_.width;
+    image_info.extent.height = swap_chain_extent_.height;
+    image_info.extent.depth = 1;
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.format = swap_chain_image_format_;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    image_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if (!utils::vk::CreateImage(image_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                device_, &allocator_, swap_chain_images_[i],
+                                offscreen_image_allocations_[i])) {
+      std::cerr << "Could not create offscreen image." << std::endl;
+      return false;
+    }
 
-  if (!CreateFramebuffers())
-    return false;
+    VkImageViewCreateInfo image_view_info{};
+    image_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    image_view_info.image = swap_chain_images_[i];
+    image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    image_view_info.format = swap_chain_image_format_;
+    image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    image_view_info.subresourceRange.baseMipLevel = 0;
+    image_view_info.subresourceRange.levelCount = 1;
+    image_view_info.subresourceRange.baseArrayLayer = 0;
+    image_view_info.subresourceRange.layerCount = 1;
 
+    if (vkCreateImageView(device_, &image_view_info, nullptr,
+                          &swap_chain_image_views_[i]) != VK_SUCCESS) {
+      std::cerr << "Could not create offscreen image view." << std::endl;
+      return false;
+    }
+  }
   return true;
 }
 
-bool App::CreateRenderPass() {
-  VkAttachmentDescription color_attachment{};
-  color_attachment.format = swap_chain_image_format_;
+bool App::CreateReadbackBuffers() {
+  VkBufferCreateInfo buffer_info{};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size =
+      VkDeviceSize{swap_chain_extent_.width} * swap_chain_extent_.height * 4;
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  for (int i = 0; i < frames_in_flight_; ++i) {
+    FrameContext& frame = frames_[i];
+
+    // Uncached memory makes the CPU copy out of the buffer very slow, so
+    // cached memory is preferred where the device has it.
+    if (utils::vk::CreateBuffer(buffer_info,
+                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+                                    VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                                device_, &allocator_, frame.readback_buffer,
+                                frame.readback_buffer_allocation)) {
+      continue;
+    }
+
+    if (!utils::vk::CreateBuffer(buffer_info,
+                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                 device_, &allocator_, frame.readback_buffer,
+                                 frame.readback_buffer_allocation)) {
+      std::cerr << "Could not create readback buffer." << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool App::CreateScenePassResources() {
+  if (!CreateRenderPass())
+    return false;
+
+  if (!CreateFramebuffers())
+    return false;
+
+  return true;
+}
+
+bool App::CreatePipelines() {
+  // The pipelines only share the pipeline cache, which is internally
+  // synchronized, so they can be compiled at the same time.
+  std::future<bool> scene_pipeline =
+      thread_pool_.Submit([this]() {
+        return CreatePipelineLayout() &&
+               CreatePipeline(&pipeline_, &depth_prepass_pipeline_);
+      });
+  std::future<bool> shadow_pipeline =
+      thread_pool_.Submit([this]() {
+        return CreateShadowPipelineLayout() &&
+               CreateShadowPipeline(&shadow_pipeline_);
+      });
+  std::future<bool> cull_pipeline =
+      thread_pool_.Submit([this]() {
+        return CreateCullPipelineLayout() &&
+               CreateCullPipeline(&cull_pipeline_);
+      });
+  std::future<bool> cluster_pipeline =
+      thread_pool_.Submit([this]() {
+        return CreateClusterPipelineLayout() &&
+               CreateClusterPipeline(&cluster_pipeline_);
+      });
+
+  // All of them have to finish before returning, even if one of them failed.
+  bool scene_result = scene_pipeline.get();
+  bool shadow_result = shadow_pipeline.get();
+  bool cull_result = cull_pipeline.get();
+  bool cluster_result = cluster_pipeline.get();
+
+  return scene_result && shadow_result && cull_result && cluster_result;
+}
+
+bool App::CreateRenderPass() {
+  bool use_msaa = msaa_sample_count_ != VK_SAMPLE_COUNT_1_BIT;
+
+  VkImageLayout presented_layout = options_.headless ?
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+  // Without MSAA this is the swap chain image itself, and there is nothing
+  // to resolve.
+  VkAttachmentDescription color_attachment{};
+  color_attachment.format = swap_chain_image_format_;
   color_attachment.samples = msaa_sample_count_;
   color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  color_attachment.storeOp = use_msaa ?
+      VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
   color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  color_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  color_attachment.finalLayout = use_msaa ?
+      VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : presented_layout;
 
   VkFormat depth_format = FindDepthFormat(physical_device_);
   if (depth_format == VK_FORMAT_UNDEFINED) {
@@ -564,7 +1394,7 @@ bool App::CreateRenderPass() {
   color_resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   color_resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
   color_resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  color_resolve_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  color_resolve_attachment.finalLayout = presented_layout;
 
   VkAttachmentReference color_attachment_ref{};
   color_attachment_ref.attachment = 0;
@@ -580,12 +1410,27 @@ bool App::CreateRenderPass() {
   color_resolve_attachment_ref.layout =
       VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
-  VkSubpassDescription subpass{};
-  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-  subpass.colorAttachmentCount = 1;
-  subpass.pColorAttachments = &color_attachment_ref;
-  subpass.pResolveAttachments = &color_resolve_attachment_ref;
-  subpass.pDepthStencilAttachment = &depth_attachment_ref;
+  VkSubpassDescription depth_prepass_subpass{};
+  depth_prepass_subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  depth_prepass_subpass.colorAttachmentCount = 0;
+  depth_prepass_subpass.pDepthStencilAttachment = &depth_attachment_ref;
+
+  VkSubpassDescription scene_subpass{};
+  scene_subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  scene_subpass.colorAttachmentCount = 1;
+  scene_subpass.pColorAttachments = &color_attachment_ref;
+  scene_subpass.pResolveAttachments =
+      use_msaa ? &color_resolve_attachment_ref : nullptr;
+  scene_subpass.pDepthStencilAttachment = &depth_attachment_ref;
+
+  std::vector<VkSubpassDescription> subpasses;
+  if (options_.depth_prepass)
+    subpasses.push_back(depth_prepass_subpass);
+  subpasses.push_back(scene_subpass);
+
+  scene_subpass_ = static_cast<uint32_t>(subpasses.size() - 1);
+
+  std::vector<VkSubpassDependency> subpass_deps;
 
   VkSubpassDependency subpass_dep{};
   subpass_dep.srcSubpass = VK_SUBPASS_EXTERNAL;
@@ -597,6 +1442,40 @@ bool App::CreateRenderPass() {
       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
   subpass_dep.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  subpass_deps.push_back(subpass_dep);
+
+  if (options_.depth_prepass) {
+    // The colour attachments are first written in the scene subpass.
+    VkSubpassDependency color_dep = subpass_dep;
+    color_dep.dstSubpass = scene_subpass_;
+    subpass_deps.push_back(color_dep);
+
+    // The scene subpass tests against the depth the pre-pass wrote. Each
+    // sample only depends on itself, so this is by region.
+    VkSubpassDependency depth_dep{};
+    depth_dep.srcSubpass = 0;
+    depth_dep.dstSubpass = scene_subpass_;
+    depth_dep.srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    depth_dep.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    depth_dep.dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    depth_dep.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+    depth_dep.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    subpass_deps.push_back(depth_dep);
+  }
+
+  // Headless frames are copied out of the resolve attachment straight after
+  // the render pass.
+  if (options_.headless) {
+    VkSubpassDependency readback_dep{};
+    readback_dep.srcSubpass = scene_subpass_;
+    readback_dep.dstSubpass = VK_SUBPASS_EXTERNAL;
+    readback_dep.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    readback_dep.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    readback_dep.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    readback_dep.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    subpass_deps.push_back(readback_dep);
+  }
 
   VkAttachmentDescription attachments[] = {
     color_attachment, depth_attachment, color_resolve_attachment
@@ -604,12 +1483,13 @@ bool App::CreateRenderPass() {
 
   VkRenderPassCreateInfo render_pass_info{};
   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-  render_pass_info.attachmentCount = 3;
+  render_pass_info.attachmentCount = use_msaa ? 3 : 2;
   render_pass_info.pAttachments = attachments;
-  render_pass_info.subpassCount = 1;
-  render_pass_info.pSubpasses = &subpass;
-  render_pass_info.dependencyCount = 1;
-  render_pass_info.pDependencies = &subpass_dep;
+  render_pass_info.subpassCount = static_cast<uint32_t>(subpasses.size());
+  render_pass_info.pSubpasses = subpasses.data();
+  render_pass_info.dependencyCount =
+      static_cast<uint32_t>(subpass_deps.size());
+  render_pass_info.pDependencies = subpass_deps.data();
 
   if (vkCreateRenderPass(device_, &render_pass_info, nullptr, &render_pass_)
           != VK_SUCCESS) {
@@ -619,37 +1499,13 @@ bool App::CreateRenderPass() {
   return true;
 }
 
-bool App::CreatePipeline() {
-  std::vector<std::string> shader_file_paths = {
-    "shader_vert.spv", "shader_frag.spv"
-  };
-  std::vector<VkShaderModule> shader_modules;
-  if (!utils::vk::CreateShaderModulesFromFiles(shader_file_paths, device_,
-                                               &shader_modules)) {
-    std::cerr << "Could not create shader modules." << std::endl;
-    return false;
-  }
-
-  VkPipelineShaderStageCreateInfo vert_shader_info{};
-  vert_shader_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  vert_shader_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-  vert_shader_info.module = shader_modules[0];
-  vert_shader_info.pName = "main";
-
-  VkPipelineShaderStageCreateInfo frag_shader_info{};
-  frag_shader_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  frag_shader_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  frag_shader_info.module = shader_modules[1];
-  frag_shader_info.pName = "main";
-
-  VkPipelineShaderStageCreateInfo shader_stages[] = {
-    vert_shader_info, frag_shader_info
-  };
-
+bool App::CreatePipelineLayout() {
+  // Dynamic so that each frame's slot in the vertex UBO ring buffer is picked
+  // with an offset at bind time.
   VkDescriptorSetLayoutBinding vert_ubo_binding{};
   vert_ubo_binding.binding = 0;
   vert_ubo_binding.descriptorCount = 1;
-  vert_ubo_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  vert_ubo_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   vert_ubo_binding.pImmutableSamplers = nullptr;
   vert_ubo_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
@@ -668,14 +1524,54 @@ bool App::CreatePipeline() {
   shadow_tex_sampler_binding.pImmutableSamplers = nullptr;
   shadow_tex_sampler_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
+  VkDescriptorSetLayoutBinding instance_binding{};
+  instance_binding.binding = 3;
+  instance_binding.descriptorCount = 1;
+  instance_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  instance_binding.pImmutableSamplers = nullptr;
+  instance_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  VkDescriptorSetLayoutBinding visible_instance_binding{};
+  visible_instance_binding.binding = 4;
+  visible_instance_binding.descriptorCount = 1;
+  visible_instance_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  visible_instance_binding.pImmutableSamplers = nullptr;
+  visible_instance_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  // Indexed by the vertex's material index, so there is no limit on the
+  // number of materials.
+  VkDescriptorSetLayoutBinding material_binding{};
+  material_binding.binding = 5;
+  material_binding.descriptorCount = 1;
+  material_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  material_binding.pImmutableSamplers = nullptr;
+  material_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+  VkDescriptorSetLayoutBinding light_binding{};
+  light_binding.binding = 6;
+  light_binding.descriptorCount = 1;
+  light_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  light_binding.pImmutableSamplers = nullptr;
+  light_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+  // The frame's own range of the cluster buffer, so it isn't dynamic.
+  VkDescriptorSetLayoutBinding cluster_binding{};
+  cluster_binding.binding = 7;
+  cluster_binding.descriptorCount = 1;
+  cluster_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  cluster_binding.pImmutableSamplers = nullptr;
+  cluster_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
   VkDescriptorSetLayoutBinding descriptor_set_bindings[] = {
-    vert_ubo_binding, frag_ubo_binding, shadow_tex_sampler_binding
+    vert_ubo_binding, frag_ubo_binding, shadow_tex_sampler_binding,
+    instance_binding, visible_instance_binding, material_binding,
+    light_binding, cluster_binding
   };
 
   VkDescriptorSetLayoutCreateInfo descriptor_set_layout_info{};
   descriptor_set_layout_info.sType =
       VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  descriptor_set_layout_info.bindingCount = 3;
+  descriptor_set_layout_info.bindingCount = 8;
   descriptor_set_layout_info.pBindings = descriptor_set_bindings;
 
   if (vkCreateDescriptorSetLayout(device_, &descriptor_set_layout_info, nullptr,
@@ -684,6 +1580,66 @@ bool App::CreatePipeline() {
     return false;
   }
 
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &descriptor_set_layout_;
+
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &pipeline_layout_) != VK_SUCCESS) {
+    std::cerr << "Could not create pipeline layout." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool App::CreatePipeline(VkPipeline* pipeline,
+                         VkPipeline* depth_prepass_pipeline) {
+  std::vector<std::string> shader_file_paths = {
+    "shader_vert.spv", "shader_frag.spv"
+  };
+  if (options_.depth_prepass)
+    shader_file_paths.push_back("depth_prepass_vert.spv");
+
+  std::vector<VkShaderModule> shader_modules;
+  if (!utils::vk::CreateShaderModulesFromFiles(shader_file_paths, device_,
+                                               &shader_modules)) {
+    std::cerr << "Could not create shader modules." << std::endl;
+    return false;
+  }
+
+  VkPipelineShaderStageCreateInfo vert_shader_info{};
+  vert_shader_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  vert_shader_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
+  vert_shader_info.module = shader_modules[0];
+  vert_shader_info.pName = "main";
+
+  // Tells the vertex shader how the normals are encoded.
+  VkBool32 packed_vertices = kUsePackedVertices ? VK_TRUE : VK_FALSE;
+
+  VkSpecializationMapEntry packed_vertices_entry{};
+  packed_vertices_entry.constantID = 0;
+  packed_vertices_entry.offset = 0;
+  packed_vertices_entry.size = sizeof(VkBool32);
+
+  VkSpecializationInfo vert_specialization_info{};
+  vert_specialization_info.mapEntryCount = 1;
+  vert_specialization_info.pMapEntries = &packed_vertices_entry;
+  vert_specialization_info.dataSize = sizeof(VkBool32);
+  vert_specialization_info.pData = &packed_vertices;
+
+  vert_shader_info.pSpecializationInfo = &vert_specialization_info;
+
+  VkPipelineShaderStageCreateInfo frag_shader_info{};
+  frag_shader_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  frag_shader_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  frag_shader_info.module = shader_modules[1];
+  frag_shader_info.pName = "main";
+
+  VkPipelineShaderStageCreateInfo shader_stages[] = {
+    vert_shader_info, frag_shader_info
+  };
+
   VkVertexInputBindingDescription position_binding{};
   position_binding.binding = 0;
   position_binding.stride = sizeof(glm::vec3);
@@ -717,6 +1673,18 @@ bool App::CreatePipeline() {
   mtl_idx_attrib_desc.format = VK_FORMAT_R32_UINT;
   mtl_idx_attrib_desc.offset = 0;
 
+  if (kUsePackedVertices) {
+    position_binding.stride = sizeof(utils::PackedVertex);
+
+    normal_attrib_desc.binding = 0;
+    normal_attrib_desc.format = VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+    normal_attrib_desc.offset = offsetof(utils::PackedVertex, normal);
+
+    mtl_idx_attrib_desc.binding = 0;
+    mtl_idx_attrib_desc.format = VK_FORMAT_R16_UINT;
+    mtl_idx_attrib_desc.offset = offsetof(utils::PackedVertex, material_idx);
+  }
+
   VkVertexInputBindingDescription vertex_bindings[] = {
     position_binding, normal_binding, mtl_idx_binding
   };
@@ -728,7 +1696,7 @@ bool App::CreatePipeline() {
   VkPipelineVertexInputStateCreateInfo vertex_input{};
   vertex_input.sType =
       VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vertex_input.vertexBindingDescriptionCount = 3;
+  vertex_input.vertexBindingDescriptionCount = kUsePackedVertices ? 1 : 3;
   vertex_input.pVertexBindingDescriptions = vertex_bindings;
   vertex_input.vertexAttributeDescriptionCount = 3;
   vertex_input.pVertexAttributeDescriptions = vertex_attribs;
@@ -739,24 +1707,22 @@ bool App::CreatePipeline() {
   input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
   input_assembly.primitiveRestartEnable = VK_FALSE;
 
-  VkViewport viewport{};
-  viewport.x = 0.f;
-  viewport.y = 0.f;
-  viewport.width = static_cast<float>(swap_chain_extent_.width);
-  viewport.height = static_cast<float>(swap_chain_extent_.height);
-  viewport.minDepth = 0.f;
-  viewport.maxDepth = 1.f;
-
-  VkRect2D scissor{};
-  scissor.offset = {0, 0};
-  scissor.extent = swap_chain_extent_;
-
+  // The viewport and scissor are set when recording, so that the pipeline
+  // survives swap chain resizes.
   VkPipelineViewportStateCreateInfo viewport_info{};
   viewport_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
   viewport_info.viewportCount = 1;
-  viewport_info.pViewports = &viewport;
   viewport_info.scissorCount = 1;
-  viewport_info.pScissors = &scissor;
+
+  VkDynamicState dynamic_states[] = {
+    VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR
+  };
+
+  VkPipelineDynamicStateCreateInfo dynamic_state_info{};
+  dynamic_state_info.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamic_state_info.dynamicStateCount = 2;
+  dynamic_state_info.pDynamicStates = dynamic_states;
 
   VkPipelineRasterizationStateCreateInfo rasterizer{};
   rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -783,6 +1749,13 @@ bool App::CreatePipeline() {
   depth_stencil.depthBoundsTestEnable = VK_FALSE;
   depth_stencil.stencilTestEnable = VK_FALSE;
 
+  // After the pre-pass only the nearest surface of each sample is left with
+  // its depth, and everything behind it fails before being shaded.
+  if (options_.depth_prepass) {
+    depth_stencil.depthWriteEnable = VK_FALSE;
+    depth_stencil.depthCompareOp = VK_COMPARE_OP_EQUAL;
+  }
+
   VkPipelineColorBlendAttachmentState color_blend_attachment{};
   color_blend_attachment.colorWriteMask =
       VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
@@ -801,17 +1774,6 @@ bool App::CreatePipeline() {
   color_blend_info.blendConstants[2] = 0.0f;
   color_blend_info.blendConstants[3] = 0.0f;
 
-  VkPipelineLayoutCreateInfo pipeline_layout_info{};
-  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipeline_layout_info.setLayoutCount = 1;
-  pipeline_layout_info.pSetLayouts = &descriptor_set_layout_;
-
-  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
-                             &pipeline_layout_) != VK_SUCCESS) {
-    std::cerr << "Could not create pipeline layout." << std::endl;
-    return false;
-  }
-
   VkGraphicsPipelineCreateInfo pipeline_info{};
   pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
   pipeline_info.stageCount = 2;
@@ -823,65 +1785,79 @@ bool App::CreatePipeline() {
   pipeline_info.pMultisampleState = &multisampling;
   pipeline_info.pDepthStencilState = &depth_stencil;
   pipeline_info.pColorBlendState = &color_blend_info;
+  pipeline_info.pDynamicState = &dynamic_state_info;
   pipeline_info.layout = pipeline_layout_;
   pipeline_info.renderPass = render_pass_;
-  pipeline_info.subpass = 0;
+  pipeline_info.subpass = scene_subpass_;
   pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
 
-  if (vkCreateGraphicsPipelines(device_, VK_NULL_HANDLE, 1, &pipeline_info,
-                                nullptr, &pipeline_) != VK_SUCCESS) {
+  // The modules are destroyed whether or not the pipelines could be built,
+  // and nothing is left behind on failure.
+  bool succeeded = true;
+  if (vkCreateGraphicsPipelines(device_, pipeline_cache_, 1, &pipeline_info,
+                                nullptr, pipeline) != VK_SUCCESS) {
     std::cerr << "Could not create pipeline." << std::endl;
-    return false;
+    succeeded = false;
+  }
+
+  if (succeeded && options_.depth_prepass) {
+    VkPipelineShaderStageCreateInfo prepass_shader_info{};
+    prepass_shader_info.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    prepass_shader_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    prepass_shader_info.module = shader_modules[2];
+    prepass_shader_info.pName = "main";
+
+    // Only the positions are read, from the same binding the shadow pass
+    // uses.
+    VkPipelineVertexInputStateCreateInfo prepass_vertex_input{};
+    prepass_vertex_input.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    prepass_vertex_input.vertexBindingDescriptionCount = 1;
+    prepass_vertex_input.pVertexBindingDescriptions = &position_binding;
+    prepass_vertex_input.vertexAttributeDescriptionCount = 1;
+    prepass_vertex_input.pVertexAttributeDescriptions = &position_attrib_desc;
+
+    VkPipelineDepthStencilStateCreateInfo prepass_depth_stencil =
+        depth_stencil;
+    prepass_depth_stencil.depthWriteEnable = VK_TRUE;
+    prepass_depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+
+    // The subpass has no colour attachments.
+    VkPipelineColorBlendStateCreateInfo prepass_color_blend_info =
+        color_blend_info;
+    prepass_color_blend_info.attachmentCount = 0;
+    prepass_color_blend_info.pAttachments = nullptr;
+
+    VkGraphicsPipelineCreateInfo prepass_pipeline_info = pipeline_info;
+    prepass_pipeline_info.stageCount = 1;
+    prepass_pipeline_info.pStages = &prepass_shader_info;
+    prepass_pipeline_info.pVertexInputState = &prepass_vertex_input;
+    prepass_pipeline_info.pDepthStencilState = &prepass_depth_stencil;
+    prepass_pipeline_info.pColorBlendState = &prepass_color_blend_info;
+    prepass_pipeline_info.subpass = 0;
+
+    if (vkCreateGraphicsPipelines(device_, pipeline_cache_, 1,
+                                  &prepass_pipeline_info, nullptr,
+                                  depth_prepass_pipeline) != VK_SUCCESS) {
+      std::cerr << "Could not create depth pre-pass pipeline." << std::endl;
+      vkDestroyPipeline(device_, *pipeline, nullptr);
+      *pipeline = VK_NULL_HANDLE;
+      succeeded = false;
+    }
   }
 
   for (VkShaderModule shader_module : shader_modules) {
     vkDestroyShaderModule(device_, shader_module, nullptr);
   }
-  return true;
+  return succeeded;
 }
 
 bool App::CreateFramebuffers() {
-  VkImageCreateInfo color_image_info{};
-  color_image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-  color_image_info.imageType = VK_IMAGE_TYPE_2D;
-  color_image_info.extent.width = swap_chain_extent_.width;
-  color_image_info.extent.height = swap_chain_extent_.height;
-  color_image_info.extent.depth = 1;
-  color_image_info.mipLevels = 1;
-  color_image_info.arrayLayers = 1;
-  color_image_info.format = swap_chain_image_format_;
-  color_image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
-  color_image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  color_image_info.usage = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
-      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-  color_image_info.samples = msaa_sample_count_;
-  color_image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-  if (!utils::vk::CreateImage(color_image_info,
-                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                              physical_device_, device_, color_image_,
-                              color_image_memory_)) {
-    std::cerr << "Could not create color image." << std::endl;
-    return false;
-  }
-
-  VkImageViewCreateInfo color_image_view_info{};
-  color_image_view_info.sType =
-      VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-  color_image_view_info.image = color_image_;
-  color_image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-  color_image_view_info.format = swap_chain_image_format_;
-  color_image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  color_image_view_info.subresourceRange.baseMipLevel = 0;
-  color_image_view_info.subresourceRange.levelCount = 1;
-  color_image_view_info.subresourceRange.baseArrayLayer = 0;
-  color_image_view_info.subresourceRange.layerCount = 1;
+  bool use_msaa = msaa_sample_count_ != VK_SAMPLE_COUNT_1_BIT;
 
-  if (vkCreateImageView(device_, &color_image_view_info, nullptr,
-                        &color_image_view_) != VK_SUCCESS) {
-    std::cerr << "Could not create color image view." << std::endl;
+  if (use_msaa && !CreateColorImage())
     return false;
-  }
 
   VkFormat depth_format = FindDepthFormat(physical_device_);
   if (depth_format == VK_FORMAT_UNDEFINED) {
@@ -889,6 +1865,7 @@ bool App::CreateFramebuffers() {
     return false;
   }
 
+  // Never read after the render pass, so only needs to exist on chip.
   VkImageCreateInfo depth_image_info{};
   depth_image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
   depth_image_info.imageType = VK_IMAGE_TYPE_2D;
@@ -900,14 +1877,13 @@ bool App::CreateFramebuffers() {
   depth_image_info.format = depth_format;
   depth_image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
   depth_image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  depth_image_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  depth_image_info.usage = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+      VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
   depth_image_info.samples = msaa_sample_count_;
   depth_image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-  if (!utils::vk::CreateImage(depth_image_info,
-                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                              physical_device_, device_, depth_image_,
-                              depth_image_memory_)) {
+  if (!CreateTransientAttachmentImage(depth_image_info, device_, &allocator_,
+                                      depth_image_, depth_image_allocation_)) {
     std::cerr << "Could not create depth image." << std::endl;
     return false;
   }
@@ -932,15 +1908,22 @@ bool App::CreateFramebuffers() {
   swap_chain_framebuffers_.resize(swap_chain_images_.size());
 
   for (int i = 0; i < swap_chain_images_.size(); ++i) {
-    VkImageView attachments[] = {
-      color_image_view_, depth_image_view_, swap_chain_image_views_[i]
-    };
+    // Matches the attachment order of CreateRenderPass().
+    std::vector<VkImageView> attachments;
+    if (use_msaa) {
+      attachments = {
+        color_image_view_, depth_image_view_, swap_chain_image_views_[i]
+      };
+    } else {
+      attachments = { swap_chain_image_views_[i], depth_image_view_ };
+    }
 
     VkFramebufferCreateInfo framebuffer_info{};
     framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     framebuffer_info.renderPass = render_pass_;
-    framebuffer_info.attachmentCount = 3;
-    framebuffer_info.pAttachments = attachments;
+    framebuffer_info.attachmentCount =
+        static_cast<uint32_t>(attachments.size());
+    framebuffer_info.pAttachments = attachments.data();
     framebuffer_info.width = swap_chain_extent_.width;
     framebuffer_info.height = swap_chain_extent_.height;
     framebuffer_info.layers = 1;
@@ -954,52 +1937,260 @@ bool App::CreateFramebuffers() {
   return true;
 }
 
-bool App::CreateShadowPassResources() {
-  if (!CreateShadowRenderPass())
-    return false;
+bool App::CreateColorImage() {
+  // Resolved into the swap chain image at the end of the render pass.
+  VkImageCreateInfo color_image_info{};
+  color_image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  color_image_info.imageType = VK_IMAGE_TYPE_2D;
+  color_image_info.extent.width = swap_chain_extent_.width;
+  color_image_info.extent.height = swap_chain_extent_.height;
+  color_image_info.extent.depth = 1;
+  color_image_info.mipLevels = 1;
+  color_image_info.arrayLayers = 1;
+  color_image_info.format = swap_chain_image_format_;
+  color_image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  color_image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  color_image_info.usage = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  color_image_info.samples = msaa_sample_count_;
+  color_image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-  if (!CreateShadowPipeline())
+  if (!CreateTransientAttachmentImage(color_image_info, device_, &allocator_,
+                                      color_image_, color_image_allocation_)) {
+    std::cerr << "Could not create color image." << std::endl;
     return false;
+  }
 
-  if (!CreateShadowFramebuffers())
-    return false;
+  VkImageViewCreateInfo color_image_view_info{};
+  color_image_view_info.sType =
+      VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  color_image_view_info.image = color_image_;
+  color_image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  color_image_view_info.format = swap_chain_image_format_;
+  color_image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  color_image_view_info.subresourceRange.baseMipLevel = 0;
+  color_image_view_info.subresourceRange.levelCount = 1;
+  color_image_view_info.subresourceRange.baseArrayLayer = 0;
+  color_image_view_info.subresourceRange.layerCount = 1;
 
+  if (vkCreateImageView(device_, &color_image_view_info, nullptr,
+                        &color_image_view_) != VK_SUCCESS) {
+    std::cerr << "Could not create color image view." << std::endl;
+    return false;
+  }
   return true;
 }
 
-bool App::CreateShadowRenderPass() {
-  VkFormat depth_format = FindDepthFormat(physical_device_);
-  if (depth_format == VK_FORMAT_UNDEFINED) {
-    std::cerr << "Could not find suitable depth format." << std::endl;
-    return false;
+bool App::CreateCullPipelineLayout() {
+  VkDescriptorSetLayoutBinding bindings[4]{};
+  for (uint32_t i = 0; i < 4; ++i) {
+    bindings[i].binding = i;
+    bindings[i].descriptorCount = 1;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].pImmutableSamplers = nullptr;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
   }
 
-  VkAttachmentDescription depth_attachment{};
-  depth_attachment.format = depth_format;
-  depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-  depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  depth_attachment.finalLayout =
-      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  VkDescriptorSetLayoutCreateInfo descriptor_layout_info{};
+  descriptor_layout_info.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout_info.bindingCount = 4;
+  descriptor_layout_info.pBindings = bindings;
 
-  VkAttachmentReference depth_attachment_ref{};
-  depth_attachment_ref.attachment = 0;
-  depth_attachment_ref.layout =
-      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  if (vkCreateDescriptorSetLayout(device_, &descriptor_layout_info, nullptr,
+                                  &cull_descriptor_layout_) != VK_SUCCESS) {
+    std::cerr << "Could not create cull descriptor set layout." << std::endl;
+    return false;
+  }
 
-  VkSubpassDescription subpass{};
-  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-  subpass.pDepthStencilAttachment = &depth_attachment_ref;
+  VkPushConstantRange push_constant_range{};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = sizeof(CullPushConstants);
 
-  VkSubpassDependency subpass_dep{};
-  subpass_dep.srcSubpass = VK_SUBPASS_EXTERNAL;
-  subpass_dep.dstSubpass = 0;
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &cull_descriptor_layout_;
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &cull_pipeline_layout_) != VK_SUCCESS) {
+    std::cerr << "Could not create cull pipeline layout." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool App::CreateCullPipeline(VkPipeline* pipeline) {
+  std::vector<std::string> shader_file_paths = { "cull_comp.spv" };
+  std::vector<VkShaderModule> shader_modules;
+  if (!utils::vk::CreateShaderModulesFromFiles(shader_file_paths, device_,
+                                               &shader_modules)) {
+    std::cerr << "Could not create cull shader module." << std::endl;
+    return false;
+  }
+
+  VkComputePipelineCreateInfo pipeline_info{};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = shader_modules[0];
+  pipeline_info.stage.pName = "main";
+  pipeline_info.layout = cull_pipeline_layout_;
+  pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+
+  // The modules are only needed while the pipeline is built.
+  bool created = vkCreateComputePipelines(device_, pipeline_cache_, 1,
+                                          &pipeline_info, nullptr,
+                                          pipeline) == VK_SUCCESS;
+
+  for (VkShaderModule shader_module : shader_modules) {
+    vkDestroyShaderModule(device_, shader_module, nullptr);
+  }
+
+  if (!created) {
+    std::cerr << "Could not create cull pipeline." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool App::CreateClusterPipelineLayout() {
+  // The vertex UBO ring and the cluster buffer are both picked per frame with
+  // dynamic offsets.
+  VkDescriptorType descriptor_types[] = {
+    VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC
+  };
+
+  VkDescriptorSetLayoutBinding bindings[3]{};
+  for (uint32_t i = 0; i < 3; ++i) {
+    bindings[i].binding = i;
+    bindings[i].descriptorCount = 1;
+    bindings[i].descriptorType = descriptor_types[i];
+    bindings[i].pImmutableSamplers = nullptr;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout_info{};
+  descriptor_layout_info.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout_info.bindingCount = 3;
+  descriptor_layout_info.pBindings = bindings;
+
+  if (vkCreateDescriptorSetLayout(device_, &descriptor_layout_info, nullptr,
+                                  &cluster_descriptor_layout_) != VK_SUCCESS) {
+    std::cerr << "Could not create cluster descriptor set layout." << std::endl;
+    return false;
+  }
+
+  VkPushConstantRange push_constant_range{};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = sizeof(ClusterPushConstants);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &cluster_descriptor_layout_;
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &cluster_pipeline_layout_) != VK_SUCCESS) {
+    std::cerr << "Could not create cluster pipeline layout." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool App::CreateClusterPipeline(VkPipeline* pipeline) {
+  std::vector<std::string> shader_file_paths = { "cluster_comp.spv" };
+  std::vector<VkShaderModule> shader_modules;
+  if (!utils::vk::CreateShaderModulesFromFiles(shader_file_paths, device_,
+                                               &shader_modules)) {
+    std::cerr << "Could not create cluster shader module." << std::endl;
+    return false;
+  }
+
+  VkComputePipelineCreateInfo pipeline_info{};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = shader_modules[0];
+  pipeline_info.stage.pName = "main";
+  pipeline_info.layout = cluster_pipeline_layout_;
+  pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+
+  // The modules are only needed while the pipeline is built.
+  bool created = vkCreateComputePipelines(device_, pipeline_cache_, 1,
+                                          &pipeline_info, nullptr,
+                                          pipeline) == VK_SUCCESS;
+
+  for (VkShaderModule shader_module : shader_modules) {
+    vkDestroyShaderModule(device_, shader_module, nullptr);
+  }
+
+  if (!created) {
+    std::cerr << "Could not create cluster pipeline." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool App::CreateShadowPassResources() {
+  if (!CreateShadowRenderPass())
+    return false;
+
+  if (!CreateShadowFramebuffers())
+    return false;
+
+  return true;
+}
+
+bool App::CreateShadowRenderPass() {
+  VkFormat depth_format = shadow_depth_format_;
+
+  VkAttachmentDescription depth_attachment{};
+  depth_attachment.format = depth_format;
+  depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  depth_attachment.finalLayout =
+      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+  VkAttachmentReference depth_attachment_ref{};
+  depth_attachment_ref.attachment = 0;
+  depth_attachment_ref.layout =
+      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+  VkSubpassDescription subpass{};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.pDepthStencilAttachment = &depth_attachment_ref;
+
+  VkSubpassDependency subpass_dep{};
+  subpass_dep.srcSubpass = VK_SUBPASS_EXTERNAL;
+  subpass_dep.dstSubpass = 0;
   subpass_dep.srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
   subpass_dep.srcAccessMask = 0;
   subpass_dep.dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
   subpass_dep.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
+  // Broadcasts the subpass to every face of a light's cubemap. The vertex
+  // shader picks the face's matrix with gl_ViewIndex.
+  uint32_t view_mask = (1u << kShadowCubemapFaceCount) - 1;
+
+  VkRenderPassMultiviewCreateInfo multiview_info{};
+  multiview_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO;
+  multiview_info.subpassCount = 1;
+  multiview_info.pViewMasks = &view_mask;
+
   VkRenderPassCreateInfo render_pass_info{};
   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
   render_pass_info.attachmentCount = 1;
@@ -1008,6 +2199,8 @@ bool App::CreateShadowRenderPass() {
   render_pass_info.pSubpasses = &subpass;
   render_pass_info.dependencyCount = 1;
   render_pass_info.pDependencies = &subpass_dep;
+  if (use_multiview_shadow_pass_)
+    render_pass_info.pNext = &multiview_info;
 
   if (vkCreateRenderPass(device_, &render_pass_info, nullptr,
                          &shadow_render_pass_) != VK_SUCCESS) {
@@ -1017,9 +2210,74 @@ bool App::CreateShadowRenderPass() {
   return true;
 }
 
-bool App::CreateShadowPipeline() {
+bool App::CreateShadowPipelineLayout() {
+  VkDescriptorSetLayoutBinding instance_binding{};
+  instance_binding.binding = 1;
+  instance_binding.descriptorCount = 1;
+  instance_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  instance_binding.pImmutableSamplers = nullptr;
+  instance_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  VkDescriptorSetLayoutBinding vert_ubo_binding{};
+  vert_ubo_binding.binding = 0;
+  vert_ubo_binding.descriptorCount = 1;
+  vert_ubo_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  vert_ubo_binding.pImmutableSamplers = nullptr;
+  vert_ubo_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  VkDescriptorSetLayoutBinding visible_instance_binding{};
+  visible_instance_binding.binding = 2;
+  visible_instance_binding.descriptorCount = 1;
+  visible_instance_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  visible_instance_binding.pImmutableSamplers = nullptr;
+  visible_instance_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  // The face matrices UBO is only used by the multiview path.
+  VkDescriptorSetLayoutBinding descriptor_set_bindings[] = {
+    instance_binding, visible_instance_binding, vert_ubo_binding
+  };
+
+  VkDescriptorSetLayoutCreateInfo descriptor_layout_info{};
+  descriptor_layout_info.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  descriptor_layout_info.bindingCount = use_multiview_shadow_pass_ ? 3 : 2;
+  descriptor_layout_info.pBindings = descriptor_set_bindings;
+
+  if (vkCreateDescriptorSetLayout(device_, &descriptor_layout_info, nullptr,
+                                  &shadow_descriptor_layout_) != VK_SUCCESS) {
+    std::cerr << "Could not create shadow descriptor set layout." << std::endl;
+    return false;
+  }
+
+  VkPushConstantRange push_constant_range{};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = use_multiview_shadow_pass_ ?
+      sizeof(uint32_t) : sizeof(glm::mat4);
+
+  // The multiview path reads all the face matrices from a UBO and is pushed
+  // the index of the light's first one, while the per-face path pushes one
+  // matrix before each render pass.
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &shadow_descriptor_layout_;
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &shadow_pipeline_layout_) != VK_SUCCESS) {
+    std::cerr << "Could not create shadow pipeline layout." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool App::CreateShadowPipeline(VkPipeline* pipeline) {
   std::vector<std::string> shader_file_paths = {
-    "shadow_vert.spv", "shadow_frag.spv"
+    use_multiview_shadow_pass_ ? "shadow_multiview_vert.spv"
+                               : "shadow_vert.spv",
+    "shadow_frag.spv"
   };
   std::vector<VkShaderModule> shader_modules;
   if (!utils::vk::CreateShaderModulesFromFiles(shader_file_paths, device_,
@@ -1044,28 +2302,10 @@ bool App::CreateShadowPipeline() {
     vert_shader_info, frag_shader_info
   };
 
-  VkDescriptorSetLayoutBinding vert_ubo_binding{};
-  vert_ubo_binding.binding = 0;
-  vert_ubo_binding.descriptorCount = 1;
-  vert_ubo_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  vert_ubo_binding.pImmutableSamplers = nullptr;
-  vert_ubo_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-
-  VkDescriptorSetLayoutCreateInfo descriptor_layout_info{};
-  descriptor_layout_info.sType =
-      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  descriptor_layout_info.bindingCount = 1;
-  descriptor_layout_info.pBindings = &vert_ubo_binding;
-
-  if (vkCreateDescriptorSetLayout(device_, &descriptor_layout_info, nullptr,
-                                  &shadow_descriptor_layout_) != VK_SUCCESS) {
-    std::cerr << "Could not create shadow descriptor set layout." << std::endl;
-    return false;
-  }
-
   VkVertexInputBindingDescription vertex_pos_binding{};
   vertex_pos_binding.binding = 0;
-  vertex_pos_binding.stride = sizeof(glm::vec3);
+  vertex_pos_binding.stride = kUsePackedVertices ?
+      sizeof(utils::PackedVertex) : sizeof(glm::vec3);
   vertex_pos_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
   VkVertexInputAttributeDescription vertex_pos_desc{};
@@ -1091,14 +2331,14 @@ bool App::CreateShadowPipeline() {
   VkViewport viewport{};
   viewport.x = 0.f;
   viewport.y = 0.f;
-  viewport.width = static_cast<float>(kShadowTextureWidth);
-  viewport.height = static_cast<float>(kShadowTextureHeight);
+  viewport.width = static_cast<float>(shadow_texture_size_);
+  viewport.height = static_cast<float>(shadow_texture_size_);
   viewport.minDepth = 0.f;
   viewport.maxDepth = 1.f;
 
   VkRect2D scissor{};
   scissor.offset = {0, 0};
-  scissor.extent = {kShadowTextureWidth, kShadowTextureHeight};
+  scissor.extent = {shadow_texture_size_, shadow_texture_size_};
 
   VkPipelineViewportStateCreateInfo viewport_info{};
   viewport_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -1132,22 +2372,6 @@ bool App::CreateShadowPipeline() {
   depth_stencil.depthBoundsTestEnable = VK_FALSE;
   depth_stencil.stencilTestEnable = VK_FALSE;
 
-  VkPushConstantRange push_constant_range{};
-  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-  push_constant_range.offset = 0;
-  push_constant_range.size = sizeof(glm::mat4);
-
-  VkPipelineLayoutCreateInfo pipeline_layout_info{};
-  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipeline_layout_info.pushConstantRangeCount = 1;
-  pipeline_layout_info.pPushConstantRanges = &push_constant_range;
-
-  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
-                             &shadow_pipeline_layout_) != VK_SUCCESS) {
-    std::cerr << "Could not create shadow pipeline layout." << std::endl;
-    return false;
-  }
-
   VkGraphicsPipelineCreateInfo pipeline_info{};
   pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
   pipeline_info.stageCount = 2;
@@ -1163,110 +2387,127 @@ bool App::CreateShadowPipeline() {
   pipeline_info.subpass = 0;
   pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
 
-  if (vkCreateGraphicsPipelines(device_, VK_NULL_HANDLE, 1, &pipeline_info,
-                                nullptr, &shadow_pipeline_) != VK_SUCCESS) {
-    std::cerr << "Could not create shadow pipeline." << std::endl;
-    return false;
-  }
+  // The modules are only needed while the pipeline is built.
+  bool created = vkCreateGraphicsPipelines(device_, pipeline_cache_, 1,
+                                           &pipeline_info, nullptr,
+                                           pipeline) == VK_SUCCESS;
 
   for (VkShaderModule shader_module : shader_modules) {
     vkDestroyShaderModule(device_, shader_module, nullptr);
   }
+
+  if (!created) {
+    std::cerr << "Could not create shadow pipeline." << std::endl;
+    return false;
+  }
   return true;
 }
 
 bool App::CreateShadowFramebuffers() {
-  VkFormat depth_format = FindDepthFormat(physical_device_);
-  if (depth_format == VK_FORMAT_UNDEFINED) {
-    std::cerr << "Could not find suitable depth format." << std::endl;
+  VkFormat depth_format = shadow_depth_format_;
+
+  // Light i's cubemap is layers [6i, 6i + 6) of the array.
+  uint32_t layer_count = kShadowCubemapFaceCount *
+      static_cast<uint32_t>(shadow_light_positions_.size());
+
+  VkImageCreateInfo shadow_tex_info{};
+  shadow_tex_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  shadow_tex_info.imageType = VK_IMAGE_TYPE_2D;
+  shadow_tex_info.flags = VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
+  shadow_tex_info.extent.width = shadow_texture_size_;
+  shadow_tex_info.extent.height = shadow_texture_size_;
+  shadow_tex_info.extent.depth = 1;
+  shadow_tex_info.mipLevels = 1;
+  shadow_tex_info.arrayLayers = layer_count;
+  shadow_tex_info.format = depth_format;
+  shadow_tex_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  shadow_tex_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  shadow_tex_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+      VK_IMAGE_USAGE_SAMPLED_BIT;
+  shadow_tex_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  shadow_tex_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (!utils::vk::CreateImage(shadow_tex_info,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                              device_, &allocator_,
+                              shadow_map_.shadow_texture,
+                              shadow_map_.shadow_texture_allocation)) {
+    std::cerr << "Could not create shadow image." << std::endl;
     return false;
   }
 
-  shadow_frame_resources_.resize(swap_chain_images_.size());
-
-  for (ShadowPassFrameResource& frame : shadow_frame_resources_) {
-    VkImageCreateInfo shadow_tex_info{};
-    shadow_tex_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    shadow_tex_info.imageType = VK_IMAGE_TYPE_2D;
-    shadow_tex_info.flags = VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
-    shadow_tex_info.extent.width = kShadowTextureWidth;
-    shadow_tex_info.extent.height = kShadowTextureHeight;
-    shadow_tex_info.extent.depth = 1;
-    shadow_tex_info.mipLevels = 1;
-    shadow_tex_info.arrayLayers = 6;
-    shadow_tex_info.format = depth_format;
-    shadow_tex_info.tiling = VK_IMAGE_TILING_OPTIMAL;
-    shadow_tex_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    shadow_tex_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
-        VK_IMAGE_USAGE_SAMPLED_BIT;
-    shadow_tex_info.samples = VK_SAMPLE_COUNT_1_BIT;
-    shadow_tex_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    if (!utils::vk::CreateImage(shadow_tex_info,
-                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                physical_device_, device_, frame.shadow_texture,
-                                frame.shadow_texture_memory)) {
-      std::cerr << "Could not create shadow image." << std::endl;
-      return false;
-    }
-
-    frame.depth_framebuffer_views.resize(6);
-    frame.depth_framebuffers.resize(6);
+  // The multiview path renders each light into a single framebuffer whose
+  // view covers all of its faces. Otherwise, each face gets its own
+  // framebuffer.
+  int framebuffer_count = GetShadowPassesPerLight() *
+      static_cast<int>(shadow_light_positions_.size());
+  shadow_map_.depth_framebuffer_views.resize(framebuffer_count);
+  shadow_map_.depth_framebuffers.resize(framebuffer_count);
 
-    for (int i = 0; i < frame.depth_framebuffer_views.size(); ++i) {
-      VkImageViewCreateInfo image_view_info{};
-      image_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-      image_view_info.image = frame.shadow_texture;
+  for (int i = 0; i < shadow_map_.depth_framebuffer_views.size(); ++i) {
+    VkImageViewCreateInfo image_view_info{};
+    image_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    image_view_info.image = shadow_map_.shadow_texture;
+    image_view_info.format = depth_format;
+    image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    image_view_info.subresourceRange.baseMipLevel = 0;
+    image_view_info.subresourceRange.levelCount = 1;
+    if (use_multiview_shadow_pass_) {
+      image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+      image_view_info.subresourceRange.baseArrayLayer =
+          i * kShadowCubemapFaceCount;
+      image_view_info.subresourceRange.layerCount = kShadowCubemapFaceCount;
+    } else {
       image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-      image_view_info.format = depth_format;
-      image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-      image_view_info.subresourceRange.baseMipLevel = 0;
-      image_view_info.subresourceRange.levelCount = 1;
       image_view_info.subresourceRange.baseArrayLayer = i;
       image_view_info.subresourceRange.layerCount = 1;
+    }
 
-      if (vkCreateImageView(device_, &image_view_info, nullptr,
-                            &frame.depth_framebuffer_views[i]) != VK_SUCCESS) {
-        std::cerr << "Could not create shadow image framebuffer view."
-                  << std::endl;
-        return false;
-      }
-
-      VkFramebufferCreateInfo framebuffer_info{};
-      framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-      framebuffer_info.renderPass = shadow_render_pass_;
-      framebuffer_info.attachmentCount = 1;
-      framebuffer_info.pAttachments = &frame.depth_framebuffer_views[i];
-      framebuffer_info.width = kShadowTextureWidth;
-      framebuffer_info.height = kShadowTextureHeight;
-      framebuffer_info.layers = 1;
-
-      if (vkCreateFramebuffer(device_, &framebuffer_info, nullptr,
-                              &frame.depth_framebuffers[i]) != VK_SUCCESS) {
-        std::cerr << "Could not create framebuffer." << std::endl;
-        return false;
-      }
+    if (vkCreateImageView(device_, &image_view_info, nullptr,
+                          &shadow_map_.depth_framebuffer_views[i])
+            != VK_SUCCESS) {
+      std::cerr << "Could not create shadow image framebuffer view."
+                << std::endl;
+      return false;
     }
 
-    VkImageViewCreateInfo shadow_tex_view_info{};
-    shadow_tex_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    shadow_tex_view_info.image = frame.shadow_texture;
-    shadow_tex_view_info.viewType = VK_IMAGE_VIEW_TYPE_CUBE;
-    shadow_tex_view_info.format = depth_format;
-    shadow_tex_view_info.subresourceRange.aspectMask =
-        VK_IMAGE_ASPECT_DEPTH_BIT;
-    shadow_tex_view_info.subresourceRange.baseMipLevel = 0;
-    shadow_tex_view_info.subresourceRange.levelCount = 1;
-    shadow_tex_view_info.subresourceRange.baseArrayLayer = 0;
-    shadow_tex_view_info.subresourceRange.layerCount = 6;
-
-    if (vkCreateImageView(device_, &shadow_tex_view_info, nullptr,
-                          &frame.shadow_texture_view) != VK_SUCCESS) {
-      std::cerr << "Could not create shadow texture view." << std::endl;
+    VkFramebufferCreateInfo framebuffer_info{};
+    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_info.renderPass = shadow_render_pass_;
+    framebuffer_info.attachmentCount = 1;
+    framebuffer_info.pAttachments = &shadow_map_.depth_framebuffer_views[i];
+    framebuffer_info.width = shadow_texture_size_;
+    framebuffer_info.height = shadow_texture_size_;
+    framebuffer_info.layers = 1;
+
+    if (vkCreateFramebuffer(device_, &framebuffer_info, nullptr,
+                            &shadow_map_.depth_framebuffers[i]) != VK_SUCCESS) {
+      std::cerr << "Could not create framebuffer." << std::endl;
       return false;
     }
   }
 
+  VkImageViewCreateInfo shadow_tex_view_info{};
+  shadow_tex_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  shadow_tex_view_info.image = shadow_map_.shadow_texture;
+  shadow_tex_view_info.viewType = VK_IMAGE_VIEW_TYPE_CUBE_ARRAY;
+  shadow_tex_view_info.format = depth_format;
+  shadow_tex_view_info.subresourceRange.aspectMask =
+      VK_IMAGE_ASPECT_DEPTH_BIT;
+  shadow_tex_view_info.subresourceRange.baseMipLevel = 0;
+  shadow_tex_view_info.subresourceRange.levelCount = 1;
+  shadow_tex_view_info.subresourceRange.baseArrayLayer = 0;
+  shadow_tex_view_info.subresourceRange.layerCount = layer_count;
+
+  if (vkCreateImageView(device_, &shadow_tex_view_info, nullptr,
+                        &shadow_map_.shadow_texture_view) != VK_SUCCESS) {
+    std::cerr << "Could not create shadow texture view." << std::endl;
+    return false;
+  }
+
+  // The new cubemaps have undefined contents until the shadow pass runs.
+  shadow_map_dirty_ = true;
+
   return true;
 }
 
@@ -1285,43 +2526,122 @@ bool App::CreateCommandPool() {
 }
 
 bool App::CreateCommandBuffers() {
-  command_buffers_.resize(swap_chain_framebuffers_.size());
+  size_t command_buffer_count = 1;
+  if (kPrerecordCommandBuffers)
+    command_buffer_count = swap_chain_framebuffers_.size();
+
+  for (int i = 0; i < frames_in_flight_; ++i) {
+    FrameContext& frame = frames_[i];
+    frame.command_buffers.resize(command_buffer_count);
+
+    VkCommandBufferAllocateInfo command_buffer_info{};
+    command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    command_buffer_info.commandPool = command_pool_;
+    command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    command_buffer_info.commandBufferCount =
+        static_cast<uint32_t>(frame.command_buffers.size());
+
+    if (vkAllocateCommandBuffers(device_, &command_buffer_info,
+                                 frame.command_buffers.data()) != VK_SUCCESS) {
+      std::cerr << "Could not create command buffers." << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
 
+bool App::CreateShadowCommandBuffer() {
   VkCommandBufferAllocateInfo command_buffer_info{};
   command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   command_buffer_info.commandPool = command_pool_;
   command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  command_buffer_info.commandBufferCount =
-      static_cast<uint32_t>(command_buffers_.size());
+  command_buffer_info.commandBufferCount = 1;
 
   if (vkAllocateCommandBuffers(device_, &command_buffer_info,
-                               command_buffers_.data()) != VK_SUCCESS) {
-    std::cerr << "Could not create command buffers." << std::endl;
+                               &shadow_command_buffer_) != VK_SUCCESS) {
+    std::cerr << "Could not create shadow command buffer." << std::endl;
     return false;
   }
   return true;
 }
 
+bool App::CreateRecordingJobCommandBuffers() {
+  // Both scene pass buffers are recorded by the same job, so they share a
+  // pool.
+  for (FrameContext& frame : frames_) {
+    VkCommandBuffer command_buffers[2];
+    if (!CreateRecordingJobCommandPool(device_, graphics_queue_index_, 2,
+                                       &frame.scene_pass_command_pool,
+                                       command_buffers)) {
+      std::cerr << "Could not create scene pass command buffers." << std::endl;
+      return false;
+    }
+    frame.scene_pass_command_buffer = command_buffers[0];
+    frame.depth_prepass_command_buffer = command_buffers[1];
+  }
+
+  size_t shadow_job_count = shadow_map_.depth_framebuffers.size();
+  shadow_pass_command_pools_.resize(shadow_job_count, VK_NULL_HANDLE);
+  shadow_pass_command_buffers_.resize(shadow_job_count);
+
+  for (size_t i = 0; i < shadow_job_count; ++i) {
+    if (!CreateRecordingJobCommandPool(device_, graphics_queue_index_, 1,
+                                       &shadow_pass_command_pools_[i],
+                                       &shadow_pass_command_buffers_[i])) {
+      std::cerr << "Could not create shadow pass command buffer."
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
 bool App::CreateDescriptorSets() {
+  // One extra set and uniform buffer for the multiview shadow pass matrices.
   VkDescriptorPoolSize uniform_buffer_pool_size{};
   uniform_buffer_pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
   uniform_buffer_pool_size.descriptorCount =
-      static_cast<uint32_t>(swap_chain_images_.size()) * 2;
+      kMaxFramesInFlight + 1;
+
+  // The vertex UBO ring in every scene pass set and in the cluster set.
+  VkDescriptorPoolSize dynamic_uniform_buffer_pool_size{};
+  dynamic_uniform_buffer_pool_size.type =
+      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  dynamic_uniform_buffer_pool_size.descriptorCount =
+      kMaxFramesInFlight + 1;
 
   VkDescriptorPoolSize combined_sampler_pool_size{};
   combined_sampler_pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
   combined_sampler_pool_size.descriptorCount =
-      static_cast<uint32_t>(swap_chain_images_.size());
+      kMaxFramesInFlight;
+
+  // The instance and visible instance buffers, in every scene pass set and
+  // in the shadow pass set, the material, light and cluster buffers in every
+  // scene pass set, the four buffers of the cull set and the light buffer of
+  // the cluster set.
+  VkDescriptorPoolSize storage_buffer_pool_size{};
+  storage_buffer_pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  storage_buffer_pool_size.descriptorCount =
+      (kMaxFramesInFlight + 1) * 2 + kMaxFramesInFlight * 3 + 4 + 1;
+
+  // The cluster buffer of the cluster set, which writes a different range
+  // each frame.
+  VkDescriptorPoolSize dynamic_storage_buffer_pool_size{};
+  dynamic_storage_buffer_pool_size.type =
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  dynamic_storage_buffer_pool_size.descriptorCount = 1;
 
   VkDescriptorPoolSize pool_sizes[] = {
-    uniform_buffer_pool_size, combined_sampler_pool_size
+    uniform_buffer_pool_size, dynamic_uniform_buffer_pool_size,
+    combined_sampler_pool_size, storage_buffer_pool_size,
+    dynamic_storage_buffer_pool_size
   };
 
   VkDescriptorPoolCreateInfo pool_info{};
   pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  pool_info.poolSizeCount = 2;
+  pool_info.poolSizeCount = 5;
   pool_info.pPoolSizes = pool_sizes;
-  pool_info.maxSets = static_cast<uint32_t>(swap_chain_images_.size());
+  pool_info.maxSets = kMaxFramesInFlight + 3;
 
   if (vkCreateDescriptorPool(device_, &pool_info, nullptr, &descriptor_pool_)
           != VK_SUCCESS) {
@@ -1329,135 +2649,115 @@ bool App::CreateDescriptorSets() {
     return false;
   }
 
-  std::vector<VkDescriptorSetLayout> layouts(swap_chain_images_.size(),
+  std::vector<VkDescriptorSetLayout> layouts(kMaxFramesInFlight,
                                              descriptor_set_layout_);
   VkDescriptorSetAllocateInfo alloc_info{};
   alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
   alloc_info.descriptorPool = descriptor_pool_;
-  alloc_info.descriptorSetCount = static_cast<uint32_t>(
-      swap_chain_images_.size());
+  alloc_info.descriptorSetCount = kMaxFramesInFlight;
   alloc_info.pSetLayouts = layouts.data();
 
-  descriptor_sets_.resize(swap_chain_images_.size());
-  if (vkAllocateDescriptorSets(device_, &alloc_info, descriptor_sets_.data())
+  VkDescriptorSet descriptor_sets[kMaxFramesInFlight];
+  if (vkAllocateDescriptorSets(device_, &alloc_info, descriptor_sets)
           != VK_SUCCESS) {
     std::cerr << "Could not create descriptor sets." << std::endl;
     return false;
   }
 
-  model_mat_ = glm::mat4(1.f);
-  glm::vec3 light_pos = glm::vec3(0.f, 1.9f, 0.f);
+  for (int i = 0; i < kMaxFramesInFlight; ++i)
+    frames_[i].descriptor_set = descriptor_sets[i];
 
-  float shadow_tex_aspect_ratio = static_cast<float>(kShadowTextureWidth) /
-      static_cast<float>(kShadowTextureHeight);
+  UpdateShadowMatrices();
 
-  glm::mat4 pos_z_view_mat =
-      glm::rotate(glm::mat4(1.f), kPi, glm::vec3(0.f, 1.f, 0.f)) *
-          glm::translate(glm::mat4(1.f), -light_pos);
-  glm::mat4 shadow_proj_mat = glm::perspective(glm::radians(90.f),
-                                               shadow_tex_aspect_ratio,
-                                               kShadowPassNearPlane,
-                                               kShadowPassFarPlane);
-  shadow_proj_mat[1][1] *= -1;
+  if (!CreateShadowDescriptorSet())
+    return false;
 
-  // Cubemap faces are in left-handed coordinates. E.g. +x is to the right
-  // of +z in a cubemap while +x is to the left of +z in Vulkan.
-  std::vector<glm::mat4> shadow_view_mats(6);
-  shadow_view_mats[0] =  // Right (+x)
-      glm::rotate(glm::mat4(1.f), kPi / 2.f, glm::vec3(0.f, 1.f, 0.f)) *
-          pos_z_view_mat;
-  shadow_view_mats[1] =  // Left (-x)
-      glm::rotate(glm::mat4(1.f), -kPi / 2.f, glm::vec3(0.f, 1.f, 0.f)) *
-          pos_z_view_mat;
-  shadow_view_mats[2] =  // Top (+y)
-      glm::rotate(glm::mat4(1.f), -kPi / 2.f, glm::vec3(1.f, 0.f, 0.f)) *
-          pos_z_view_mat;
-  shadow_view_mats[3] =  // Bottom (-y)
-      glm::rotate(glm::mat4(1.f), kPi / 2.f, glm::vec3(1.f, 0.f, 0.f)) *
-          pos_z_view_mat;
-  shadow_view_mats[4] = pos_z_view_mat;  // Front (+z)
-  shadow_view_mats[5] =  // Back (-z)
-      glm::rotate(glm::mat4(1.f), kPi, glm::vec3(0.f, 1.f, 0.f)) *
-          pos_z_view_mat;
-
-  shadow_mats_.resize(6);
-  for (int i = 0; i < shadow_mats_.size(); ++i) {
-    shadow_mats_[i] = shadow_proj_mat * shadow_view_mats[i] * model_mat_;
-  }
+  if (!CreateCullDescriptorSet())
+    return false;
 
-  vert_ubo_buffers_.resize(swap_chain_images_.size());
-  vert_ubo_buffers_memory_.resize(swap_chain_images_.size());
+  VkPhysicalDeviceProperties phys_device_props{};
+  vkGetPhysicalDeviceProperties(physical_device_, &phys_device_props);
 
-  for (size_t i = 0; i < swap_chain_images_.size(); i++) {
-    VkBufferCreateInfo vert_ubo_buffer_info{};
-    vert_ubo_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    vert_ubo_buffer_info.size = sizeof(VertexShaderUbo);
-    vert_ubo_buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    vert_ubo_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  // One slot per frame in flight, each aligned so that it can be used as a
+  // dynamic offset.
+  VkDeviceSize ubo_alignment =
+      phys_device_props.limits.minUniformBufferOffsetAlignment;
+  VkDeviceSize vert_ubo_ring_stride = sizeof(VertexShaderUbo);
+  if (ubo_alignment > 0) {
+    vert_ubo_ring_stride =
+        (vert_ubo_ring_stride + ubo_alignment - 1) & ~(ubo_alignment - 1);
+  }
 
-    utils::vk::CreateBuffer(vert_ubo_buffer_info,
-                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                            physical_device_, device_, vert_ubo_buffers_[i],
-                            vert_ubo_buffers_memory_[i]);
+  VkBufferCreateInfo vert_ubo_buffer_info{};
+  vert_ubo_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  vert_ubo_buffer_info.size = vert_ubo_ring_stride * kMaxFramesInFlight;
+  vert_ubo_buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+  vert_ubo_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (!utils::vk::CreateBuffer(vert_ubo_buffer_info,
+                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                               device_, &allocator_, vert_ubo_buffer_,
+                               vert_ubo_buffer_allocation_)) {
+    std::cerr << "Could not create vertex UBO buffer." << std::endl;
+    return false;
   }
 
-  struct Material {
-    glm::vec4 ambient_color;
-    glm::vec4 diffuse_color;
-  };
+  // Host-visible blocks stay mapped for as long as the allocator lives.
+  auto vert_ubo_buffer_ptr =
+      static_cast<uint8_t*>(vert_ubo_buffer_allocation_.mapped_data);
 
-  struct FragmentShaderUbo {
-    glm::vec4 light_pos;
-    float shadow_near_plane;
-    float shadow_far_plane;
-    glm::vec2 pad;
-    Material materials[20];
-  } frag_ubo_data;
+  for (int i = 0; i < kMaxFramesInFlight; i++) {
+    FrameContext& frame = frames_[i];
+    frame.vert_ubo_offset = static_cast<uint32_t>(i * vert_ubo_ring_stride);
+    frame.vert_ubo = reinterpret_cast<VertexShaderUbo*>(
+        vert_ubo_buffer_ptr + frame.vert_ubo_offset);
 
-  frag_ubo_data.light_pos = glm::vec4(light_pos, 0.f);
-  frag_ubo_data.shadow_near_plane = kShadowPassNearPlane;
-  frag_ubo_data.shadow_far_plane = kShadowPassFarPlane;
+    // Written once here rather than per frame - updating a descriptor set
+    // invalidates any recorded command buffer that binds it.
+    VkDescriptorBufferInfo descriptor_buffer_info{};
+    descriptor_buffer_info.buffer = vert_ubo_buffer_;
+    descriptor_buffer_info.offset = 0;
+    descriptor_buffer_info.range = sizeof(VertexShaderUbo);
 
-  for (int i = 0; i < model_.materials.size(); ++i) {
-    frag_ubo_data.materials[i].ambient_color =
-        glm::vec4(model_.materials[i].ambient_color, 0.f);
-    frag_ubo_data.materials[i].diffuse_color =
-        glm::vec4(model_.materials[i].diffuse_color, 0.f);
-  }
+    VkWriteDescriptorSet descriptor_write{};
+    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_write.dstSet = frame.descriptor_set;
+    descriptor_write.dstBinding = 0;
+    descriptor_write.dstArrayElement = 0;
+    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    descriptor_write.descriptorCount = 1;
+    descriptor_write.pBufferInfo = &descriptor_buffer_info;
 
-  frag_ubo_buffers_.resize(swap_chain_images_.size());
-  frag_ubo_buffers_memory_.resize(swap_chain_images_.size());
+    vkUpdateDescriptorSets(device_, 1, &descriptor_write, 0, nullptr);
+  }
 
   VkDeviceSize frag_ubo_buffer_size = sizeof(FragmentShaderUbo);
 
-  for (size_t i = 0; i < swap_chain_images_.size(); i++) {
+  for (FrameContext& frame : frames_) {
     VkBufferCreateInfo vert_ubo_buffer_info{};
     vert_ubo_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     vert_ubo_buffer_info.size = frag_ubo_buffer_size;
     vert_ubo_buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
     vert_ubo_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    utils::vk::CreateBuffer(vert_ubo_buffer_info,
-                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                            physical_device_, device_, frag_ubo_buffers_[i],
-                            frag_ubo_buffers_memory_[i]);
-
-    FragmentShaderUbo* ubo_ptr;
-    vkMapMemory(device_, frag_ubo_buffers_memory_[i], 0, frag_ubo_buffer_size,
-                0, reinterpret_cast<void**>(&ubo_ptr));
-    *ubo_ptr = frag_ubo_data;
-    vkUnmapMemory(device_, frag_ubo_buffers_memory_[i]);
+    if (!utils::vk::CreateBuffer(vert_ubo_buffer_info,
+                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                 device_, &allocator_, frame.frag_ubo_buffer,
+                                 frame.frag_ubo_buffer_allocation)) {
+      std::cerr << "Could not create fragment UBO buffer." << std::endl;
+      return false;
+    }
 
     VkDescriptorBufferInfo descriptor_buffer_info{};
-    descriptor_buffer_info.buffer = frag_ubo_buffers_[i];
+    descriptor_buffer_info.buffer = frame.frag_ubo_buffer;
     descriptor_buffer_info.offset = 0;
     descriptor_buffer_info.range = frag_ubo_buffer_size;
 
     VkWriteDescriptorSet descriptor_write{};
     descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_write.dstSet = descriptor_sets_[i];
+    descriptor_write.dstSet = frame.descriptor_set;
     descriptor_write.dstBinding = 1;
     descriptor_write.dstArrayElement = 0;
     descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
@@ -1467,37 +2767,284 @@ bool App::CreateDescriptorSets() {
     vkUpdateDescriptorSets(device_, 1, &descriptor_write, 0, nullptr);
   }
 
-  VkPhysicalDeviceProperties phys_device_props{};
-  vkGetPhysicalDeviceProperties(physical_device_, &phys_device_props);
+  WriteFragmentShaderUbos();
+
+  if (!CreateShadowTextureSampler())
+    return false;
+
+  UpdateShadowTextureDescriptors();
+
+  // Bindings 3 to 7. The cluster buffer only has ranges for the frames in
+  // use, and the other sets are never bound.
+  for (int frame_index = 0; frame_index < frames_in_flight_; ++frame_index) {
+    FrameContext& frame = frames_[frame_index];
+
+    VkBuffer buffers[] = {
+      instance_buffer_, visible_instance_buffer_, material_buffer_,
+      light_buffer_, cluster_buffer_
+    };
+
+    VkDescriptorBufferInfo buffer_infos[5]{};
+    VkWriteDescriptorSet descriptor_writes[5]{};
+    for (uint32_t i = 0; i < 5; ++i) {
+      buffer_infos[i].buffer = buffers[i];
+      buffer_infos[i].offset = 0;
+      buffer_infos[i].range = VK_WHOLE_SIZE;
+      if (buffers[i] == cluster_buffer_) {
+        buffer_infos[i].offset = frame_index * cluster_buffer_stride_;
+        buffer_infos[i].range = cluster_buffer_range_;
+      }
+
+      descriptor_writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      descriptor_writes[i].dstSet = frame.descriptor_set;
+      descriptor_writes[i].dstBinding = 3 + i;
+      descriptor_writes[i].dstArrayElement = 0;
+      descriptor_writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      descriptor_writes[i].descriptorCount = 1;
+      descriptor_writes[i].pBufferInfo = &buffer_infos[i];
+    }
+
+    vkUpdateDescriptorSets(device_, 5, descriptor_writes, 0, nullptr);
+  }
+
+  // Needs the vertex UBO ring.
+  if (!CreateClusterDescriptorSet())
+    return false;
+
+  return true;
+}
+
+void App::UpdateMaterialDescriptors() {
+  VkDescriptorBufferInfo buffer_info{};
+  buffer_info.buffer = material_buffer_;
+  buffer_info.offset = 0;
+  buffer_info.range = VK_WHOLE_SIZE;
+
+  for (FrameContext& frame : frames_) {
+    VkWriteDescriptorSet descriptor_write{};
+    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_write.dstSet = frame.descriptor_set;
+    descriptor_write.dstBinding = 5;
+    descriptor_write.dstArrayElement = 0;
+    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptor_write.descriptorCount = 1;
+    descriptor_write.pBufferInfo = &buffer_info;
+
+    vkUpdateDescriptorSets(device_, 1, &descriptor_write, 0, nullptr);
+  }
+}
+
+bool App::CreateCullDescriptorSet() {
+  VkDescriptorSetAllocateInfo alloc_info{};
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = descriptor_pool_;
+  alloc_info.descriptorSetCount = 1;
+  alloc_info.pSetLayouts = &cull_descriptor_layout_;
+
+  if (vkAllocateDescriptorSets(device_, &alloc_info, &cull_descriptor_set_)
+          != VK_SUCCESS) {
+    std::cerr << "Could not create cull descriptor set." << std::endl;
+    return false;
+  }
+
+  VkBuffer buffers[] = {
+    instance_buffer_, cull_view_buffer_, draw_buffer_, visible_instance_buffer_
+  };
+
+  VkDescriptorBufferInfo buffer_infos[4]{};
+  VkWriteDescriptorSet descriptor_writes[4]{};
+  for (uint32_t i = 0; i < 4; ++i) {
+    buffer_infos[i].buffer = buffers[i];
+    buffer_infos[i].offset = 0;
+    buffer_infos[i].range = VK_WHOLE_SIZE;
+
+    descriptor_writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_writes[i].dstSet = cull_descriptor_set_;
+    descriptor_writes[i].dstBinding = i;
+    descriptor_writes[i].dstArrayElement = 0;
+    descriptor_writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptor_writes[i].descriptorCount = 1;
+    descriptor_writes[i].pBufferInfo = &buffer_infos[i];
+  }
+
+  vkUpdateDescriptorSets(device_, 4, descriptor_writes, 0, nullptr);
+
+  return true;
+}
+
+bool App::CreateClusterDescriptorSet() {
+  VkDescriptorSetAllocateInfo alloc_info{};
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = descriptor_pool_;
+  alloc_info.descriptorSetCount = 1;
+  alloc_info.pSetLayouts = &cluster_descriptor_layout_;
+
+  if (vkAllocateDescriptorSets(device_, &alloc_info, &cluster_descriptor_set_)
+          != VK_SUCCESS) {
+    std::cerr << "Could not create cluster descriptor set." << std::endl;
+    return false;
+  }
+
+  VkBuffer buffers[] = { vert_ubo_buffer_, light_buffer_, cluster_buffer_ };
+  VkDeviceSize ranges[] = {
+    sizeof(VertexShaderUbo), VK_WHOLE_SIZE, cluster_buffer_range_
+  };
+  VkDescriptorType descriptor_types[] = {
+    VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC
+  };
+
+  VkDescriptorBufferInfo buffer_infos[3]{};
+  VkWriteDescriptorSet descriptor_writes[3]{};
+  for (uint32_t i = 0; i < 3; ++i) {
+    buffer_infos[i].buffer = buffers[i];
+    buffer_infos[i].offset = 0;
+    buffer_infos[i].range = ranges[i];
+
+    descriptor_writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_writes[i].dstSet = cluster_descriptor_set_;
+    descriptor_writes[i].dstBinding = i;
+    descriptor_writes[i].dstArrayElement = 0;
+    descriptor_writes[i].descriptorType = descriptor_types[i];
+    descriptor_writes[i].descriptorCount = 1;
+    descriptor_writes[i].pBufferInfo = &buffer_infos[i];
+  }
+
+  vkUpdateDescriptorSets(device_, 3, descriptor_writes, 0, nullptr);
+
+  return true;
+}
+
+void App::UpdateShadowMatrices() {
+  // The faces' rotations are the same for every light, which only moves the
+  // translation in front of them.
+  glm::mat4 pos_z_view_mat =
+      glm::rotate(glm::mat4(1.f), kPi, glm::vec3(0.f, 1.f, 0.f));
+  // The faces are square.
+  glm::mat4 shadow_proj_mat = glm::perspective(glm::radians(90.f), 1.f,
+                                               kShadowPassNearPlane,
+                                               kShadowPassFarPlane);
+  shadow_proj_mat[1][1] *= -1;
+
+  // Cubemap faces are in left-handed coordinates. E.g. +x is to the right
+  // of +z in a cubemap while +x is to the left of +z in Vulkan.
+  std::vector<glm::mat4> shadow_view_mats(kShadowCubemapFaceCount);
+  shadow_view_mats[0] =  // Right (+x)
+      glm::rotate(glm::mat4(1.f), kPi / 2.f, glm::vec3(0.f, 1.f, 0.f)) *
+          pos_z_view_mat;
+  shadow_view_mats[1] =  // Left (-x)
+      glm::rotate(glm::mat4(1.f), -kPi / 2.f, glm::vec3(0.f, 1.f, 0.f)) *
+          pos_z_view_mat;
+  shadow_view_mats[2] =  // Top (+y)
+      glm::rotate(glm::mat4(1.f), -kPi / 2.f, glm::vec3(1.f, 0.f, 0.f)) *
+          pos_z_view_mat;
+  shadow_view_mats[3] =  // Bottom (-y)
+      glm::rotate(glm::mat4(1.f), kPi / 2.f, glm::vec3(1.f, 0.f, 0.f)) *
+          pos_z_view_mat;
+  shadow_view_mats[4] = pos_z_view_mat;  // Front (+z)
+  shadow_view_mats[5] =  // Back (-z)
+      glm::rotate(glm::mat4(1.f), kPi, glm::vec3(0.f, 1.f, 0.f)) *
+          pos_z_view_mat;
+
+  shadow_mats_.clear();
+  for (int i = 0; i < shadow_light_positions_.size(); ++i) {
+    glm::mat4 light_translation =
+        glm::translate(glm::mat4(1.f), -shadow_light_positions_[i]);
+    for (const glm::mat4& view_mat : shadow_view_mats) {
+      shadow_mats_.push_back(shadow_proj_mat * view_mat * light_translation);
+    }
+
+    // Together the six faces see everything within the far plane distance
+    // on each axis, which the light's single multiview draw is culled
+    // against.
+    if (use_multiview_shadow_pass_) {
+      cull_view_mats_[kShadowCullViewSlot + i] =
+          glm::ortho(-kShadowPassFarPlane, kShadowPassFarPlane,
+                     -kShadowPassFarPlane, kShadowPassFarPlane,
+                     -kShadowPassFarPlane, kShadowPassFarPlane) *
+          light_translation;
+    }
+  }
+
+  if (!use_multiview_shadow_pass_) {
+    for (int i = 0; i < shadow_mats_.size(); ++i) {
+      cull_view_mats_[kShadowCullViewSlot + i] = shadow_mats_[i];
+    }
+  }
+
+  // The lights moved, so the cached cubemaps are stale.
+  shadow_map_dirty_ = true;
+}
+
+int App::GetShadowPassesPerLight() const {
+  return use_multiview_shadow_pass_ ? 1 : kShadowCubemapFaceCount;
+}
+
+void App::SelectShadowQualityTier(int tier) {
+  const ShadowQualityTier& quality = kShadowQualityTiers[tier];
 
+  shadow_quality_tier_ = tier;
+  requested_shadow_quality_tier_ = tier;
+  shadow_texture_size_ = quality.resolution;
+  shadow_pcf_tap_count_ = quality.pcf_tap_count;
+
+  std::vector<VkFormat> formats = { quality.depth_format };
+  if (quality.depth_format != VK_FORMAT_D16_UNORM)
+    formats.push_back(VK_FORMAT_D16_UNORM);
+
+  shadow_depth_format_ = utils::vk::FindSupportedFormat(
+      formats, VK_IMAGE_TILING_OPTIMAL,
+      VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT |
+          VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT,
+      physical_device_);
+}
+
+bool App::CreateShadowTextureSampler() {
+  // With linear filtering, every compare also blends the results of the 2x2
+  // texels around it, on top of the PCF taps.
+  VkFormatProperties format_props;
+  vkGetPhysicalDeviceFormatProperties(physical_device_, shadow_depth_format_,
+                                      &format_props);
+  VkFilter filter = VK_FILTER_NEAREST;
+  if (format_props.optimalTilingFeatures &
+          VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) {
+    filter = VK_FILTER_LINEAR;
+  }
+
+  // A fragment is lit where its depth is less than the stored depth.
   VkSamplerCreateInfo sampler_info{};
   sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-  sampler_info.magFilter = VK_FILTER_LINEAR;
-  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.magFilter = filter;
+  sampler_info.minFilter = filter;
   sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
   sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
   sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
-  sampler_info.anisotropyEnable = VK_TRUE;
-  sampler_info.maxAnisotropy = phys_device_props.limits.maxSamplerAnisotropy;
+  sampler_info.anisotropyEnable = VK_FALSE;
+  sampler_info.compareEnable = VK_TRUE;
+  sampler_info.compareOp = VK_COMPARE_OP_LESS;
   sampler_info.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
   sampler_info.unnormalizedCoordinates = VK_FALSE;
-  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
 
   if (vkCreateSampler(device_, &sampler_info, nullptr, &shadow_texture_sampler_)
           != VK_SUCCESS) {
     std::cerr << "Could not create shadow texture sampler." << std::endl;
     return false;
   }
+  return true;
+}
 
-  for (int i = 0; i < swap_chain_images_.size(); i++) {
+void App::UpdateShadowTextureDescriptors() {
+  for (FrameContext& frame : frames_) {
     VkDescriptorImageInfo image_info{};
     image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    image_info.imageView = shadow_frame_resources_[i].shadow_texture_view;
+    image_info.imageView = shadow_map_.shadow_texture_view;
     image_info.sampler = shadow_texture_sampler_;
 
     VkWriteDescriptorSet descriptor_write{};
     descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_write.dstSet = descriptor_sets_[i];
+    descriptor_write.dstSet = frame.descriptor_set;
     descriptor_write.dstBinding = 2;
     descriptor_write.dstArrayElement = 0;
     descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
@@ -1506,36 +3053,354 @@ bool App::CreateDescriptorSets() {
 
     vkUpdateDescriptorSets(device_, 1, &descriptor_write, 0, nullptr);
   }
+}
+
+void App::WriteFragmentShaderUbos() {
+  FragmentShaderUbo frag_ubo_data;
+
+  // The tiles split the extent evenly, and the slices are evenly spaced in
+  // log(depth) like the ones cluster.comp builds.
+  float log_depth_range = std::log(kSceneFarPlane / kSceneNearPlane);
+  frag_ubo_data.cluster_scale = glm::vec4(
+      static_cast<float>(kClusterGridX) /
+          static_cast<float>(swap_chain_extent_.width),
+      static_cast<float>(kClusterGridY) /
+          static_cast<float>(swap_chain_extent_.height),
+      static_cast<float>(kClusterGridZ) / log_depth_range,
+      -static_cast<float>(kClusterGridZ) * std::log(kSceneNearPlane) /
+          log_depth_range);
+
+  frag_ubo_data.shadow_near_plane = kShadowPassNearPlane;
+  frag_ubo_data.shadow_far_plane = kShadowPassFarPlane;
+  frag_ubo_data.pcf_tap_count = shadow_pcf_tap_count_;
+
+  // A face spans [-1, 1] in cubemap coordinates.
+  frag_ubo_data.pcf_radius = kShadowPcfRadiusTexels * 2.f /
+      static_cast<float>(shadow_texture_size_);
+
+  for (FrameContext& frame : frames_) {
+    memcpy(frame.frag_ubo_buffer_allocation.mapped_data, &frag_ubo_data,
+           sizeof(frag_ubo_data));
+  }
+}
+
+bool App::ChangeShadowQualityTier(int tier) {
+  if (!frame_pacer_.WaitIdle()) {
+    std::cerr << "Could not wait for frames." << std::endl;
+    return false;
+  }
+
+  // The pipeline layout and the descriptor sets don't depend on the tier.
+  // Everything that names the cubemap's size or format is rebuilt.
+  DestroyShadowFramebuffers();
+  vkDestroyPipeline(device_, shadow_pipeline_, nullptr);
+  vkDestroyRenderPass(device_, shadow_render_pass_, nullptr);
+  vkDestroySampler(device_, shadow_texture_sampler_, nullptr);
+
+  SelectShadowQualityTier(tier);
+
+  if (!CreateShadowRenderPass())
+    return false;
+
+  if (!CreateShadowFramebuffers())
+    return false;
+
+  if (!CreateShadowPipeline(&shadow_pipeline_))
+    return false;
+
+  if (!CreateShadowTextureSampler())
+    return false;
+
+  UpdateShadowTextureDescriptors();
+  WriteFragmentShaderUbos();
+
+  shadow_over_budget_frame_count_ = 0;
+
+  // Updating the descriptor sets invalidated the command buffers that bind
+  // them.
+  return RecordStaticCommandBuffers();
+}
+
+void App::WatchReloadableFiles() {
+  for (const WatchedShader& shader : kWatchedShaders) {
+    file_watcher_.AddFile(shader.path);
+    watched_file_reload_flags_.push_back(shader.reload_flags);
+  }
+
+  // The OBJ file and the MTL files it names.
+  std::vector<std::string> model_paths = model_.source_paths;
+  if (model_paths.empty())
+    model_paths.push_back(kModelPath);
+
+  for (const std::string& path : model_paths) {
+    file_watcher_.AddFile(path);
+    watched_file_reload_flags_.push_back(kReloadGeometry);
+  }
+}
+
+bool App::PollHotReload() {
+  if (pipeline_reload_.valid() &&
+      pipeline_reload_.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+    if (!FinishPipelineReload())
+      return false;
+  }
+
+  if (geometry_reload_.valid() &&
+      geometry_reload_.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+    if (!FinishGeometryReload())
+      return false;
+  }
+
+  // Files that change while a reload is running are picked up once it is
+  // done.
+  if (pipeline_reload_.valid() || geometry_reload_.valid() ||
+      current_frame_time_ - last_file_poll_time_ < kHotReloadPollInterval) {
+    return true;
+  }
+  last_file_poll_time_ = current_frame_time_;
+
+  file_watcher_.Poll(&changed_files_);
+
+  uint32_t reload_flags = 0;
+  for (int index : changed_files_) {
+    std::cout << "Reloading " << file_watcher_.GetPath(index) << "."
+              << std::endl;
+    reload_flags |= watched_file_reload_flags_[index];
+  }
+
+  if ((reload_flags & ~kReloadGeometry) != 0)
+    StartPipelineReload(reload_flags & ~kReloadGeometry);
+
+  if ((reload_flags & kReloadGeometry) != 0)
+    StartGeometryReload();
 
   return true;
 }
 
-void App::UpdateScenePassMatrices(int frame_index) {
-  float aspect_ratio = static_cast<float>(swap_chain_extent_.width) /
-      static_cast<float>(swap_chain_extent_.height);
+void App::StartPipelineReload(uint32_t reload_flags) {
+  reloaded_pipelines_ = ReloadedPipelines();
+  reloaded_pipelines_.reload_flags = reload_flags;
+
+  // Goes through the pipeline cache, so only the stages whose SPIR-V changed
+  // are actually compiled again. Everything it reads stays put between
+  // frames.
+  pipeline_reload_ = thread_pool_.Submit([this]() {
+    ReloadedPipelines& pipelines = reloaded_pipelines_;
+    bool succeeded = true;
+
+    if ((pipelines.reload_flags & kReloadScenePipeline) != 0) {
+      succeeded = CreatePipeline(&pipelines.pipeline,
+                                 &pipelines.depth_prepass_pipeline) &&
+                  succeeded;
+    }
+    if ((pipelines.reload_flags & kReloadShadowPipeline) != 0)
+      succeeded = CreateShadowPipeline(&pipelines.shadow_pipeline) && succeeded;
+    if ((pipelines.reload_flags & kReloadCullPipeline) != 0)
+      succeeded = CreateCullPipeline(&pipelines.cull_pipeline) && succeeded;
+    if ((pipelines.reload_flags & kReloadClusterPipeline) != 0) {
+      succeeded = CreateClusterPipeline(&pipelines.cluster_pipeline) &&
+                  succeeded;
+    }
+    return succeeded;
+  });
+}
 
-  glm::mat4 view_mat = camera_.GetViewMat();
-  glm::mat4 proj_mat = glm::perspective(glm::radians(45.f), aspect_ratio, 0.1f,
-                                        100.f);
-  proj_mat[1][1] *= -1;
+bool App::FinishPipelineReload() {
+  if (!pipeline_reload_.get()) {
+    // Nothing is swapped in, so that the pipelines in use are always built
+    // from shaders that compiled.
+    std::cerr << "Could not reload pipelines. Keeping the old ones."
+              << std::endl;
+    DestroyReloadedPipelines();
+    return true;
+  }
+
+  // The frames in flight still use the old pipelines.
+  if (!frame_pacer_.WaitIdle()) {
+    std::cerr << "Could not wait for frames." << std::endl;
+    return false;
+  }
+
+  // After the swaps, the reloaded set holds the old pipelines.
+  ReloadedPipelines& pipelines = reloaded_pipelines_;
+  if ((pipelines.reload_flags & kReloadScenePipeline) != 0) {
+    std::swap(pipeline_, pipelines.pipeline);
+    std::swap(depth_prepass_pipeline_, pipelines.depth_prepass_pipeline);
+  }
+  if ((pipelines.reload_flags & kReloadShadowPipeline) != 0)
+    std::swap(shadow_pipeline_, pipelines.shadow_pipeline);
+  if ((pipelines.reload_flags & kReloadCullPipeline) != 0)
+    std::swap(cull_pipeline_, pipelines.cull_pipeline);
+  if ((pipelines.reload_flags & kReloadClusterPipeline) != 0)
+    std::swap(cluster_pipeline_, pipelines.cluster_pipeline);
+
+  // The shadow pass culls too, so the cached cubemap has to be redrawn with
+  // either of its pipelines.
+  if ((pipelines.reload_flags &
+       (kReloadShadowPipeline | kReloadCullPipeline)) != 0) {
+    shadow_map_dirty_ = true;
+  }
+
+  DestroyReloadedPipelines();
+
+  std::cout << "Reloaded pipelines." << std::endl;
+
+  // The pre-recorded command buffers bind the old pipelines.
+  return RecordStaticCommandBuffers();
+}
+
+void App::StartGeometryReload() {
+  // ParallelFor() can't be called from one of the pool's own tasks, so the
+  // file is parsed on this task alone.
+  geometry_reload_ = thread_pool_.Submit([this]() {
+    reloaded_model_ = utils::Model();
+    if (!utils::LoadModel(kModelPath, &reloaded_model_, true))
+      return false;
+    utils::GenerateLods(&reloaded_model_, kMaxLodCount);
+
+    // So that the next start-up doesn't find the cache stale.
+    if (kUsePackedVertices &&
+        !utils::WriteMeshCache(reloaded_model_, kMeshCachePath)) {
+      std::cerr << "Could not write mesh cache." << std::endl;
+    }
+    return true;
+  });
+}
+
+bool App::FinishGeometryReload() {
+  if (!geometry_reload_.get()) {
+    std::cerr << "Could not reload " << kModelPath
+              << ". Keeping the old geometry." << std::endl;
+    return true;
+  }
+
+  // The frames in flight still read the old buffers.
+  if (!frame_pacer_.WaitIdle()) {
+    std::cerr << "Could not wait for frames." << std::endl;
+    return false;
+  }
+
+  model_ = std::move(reloaded_model_);
+  reloaded_model_ = utils::Model();
+
+  // The instances and lights don't depend on the model, and the draw list
+  // only needs the new index count.
+  DestroyVertexBuffers();
+  if (!CreateVertexBuffers())
+    return false;
+
+  if (!UploadDrawCommands())
+    return false;
+
+  DestroyMaterialBuffer();
+  if (!CreateMaterialBuffer())
+    return false;
+
+  UpdateMaterialDescriptors();
+
+  std::cout << "Reloaded " << kModelPath << "." << std::endl;
+
+  // The pre-recorded command buffers bind the old vertex buffers.
+  return RecordStaticCommandBuffers();
+}
+
+void App::DestroyReloadedPipelines() {
+  vkDestroyPipeline(device_, reloaded_pipelines_.pipeline, nullptr);
+  vkDestroyPipeline(device_, reloaded_pipelines_.depth_prepass_pipeline,
+                    nullptr);
+  vkDestroyPipeline(device_, reloaded_pipelines_.shadow_pipeline, nullptr);
+  vkDestroyPipeline(device_, reloaded_pipelines_.cull_pipeline, nullptr);
+  vkDestroyPipeline(device_, reloaded_pipelines_.cluster_pipeline, nullptr);
+  reloaded_pipelines_ = ReloadedPipelines();
+}
+
+void App::UpdateAdaptiveShadowQuality(double gpu_milliseconds) {
+  if (options_.shadow_gpu_budget_ms <= 0.0 ||
+      requested_shadow_quality_tier_ != shadow_quality_tier_ ||
+      shadow_quality_tier_ == 0) {
+    return;
+  }
+
+  if (gpu_milliseconds <= options_.shadow_gpu_budget_ms) {
+    shadow_over_budget_frame_count_ = 0;
+    return;
+  }
+
+  if (++shadow_over_budget_frame_count_ >= kShadowQualityDowngradeFrameCount)
+    requested_shadow_quality_tier_ = shadow_quality_tier_ - 1;
+}
+
+bool App::CreateShadowDescriptorSet() {
+  VkDescriptorSetAllocateInfo alloc_info{};
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = descriptor_pool_;
+  alloc_info.descriptorSetCount = 1;
+  alloc_info.pSetLayouts = &shadow_descriptor_layout_;
+
+  if (vkAllocateDescriptorSets(device_, &alloc_info, &shadow_descriptor_set_)
+          != VK_SUCCESS) {
+    std::cerr << "Could not create shadow descriptor set." << std::endl;
+    return false;
+  }
+
+  VkBuffer instance_buffers[] = { instance_buffer_, visible_instance_buffer_ };
+
+  VkDescriptorBufferInfo instance_buffer_infos[2]{};
+  VkWriteDescriptorSet instance_writes[2]{};
+  for (uint32_t i = 0; i < 2; ++i) {
+    instance_buffer_infos[i].buffer = instance_buffers[i];
+    instance_buffer_infos[i].offset = 0;
+    instance_buffer_infos[i].range = VK_WHOLE_SIZE;
+
+    instance_writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    instance_writes[i].dstSet = shadow_descriptor_set_;
+    instance_writes[i].dstBinding = 1 + i;
+    instance_writes[i].dstArrayElement = 0;
+    instance_writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    instance_writes[i].descriptorCount = 1;
+    instance_writes[i].pBufferInfo = &instance_buffer_infos[i];
+  }
+
+  vkUpdateDescriptorSets(device_, 2, instance_writes, 0, nullptr);
 
-  VkDeviceSize vert_ubo_buffer_size = sizeof(VertexShaderUbo);
+  if (!use_multiview_shadow_pass_)
+    return true;
+
+  VkDeviceSize shadow_ubo_buffer_size = sizeof(ShadowShaderUbo);
 
-  VertexShaderUbo* ubo_ptr;
-  vkMapMemory(device_, vert_ubo_buffers_memory_[frame_index], 0,
-              vert_ubo_buffer_size, 0, reinterpret_cast<void**>(&ubo_ptr));
-  ubo_ptr->model_mat = model_mat_;
-  ubo_ptr->mvp_mat = proj_mat * view_mat * model_mat_;
-  vkUnmapMemory(device_, vert_ubo_buffers_memory_[frame_index]);
+  VkBufferCreateInfo shadow_ubo_buffer_info{};
+  shadow_ubo_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  shadow_ubo_buffer_info.size = shadow_ubo_buffer_size;
+  shadow_ubo_buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+  shadow_ubo_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (!utils::vk::CreateBuffer(shadow_ubo_buffer_info,
+                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                               device_, &allocator_, shadow_ubo_buffer_,
+                               shadow_ubo_buffer_allocation_)) {
+    std::cerr << "Could not create shadow uniform buffer." << std::endl;
+    return false;
+  }
+
+  // The matrices of the lights past shadow_light_positions_ are left unset,
+  // since no view ever reads them.
+  auto ubo_ptr = static_cast<ShadowShaderUbo*>(
+      shadow_ubo_buffer_allocation_.mapped_data);
+  for (int i = 0; i < shadow_mats_.size(); ++i) {
+    ubo_ptr->shadow_mats[i] = shadow_mats_[i];
+  }
 
   VkDescriptorBufferInfo descriptor_buffer_info{};
-  descriptor_buffer_info.buffer = vert_ubo_buffers_[frame_index];
+  descriptor_buffer_info.buffer = shadow_ubo_buffer_;
   descriptor_buffer_info.offset = 0;
-  descriptor_buffer_info.range = vert_ubo_buffer_size;
+  descriptor_buffer_info.range = shadow_ubo_buffer_size;
 
   VkWriteDescriptorSet descriptor_write{};
   descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-  descriptor_write.dstSet = descriptor_sets_[frame_index];
+  descriptor_write.dstSet = shadow_descriptor_set_;
   descriptor_write.dstBinding = 0;
   descriptor_write.dstArrayElement = 0;
   descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
@@ -1543,139 +3408,653 @@ void App::UpdateScenePassMatrices(int frame_index) {
   descriptor_write.pBufferInfo = &descriptor_buffer_info;
 
   vkUpdateDescriptorSets(device_, 1, &descriptor_write, 0, nullptr);
+
+  return true;
+}
+
+void App::UpdateScenePassMatrices(int frame_index) {
+  float aspect_ratio = static_cast<float>(swap_chain_extent_.width) /
+      static_cast<float>(swap_chain_extent_.height);
+
+  glm::mat4 view_mat = simulation_snapshots_.Read().view_mat;
+  glm::mat4 proj_mat =
+      glm::perspective(glm::radians(kSceneFieldOfViewDegrees), aspect_ratio,
+                       kSceneNearPlane, kSceneFarPlane);
+  proj_mat[1][1] *= -1;
+
+  VertexShaderUbo* ubo_ptr = frames_[frame_index].vert_ubo;
+  ubo_ptr->view_proj_mat = proj_mat * view_mat;
+  ubo_ptr->view_mat = view_mat;
+
+  cull_view_mats_[frame_index] = ubo_ptr->view_proj_mat;
 }
 
 bool App::CreateVertexBuffers() {
-  VkDeviceSize pos_buffer_size =
-      sizeof(glm::vec3) * model_.positions.size();
+  // The buffers are written on the transfer queue and read on the graphics
+  // queue.
+  uint32_t queue_indices[] = { graphics_queue_index_, transfer_queue_index_ };
+  uint32_t queue_index_count = 0;
+  VkSharingMode sharing_mode = VK_SHARING_MODE_EXCLUSIVE;
+  if (graphics_queue_index_ != transfer_queue_index_) {
+    queue_index_count = 2;
+    sharing_mode = VK_SHARING_MODE_CONCURRENT;
+  }
 
-  VkBufferCreateInfo pos_buffer_info{};
-  pos_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  pos_buffer_info.size = pos_buffer_size;
-  pos_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-  pos_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  // Only lives until the uploads below have been waited on.
+  std::vector<utils::PackedVertex> packed_vertices;
 
-  utils::vk::CreateBuffer(pos_buffer_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                          physical_device_, device_, position_buffer_,
-                          position_buffer_memory_);
+  if (kUsePackedVertices) {
+    // Uploaded straight out of the mapped cache when there is one.
+    const utils::PackedVertex* vertices = mesh_cache_.GetVertices();
+    size_t vertex_count = mesh_cache_.GetVertexCount();
 
-  UploadDataToBuffer(model_.positions.data(), pos_buffer_size,
-                     position_buffer_);
+    if (vertices == nullptr) {
+      packed_vertices = utils::PackVertices(model_);
+      vertices = packed_vertices.data();
+      vertex_count = packed_vertices.size();
+    }
 
-  VkDeviceSize normal_buffer_size =
-      sizeof(glm::vec3) * model_.normals.size();
+    VkDeviceSize vertex_buffer_size =
+        sizeof(utils::PackedVertex) * vertex_count;
+
+    VkBufferCreateInfo vertex_buffer_info{};
+    vertex_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    vertex_buffer_info.size = vertex_buffer_size;
+    vertex_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    vertex_buffer_info.sharingMode = sharing_mode;
+    vertex_buffer_info.queueFamilyIndexCount = queue_index_count;
+    vertex_buffer_info.pQueueFamilyIndices = queue_indices;
+
+    if (!utils::vk::CreateBuffer(vertex_buffer_info,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                                 &allocator_, vertex_buffer_,
+                                 vertex_buffer_allocation_)) {
+      std::cerr << "Could not create vertex buffer." << std::endl;
+      return false;
+    }
 
-  VkBufferCreateInfo normal_buffer_info{};
-  normal_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  normal_buffer_info.size = normal_buffer_size;
-  normal_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-  normal_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (!upload_manager_.UploadToBuffer(vertices, vertex_buffer_size,
+                                        vertex_buffer_)) {
+      std::cerr << "Could not upload vertex buffer." << std::endl;
+      return false;
+    }
 
-  utils::vk::CreateBuffer(normal_buffer_info,
-                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, physical_device_,
-                          device_, normal_buffer_, normal_buffer_memory_);
+    mesh_bounds_ = utils::ComputeBoundingSphere(vertices, vertex_count,
+                                                sizeof(utils::PackedVertex));
+  } else {
+    VkDeviceSize pos_buffer_size =
+        sizeof(glm::vec3) * model_.positions.size();
+
+    VkBufferCreateInfo pos_buffer_info{};
+    pos_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    pos_buffer_info.size = pos_buffer_size;
+    pos_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    pos_buffer_info.sharingMode = sharing_mode;
+    pos_buffer_info.queueFamilyIndexCount = queue_index_count;
+    pos_buffer_info.pQueueFamilyIndices = queue_indices;
+
+    if (!utils::vk::CreateBuffer(pos_buffer_info,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                                 &allocator_, position_buffer_,
+                                 position_buffer_allocation_)) {
+      std::cerr << "Could not create position buffer." << std::endl;
+      return false;
+    }
 
-  UploadDataToBuffer(model_.normals.data(), normal_buffer_size,
-                     normal_buffer_);
+    if (!upload_manager_.UploadToBuffer(model_.positions.data(),
+                                        pos_buffer_size, position_buffer_)) {
+      std::cerr << "Could not upload position buffer." << std::endl;
+      return false;
+    }
 
-  VkDeviceSize mtl_idx_buffer_size =
-      sizeof(uint32_t) * model_.material_indices.size();
+    mesh_bounds_ = utils::ComputeBoundingSphere(model_.positions.data(),
+                                                model_.positions.size(),
+                                                sizeof(glm::vec3));
+
+    VkDeviceSize normal_buffer_size =
+        sizeof(glm::vec3) * model_.normals.size();
+
+    VkBufferCreateInfo normal_buffer_info{};
+    normal_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    normal_buffer_info.size = normal_buffer_size;
+    normal_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    normal_buffer_info.sharingMode = sharing_mode;
+    normal_buffer_info.queueFamilyIndexCount = queue_index_count;
+    normal_buffer_info.pQueueFamilyIndices = queue_indices;
+
+    if (!utils::vk::CreateBuffer(normal_buffer_info,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                                 &allocator_, normal_buffer_,
+                                 normal_buffer_allocation_)) {
+      std::cerr << "Could not create normal buffer." << std::endl;
+      return false;
+    }
 
-  VkBufferCreateInfo mtl_idx_buffer_info{};
-  mtl_idx_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  mtl_idx_buffer_info.size = mtl_idx_buffer_size;
-  mtl_idx_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-  mtl_idx_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (!upload_manager_.UploadToBuffer(model_.normals.data(),
+                                        normal_buffer_size, normal_buffer_)) {
+      std::cerr << "Could not upload normal buffer." << std::endl;
+      return false;
+    }
 
-  utils::vk::CreateBuffer(mtl_idx_buffer_info,
-                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, physical_device_,
-                          device_, material_idx_buffer_,
-                          material_idx_buffer_memory_);
+    VkDeviceSize mtl_idx_buffer_size =
+        sizeof(uint32_t) * model_.material_indices.size();
+
+    VkBufferCreateInfo mtl_idx_buffer_info{};
+    mtl_idx_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    mtl_idx_buffer_info.size = mtl_idx_buffer_size;
+    mtl_idx_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    mtl_idx_buffer_info.sharingMode = sharing_mode;
+    mtl_idx_buffer_info.queueFamilyIndexCount = queue_index_count;
+    mtl_idx_buffer_info.pQueueFamilyIndices = queue_indices;
+
+    if (!utils::vk::CreateBuffer(mtl_idx_buffer_info,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                                 &allocator_, material_idx_buffer_,
+                                 material_idx_buffer_allocation_)) {
+      std::cerr << "Could not create material index buffer." << std::endl;
+      return false;
+    }
 
-  UploadDataToBuffer(model_.material_indices.data(), mtl_idx_buffer_size,
-                     material_idx_buffer_);
+    if (!upload_manager_.UploadToBuffer(model_.material_indices.data(),
+                                        mtl_idx_buffer_size,
+                                        material_idx_buffer_)) {
+      std::cerr << "Could not upload material index buffer." << std::endl;
+      return false;
+    }
+  }
 
-  VkDeviceSize index_buffer_size =
-      sizeof(uint16_t) * model_.index_buffer.size();
+  // Indices are kept as 32-bit on the CPU and narrowed when they all fit. The
+  // cache has already been narrowed when it was cooked.
+  std::vector<uint16_t> indices_16;
+  const void* index_data = model_.index_buffer.data();
+  index_count_ = static_cast<uint32_t>(model_.index_buffer.size());
+  VkDeviceSize index_buffer_size = sizeof(uint32_t) * index_count_;
+  index_type_ = VK_INDEX_TYPE_UINT32;
+
+  if (mesh_cache_.GetIndices() != nullptr) {
+    index_data = mesh_cache_.GetIndices();
+    index_count_ = mesh_cache_.GetIndexCount();
+    index_buffer_size = VkDeviceSize{mesh_cache_.GetIndexSize()} * index_count_;
+    if (mesh_cache_.GetIndexSize() == sizeof(uint16_t))
+      index_type_ = VK_INDEX_TYPE_UINT16;
+  } else if (utils::FitsInUint16Indices(model_)) {
+    indices_16.assign(model_.index_buffer.begin(), model_.index_buffer.end());
+    index_data = indices_16.data();
+    index_buffer_size = sizeof(uint16_t) * indices_16.size();
+    index_type_ = VK_INDEX_TYPE_UINT16;
+  }
 
   VkBufferCreateInfo index_buffer_info{};
   index_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
   index_buffer_info.size = index_buffer_size;
   index_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
       VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-  index_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  index_buffer_info.sharingMode = sharing_mode;
+  index_buffer_info.queueFamilyIndexCount = queue_index_count;
+  index_buffer_info.pQueueFamilyIndices = queue_indices;
+
+  if (!utils::vk::CreateBuffer(index_buffer_info,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                               &allocator_, index_buffer_,
+                               index_buffer_allocation_)) {
+    std::cerr << "Could not create index buffer." << std::endl;
+    return false;
+  }
 
-  utils::vk::CreateBuffer(index_buffer_info,
-                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, physical_device_,
-                          device_, index_buffer_, index_buffer_memory_);
+  if (!upload_manager_.UploadToBuffer(index_data, index_buffer_size,
+                                      index_buffer_)) {
+    std::cerr << "Could not upload index buffer." << std::endl;
+    return false;
+  }
 
-  UploadDataToBuffer(model_.index_buffer.data(), index_buffer_size,
-                     index_buffer_);
+  if (mesh_cache_.GetLods() != nullptr) {
+    mesh_lods_.assign(mesh_cache_.GetLods(),
+                      mesh_cache_.GetLods() + mesh_cache_.GetLodCount());
+  } else {
+    mesh_lods_ = model_.lods;
+  }
+
+  // A mesh without LODs is drawn whole.
+  if (mesh_lods_.empty()) {
+    utils::MeshLod lod{};
+    lod.index_count = index_count_;
+    mesh_lods_.push_back(lod);
+  }
+  mesh_lods_.resize(std::min<size_t>(
+      mesh_lods_.size(), std::clamp(options_.lod_count, 1, kMaxLodCount)));
+
+  // All the uploads go out in a single submission.
+  if (!upload_manager_.Wait()) {
+    std::cerr << "Could not upload vertex buffers." << std::endl;
+    return false;
+  }
+
+  // Everything has been copied out of the mapping.
+  mesh_cache_.Close();
+
+  // New geometry has to be drawn into the cached cubemap.
+  shadow_map_dirty_ = true;
 
   return true;
 }
 
-void App::UploadDataToBuffer(void* data, VkDeviceSize size, VkBuffer buffer) {
-  VkCommandBufferAllocateInfo command_buffer_info{};
-  command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  command_buffer_info.commandPool = command_pool_;
-  command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  command_buffer_info.commandBufferCount = 1;
+bool App::CreateDrawBuffers() {
+  uint32_t queue_indices[] = { graphics_queue_index_, transfer_queue_index_ };
+  uint32_t queue_index_count = 0;
+  VkSharingMode sharing_mode = VK_SHARING_MODE_EXCLUSIVE;
+  if (graphics_queue_index_ != transfer_queue_index_) {
+    queue_index_count = 2;
+    sharing_mode = VK_SHARING_MODE_CONCURRENT;
+  }
+
+  int instance_count = std::max(options_.instance_count, 1);
+  instance_count_ = static_cast<uint32_t>(instance_count);
+
+  int row_size = GetInstanceRowSize(instance_count);
+
+  std::vector<InstanceData> instances(instance_count);
+  for (int i = 0; i < instance_count; ++i) {
+    instances[i].model_mat =
+        glm::translate(glm::mat4(1.f), GetInstanceOffset(i, row_size));
+  }
+
+  VkDeviceSize instance_buffer_size = sizeof(InstanceData) * instances.size();
+
+  VkBufferCreateInfo instance_buffer_info{};
+  instance_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  instance_buffer_info.size = instance_buffer_size;
+  instance_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  instance_buffer_info.sharingMode = sharing_mode;
+  instance_buffer_info.queueFamilyIndexCount = queue_index_count;
+  instance_buffer_info.pQueueFamilyIndices = queue_indices;
+
+  if (!utils::vk::CreateBuffer(instance_buffer_info,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                               &allocator_, instance_buffer_,
+                               instance_buffer_allocation_)) {
+    std::cerr << "Could not create instance buffer." << std::endl;
+    return false;
+  }
+
+  if (!upload_manager_.UploadToBuffer(instances.data(), instance_buffer_size,
+                                      instance_buffer_)) {
+    std::cerr << "Could not upload instance buffer." << std::endl;
+    return false;
+  }
+
+  // Has room for every LOD, so that reloaded geometry with a different
+  // number of them fits.
+  VkDeviceSize draw_buffer_size =
+      sizeof(VkDrawIndexedIndirectCommand) * kCullViewSlotCount *
+      kMaxLodCount;
+
+  VkBufferCreateInfo draw_buffer_info{};
+  draw_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  draw_buffer_info.size = draw_buffer_size;
+  draw_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+      VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  draw_buffer_info.sharingMode = sharing_mode;
+  draw_buffer_info.queueFamilyIndexCount = queue_index_count;
+  draw_buffer_info.pQueueFamilyIndices = queue_indices;
+
+  if (!utils::vk::CreateBuffer(draw_buffer_info,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                               &allocator_, draw_buffer_,
+                               draw_buffer_allocation_)) {
+    std::cerr << "Could not create draw buffer." << std::endl;
+    return false;
+  }
+
+  if (!UploadDrawCommands())
+    return false;
+
+  // Only ever written and read on the graphics queue.
+  VkBufferCreateInfo visible_instance_buffer_info{};
+  visible_instance_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  visible_instance_buffer_info.size =
+      sizeof(uint32_t) * instance_count_ * kCullViewSlotCount * kMaxLodCount;
+  visible_instance_buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  visible_instance_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (!utils::vk::CreateBuffer(visible_instance_buffer_info,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                               &allocator_, visible_instance_buffer_,
+                               visible_instance_buffer_allocation_)) {
+    std::cerr << "Could not create visible instance buffer." << std::endl;
+    return false;
+  }
+
+  VkBufferCreateInfo cull_view_buffer_info{};
+  cull_view_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  cull_view_buffer_info.size = sizeof(glm::mat4) * kCullViewSlotCount;
+  cull_view_buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  cull_view_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (!utils::vk::CreateBuffer(cull_view_buffer_info,
+                               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                               device_, &allocator_, cull_view_buffer_,
+                               cull_view_buffer_allocation_)) {
+    std::cerr << "Could not create cull view buffer." << std::endl;
+    return false;
+  }
+  cull_view_mats_ =
+      static_cast<glm::mat4*>(cull_view_buffer_allocation_.mapped_data);
+
+  if (!upload_manager_.Wait()) {
+    std::cerr << "Could not upload draw buffers." << std::endl;
+    return false;
+  }
+
+  // The new instances have to be drawn into the cached cubemap.
+  shadow_map_dirty_ = true;
+
+  return true;
+}
+
+bool App::UploadDrawCommands() {
+  // One draw per LOD in each cull view slot. The instance counts are filled
+  // in by the cull pass, and each draw's visible instances start at its
+  // firstInstance. The draws past draw_count_ are left empty.
+  draw_count_ = static_cast<uint32_t>(mesh_lods_.size());
+
+  std::vector<VkDrawIndexedIndirectCommand> draws(
+      kCullViewSlotCount * kMaxLodCount);
+  for (int i = 0; i < kCullViewSlotCount; ++i) {
+    for (uint32_t j = 0; j < draw_count_; ++j) {
+      uint32_t draw_index = i * kMaxLodCount + j;
+      draws[draw_index].indexCount = mesh_lods_[j].index_count;
+      draws[draw_index].instanceCount = 0;
+      draws[draw_index].firstIndex = mesh_lods_[j].first_index;
+      draws[draw_index].vertexOffset = mesh_lods_[j].vertex_offset;
+      draws[draw_index].firstInstance = instance_count_ * draw_index;
+    }
+  }
+
+  if (!upload_manager_.UploadToBuffer(
+          draws.data(), sizeof(VkDrawIndexedIndirectCommand) * draws.size(),
+          draw_buffer_)) {
+    std::cerr << "Could not upload draw commands." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool App::CreateMaterialBuffer() {
+  uint32_t queue_indices[] = { graphics_queue_index_, transfer_queue_index_ };
+  uint32_t queue_index_count = 0;
+  VkSharingMode sharing_mode = VK_SHARING_MODE_EXCLUSIVE;
+  if (graphics_queue_index_ != transfer_queue_index_) {
+    queue_index_count = 2;
+    sharing_mode = VK_SHARING_MODE_CONCURRENT;
+  }
+
+  // An empty table can't be bound, so a model without materials gets a
+  // single grey one.
+  std::vector<MaterialData> materials(
+      std::max<size_t>(model_.materials.size(), 1));
+  for (int i = 0; i < model_.materials.size(); ++i) {
+    materials[i].ambient_color =
+        glm::vec4(model_.materials[i].ambient_color, 0.f);
+    materials[i].diffuse_color =
+        glm::vec4(model_.materials[i].diffuse_color, 0.f);
+  }
+  if (model_.materials.empty()) {
+    materials[0].ambient_color = glm::vec4(0.5f, 0.5f, 0.5f, 0.f);
+    materials[0].diffuse_color = glm::vec4(0.5f, 0.5f, 0.5f, 0.f);
+  }
+
+  VkDeviceSize material_buffer_size = sizeof(MaterialData) * materials.size();
+
+  VkBufferCreateInfo material_buffer_info{};
+  material_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  material_buffer_info.size = material_buffer_size;
+  material_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  material_buffer_info.sharingMode = sharing_mode;
+  material_buffer_info.queueFamilyIndexCount = queue_index_count;
+  material_buffer_info.pQueueFamilyIndices = queue_indices;
+
+  if (!utils::vk::CreateBuffer(material_buffer_info,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                               &allocator_, material_buffer_,
+                               material_buffer_allocation_)) {
+    std::cerr << "Could not create material buffer." << std::endl;
+    return false;
+  }
+
+  if (!upload_manager_.UploadToBuffer(materials.data(), material_buffer_size,
+                                      material_buffer_)) {
+    std::cerr << "Could not upload material buffer." << std::endl;
+    return false;
+  }
+
+  if (!upload_manager_.Wait()) {
+    std::cerr << "Could not upload material buffer." << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool App::CreateLightBuffers() {
+  uint32_t queue_indices[] = { graphics_queue_index_, transfer_queue_index_ };
+  uint32_t queue_index_count = 0;
+  VkSharingMode sharing_mode = VK_SHARING_MODE_EXCLUSIVE;
+  if (graphics_queue_index_ != transfer_queue_index_) {
+    queue_index_count = 2;
+    sharing_mode = VK_SHARING_MODE_CONCURRENT;
+  }
+
+  int light_count = std::max(options_.light_count, 1);
+  light_count_ = static_cast<uint32_t>(light_count);
+
+  // Each shadowed light samples the cubemap rendered from its position.
+  // Init() already fit as many of them as the array has cubemaps into the
+  // light count.
+  int shadowed_light_count = static_cast<int>(shadow_light_positions_.size());
+
+  std::vector<LightData> lights(light_count);
+  for (int i = 0; i < shadowed_light_count; ++i) {
+    lights[i].position_radius =
+        glm::vec4(shadow_light_positions_[i], kShadowPassFarPlane);
+    lights[i].color = glm::vec4(1.f);
+    lights[i].shadow_index = i;
+  }
+
+  // The others go round the instances, each somewhere inside its box.
+  int instance_count = static_cast<int>(instance_count_);
+  int row_size = GetInstanceRowSize(instance_count);
+
+  for (int i = shadowed_light_count; i < light_count; ++i) {
+    uint32_t seed = static_cast<uint32_t>(i) * 3;
+    glm::vec3 pos_in_box(HashToUnitFloat(seed) * 1.6f - 0.8f,
+                         HashToUnitFloat(seed + 1) * 1.6f + 0.2f,
+                         HashToUnitFloat(seed + 2) * 1.6f - 0.8f);
+
+    glm::vec3 pos = GetInstanceOffset(i % instance_count, row_size) +
+        pos_in_box;
+    lights[i].position_radius = glm::vec4(pos, kExtraLightRadius);
+    lights[i].color = glm::vec4(
+        kExtraLightColors[i % std::size(kExtraLightColors)], 0.f);
+  }
+
+  VkDeviceSize light_buffer_size = sizeof(LightData) * lights.size();
+
+  VkBufferCreateInfo light_buffer_info{};
+  light_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  light_buffer_info.size = light_buffer_size;
+  light_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  light_buffer_info.sharingMode = sharing_mode;
+  light_buffer_info.queueFamilyIndexCount = queue_index_count;
+  light_buffer_info.pQueueFamilyIndices = queue_indices;
+
+  if (!utils::vk::CreateBuffer(light_buffer_info,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                               &allocator_, light_buffer_,
+                               light_buffer_allocation_)) {
+    std::cerr << "Could not create light buffer." << std::endl;
+    return false;
+  }
+
+  if (!upload_manager_.UploadToBuffer(lights.data(), light_buffer_size,
+                                      light_buffer_)) {
+    std::cerr << "Could not upload light buffer." << std::endl;
+    return false;
+  }
+
+  if (!upload_manager_.Wait()) {
+    std::cerr << "Could not upload light buffer." << std::endl;
+    return false;
+  }
+
+  VkPhysicalDeviceProperties phys_device_props{};
+  vkGetPhysicalDeviceProperties(physical_device_, &phys_device_props);
+
+  // Each frame's range is aligned so that it can be used as a dynamic offset.
+  VkDeviceSize storage_alignment =
+      phys_device_props.limits.minStorageBufferOffsetAlignment;
+  cluster_buffer_range_ =
+      sizeof(uint32_t) * kClusterCount * (1 + kMaxLightsPerCluster);
+  cluster_buffer_stride_ = cluster_buffer_range_;
+  if (storage_alignment > 0) {
+    cluster_buffer_stride_ = (cluster_buffer_stride_ + storage_alignment - 1) &
+        ~(storage_alignment - 1);
+  }
+
+  // Only ever touched on the graphics queue.
+  VkBufferCreateInfo cluster_buffer_info{};
+  cluster_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  cluster_buffer_info.size = cluster_buffer_stride_ * frames_in_flight_;
+  cluster_buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  cluster_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (!utils::vk::CreateBuffer(cluster_buffer_info,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device_,
+                               &allocator_, cluster_buffer_,
+                               cluster_buffer_allocation_)) {
+    std::cerr << "Could not create cluster buffer." << std::endl;
+    return false;
+  }
+
+  return true;
+}
 
-  VkCommandBuffer command_buffer;
-  vkAllocateCommandBuffers(device_, &command_buffer_info, &command_buffer);
+void App::BindVertexBuffers(VkCommandBuffer command_buffer,
+                            bool positions_only) {
+  // Positions come first in the packed layout, so the shadow pass can bind
+  // the same buffer.
+  if (kUsePackedVertices) {
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer_, &offset);
+  } else if (positions_only) {
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &position_buffer_, &offset);
+  } else {
+    VkBuffer vertex_buffers[] = {
+      position_buffer_, normal_buffer_, material_idx_buffer_
+    };
+    VkDeviceSize offsets[] = { 0, 0, 0 };
+    vkCmdBindVertexBuffers(command_buffer, 0, 3, vertex_buffers, offsets);
+  }
 
-  VkCommandBufferBeginInfo commands_begin_info{};
-  commands_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  commands_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkCmdBindIndexBuffer(command_buffer, index_buffer_, 0, index_type_);
+}
 
-  vkBeginCommandBuffer(command_buffer, &commands_begin_info);
+bool App::RecordStaticCommandBuffers() {
+  if (!RecordShadowCommandBuffer())
+    return false;
 
-  VkBuffer staging_buffer;
-  VkDeviceMemory staging_buffer_memory;
+  return RecordSceneCommandBuffers();
+}
 
-  VkBufferCreateInfo staging_buffer_info{};
-  staging_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  staging_buffer_info.size = size;
-  staging_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-  staging_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+bool App::RecordSceneCommandBuffers() {
+  if (!kPrerecordCommandBuffers)
+    return true;
 
-  utils::vk::CreateBuffer(staging_buffer_info,
-                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                          physical_device_, device_, staging_buffer,
-                          staging_buffer_memory);
+  // The render pass contents of each frame only depend on the extent, so
+  // they are recorded once per frame and shared by all of its primaries.
+  bool succeeded = RunRecordingJobs(
+      frames_in_flight_,
+      [this](size_t i) { return RecordScenePassJob(static_cast<int>(i)); },
+      &thread_pool_);
+  if (!succeeded)
+    return false;
 
-  void* staging_ptr;
-  vkMapMemory(device_, staging_buffer_memory, 0, size, 0, &staging_ptr);
-  memcpy(staging_ptr, data, static_cast<size_t>(size));
-  vkUnmapMemory(device_, staging_buffer_memory);
+  for (int i = 0; i < frames_in_flight_; ++i) {
+    for (uint32_t j = 0; j < swap_chain_framebuffers_.size(); ++j) {
+      if (!RecordCommandBuffer(GetSceneCommandBuffer(i, j), i, j))
+        return false;
+    }
+  }
+  return true;
+}
 
-  VkBufferCopy copy_info{};
-  copy_info.size = size;
-  vkCmdCopyBuffer(command_buffer, staging_buffer, buffer, 1, &copy_info);
+bool App::RecordShadowCommandBuffer() {
+  bool succeeded = RunRecordingJobs(
+      shadow_pass_command_buffers_.size(),
+      [this](size_t i) { return RecordShadowPassJob(static_cast<int>(i)); },
+      &thread_pool_);
+  if (!succeeded)
+    return false;
 
-  vkEndCommandBuffer(command_buffer);
+  vkResetCommandBuffer(shadow_command_buffer_, 0);
 
-  VkSubmitInfo commands_submit_info{};
-  commands_submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  commands_submit_info.commandBufferCount = 1;
-  commands_submit_info.pCommandBuffers = &command_buffer;
+  // The shadow pass may be re-submitted while an earlier submission of it is
+  // still pending if the light moves on consecutive frames.
+  VkCommandBufferBeginInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
 
-  vkQueueSubmit(graphics_queue_, 1, &commands_submit_info, VK_NULL_HANDLE);
-  vkQueueWaitIdle(graphics_queue_);
+  if (vkBeginCommandBuffer(shadow_command_buffer_, &begin_info)
+          != VK_SUCCESS) {
+    std::cerr << "Could not begin shadow command buffer." << std::endl;
+    return false;
+  }
 
-  vkDestroyBuffer(device_, staging_buffer, nullptr);
-  vkFreeMemory(device_, staging_buffer_memory, nullptr);
+  gpu_profiler_.ResetSlot(shadow_command_buffer_, kShadowProfilerSlot);
+
+  // The multiview pass draws every face of a light from the same list.
+  gpu_profiler_.BeginScope(shadow_command_buffer_, kShadowProfilerSlot,
+                           shadow_cull_scope_);
+  RecordCullCommands(shadow_command_buffer_, kShadowCullViewSlot,
+                     static_cast<int>(shadow_pass_command_buffers_.size()));
+  gpu_profiler_.EndScope(shadow_command_buffer_, kShadowProfilerSlot,
+                         shadow_cull_scope_);
+
+  // The cubemaps are shared by all frames and stay in SHADER_READ_ONLY layout
+  // between re-renders. The barriers order the re-render after any earlier
+  // frame still sampling it, since they are all on the same queue.
+  gpu_profiler_.BeginScope(shadow_command_buffer_, kShadowProfilerSlot,
+                           shadow_to_attachment_scope_);
+  TransitionShadowTextureForShadowPass(shadow_command_buffer_);
+  gpu_profiler_.EndScope(shadow_command_buffer_, kShadowProfilerSlot,
+                         shadow_to_attachment_scope_);
+
+  RecordShadowPassCommands(shadow_command_buffer_);
+
+  gpu_profiler_.BeginScope(shadow_command_buffer_, kShadowProfilerSlot,
+                           shadow_to_sampled_scope_);
+  TransitionShadowTextureForScenePass(shadow_command_buffer_);
+  gpu_profiler_.EndScope(shadow_command_buffer_, kShadowProfilerSlot,
+                         shadow_to_sampled_scope_);
+
+  if (vkEndCommandBuffer(shadow_command_buffer_) != VK_SUCCESS) {
+    std::cerr << "Could not end shadow command buffer." << std::endl;
+    return false;
+  }
 
-  vkFreeCommandBuffers(device_, command_pool_, 1, &command_buffer);
+  return true;
 }
 
-bool App::RecordCommandBuffer(int frame_index) {
-  VkCommandBuffer command_buffer = command_buffers_[frame_index];
+bool App::RecordCommandBuffer(VkCommandBuffer command_buffer, int frame_index,
+                              uint32_t image_index) {
   vkResetCommandBuffer(command_buffer, 0);
 
   VkCommandBufferBeginInfo begin_info{};
@@ -1686,13 +4065,25 @@ bool App::RecordCommandBuffer(int frame_index) {
     return false;
   }
 
-  TransitionShadowTextureForShadowPass(command_buffer, frame_index);
+  gpu_profiler_.ResetSlot(command_buffer, frame_index);
 
-  RecordShadowPassCommands(command_buffer, frame_index);
+  gpu_profiler_.BeginScope(command_buffer, frame_index, scene_cull_scope_);
+  RecordCullCommands(command_buffer, frame_index, 1);
+  gpu_profiler_.EndScope(command_buffer, frame_index, scene_cull_scope_);
 
-  TransitionShadowTextureForScenePass(command_buffer, frame_index);
+  gpu_profiler_.BeginScope(command_buffer, frame_index, scene_clusters_scope_);
+  RecordClusterCommands(command_buffer, frame_index);
+  gpu_profiler_.EndScope(command_buffer, frame_index, scene_clusters_scope_);
 
-  RecordScenePassCommands(command_buffer, frame_index);
+  gpu_profiler_.BeginScope(command_buffer, frame_index, scene_pass_scope_);
+  RecordScenePassCommands(command_buffer, frame_index, image_index);
+  gpu_profiler_.EndScope(command_buffer, frame_index, scene_pass_scope_);
+
+  if (options_.headless) {
+    gpu_profiler_.BeginScope(command_buffer, frame_index, readback_scope_);
+    RecordReadbackCommands(command_buffer, frame_index, image_index);
+    gpu_profiler_.EndScope(command_buffer, frame_index, readback_scope_);
+  }
 
   if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
     std::cerr << "Could not end command buffer." << std::endl;
@@ -1702,10 +4093,7 @@ bool App::RecordCommandBuffer(int frame_index) {
   return true;
 }
 
-void App::TransitionShadowTextureForShadowPass(VkCommandBuffer command_buffer,
-                                               int frame_index) {
-  ShadowPassFrameResource& frame = shadow_frame_resources_[frame_index];
-
+void App::TransitionShadowTextureForShadowPass(VkCommandBuffer command_buffer) {
   VkImageMemoryBarrier barrier{};
   barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
   barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
@@ -1714,12 +4102,13 @@ void App::TransitionShadowTextureForShadowPass(VkCommandBuffer command_buffer,
   barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
   barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
   barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.image = frame.shadow_texture;
+  barrier.image = shadow_map_.shadow_texture;
   barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
   barrier.subresourceRange.baseMipLevel = 0;
   barrier.subresourceRange.levelCount = 1;
   barrier.subresourceRange.baseArrayLayer = 0;
-  barrier.subresourceRange.layerCount = 6;
+  barrier.subresourceRange.layerCount = kShadowCubemapFaceCount *
+      static_cast<uint32_t>(shadow_light_positions_.size());
 
   vkCmdPipelineBarrier(command_buffer,
                        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
@@ -1727,52 +4116,261 @@ void App::TransitionShadowTextureForShadowPass(VkCommandBuffer command_buffer,
                        nullptr, 0, nullptr, 1, &barrier);
 }
 
-void App::RecordShadowPassCommands(VkCommandBuffer command_buffer,
-                                   int frame_index) {
-  ShadowPassFrameResource& frame = shadow_frame_resources_[frame_index];
-
-  for (int i = 0; i < frame.depth_framebuffers.size(); ++i) {
+void App::RecordShadowPassCommands(VkCommandBuffer command_buffer) {
+  for (int i = 0; i < shadow_map_.depth_framebuffers.size(); ++i) {
     VkClearValue clear_value{};
     clear_value.depthStencil = {1.0f, 0};
 
     VkRenderPassBeginInfo render_pass_begin_info{};
     render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     render_pass_begin_info.renderPass = shadow_render_pass_;
-    render_pass_begin_info.framebuffer = frame.depth_framebuffers[i];
+    render_pass_begin_info.framebuffer = shadow_map_.depth_framebuffers[i];
     render_pass_begin_info.renderArea.offset = {0, 0};
     render_pass_begin_info.renderArea.extent = {
-      kShadowTextureWidth, kShadowTextureHeight
+      shadow_texture_size_, shadow_texture_size_
     };
     render_pass_begin_info.clearValueCount = 1;
     render_pass_begin_info.pClearValues = &clear_value;
 
+    // Outside of the render pass, since it may use multiview.
+    gpu_profiler_.BeginScope(command_buffer, kShadowProfilerSlot,
+                             shadow_face_scopes_[i]);
+
     vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info,
-                          VK_SUBPASS_CONTENTS_INLINE);
+                          VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
 
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                      shadow_pipeline_);
+    vkCmdExecuteCommands(command_buffer, 1, &shadow_pass_command_buffers_[i]);
 
+    vkCmdEndRenderPass(command_buffer);
+
+    gpu_profiler_.EndScope(command_buffer, kShadowProfilerSlot,
+                           shadow_face_scopes_[i]);
+  }
+}
+
+bool App::RecordShadowPassJob(int framebuffer_index) {
+  vkResetCommandPool(device_, shadow_pass_command_pools_[framebuffer_index],
+                     0);
+
+  VkCommandBuffer command_buffer =
+      shadow_pass_command_buffers_[framebuffer_index];
+
+  // Executed by the shadow command buffer, which may itself be pending more
+  // than once.
+  if (!BeginRenderPassCommandBuffer(
+          command_buffer, shadow_render_pass_, 0,
+          shadow_map_.depth_framebuffers[framebuffer_index],
+          VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT)) {
+    std::cerr << "Could not begin shadow pass command buffer." << std::endl;
+    return false;
+  }
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    shadow_pipeline_);
+
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          shadow_pipeline_layout_, 0, 1,
+                          &shadow_descriptor_set_, 0, nullptr);
+
+  // A multiview framebuffer holds all six faces of one light.
+  if (use_multiview_shadow_pass_) {
+    uint32_t first_shadow_mat =
+        static_cast<uint32_t>(framebuffer_index) * kShadowCubemapFaceCount;
+    vkCmdPushConstants(command_buffer, shadow_pipeline_layout_,
+                       VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(uint32_t),
+                       &first_shadow_mat);
+  } else {
     vkCmdPushConstants(command_buffer, shadow_pipeline_layout_,
                        VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4),
-                       &shadow_mats_[i]);
+                       &shadow_mats_[framebuffer_index]);
+  }
 
-    VkBuffer vertex_buffers[] = { position_buffer_ };
-    VkDeviceSize offsets[] = { 0 };
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, vertex_buffers, offsets);
+  BindVertexBuffers(command_buffer, true);
 
-    vkCmdBindIndexBuffer(command_buffer, index_buffer_, 0,
-                         VK_INDEX_TYPE_UINT16);
+  RecordIndirectDraws(command_buffer, kShadowCullViewSlot + framebuffer_index);
 
-    vkCmdDrawIndexed(command_buffer, model_.index_buffer.size(), 1, 0, 0, 0);
+  if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+    std::cerr << "Could not end shadow pass command buffer." << std::endl;
+    return false;
+  }
 
-    vkCmdEndRenderPass(command_buffer);
+  return true;
+}
+
+void App::RecordIndirectDraws(VkCommandBuffer command_buffer,
+                              int view_slot) {
+  VkDeviceSize draw_offset = GetDrawOffset(view_slot);
+
+  if (supports_multi_draw_indirect_) {
+    vkCmdDrawIndexedIndirect(command_buffer, draw_buffer_, draw_offset,
+                             draw_count_,
+                             sizeof(VkDrawIndexedIndirectCommand));
+    return;
+  }
+
+  for (uint32_t i = 0; i < draw_count_; ++i) {
+    vkCmdDrawIndexedIndirect(
+        command_buffer, draw_buffer_,
+        draw_offset + sizeof(VkDrawIndexedIndirectCommand) * i, 1,
+        sizeof(VkDrawIndexedIndirectCommand));
   }
 }
 
-void App::TransitionShadowTextureForScenePass(VkCommandBuffer command_buffer,
-                                              int frame_index) {
-  ShadowPassFrameResource& frame = shadow_frame_resources_[frame_index];
+void App::RecordCullCommands(VkCommandBuffer command_buffer,
+                             int first_view_slot, int view_slot_count) {
+  // Earlier draws from the same slots may still be reading them.
+  VkMemoryBarrier reuse_barrier{};
+  reuse_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  reuse_barrier.srcAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+      VK_ACCESS_SHADER_READ_BIT;
+  reuse_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT |
+      VK_ACCESS_SHADER_WRITE_BIT;
 
+  vkCmdPipelineBarrier(command_buffer,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT |
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 1, &reuse_barrier, 0, nullptr, 0, nullptr);
+
+  // The rest of each command never changes, so only the instance counts are
+  // cleared.
+  for (int i = 0; i < view_slot_count; ++i) {
+    for (uint32_t j = 0; j < draw_count_; ++j) {
+      VkDeviceSize offset = GetDrawOffset(first_view_slot + i) +
+          sizeof(VkDrawIndexedIndirectCommand) * j +
+          offsetof(VkDrawIndexedIndirectCommand, instanceCount);
+      vkCmdFillBuffer(command_buffer, draw_buffer_, offset, sizeof(uint32_t),
+                      0);
+    }
+  }
+
+  VkMemoryBarrier clear_barrier{};
+  clear_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  clear_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  clear_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+      VK_ACCESS_SHADER_WRITE_BIT;
+
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                       &clear_barrier, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    cull_pipeline_);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          cull_pipeline_layout_, 0, 1, &cull_descriptor_set_,
+                          0, nullptr);
+
+  uint32_t group_count = (instance_count_ + kCullGroupSize - 1) /
+      kCullGroupSize;
+
+  // How many pixels a unit at a view depth of one covers. The shadow faces
+  // are square, with a 90 degree field of view.
+  bool shadow_views = first_view_slot >= kShadowCullViewSlot;
+  float pixels_per_unit = shadow_views ?
+      0.5f * static_cast<float>(shadow_texture_size_) :
+      0.5f * static_cast<float>(swap_chain_extent_.height) /
+          std::tan(glm::radians(kSceneFieldOfViewDegrees) * 0.5f);
+
+  glm::vec4 lod_errors(0.f);
+  for (uint32_t i = 0; i < draw_count_; ++i)
+    lod_errors[i] = mesh_lods_[i].error;
+
+  // The multiview shadow pass is culled with an orthographic box around each
+  // light, so its clip w says nothing about depth. The distance from the
+  // light suits the per-face views just as well.
+  for (int i = 0; i < view_slot_count; ++i) {
+    glm::vec4 lod_origin(0.f);
+    if (shadow_views) {
+      int shadow_view = first_view_slot + i - kShadowCullViewSlot;
+      lod_origin = glm::vec4(
+          shadow_light_positions_[shadow_view / GetShadowPassesPerLight()],
+          1.f);
+    }
+
+    CullPushConstants push_constants{};
+    push_constants.bounding_sphere =
+        glm::vec4(mesh_bounds_.center, mesh_bounds_.radius);
+    push_constants.lod_errors = lod_errors;
+    push_constants.lod_origin = lod_origin;
+    push_constants.view_slot = static_cast<uint32_t>(first_view_slot + i);
+    push_constants.instance_count = instance_count_;
+    push_constants.lod_count = draw_count_;
+    push_constants.lod_bias = shadow_views ? kShadowLodBias : 0;
+    push_constants.lod_scale = pixels_per_unit / kLodErrorThresholdPixels;
+
+    vkCmdPushConstants(command_buffer, cull_pipeline_layout_,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants),
+                       &push_constants);
+    vkCmdDispatch(command_buffer, group_count, 1, 1);
+  }
+
+  VkMemoryBarrier cull_barrier{};
+  cull_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  cull_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  cull_barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+      VK_ACCESS_SHADER_READ_BIT;
+
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                       0, 1, &cull_barrier, 0, nullptr, 0, nullptr);
+}
+
+void App::RecordClusterCommands(VkCommandBuffer command_buffer,
+                                int frame_index) {
+  // The last frame to use the same range may still be shading with it.
+  VkMemoryBarrier reuse_barrier{};
+  reuse_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  reuse_barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  reuse_barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                       &reuse_barrier, 0, nullptr, 0, nullptr);
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    cluster_pipeline_);
+
+  // In binding order: the frame's vertex UBO slot, then its cluster range.
+  uint32_t dynamic_offsets[] = {
+    frames_[frame_index].vert_ubo_offset,
+    static_cast<uint32_t>(frame_index * cluster_buffer_stride_)
+  };
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          cluster_pipeline_layout_, 0, 1,
+                          &cluster_descriptor_set_, 2, dynamic_offsets);
+
+  float aspect_ratio = static_cast<float>(swap_chain_extent_.width) /
+      static_cast<float>(swap_chain_extent_.height);
+  float tan_half_fov_y =
+      std::tan(glm::radians(kSceneFieldOfViewDegrees) * 0.5f);
+
+  ClusterPushConstants push_constants{};
+  push_constants.projection = glm::vec4(tan_half_fov_y * aspect_ratio,
+                                        tan_half_fov_y, kSceneNearPlane,
+                                        kSceneFarPlane);
+  push_constants.light_count = light_count_;
+
+  vkCmdPushConstants(command_buffer, cluster_pipeline_layout_,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants),
+                     &push_constants);
+
+  uint32_t group_count = (kClusterCount + kClusterGroupSize - 1) /
+      kClusterGroupSize;
+  vkCmdDispatch(command_buffer, group_count, 1, 1);
+
+  VkMemoryBarrier cluster_barrier{};
+  cluster_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  cluster_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  cluster_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1,
+                       &cluster_barrier, 0, nullptr, 0, nullptr);
+}
+
+void App::TransitionShadowTextureForScenePass(VkCommandBuffer command_buffer) {
   VkImageMemoryBarrier barrier{};
   barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
   barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
@@ -1781,12 +4379,13 @@ void App::TransitionShadowTextureForScenePass(VkCommandBuffer command_buffer,
   barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
   barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
   barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.image = frame.shadow_texture;
+  barrier.image = shadow_map_.shadow_texture;
   barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
   barrier.subresourceRange.baseMipLevel = 0;
   barrier.subresourceRange.levelCount = 1;
   barrier.subresourceRange.baseArrayLayer = 0;
-  barrier.subresourceRange.layerCount = 6;
+  barrier.subresourceRange.layerCount = kShadowCubemapFaceCount *
+      static_cast<uint32_t>(shadow_light_positions_.size());
 
   vkCmdPipelineBarrier(command_buffer,
                        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
@@ -1795,7 +4394,7 @@ void App::TransitionShadowTextureForScenePass(VkCommandBuffer command_buffer,
 }
 
 void App::RecordScenePassCommands(VkCommandBuffer command_buffer,
-                                  int frame_index) {
+                                  int frame_index, uint32_t image_index) {
   VkClearValue clear_values[2]{};
   clear_values[0].color = {0.0f, 0.0f, 0.0f, 1.0f};
   clear_values[1].depthStencil = {1.0f, 0};
@@ -1803,56 +4402,160 @@ void App::RecordScenePassCommands(VkCommandBuffer command_buffer,
   VkRenderPassBeginInfo render_pass_begin_info{};
   render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
   render_pass_begin_info.renderPass = render_pass_;
-  render_pass_begin_info.framebuffer = swap_chain_framebuffers_[frame_index];
+  render_pass_begin_info.framebuffer = swap_chain_framebuffers_[image_index];
   render_pass_begin_info.renderArea.offset = {0, 0};
   render_pass_begin_info.renderArea.extent = swap_chain_extent_;
   render_pass_begin_info.clearValueCount = 2;
   render_pass_begin_info.pClearValues = clear_values;
 
-  vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info,
-                        VK_SUBPASS_CONTENTS_INLINE);
+  vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info,
+                        VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+  if (options_.depth_prepass) {
+    vkCmdExecuteCommands(command_buffer, 1,
+                         &frames_[frame_index].depth_prepass_command_buffer);
+    vkCmdNextSubpass(command_buffer,
+                     VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  }
+
+  vkCmdExecuteCommands(command_buffer, 1,
+                       &frames_[frame_index].scene_pass_command_buffer);
+
+  vkCmdEndRenderPass(command_buffer);
+}
+
+bool App::RecordScenePassJob(int frame_index) {
+  FrameContext& frame = frames_[frame_index];
+
+  vkResetCommandPool(device_, frame.scene_pass_command_pool, 0);
+
+  VkCommandBuffer command_buffer = frame.scene_pass_command_buffer;
+
+  // Pre-recorded primaries of every swap chain image execute the same
+  // buffer, so it can't name a framebuffer and has to allow being recorded
+  // into more than one of them.
+  VkCommandBufferUsageFlags flags = 0;
+  if (kPrerecordCommandBuffers)
+    flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+
+  // Draws the same culled instances as the scene subpass, but only with
+  // their positions.
+  if (options_.depth_prepass) {
+    VkCommandBuffer prepass_command_buffer =
+        frame.depth_prepass_command_buffer;
+
+    if (!BeginRenderPassCommandBuffer(prepass_command_buffer, render_pass_, 0,
+                                      VK_NULL_HANDLE, flags)) {
+      std::cerr << "Could not begin depth pre-pass command buffer."
+                << std::endl;
+      return false;
+    }
+
+    vkCmdBindPipeline(prepass_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      depth_prepass_pipeline_);
+    SetViewportAndScissor(prepass_command_buffer, swap_chain_extent_);
+
+    vkCmdBindDescriptorSets(prepass_command_buffer,
+                            VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_,
+                            0, 1, &frame.descriptor_set, 1,
+                            &frame.vert_ubo_offset);
+
+    BindVertexBuffers(prepass_command_buffer, true);
+
+    RecordIndirectDraws(prepass_command_buffer, frame_index);
+
+    if (vkEndCommandBuffer(prepass_command_buffer) != VK_SUCCESS) {
+      std::cerr << "Could not end depth pre-pass command buffer."
+                << std::endl;
+      return false;
+    }
+  }
+
+  if (!BeginRenderPassCommandBuffer(command_buffer, render_pass_,
+                                    scene_subpass_, VK_NULL_HANDLE, flags)) {
+    std::cerr << "Could not begin scene pass command buffer." << std::endl;
+    return false;
+  }
 
   vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                     pipeline_);
+  SetViewportAndScissor(command_buffer, swap_chain_extent_);
 
   vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          pipeline_layout_, 0, 1,
-                          &descriptor_sets_[frame_index], 0, nullptr);
+                          pipeline_layout_, 0, 1, &frame.descriptor_set, 1,
+                          &frame.vert_ubo_offset);
 
-  VkBuffer vertex_buffers[] = {
-    position_buffer_, normal_buffer_, material_idx_buffer_
-  };
-  VkDeviceSize offsets[] = { 0, 0, 0 };
-  vkCmdBindVertexBuffers(command_buffer, 0, 3, vertex_buffers, offsets);
+  BindVertexBuffers(command_buffer, false);
 
-  vkCmdBindIndexBuffer(command_buffer, index_buffer_, 0,
-                        VK_INDEX_TYPE_UINT16);
+  RecordIndirectDraws(command_buffer, frame_index);
 
-  vkCmdDrawIndexed(command_buffer, model_.index_buffer.size(), 1, 0, 0, 0);
+  if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+    std::cerr << "Could not end scene pass command buffer." << std::endl;
+    return false;
+  }
 
-  vkCmdEndRenderPass(command_buffer);
+  return true;
+}
+
+void App::RecordReadbackCommands(VkCommandBuffer command_buffer,
+                                 int frame_index, uint32_t image_index) {
+  // The render pass leaves the image in TRANSFER_SRC_OPTIMAL when headless.
+  VkBufferImageCopy region{};
+  region.bufferOffset = 0;
+  region.bufferRowLength = 0;
+  region.bufferImageHeight = 0;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.mipLevel = 0;
+  region.imageSubresource.baseArrayLayer = 0;
+  region.imageSubresource.layerCount = 1;
+  region.imageOffset = { 0, 0, 0 };
+  region.imageExtent.width = swap_chain_extent_.width;
+  region.imageExtent.height = swap_chain_extent_.height;
+  region.imageExtent.depth = 1;
+
+  VkBuffer readback_buffer = frames_[frame_index].readback_buffer;
+
+  vkCmdCopyImageToBuffer(command_buffer, swap_chain_images_[image_index],
+                         VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback_buffer,
+                         1, &region);
+
+  VkBufferMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = readback_buffer;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &barrier,
+                       0, nullptr);
+}
+
+VkCommandBuffer App::GetSceneCommandBuffer(int frame_index,
+                                           uint32_t image_index) {
+  const FrameContext& frame = frames_[frame_index];
+  if (!kPrerecordCommandBuffers)
+    return frame.command_buffers[0];
+
+  return frame.command_buffers[image_index];
 }
 
 bool App::CreateSyncObjects() {
-  image_ready_semaphores_.resize(kMaxFramesInFlight);
-  render_complete_semaphores_.resize(kMaxFramesInFlight);
-  frame_ready_fences_.resize(kMaxFramesInFlight);
-  image_rendered_fences_.resize(swap_chain_images_.size(), VK_NULL_HANDLE);
+  image_rendered_values_.assign(swap_chain_images_.size(), 0);
 
   VkSemaphoreCreateInfo semaphore_info{};
   semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-  VkFenceCreateInfo fence_info{};
-  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-  fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+  for (FrameContext& frame : frames_) {
+    frame.frame_ready_value = 0;
 
-  for (int i = 0; i < kMaxFramesInFlight; i++) {
     if (vkCreateSemaphore(device_, &semaphore_info, nullptr,
-                          &image_ready_semaphores_[i]) != VK_SUCCESS ||
+                          &frame.image_ready_semaphore) != VK_SUCCESS ||
         vkCreateSemaphore(device_, &semaphore_info, nullptr,
-                          &render_complete_semaphores_[i]) != VK_SUCCESS ||
-        vkCreateFence(device_, &fence_info, nullptr,
-                      &frame_ready_fences_[i]) != VK_SUCCESS) {
+                          &frame.render_complete_semaphore) != VK_SUCCESS) {
       std::cerr << "Could not create sync objects." << std::endl;
       return false;
     }
@@ -1861,31 +4564,76 @@ bool App::CreateSyncObjects() {
 }
 
 void App::Destroy() {
-  for (int i = 0; i < kMaxFramesInFlight; i++) {
-    vkDestroySemaphore(device_, image_ready_semaphores_[i], nullptr);
-    vkDestroySemaphore(device_, render_complete_semaphores_[i], nullptr);
-    vkDestroyFence(device_, frame_ready_fences_[i], nullptr);
+  // The main loop can end while a reload is still running on the pool.
+  if (pipeline_reload_.valid())
+    pipeline_reload_.get();
+  DestroyReloadedPipelines();
+
+  if (geometry_reload_.valid())
+    geometry_reload_.get();
+
+  for (FrameContext& frame : frames_) {
+    vkDestroySemaphore(device_, frame.image_ready_semaphore, nullptr);
+    vkDestroySemaphore(device_, frame.render_complete_semaphore, nullptr);
   }
 
   DestroyVertexBuffers();
 
+  DestroyDrawBuffers();
+
+  DestroyMaterialBuffer();
+
+  DestroyLightBuffers();
+
   DestroyDescriptorSets();
 
+  DestroyCullPipeline();
+
+  DestroyClusterPipeline();
+
   DestroyCommandBuffers();
 
+  vkFreeCommandBuffers(device_, command_pool_, 1, &shadow_command_buffer_);
+
   DestroyCommandPool();
 
+  DestroyRecordingJobCommandBuffers();
+
   DestroyShadowPassResources();
 
   DestroyScenePassResources();
 
-  DestroySwapChain();
+  if (options_.headless) {
+    DestroyReadbackBuffers();
+    DestroyOffscreenImages();
+  } else {
+    DestroySwapChain();
+  }
+
+  // Not being able to save the cache only slows down the next start-up.
+  if (!utils::vk::SavePipelineCacheToFile(kPipelineCachePath, physical_device_,
+                                          device_, pipeline_cache_)) {
+    std::cerr << "Could not save pipeline cache." << std::endl;
+  }
+  vkDestroyPipelineCache(device_, pipeline_cache_, nullptr);
+
+  gpu_profiler_.Destroy();
+
+  frame_pacer_.Destroy();
+
+  upload_manager_.Destroy();
+
+  allocator_.Destroy();
 
   vkDestroyDevice(device_, nullptr);
-  vkDestroySurfaceKHR(instance_, surface_, nullptr);
+  if (surface_ != VK_NULL_HANDLE)
+    vkDestroySurfaceKHR(instance_, surface_, nullptr);
   utils::vk::DestroyDebugUtilsMessenger(instance_, debug_messenger_, nullptr);
   vkDestroyInstance(instance_, nullptr);
 
+  if (options_.headless)
+    return;
+
   glfwDestroyWindow(window_);
 
   glfwTerminate();
@@ -1893,62 +4641,113 @@ void App::Destroy() {
 
 void App::DestroyVertexBuffers() {
   vkDestroyBuffer(device_, index_buffer_, nullptr);
-  vkFreeMemory(device_, index_buffer_memory_, nullptr);
+  allocator_.Free(index_buffer_allocation_);
+
+  if (kUsePackedVertices) {
+    vkDestroyBuffer(device_, vertex_buffer_, nullptr);
+    allocator_.Free(vertex_buffer_allocation_);
+    return;
+  }
 
   vkDestroyBuffer(device_, material_idx_buffer_, nullptr);
-  vkFreeMemory(device_, material_idx_buffer_memory_, nullptr);
+  allocator_.Free(material_idx_buffer_allocation_);
 
   vkDestroyBuffer(device_, normal_buffer_, nullptr);
-  vkFreeMemory(device_, normal_buffer_memory_, nullptr);
+  allocator_.Free(normal_buffer_allocation_);
 
   vkDestroyBuffer(device_, position_buffer_, nullptr);
-  vkFreeMemory(device_, position_buffer_memory_, nullptr);
+  allocator_.Free(position_buffer_allocation_);
+}
+
+void App::DestroyMaterialBuffer() {
+  vkDestroyBuffer(device_, material_buffer_, nullptr);
+  allocator_.Free(material_buffer_allocation_);
+}
+
+void App::DestroyLightBuffers() {
+  vkDestroyBuffer(device_, cluster_buffer_, nullptr);
+  allocator_.Free(cluster_buffer_allocation_);
+  vkDestroyBuffer(device_, light_buffer_, nullptr);
+  allocator_.Free(light_buffer_allocation_);
+}
+
+void App::DestroyDrawBuffers() {
+  vkDestroyBuffer(device_, cull_view_buffer_, nullptr);
+  allocator_.Free(cull_view_buffer_allocation_);
+  cull_view_mats_ = nullptr;
+
+  vkDestroyBuffer(device_, visible_instance_buffer_, nullptr);
+  allocator_.Free(visible_instance_buffer_allocation_);
+
+  vkDestroyBuffer(device_, draw_buffer_, nullptr);
+  allocator_.Free(draw_buffer_allocation_);
+
+  vkDestroyBuffer(device_, instance_buffer_, nullptr);
+  allocator_.Free(instance_buffer_allocation_);
+}
+
+void App::DestroyCullPipeline() {
+  vkDestroyPipeline(device_, cull_pipeline_, nullptr);
+  vkDestroyPipelineLayout(device_, cull_pipeline_layout_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, cull_descriptor_layout_, nullptr);
+}
+
+void App::DestroyClusterPipeline() {
+  vkDestroyPipeline(device_, cluster_pipeline_, nullptr);
+  vkDestroyPipelineLayout(device_, cluster_pipeline_layout_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, cluster_descriptor_layout_, nullptr);
 }
 
 void App::DestroyDescriptorSets() {
   vkDestroySampler(device_, shadow_texture_sampler_, nullptr);
 
-  for (int i = 0; i < swap_chain_images_.size(); ++i) {
-    vkDestroyBuffer(device_, frag_ubo_buffers_[i], nullptr);
-    vkFreeMemory(device_, frag_ubo_buffers_memory_[i], nullptr);
+  if (use_multiview_shadow_pass_) {
+    vkDestroyBuffer(device_, shadow_ubo_buffer_, nullptr);
+    allocator_.Free(shadow_ubo_buffer_allocation_);
   }
-  frag_ubo_buffers_.clear();
-  frag_ubo_buffers_memory_.clear();
 
-  for (int i = 0; i < swap_chain_images_.size(); ++i) {
-    vkDestroyBuffer(device_, vert_ubo_buffers_[i], nullptr);
-    vkFreeMemory(device_, vert_ubo_buffers_memory_[i], nullptr);
+  for (FrameContext& frame : frames_) {
+    vkDestroyBuffer(device_, frame.frag_ubo_buffer, nullptr);
+    allocator_.Free(frame.frag_ubo_buffer_allocation);
+    frame.vert_ubo = nullptr;
   }
-  vert_ubo_buffers_.clear();
-  vert_ubo_buffers_memory_.clear();
+
+  vkDestroyBuffer(device_, vert_ubo_buffer_, nullptr);
+  allocator_.Free(vert_ubo_buffer_allocation_);
 
   vkDestroyDescriptorPool(device_, descriptor_pool_, nullptr);
-  descriptor_sets_.clear();
 }
 
 void App::DestroyCommandBuffers() {
-  vkFreeCommandBuffers(device_, command_pool_, command_buffers_.size(),
-                       command_buffers_.data());
-  command_buffers_.clear();
+  // The frames past frames_in_flight_ never get any.
+  for (FrameContext& frame : frames_) {
+    if (frame.command_buffers.empty())
+      continue;
+    vkFreeCommandBuffers(device_, command_pool_, frame.command_buffers.size(),
+                         frame.command_buffers.data());
+    frame.command_buffers.clear();
+  }
 }
 
 void App::DestroyCommandPool() {
   vkDestroyCommandPool(device_, command_pool_, nullptr);
 }
 
-void App::DestroyShadowPassResources() {
-  for (ShadowPassFrameResource& frame : shadow_frame_resources_) {
-    vkDestroyImageView(device_, frame.shadow_texture_view, nullptr);
-    for (VkFramebuffer framebuffer : frame.depth_framebuffers) {
-      vkDestroyFramebuffer(device_, framebuffer, nullptr);
-    }
-    for (VkImageView image_view : frame.depth_framebuffer_views) {
-      vkDestroyImageView(device_, image_view, nullptr);
-    }
-    vkDestroyImage(device_, frame.shadow_texture, nullptr);
-    vkFreeMemory(device_, frame.shadow_texture_memory, nullptr);
+void App::DestroyRecordingJobCommandBuffers() {
+  // Destroying a pool frees its command buffers.
+  for (FrameContext& frame : frames_) {
+    vkDestroyCommandPool(device_, frame.scene_pass_command_pool, nullptr);
+    frame.scene_pass_command_pool = VK_NULL_HANDLE;
   }
-  shadow_frame_resources_.clear();
+
+  for (VkCommandPool command_pool : shadow_pass_command_pools_)
+    vkDestroyCommandPool(device_, command_pool, nullptr);
+  shadow_pass_command_pools_.clear();
+  shadow_pass_command_buffers_.clear();
+}
+
+void App::DestroyShadowPassResources() {
+  DestroyShadowFramebuffers();
 
   vkDestroyPipeline(device_, shadow_pipeline_, nullptr);
   vkDestroyPipelineLayout(device_, shadow_pipeline_layout_, nullptr);
@@ -1956,21 +4755,42 @@ void App::DestroyShadowPassResources() {
   vkDestroyRenderPass(device_, shadow_render_pass_, nullptr);
 }
 
-void App::DestroyScenePassResources() {
+void App::DestroyShadowFramebuffers() {
+  vkDestroyImageView(device_, shadow_map_.shadow_texture_view, nullptr);
+  for (VkFramebuffer framebuffer : shadow_map_.depth_framebuffers) {
+    vkDestroyFramebuffer(device_, framebuffer, nullptr);
+  }
+  shadow_map_.depth_framebuffers.clear();
+  for (VkImageView image_view : shadow_map_.depth_framebuffer_views) {
+    vkDestroyImageView(device_, image_view, nullptr);
+  }
+  shadow_map_.depth_framebuffer_views.clear();
+  vkDestroyImage(device_, shadow_map_.shadow_texture, nullptr);
+  allocator_.Free(shadow_map_.shadow_texture_allocation);
+}
+
+void App::DestroyFramebuffers() {
   for (const auto& framebuffer : swap_chain_framebuffers_) {
     vkDestroyFramebuffer(device_, framebuffer, nullptr);
   }
   swap_chain_framebuffers_.clear();
 
-  vkDestroyImageView(device_, color_image_view_, nullptr);
-  vkDestroyImage(device_, color_image_, nullptr);
-  vkFreeMemory(device_, color_image_memory_, nullptr);
+  if (msaa_sample_count_ != VK_SAMPLE_COUNT_1_BIT) {
+    vkDestroyImageView(device_, color_image_view_, nullptr);
+    vkDestroyImage(device_, color_image_, nullptr);
+    allocator_.Free(color_image_allocation_);
+  }
 
   vkDestroyImageView(device_, depth_image_view_, nullptr);
   vkDestroyImage(device_, depth_image_, nullptr);
-  vkFreeMemory(device_, depth_image_memory_, nullptr);
+  allocator_.Free(depth_image_allocation_);
+}
+
+void App::DestroyScenePassResources() {
+  DestroyFramebuffers();
 
   vkDestroyPipeline(device_, pipeline_, nullptr);
+  vkDestroyPipeline(device_, depth_prepass_pipeline_, nullptr);
   vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr);
   vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_, nullptr);
   vkDestroyRenderPass(device_, render_pass_, nullptr);
@@ -1985,83 +4805,512 @@ void App::DestroySwapChain() {
   vkDestroySwapchainKHR(device_, swap_chain_, nullptr);
 }
 
-void App::MainLoop() {
-  current_frame_time_ = glfwGetTime();
+void App::DestroyOffscreenImages() {
+  for (const auto& image_view : swap_chain_image_views_) {
+    vkDestroyImageView(device_, image_view, nullptr);
+  }
+  swap_chain_image_views_.clear();
+
+  for (int i = 0; i < swap_chain_images_.size(); ++i) {
+    vkDestroyImage(device_, swap_chain_images_[i], nullptr);
+    allocator_.Free(offscreen_image_allocations_[i]);
+  }
+  swap_chain_images_.clear();
+  offscreen_image_allocations_.clear();
+}
+
+void App::DestroyReadbackBuffers() {
+  for (FrameContext& frame : frames_) {
+    if (frame.readback_buffer == VK_NULL_HANDLE)
+      continue;
 
-  while (!glfwWindowShouldClose(window_)) {
-    glfwPollEvents();
+    vkDestroyBuffer(device_, frame.readback_buffer, nullptr);
+    allocator_.Free(frame.readback_buffer_allocation);
+    frame.readback_buffer = VK_NULL_HANDLE;
+  }
+}
+
+bool App::MainLoop() {
+  current_frame_time_ = GetTimeInSeconds();
+  double headless_start_time = current_frame_time_;
+
+  bool draw_failed = false;
+
+  if (UsesSimulationThread())
+    StartSimulationThread();
+
+  while (options_.headless || !glfwWindowShouldClose(window_)) {
+    if (options_.benchmark && !ContinueBenchmark())
+      break;
+
+    if (options_.headless && !options_.benchmark &&
+        GetSubmittedFrameCount() >=
+            static_cast<uint64_t>(options_.headless_frame_count)) {
+      break;
+    }
+
+    // A pipeline reload may still be compiling against the shadow render pass
+    // that a tier change replaces.
+    if (requested_shadow_quality_tier_ != shadow_quality_tier_ &&
+        !pipeline_reload_.valid()) {
+      if (!ChangeShadowQualityTier(requested_shadow_quality_tier_)) {
+        draw_failed = true;
+        break;
+      }
+      std::cout << "Lowered shadow quality to tier " << shadow_quality_tier_
+                << "." << std::endl;
+    }
+
+    if (options_.hot_reload && !PollHotReload()) {
+      draw_failed = true;
+      break;
+    }
 
-    if (!DrawFrame())
+    // In low latency mode, DrawFrame() samples the input itself once the
+    // previous frame is done.
+    if (options_.latency_mode != LatencyMode::kLowLatency)
+      SampleInput();
+
+    if (!DrawFrame()) {
+      draw_failed = true;
       break;
+    }
+
+    if (options_.print_gpu_timings &&
+        current_frame_time_ - last_gpu_timings_print_time_ >=
+            kGpuTimingsPrintInterval) {
+      gpu_profiler_.PrintStats(std::cout);
+      last_gpu_timings_print_time_ = current_frame_time_;
+    }
+  }
+  StopSimulationThread();
+  vkDeviceWaitIdle(device_);
+
+  if (options_.headless) {
+    double seconds = GetTimeInSeconds() - headless_start_time;
+
+    // The frames still in flight, oldest first.
+    bool writes_succeeded = true;
+    for (int i = 0; i < frames_in_flight_; ++i) {
+      int frame_index = (current_frame_ + i) % frames_in_flight_;
+      writes_succeeded = WriteReadbackImage(frame_index) && writes_succeeded;
+    }
+    writes_succeeded = WaitForImageWrites(0) && writes_succeeded;
+
+    uint64_t frame_count = GetSubmittedFrameCount();
+    std::cout << "headless frames=" << frame_count << " seconds=" << seconds
+              << " fps=" << (seconds > 0.0 ? frame_count / seconds : 0.0)
+              << std::endl;
+
+    if (!writes_succeeded)
+      return false;
+  }
+
+  if (draw_failed)
+    return false;
+
+  if (!options_.benchmark)
+    return true;
+
+  if (!benchmark_finished_) {
+    std::cerr << "Benchmark did not finish." << std::endl;
+    return false;
+  }
+
+  // Picks up the frames that were still in flight when the loop ended.
+  for (int i = 0; i < frames_in_flight_; ++i) {
+    CollectGpuTimings(i);
+  }
+
+  return WriteBenchmarkReport();
+}
 
-    double previous_frame_time = current_frame_time_;
-    current_frame_time_ = glfwGetTime();
+void App::SampleInput() {
+  utils::ScopedCpuTimer timer(&cpu_profiler_, cpu_phases_.sample_input);
 
+  if (!options_.headless)
+    glfwPollEvents();
+
+  double previous_frame_time = current_frame_time_;
+  current_frame_time_ = GetTimeInSeconds();
+
+  if (UsesSimulationThread())
+    return;
+
+  if (options_.benchmark) {
+    AdvanceBenchmarkCamera();
+  } else {
     double time_elapsed = current_frame_time_ - previous_frame_time;
     camera_.Tick(static_cast<float>(time_elapsed * 1000.0));
   }
-  vkDeviceWaitIdle(device_);
+
+  PublishSimulationSnapshot();
 }
 
-bool App::DrawFrame() {
-  vkWaitForFences(device_, 1, &frame_ready_fences_[current_frame_], VK_TRUE,
-                  UINT64_MAX);
+void App::StartSimulationThread() {
+  simulation_stopping_ = false;
+  simulation_thread_ = std::thread([this]() { SimulationLoop(); });
+}
 
-  uint32_t image_index;
-  VkResult result = vkAcquireNextImageKHR(
-      device_, swap_chain_, UINT64_MAX,
-      image_ready_semaphores_[current_frame_], VK_NULL_HANDLE, &image_index);
+void App::StopSimulationThread() {
+  if (!simulation_thread_.joinable())
+    return;
 
-  if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-    RecreateSwapChain();
-    return true;
-  } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-    std::cerr << "Could not acquire image." << std::endl;
+  simulation_stopping_ = true;
+  simulation_thread_.join();
+}
+
+void App::SimulationLoop() {
+  using Clock = std::chrono::steady_clock;
+
+  auto tick_duration = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(kSimulationTickSeconds));
+  auto next_tick_time = Clock::now();
+
+  while (!simulation_stopping_) {
+    uint32_t held_directions = held_directions_.load();
+    for (utils::Camera::Direction direction : kKeyDirections) {
+      if (held_directions & GetDirectionBit(direction))
+        camera_.StartMovement(direction, kStrafeSpeed);
+      else
+        camera_.StopMovement(direction);
+    }
+
+    camera_.Tick(static_cast<float>(kSimulationTickSeconds * 1000.0));
+    PublishSimulationSnapshot();
+
+    // Missed ticks, e.g. while the process was descheduled, are dropped
+    // rather than run back to back.
+    next_tick_time += tick_duration;
+    auto now = Clock::now();
+    if (next_tick_time < now)
+      next_tick_time = now;
+    std::this_thread::sleep_until(next_tick_time);
+  }
+}
+
+void App::PublishSimulationSnapshot() {
+  SimulationSnapshot& snapshot = simulation_snapshots_.GetWriteBuffer();
+  snapshot.view_mat = camera_.GetViewMat();
+  simulation_snapshots_.Publish();
+}
+
+void App::AdvanceBenchmarkCamera() {
+  // Counts submitted frames rather than calls, since a frame may be skipped
+  // when the swap chain has to be recreated.
+  int frame = static_cast<int>(GetSubmittedFrameCount());
+
+  for (; benchmark_camera_frame_ < frame; ++benchmark_camera_frame_) {
+    int path_frame = benchmark_camera_frame_ - kBenchmarkWarmupFrameCount;
+    if (path_frame < 0)
+      continue;
+
+    for (const CameraPathSegment& segment : kBenchmarkCameraPath) {
+      if (path_frame < segment.frame_count) {
+        camera_.MoveByIncrement(segment.direction,
+                                segment.speed * kBenchmarkFrameSeconds);
+        break;
+      }
+      path_frame -= segment.frame_count;
+    }
+  }
+}
+
+bool App::ContinueBenchmark() {
+  int frames_drawn = static_cast<int>(GetSubmittedFrameCount());
+
+  if (!benchmark_started_ && frames_drawn >= kBenchmarkWarmupFrameCount) {
+    cpu_profiler_.Clear();
+    gpu_profiler_.ClearStats();
+    benchmark_start_time_ = GetTimeInSeconds();
+    benchmark_started_ = true;
+  }
+
+  if (frames_drawn >=
+          kBenchmarkWarmupFrameCount + GetBenchmarkPathFrameCount()) {
+    benchmark_end_time_ = GetTimeInSeconds();
+    benchmark_finished_ = true;
+    return false;
+  }
+
+  return true;
+}
+
+bool App::WriteBenchmarkReport() {
+  std::ofstream file_strm;
+  std::ostream* strm = &std::cout;
+
+  if (!options_.benchmark_report_path.empty()) {
+    file_strm.open(options_.benchmark_report_path, std::ios::trunc);
+    if (!file_strm.is_open()) {
+      std::cerr << "Could not open " << options_.benchmark_report_path << "."
+                << std::endl;
+      return false;
+    }
+    strm = &file_strm;
+  }
+
+  *strm << "{\n";
+  *strm << "  \"frames\": " << GetBenchmarkPathFrameCount() << ",\n";
+  *strm << "  \"seconds\": " << benchmark_end_time_ - benchmark_start_time_
+        << ",\n";
+
+  *strm << "  \"cpu\": {\n";
+  for (int i = 0; i < cpu_profiler_.GetPhaseCount(); ++i) {
+    *strm << "    \"" << cpu_profiler_.GetPhaseName(i) << "\": ";
+    WriteTimingStatsJson(cpu_profiler_.GetStats(i), strm);
+    *strm << (i + 1 < cpu_profiler_.GetPhaseCount() ? ",\n" : "\n");
+  }
+  *strm << "  },\n";
+
+  *strm << "  \"gpu\": {\n";
+  for (int i = 0; i < gpu_profiler_.GetScopeCount(); ++i) {
+    *strm << "    \"" << gpu_profiler_.GetScopeName(i) << "\": ";
+    WriteTimingStatsJson(gpu_profiler_.GetStats(i), strm);
+    *strm << (i + 1 < gpu_profiler_.GetScopeCount() ? ",\n" : "\n");
+  }
+  *strm << "  }\n";
+  *strm << "}" << std::endl;
+
+  if (!*strm) {
+    std::cerr << "Could not write benchmark report." << std::endl;
     return false;
   }
+  return true;
+}
+
+void App::CollectGpuTimings(int frame_index) {
+  FrameContext& frame = frames_[frame_index];
+  if (!frame.gpu_timings_pending)
+    return;
+
+  // Warm-up frames are left out of the benchmark report even if they are
+  // collected after it has started.
+  bool skip = options_.benchmark &&
+      frame.frame_ready_value <= uint64_t{kBenchmarkWarmupFrameCount};
+
+  if (!skip) {
+    double gpu_milliseconds =
+        gpu_profiler_.Collect(frame_index, frame.frame_ready_value);
+    // A later frame that submitted the shadow pass again has reset its
+    // queries, even if they were never read back.
+    if (frame.shadow_gpu_timings_pending &&
+        frame.frame_ready_value == shadow_pass_frame_value_) {
+      gpu_milliseconds +=
+          gpu_profiler_.Collect(kShadowProfilerSlot, frame.frame_ready_value);
+    }
+    UpdateAdaptiveShadowQuality(gpu_milliseconds);
+  }
+
+  frame.gpu_timings_pending = false;
+  frame.shadow_gpu_timings_pending = false;
+}
+
+bool App::WriteReadbackImage(int frame_index) {
+  FrameContext& frame = frames_[frame_index];
+  if (!frame.readback_pending)
+    return true;
+  frame.readback_pending = false;
+
+  if (options_.output_format == ImageOutputFormat::kNone)
+    return true;
+
+  uint32_t width = swap_chain_extent_.width;
+  uint32_t height = swap_chain_extent_.height;
+
+  // Copied out so that the buffer can be reused by the next frame straight
+  // away, while the file is written on the thread pool.
+  auto pixels = std::make_shared<std::vector<uint8_t>>(
+      static_cast<size_t>(width) * height * 4);
+  memcpy(pixels->data(), frame.readback_buffer_allocation.mapped_data,
+         pixels->size());
+
+  bool png = options_.output_format == ImageOutputFormat::kPng;
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "_%05llu.%s",
+           static_cast<unsigned long long>(frame.frame_ready_value - 1),
+           png ? "png" : "raw");
+  std::string path = options_.output_path + suffix;
+
+  // Bounds the memory held by frames that are waiting to be written.
+  if (!WaitForImageWrites(thread_pool_.GetThreadCount()))
+    return false;
 
-  if (image_rendered_fences_[image_index] != VK_NULL_HANDLE) {
-    vkWaitForFences(device_, 1, &image_rendered_fences_[image_index], VK_TRUE,
-                    UINT64_MAX);
+  pending_image_writes_.push_back(thread_pool_.Submit(
+      [path, width, height, pixels, png]() {
+        bool success = png ?
+            utils::WritePng(path, width, height, pixels->data()) :
+            utils::WriteRaw(path, pixels->data(), pixels->size());
+        if (!success)
+          std::cerr << "Could not write " << path << "." << std::endl;
+        return success;
+      }));
+
+  return true;
+}
+
+bool App::WaitForImageWrites(size_t max_pending) {
+  bool success = true;
+  while (pending_image_writes_.size() > max_pending) {
+    success = pending_image_writes_.front().get() && success;
+    pending_image_writes_.pop_front();
   }
-  image_rendered_fences_[image_index] = frame_ready_fences_[current_frame_];
+  return success;
+}
+
+bool App::DrawFrame() {
+  utils::ScopedCpuTimer frame_timer(&cpu_profiler_, cpu_phases_.frame);
+
+  FrameContext& frame = frames_[current_frame_];
 
-  vkResetFences(device_, 1, &frame_ready_fences_[current_frame_]);
+  {
+    utils::ScopedCpuTimer timer(&cpu_profiler_, cpu_phases_.wait_frame);
+    if (!frame_pacer_.Wait(frame.frame_ready_value)) {
+      std::cerr << "Could not wait for frame." << std::endl;
+      return false;
+    }
+  }
 
-  UpdateScenePassMatrices(current_frame_);
+  // The frame's last submission has completed, so reading its timestamps
+  // doesn't stall.
+  CollectGpuTimings(current_frame_);
 
-  if (!RecordCommandBuffer(current_frame_))
+  // Likewise the frame's readback buffer, which is written out before the
+  // frame slot is reused.
+  if (!WriteReadbackImage(current_frame_))
     return false;
 
+  // Every frame slot has its own offscreen image when headless.
+  uint32_t image_index = static_cast<uint32_t>(current_frame_);
+  VkResult result;
+  if (!options_.headless) {
+    utils::ScopedCpuTimer timer(&cpu_profiler_, cpu_phases_.acquire);
+    result = vkAcquireNextImageKHR(device_, swap_chain_, UINT64_MAX,
+                                   frame.image_ready_semaphore, VK_NULL_HANDLE,
+                                   &image_index);
+
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+      RecreateSwapChain();
+      return true;
+    } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+      std::cerr << "Could not acquire image." << std::endl;
+      return false;
+    }
+  }
+
+  {
+    utils::ScopedCpuTimer timer(&cpu_profiler_, cpu_phases_.wait_image);
+    if (!frame_pacer_.Wait(image_rendered_values_[image_index])) {
+      std::cerr << "Could not wait for frame." << std::endl;
+      return false;
+    }
+  }
+
+  // Sampled as late as possible, so that the matrices reflect input that
+  // arrived while the previous frame was still rendering.
+  if (options_.latency_mode == LatencyMode::kLowLatency)
+    SampleInput();
+
+  {
+    utils::ScopedCpuTimer timer(&cpu_profiler_, cpu_phases_.update_ubo);
+    UpdateScenePassMatrices(current_frame_);
+  }
+
+  VkCommandBuffer scene_command_buffer =
+      GetSceneCommandBuffer(current_frame_, image_index);
+
+  if (!kPrerecordCommandBuffers) {
+    utils::ScopedCpuTimer timer(&cpu_profiler_, cpu_phases_.record);
+    if (!RecordScenePassJob(current_frame_))
+      return false;
+    if (!RecordCommandBuffer(scene_command_buffer, current_frame_,
+                             image_index)) {
+      return false;
+    }
+  }
+
+  // The shadow cubemap is only re-rendered, ahead of the scene pass, when it
+  // is stale.
+  VkCommandBuffer submit_command_buffers[2];
+  uint32_t submit_command_buffer_count = 0;
+
+  bool submit_shadow_pass = shadow_map_dirty_;
+  if (submit_shadow_pass) {
+    submit_command_buffers[submit_command_buffer_count++] =
+        shadow_command_buffer_;
+    shadow_map_dirty_ = false;
+  }
+  submit_command_buffers[submit_command_buffer_count++] = scene_command_buffer;
+
   VkSemaphore submit_wait_semaphores[] = {
-    image_ready_semaphores_[current_frame_]
+    frame.image_ready_semaphore
   };
   VkPipelineStageFlags submit_wait_stages[] = {
     VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
   };
 
+  // Binary semaphores ignore their entry in the value arrays.
+  uint64_t submit_wait_values[] = { 0 };
+
+  uint64_t frame_ready_value = frame_pacer_.GetNextValue();
+
+  // Nothing is acquired or presented when headless, so only the timeline
+  // semaphore is used.
+  uint32_t submit_wait_semaphore_count = options_.headless ? 0 : 1;
+  uint32_t submit_signal_semaphore_count = options_.headless ? 1 : 2;
+
   VkSemaphore submit_signal_semaphores[] = {
-    render_complete_semaphores_[current_frame_]
+    frame_pacer_.GetSemaphore(),
+    frame.render_complete_semaphore
   };
+  uint64_t submit_signal_values[] = { frame_ready_value, 0 };
+
+  VkTimelineSemaphoreSubmitInfoKHR timeline_submit_info{};
+  timeline_submit_info.sType =
+      VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+  timeline_submit_info.waitSemaphoreValueCount = submit_wait_semaphore_count;
+  timeline_submit_info.pWaitSemaphoreValues = submit_wait_values;
+  timeline_submit_info.signalSemaphoreValueCount =
+      submit_signal_semaphore_count;
+  timeline_submit_info.pSignalSemaphoreValues = submit_signal_values;
 
   VkSubmitInfo queue_submit_info{};
   queue_submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  queue_submit_info.waitSemaphoreCount = 1;
+  queue_submit_info.pNext = &timeline_submit_info;
+  queue_submit_info.waitSemaphoreCount = submit_wait_semaphore_count;
   queue_submit_info.pWaitSemaphores = submit_wait_semaphores;
   queue_submit_info.pWaitDstStageMask = submit_wait_stages;
-  queue_submit_info.commandBufferCount = 1;
-  queue_submit_info.pCommandBuffers = &command_buffers_[image_index];
-  queue_submit_info.signalSemaphoreCount = 1;
+  queue_submit_info.commandBufferCount = submit_command_buffer_count;
+  queue_submit_info.pCommandBuffers = submit_command_buffers;
+  queue_submit_info.signalSemaphoreCount = submit_signal_semaphore_count;
   queue_submit_info.pSignalSemaphores = submit_signal_semaphores;
 
-  if (vkQueueSubmit(graphics_queue_, 1, &queue_submit_info,
-                    frame_ready_fences_[current_frame_]) != VK_SUCCESS) {
-    std::cerr << "Could not submit to queue." << std::endl;
-    return false;
+  {
+    utils::ScopedCpuTimer timer(&cpu_profiler_, cpu_phases_.submit);
+    if (vkQueueSubmit(graphics_queue_, 1, &queue_submit_info, VK_NULL_HANDLE)
+            != VK_SUCCESS) {
+      std::cerr << "Could not submit to queue." << std::endl;
+      return false;
+    }
+  }
+
+  frame_pacer_.AdvanceValue();
+  frame.frame_ready_value = frame_ready_value;
+  frame.gpu_timings_pending = true;
+  frame.shadow_gpu_timings_pending = submit_shadow_pass;
+  if (submit_shadow_pass)
+    shadow_pass_frame_value_ = frame_ready_value;
+  frame.readback_pending = options_.headless;
+  image_rendered_values_[image_index] = frame_ready_value;
+
+  if (options_.headless) {
+    current_frame_ = (current_frame_ + 1) % frames_in_flight_;
+    return true;
   }
 
   VkSemaphore present_wait_semaphores[] = {
-    render_complete_semaphores_[current_frame_]
+    frame.render_complete_semaphore
   };
 
   VkSwapchainKHR swap_chains[] = { swap_chain_ };
@@ -2074,7 +5323,10 @@ bool App::DrawFrame() {
   present_info.pSwapchains = &swap_chain_;
   present_info.pImageIndices = &image_index;
 
-  result = vkQueuePresentKHR(present_queue_, &present_info);
+  {
+    utils::ScopedCpuTimer timer(&cpu_profiler_, cpu_phases_.present);
+    result = vkQueuePresentKHR(present_queue_, &present_info);
+  }
 
   if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
       framebuffer_resized_) {
@@ -2086,7 +5338,7 @@ bool App::DrawFrame() {
     return false;
   }
 
-  current_frame_ = (current_frame_ + 1) % kMaxFramesInFlight;
+  current_frame_ = (current_frame_ + 1) % frames_in_flight_;
 
   return true;
 }
@@ -2100,34 +5352,57 @@ bool App::RecreateSwapChain() {
     glfwWaitEvents();
   }
 
-  vkDeviceWaitIdle(device_);
-
-  DestroyDescriptorSets();
+  // Only the resources that depend on the swap chain are rebuilt, so only the
+  // frames that may still be using them have to finish. The shadow pass, the
+  // descriptor sets and the pipelines don't depend on the extent, and the
+  // surface format doesn't change on a resize.
+  if (!frame_pacer_.WaitIdle()) {
+    std::cerr << "Could not wait for frames." << std::endl;
+    return false;
+  }
 
   DestroyCommandBuffers();
 
-  DestroyShadowPassResources();
+  DestroyFramebuffers();
 
-  DestroyScenePassResources();
+  for (const auto& image_view : swap_chain_image_views_) {
+    vkDestroyImageView(device_, image_view, nullptr);
+  }
+  swap_chain_image_views_.clear();
 
-  DestroySwapChain();
+  VkSwapchainKHR old_swap_chain = swap_chain_;
+  swap_chain_ = VK_NULL_HANDLE;
 
-  if (!CreateSwapChain())
-    return false;
+  bool swap_chain_created = CreateSwapChain(old_swap_chain);
 
-  if (!CreateScenePassResources())
+  // The frame pacer only tracks the graphics submissions, so presents of
+  // the old images may still be queued. Resizes are rare enough to stall
+  // for them. The old swap chain is retired even if creating the new one
+  // failed.
+  bool presents_finished = vkQueueWaitIdle(present_queue_) == VK_SUCCESS;
+  vkDestroySwapchainKHR(device_, old_swap_chain, nullptr);
+
+  if (!presents_finished) {
+    std::cerr << "Could not wait for presents." << std::endl;
     return false;
+  }
 
-  if (!CreateShadowPassResources())
+  if (!swap_chain_created)
     return false;
 
-  if (!CreateDescriptorSets())
+  // The cluster tiles are sized from the extent.
+  WriteFragmentShaderUbos();
+
+  if (!CreateFramebuffers())
     return false;
 
   if (!CreateCommandBuffers())
     return false;
 
-  image_rendered_fences_.resize(swap_chain_images_.size(), VK_NULL_HANDLE);
+  if (!RecordSceneCommandBuffers())
+    return false;
+
+  image_rendered_values_.assign(swap_chain_images_.size(), 0);
 
   return true;
 }
\ No newline at end of file
@@ -7,92 +7,541 @@
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include <glm/glm.hpp>
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "utils/bounds.h"
 #include "utils/camera.h"
+#include "utils/cpu_profiler.h"
+#include "utils/file_watcher.h"
+#include "utils/mesh_cache.h"
 #include "utils/model.h"
+#include "utils/thread_pool.h"
+#include "utils/triple_buffer.h"
+#include "utils/vk_allocator.h"
+#include "utils/vk_frame_pacer.h"
+#include "utils/vk_profiler.h"
+#include "utils/vk_upload.h"
+
+enum class LatencyMode {
+  // One frame in flight, and input is sampled only once the previous frame
+  // has finished, just before the camera matrices are written.
+  kLowLatency,
+
+  // AppOptions::frames_in_flight frames are queued up behind each other.
+  kThroughput
+};
+
+enum class ImageOutputFormat {
+  kNone,
+
+  // Tightly packed 8-bit RGBA rows, top row first, with no header.
+  kRaw,
+
+  kPng
+};
+
+struct AppOptions {
+  LatencyMode latency_mode = LatencyMode::kThroughput;
+
+  // Only used in throughput mode. Clamped to [2, App::kMaxFramesInFlight].
+  int frames_in_flight = 3;
+
+  // Falls back to FIFO, which is always supported, if the surface doesn't
+  // support it.
+  VkPresentModeKHR present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+
+  // Prints the GPU pass timings to stdout about once a second.
+  bool print_gpu_timings = false;
+
+  // If set, every GPU pass timing is also written to this CSV file.
+  std::string gpu_timings_csv_path;
+
+  // Renders a fixed camera path instead of taking keyboard input, then exits
+  // and writes a JSON report of the CPU and GPU frame timings.
+  bool benchmark = false;
+
+  // Where the benchmark report goes. Written to stdout if empty.
+  std::string benchmark_report_path;
+
+  // Renders into offscreen images of headless_width x headless_height
+  // instead of a window, so neither a display nor a swap chain is needed.
+  bool headless = false;
+  uint32_t headless_width = 1280;
+  uint32_t headless_height = 720;
+
+  // Number of frames drawn before a headless run exits. Benchmarks have a
+  // fixed length of their own.
+  int headless_frame_count = 300;
+
+  // Headless frames are written to <output_path>_<frame>.raw or .png.
+  ImageOutputFormat output_format = ImageOutputFormat::kNone;
+  std::string output_path = "frame";
+
+  // Copies of the Cornell box laid out on a grid, all drawn with a single
+  // indirect draw. The first copy stays around the light.
+  int instance_count = 1;
+
+  // Shadow quality tier, from 0 (256 x 256 D16 faces, a single compare) to
+  // App::kShadowQualityTierCount - 1 (4096 x 4096 D32 faces, 20 PCF taps).
+  int shadow_quality = 2;
+
+  // When positive, the shadow quality is lowered a tier at a time while the
+  // GPU time of the frames stays over this many milliseconds.
+  double shadow_gpu_budget_ms = 0.0;
+
+  // Point lights, shaded through per-cluster light lists. The first
+  // App::kMaxShadowedLights of them are shadowed lights, one under the ceiling
+  // of each of the first instances, and the rest are scattered through the
+  // instances without shadows.
+  int light_count = 1;
+
+  // Samples per pixel of the scene pass, lowered to the highest count the
+  // device supports. 1 renders straight into the swap chain images.
+  int msaa_sample_count = 4;
+
+  // Renders the scene depth first, so that the shaded pass only runs its
+  // fragment shader once per visible sample.
+  bool depth_prepass = false;
+
+  // Levels of detail drawn per mesh, clamped to [1, App::kMaxLodCount]. The
+  // cull pass picks one per instance and view from how large its error
+  // looks on screen.
+  int lod_count = 4;
+
+  // Watches the compiled shaders and the model files, and rebuilds only the
+  // pipelines or buffers that depend on whichever of them changes.
+  bool hot_reload = false;
+};
 
 class App {
 public:
-  bool Init();
+  static constexpr int kMaxFramesInFlight = 3;
+  static constexpr int kShadowQualityTierCount = 5;
+
+  // Has to match kMaxLodCount in cull.comp.
+  static constexpr int kMaxLodCount = 4;
+
+  // Each shadowed light has its own cubemap in the shadow cubemap array. Has
+  // to match kMaxShadowedLights in shadow_multiview.vert.
+  static constexpr int kMaxShadowedLights = 4;
+
+  bool Init(const AppOptions& options = AppOptions());
   void Destroy();
 
-  void MainLoop();
+  // Returns false if drawing failed, or if a benchmark didn't run to
+  // completion or its report couldn't be written.
+  bool MainLoop();
 
 private:
   static void GlfwFramebufferResized(GLFWwindow* window, int width, int height);
   static void GlfwKeyCallback(GLFWwindow* window, int key, int scancode,
                               int action, int mods);
 
+  bool LoadSceneGeometry();
+
   bool InitInstanceAndSurface();
   bool ChoosePhysicalDevice();
   bool CreateDevice();
-  bool CreateSwapChain();
+  void AddCpuPhases();
+  bool CreateGpuProfiler();
+  // Passing the current swap chain as `old_swap_chain` lets the presentation
+  // engine hand its resources over to the new one.
+  bool CreateSwapChain(VkSwapchainKHR old_swap_chain = VK_NULL_HANDLE);
+
+  // Headless replacement for the swap chain. Fills in the same swap_chain_*
+  // members, with one image per frame in flight.
+  bool CreateOffscreenImages();
+  bool CreateReadbackBuffers();
 
   bool CreateScenePassResources();
 
+  // Compiles the scene and shadow pipelines on the thread pool. Needs both
+  // render passes.
+  bool CreatePipelines();
+
   bool CreateRenderPass();
-  bool CreatePipeline();
+
+  // The layouts outlive the pipelines when the shaders are reloaded, see
+  // StartPipelineReload().
+  bool CreatePipelineLayout();
+  bool CreatePipeline(VkPipeline* pipeline,
+                      VkPipeline* depth_prepass_pipeline);
   bool CreateFramebuffers();
 
+  // The multisampled colour attachment. Not needed without MSAA.
+  bool CreateColorImage();
+
+  bool CreateCullPipelineLayout();
+  bool CreateCullPipeline(VkPipeline* pipeline);
+  bool CreateClusterPipelineLayout();
+  bool CreateClusterPipeline(VkPipeline* pipeline);
+
   bool CreateShadowPassResources();
 
+  // Sets the cubemap size, format and PCF taps to those of `tier`.
+  void SelectShadowQualityTier(int tier);
+
   bool CreateShadowRenderPass();
-  bool CreateShadowPipeline();
+
+  // The layout doesn't depend on the quality tier, so it outlives the
+  // pipeline when the tier changes.
+  bool CreateShadowPipelineLayout();
+  bool CreateShadowPipeline(VkPipeline* pipeline);
   bool CreateShadowFramebuffers();
+  bool CreateShadowTextureSampler();
 
   bool CreateCommandPool();
   bool CreateCommandBuffers();
+  bool CreateShadowCommandBuffer();
+
+  // Creates the secondary command buffers the render passes are recorded
+  // into, each with its own pool so that they can be recorded in parallel.
+  bool CreateRecordingJobCommandBuffers();
 
   bool CreateDescriptorSets();
+  bool CreateShadowDescriptorSet();
+  bool CreateCullDescriptorSet();
+  bool CreateClusterDescriptorSet();
+  void UpdateShadowTextureDescriptors();
+
+  // Points binding 5 of every frame's descriptor set at material_buffer_.
+  void UpdateMaterialDescriptors();
+  void WriteFragmentShaderUbos();
+  void UpdateShadowMatrices();
+
+  // How many shadow render passes, framebuffers and cull views each shadowed
+  // light takes: one per face, or a single multiview one.
+  int GetShadowPassesPerLight() const;
   void UpdateScenePassMatrices(int frame_index);
 
   bool CreateVertexBuffers();
 
-  bool RecordCommandBuffer(int frame_index);
-  void TransitionShadowTextureForShadowPass(VkCommandBuffer command_buffer,
-                                            int frame_index);
-  void RecordShadowPassCommands(VkCommandBuffer command_buffer,
-                                int frame_index);
-  void TransitionShadowTextureForScenePass(VkCommandBuffer command_buffer,
-                                           int frame_index);
-  void RecordScenePassCommands(VkCommandBuffer command_buffer, int frame_index);
+  // Uploads the per-instance transforms and the indirect draw list. Needs the
+  // index count from CreateVertexBuffers().
+  bool CreateDrawBuffers();
+
+  // Queues the upload of the indirect draw list, which names index_count_.
+  // The caller waits for it.
+  bool UploadDrawCommands();
+
+  // Uploads the material table, which every frame shares.
+  bool CreateMaterialBuffer();
+
+  // Uploads the lights and creates the cluster buffer they are sorted into.
+  // Needs the instance count from CreateDrawBuffers().
+  bool CreateLightBuffers();
+  void BindVertexBuffers(VkCommandBuffer command_buffer, bool positions_only);
+
+  bool RecordStaticCommandBuffers();
+  bool RecordSceneCommandBuffers();
+  bool RecordShadowCommandBuffer();
+  bool RecordCommandBuffer(VkCommandBuffer command_buffer, int frame_index,
+                           uint32_t image_index);
+  void TransitionShadowTextureForShadowPass(VkCommandBuffer command_buffer);
+  void RecordShadowPassCommands(VkCommandBuffer command_buffer);
+
+  // Records the draws of the shadow render pass with the given framebuffer.
+  // Safe to run on the thread pool alongside the other recording jobs.
+  bool RecordShadowPassJob(int framebuffer_index);
+
+  // Culls the instances against `view_slot_count` consecutive cull views and
+  // fills in their indirect draws. Has to be outside of a render pass.
+  void RecordCullCommands(VkCommandBuffer command_buffer, int first_view_slot,
+                          int view_slot_count);
+
+  // Draws the instances the cull pass left in `view_slot`, one draw per LOD.
+  void RecordIndirectDraws(VkCommandBuffer command_buffer, int view_slot);
+
+  // Fills in the frame's light lists from its camera. Has to be outside of a
+  // render pass.
+  void RecordClusterCommands(VkCommandBuffer command_buffer, int frame_index);
+  void TransitionShadowTextureForScenePass(VkCommandBuffer command_buffer);
+  void RecordScenePassCommands(VkCommandBuffer command_buffer, int frame_index,
+                               uint32_t image_index);
+
+  // Records the frame's scene pass draws. Needs to be re-run when the extent
+  // changes, since the viewport is recorded into it.
+  bool RecordScenePassJob(int frame_index);
+  void RecordReadbackCommands(VkCommandBuffer command_buffer, int frame_index,
+                              uint32_t image_index);
+  VkCommandBuffer GetSceneCommandBuffer(int frame_index, uint32_t image_index);
 
   bool CreateSyncObjects();
 
-  void UploadDataToBuffer(void* data, VkDeviceSize size, VkBuffer buffer);
-
   void DestroyVertexBuffers();
+  void DestroyDrawBuffers();
+  void DestroyMaterialBuffer();
+  void DestroyLightBuffers();
+  void DestroyCullPipeline();
+  void DestroyClusterPipeline();
   void DestroyDescriptorSets();
   void DestroyCommandBuffers();
   void DestroyCommandPool();
+  void DestroyRecordingJobCommandBuffers();
   void DestroyShadowPassResources();
+  void DestroyShadowFramebuffers();
+  void DestroyFramebuffers();
   void DestroyScenePassResources();
   void DestroySwapChain();
+  void DestroyOffscreenImages();
+  void DestroyReadbackBuffers();
+
+  // Polls window events. Unless the simulation thread is running, also
+  // advances the camera by the time since the last call and publishes it.
+  void SampleInput();
+
+  // The camera is only stepped on its own thread when it follows the
+  // keyboard. The benchmark path and headless runs step it once per frame.
+  bool UsesSimulationThread() const {
+    return !options_.headless && !options_.benchmark;
+  }
+
+  void StartSimulationThread();
+  void StopSimulationThread();
+
+  // Steps the camera at a fixed rate until StopSimulationThread().
+  void SimulationLoop();
+
+  // Copies the camera state into the next simulation snapshot.
+  void PublishSimulationSnapshot();
+
+  // Steps the camera along the benchmark path up to the next frame.
+  void AdvanceBenchmarkCamera();
+
+  // Clears the timings of the warm-up frames once they are done. Returns
+  // false once the whole camera path has been drawn.
+  bool ContinueBenchmark();
+  bool WriteBenchmarkReport();
+
+  void CollectGpuTimings(int frame_index);
+
+  // Requests a lower shadow quality tier once the GPU time of enough
+  // consecutive frames has gone over budget.
+  void UpdateAdaptiveShadowQuality(double gpu_milliseconds);
+
+  // Waits for the GPU and rebuilds the cubemap and everything that refers to
+  // it for `tier`.
+  bool ChangeShadowQualityTier(int tier);
+
+  void WatchReloadableFiles();
+
+  // Swaps in whatever a finished reload built, and every
+  // kHotReloadPollInterval starts reloading whatever depends on the watched
+  // files that changed. Only fails if the app can't carry on.
+  bool PollHotReload();
+
+  // Builds the pipelines named by `reload_flags` on the thread pool into
+  // reloaded_pipelines_. The old ones keep drawing in the meantime.
+  void StartPipelineReload(uint32_t reload_flags);
+
+  // Waits for the frames in flight, then swaps the new pipelines in and
+  // re-records the command buffers. Keeps the old ones if any of the new
+  // ones failed to build.
+  bool FinishPipelineReload();
+
+  // Parses the model files on the thread pool into reloaded_model_.
+  void StartGeometryReload();
+
+  // Waits for the frames in flight, then re-uploads the vertex, index, draw
+  // and material buffers from the new model.
+  bool FinishGeometryReload();
+
+  void DestroyReloadedPipelines();
+
+  // Hands the frame's readback buffer to the thread pool to be written out,
+  // if the frame has rendered since it was last written.
+  bool WriteReadbackImage(int frame_index);
+
+  // Waits for the oldest image writes until at most `max_pending` are left.
+  bool WaitForImageWrites(size_t max_pending);
+
+  uint64_t GetSubmittedFrameCount() const {
+    return frame_pacer_.GetNextValue() - 1;
+  }
 
   bool DrawFrame();
 
   bool RecreateSwapChain();
 
+  // Also read by cluster.comp, which needs the view matrix on its own.
   struct VertexShaderUbo {
+    glm::mat4 view_proj_mat;
+    glm::mat4 view_mat;
+  };
+
+  // Matches the std140 layout in shader.frag. The materials and lights are in
+  // material_buffer_ and light_buffer_, shared by every frame.
+  struct FragmentShaderUbo {
+    // Turns a fragment's coordinates and the log of its view depth into its
+    // cluster, see WriteFragmentShaderUbos().
+    glm::vec4 cluster_scale;
+
+    float shadow_near_plane;
+    float shadow_far_plane;
+    int32_t pcf_tap_count;
+
+    // How far the outer PCF taps are from the sample direction, in cubemap
+    // coordinates.
+    float pcf_radius;
+  };
+
+  // Element of the instance storage buffer both passes index with
+  // gl_InstanceIndex.
+  struct InstanceData {
     glm::mat4 model_mat;
-    glm::mat4 mvp_mat;
   };
 
+  // Element of the material storage buffer, indexed by the vertex's material
+  // index. Matches the std430 layout in shader.frag.
+  struct MaterialData {
+    glm::vec4 ambient_color;
+    glm::vec4 diffuse_color;
+
+    // Reserved for an index into a descriptor-indexed texture array. -1
+    // means untextured, which is all there is so far.
+    int32_t diffuse_texture_index = -1;
+    uint32_t padding[3] = {};
+  };
+
+  // Element of the light storage buffer. Matches the std430 layout in
+  // cluster.comp and shader.frag.
+  struct LightData {
+    // World space position, and the distance at which the light fades out.
+    glm::vec4 position_radius;
+    glm::vec4 color;
+
+    // Index of the light's cubemap in the shadow cubemap array, or -1 for
+    // none.
+    int32_t shadow_index = -1;
+    uint32_t padding[3] = {};
+  };
+
+  // The face matrices of every shadowed light, six per light.
+  struct ShadowShaderUbo {
+    glm::mat4 shadow_mats[6 * kMaxShadowedLights];
+  };
+
+  // Everything that a frame in flight writes to or waits on. Frames are only
+  // ever looked up by their slot, current_frame_. The swap chain image index
+  // only picks the framebuffer, so adding swap chain images doesn't add any
+  // per-frame memory.
+  struct FrameContext {
+    // One, or one per swap chain image when the scene pass is pre-recorded,
+    // since a recorded render pass names its framebuffer.
+    std::vector<VkCommandBuffer> command_buffers;
+
+    // Secondary buffers with the scene render pass contents, executed by the
+    // primaries above. The depth pre-pass one is only recorded with
+    // AppOptions::depth_prepass.
+    VkCommandPool scene_pass_command_pool = VK_NULL_HANDLE;
+    VkCommandBuffer scene_pass_command_buffer;
+    VkCommandBuffer depth_prepass_command_buffer;
+
+    VkDescriptorSet descriptor_set;
+
+    // The frame's slot in the vertex UBO ring, passed as the dynamic offset.
+    uint32_t vert_ubo_offset = 0;
+    VertexShaderUbo* vert_ubo = nullptr;
+
+    VkBuffer frag_ubo_buffer;
+    utils::vk::Allocation frag_ubo_buffer_allocation;
+
+    VkSemaphore image_ready_semaphore;
+    VkSemaphore render_complete_semaphore;
+
+    // The frame pacer value signalled by the frame's last submission.
+    uint64_t frame_ready_value = 0;
+
+    // Whether the GPU timings of the frame's last submission, and of the
+    // shadow pass if it was part of it, still have to be collected.
+    bool gpu_timings_pending = false;
+    bool shadow_gpu_timings_pending = false;
+
+    // Headless only. Host visible buffer the rendered image is copied into.
+    VkBuffer readback_buffer = VK_NULL_HANDLE;
+    utils::vk::Allocation readback_buffer_allocation;
+    bool readback_pending = false;
+  };
+
+  AppOptions options_;
+
+  // Only the first frames_in_flight_ entries of frames_ are used.
+  int frames_in_flight_ = kMaxFramesInFlight;
+
   int current_frame_ = 0;
   double current_frame_time_ = 0.0;
 
+  // Only touched by the thread that publishes the simulation snapshots.
   utils::Camera camera_;
   utils::Model model_;
 
-  glm::mat4 model_mat_;
+  // What the render thread needs of the simulation state. The lights don't
+  // move, so they stay in shadow_light_positions_ and light_buffer_.
+  struct SimulationSnapshot {
+    glm::mat4 view_mat = glm::mat4(1.f);
+  };
+
+  // Written by the simulation thread, or by the render thread when there is
+  // none, and read in UpdateScenePassMatrices().
+  utils::TripleBuffer<SimulationSnapshot> simulation_snapshots_;
+
+  std::thread simulation_thread_;
+  std::atomic<bool> simulation_stopping_ = false;
+
+  // Bit N is set while the key for utils::Camera::Direction N is held. Set by
+  // the key callback and turned into camera movement by the simulation.
+  std::atomic<uint32_t> held_directions_ = 0;
+
+  // Only open from start-up until the vertex buffers have been uploaded.
+  // While it is open, model_ holds nothing but the materials.
+  utils::MeshCache mesh_cache_;
+
+  // Where each shadowed light is, indexed by its shadow_index.
+  std::vector<glm::vec3> shadow_light_positions_;
+
+  // The six face matrices of each shadowed light in turn.
   std::vector<glm::mat4> shadow_mats_;
 
+  // Set whenever the light, the instances or the geometry changes. The
+  // shadow cubemap is only re-rendered when this is set.
+  bool shadow_map_dirty_ = true;
+
+  // Timeline value of the last frame that submitted the shadow pass. Its
+  // queries share one profiler slot, so only that frame can collect them.
+  uint64_t shadow_pass_frame_value_ = 0;
+
+  // The shadow quality tier in use, and what it resolved to on this device.
+  int shadow_quality_tier_ = 0;
+  uint32_t shadow_texture_size_ = 0;
+  VkFormat shadow_depth_format_ = VK_FORMAT_UNDEFINED;
+  int shadow_pcf_tap_count_ = 1;
+
+  // Set by UpdateAdaptiveShadowQuality() and applied by MainLoop() between
+  // frames.
+  int requested_shadow_quality_tier_ = 0;
+
+  // Consecutive frames over AppOptions::shadow_gpu_budget_ms.
+  int shadow_over_budget_frame_count_ = 0;
+
   uint32_t graphics_queue_index_;
   uint32_t present_queue_index_;
+  uint32_t transfer_queue_index_;
 
   VkSampleCountFlagBits msaa_sample_count_ = VK_SAMPLE_COUNT_1_BIT;
 
+  // The shaded subpass of render_pass_, which follows the depth pre-pass
+  // when there is one.
+  uint32_t scene_subpass_ = 0;
+
+  bool use_multiview_shadow_pass_ = false;
+  bool supports_multi_draw_indirect_ = false;
+
   bool framebuffer_resized_ = false;
 
   GLFWwindow* window_;
@@ -104,6 +553,53 @@ private:
   VkDevice device_;
   VkQueue graphics_queue_;
   VkQueue present_queue_;
+  VkQueue transfer_queue_;
+
+  utils::vk::MemoryAllocator allocator_;
+  utils::vk::UploadManager upload_manager_;
+
+  VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
+
+  utils::ThreadPool thread_pool_;
+
+  utils::vk::FramePacer frame_pacer_;
+
+  // Has a slot per frame in flight, plus one for the shadow command buffer.
+  utils::vk::GpuProfiler gpu_profiler_;
+  int shadow_to_attachment_scope_;
+  std::vector<int> shadow_face_scopes_;
+  int shadow_to_sampled_scope_;
+  int scene_pass_scope_;
+  int scene_cull_scope_;
+  int scene_clusters_scope_;
+  int shadow_cull_scope_;
+  int readback_scope_;
+  double last_gpu_timings_print_time_ = 0.0;
+
+  utils::CpuProfiler cpu_profiler_;
+
+  // Indices of the CPU profiler phases of a frame.
+  struct CpuPhases {
+    int frame;
+    int sample_input;
+    int wait_frame;
+    int acquire;
+    int wait_image;
+    int update_ubo;
+    int record;
+    int submit;
+    int present;
+  };
+
+  CpuPhases cpu_phases_;
+
+  // The number of frames the benchmark camera has been stepped for.
+  int benchmark_camera_frame_ = 0;
+
+  bool benchmark_started_ = false;
+  bool benchmark_finished_ = false;
+  double benchmark_start_time_ = 0.0;
+  double benchmark_end_time_ = 0.0;
 
   VkSwapchainKHR swap_chain_;
   std::vector<VkImage> swap_chain_images_;
@@ -111,15 +607,29 @@ private:
   VkExtent2D swap_chain_extent_;
   std::vector<VkImageView> swap_chain_image_views_;
 
+  // Only used in headless mode, where the swap_chain_* members describe the
+  // offscreen images.
+  std::vector<utils::vk::Allocation> offscreen_image_allocations_;
+
+  // Image files still being written on the thread pool, oldest first.
+  std::deque<std::future<bool>> pending_image_writes_;
+
   VkRenderPass render_pass_;
   VkDescriptorSetLayout descriptor_set_layout_;
   VkPipelineLayout pipeline_layout_;
   VkPipeline pipeline_;
+
+  // Writes depth only, in the subpass before scene_subpass_. Only created
+  // with AppOptions::depth_prepass.
+  VkPipeline depth_prepass_pipeline_ = VK_NULL_HANDLE;
+
+  // Not created without MSAA, since the pass then renders straight into the
+  // swap chain images.
   VkImage color_image_;
-  VkDeviceMemory color_image_memory_;
+  utils::vk::Allocation color_image_allocation_;
   VkImageView color_image_view_;
   VkImage depth_image_;
-  VkDeviceMemory depth_image_memory_;
+  utils::vk::Allocation depth_image_allocation_;
   VkImageView depth_image_view_;
   std::vector<VkFramebuffer> swap_chain_framebuffers_;
 
@@ -127,42 +637,134 @@ private:
   VkDescriptorSetLayout shadow_descriptor_layout_;
   VkPipelineLayout shadow_pipeline_layout_;
   VkPipeline shadow_pipeline_;
+  VkDescriptorSet shadow_descriptor_set_;
+  VkBuffer shadow_ubo_buffer_;
+  utils::vk::Allocation shadow_ubo_buffer_allocation_;
 
-  struct ShadowPassFrameResource {
+  struct ShadowMapResource {
     VkImage shadow_texture;
-    VkDeviceMemory shadow_texture_memory;
+    utils::vk::Allocation shadow_texture_allocation;
     std::vector<VkImageView> depth_framebuffer_views;
     std::vector<VkFramebuffer> depth_framebuffers;
     VkImageView shadow_texture_view;
   };
 
-  std::vector<ShadowPassFrameResource> shadow_frame_resources_;
+  ShadowMapResource shadow_map_;
+
+  FrameContext frames_[kMaxFramesInFlight];
 
   VkCommandPool command_pool_;
-  std::vector<VkCommandBuffer> command_buffers_;
+  VkCommandBuffer shadow_command_buffer_;
+
+  // One secondary buffer per shadow framebuffer, each with its own pool.
+  std::vector<VkCommandPool> shadow_pass_command_pools_;
+  std::vector<VkCommandBuffer> shadow_pass_command_buffers_;
   VkDescriptorPool descriptor_pool_;
-  std::vector<VkDescriptorSet> descriptor_sets_;
 
-  std::vector<VkBuffer> vert_ubo_buffers_;
-  std::vector<VkDeviceMemory> vert_ubo_buffers_memory_;
-  std::vector<VkBuffer> frag_ubo_buffers_;
-  std::vector<VkDeviceMemory> frag_ubo_buffers_memory_;
+  // Persistently mapped ring with one VertexShaderUbo slot per frame in
+  // flight, see FrameContext::vert_ubo_offset.
+  VkBuffer vert_ubo_buffer_;
+  utils::vk::Allocation vert_ubo_buffer_allocation_;
 
   VkSampler shadow_texture_sampler_;
 
+  // Only used with the packed vertex layout. The other three vertex buffers
+  // are only used without it.
+  VkBuffer vertex_buffer_;
+  utils::vk::Allocation vertex_buffer_allocation_;
   VkBuffer position_buffer_;
-  VkDeviceMemory position_buffer_memory_;
+  utils::vk::Allocation position_buffer_allocation_;
   VkBuffer normal_buffer_;
-  VkDeviceMemory normal_buffer_memory_;
+  utils::vk::Allocation normal_buffer_allocation_;
   VkBuffer material_idx_buffer_;
-  VkDeviceMemory material_idx_buffer_memory_;
+  utils::vk::Allocation material_idx_buffer_allocation_;
   VkBuffer index_buffer_;
-  VkDeviceMemory index_buffer_memory_;
+  utils::vk::Allocation index_buffer_allocation_;
+  VkIndexType index_type_ = VK_INDEX_TYPE_UINT16;
+  uint32_t index_count_ = 0;
+
+  // The LODs in index_buffer_, finest first. Always has at least one.
+  std::vector<utils::MeshLod> mesh_lods_;
+
+  // Device local and written once at start-up. The draw list holds one
+  // VkDrawIndexedIndirectCommand per mesh, so the cost of recording a pass
+  // doesn't depend on how many instances there are.
+  VkBuffer instance_buffer_;
+  utils::vk::Allocation instance_buffer_allocation_;
+  uint32_t instance_count_ = 0;
+  utils::BoundingSphere mesh_bounds_;
+
+  // Every pass draws from its own cull view slot, which has a view
+  // projection matrix in cull_view_buffer_, kMaxLodCount commands in
+  // draw_buffer_ of which the first draw_count_ (one per LOD) are used, and
+  // a range of instance_count_ entries per command in
+  // visible_instance_buffer_. The cull pass writes the visible instances and
+  // their count into the command of the LOD it picked, and the vertex
+  // shaders look the instances up through the visible list. Each frame in
+  // flight has a slot for the scene pass, and the shadow views follow.
+  VkBuffer draw_buffer_;
+  utils::vk::Allocation draw_buffer_allocation_;
+  uint32_t draw_count_ = 0;
+  // Device local and shared by every frame.
+  VkBuffer material_buffer_;
+  utils::vk::Allocation material_buffer_allocation_;
+
+  VkBuffer visible_instance_buffer_;
+  utils::vk::Allocation visible_instance_buffer_allocation_;
+  VkBuffer cull_view_buffer_;
+  utils::vk::Allocation cull_view_buffer_allocation_;
+  glm::mat4* cull_view_mats_ = nullptr;
+
+  VkDescriptorSetLayout cull_descriptor_layout_;
+  VkPipelineLayout cull_pipeline_layout_;
+  VkPipeline cull_pipeline_;
+  VkDescriptorSet cull_descriptor_set_;
+
+  // Device local and shared by every frame.
+  VkBuffer light_buffer_;
+  utils::vk::Allocation light_buffer_allocation_;
+  uint32_t light_count_ = 0;
+
+  // Device local, with a range per frame in flight that cluster.comp writes
+  // and the scene pass reads. A range holds the light count of every cluster
+  // followed by kMaxLightsPerCluster light indices for each of them.
+  VkBuffer cluster_buffer_;
+  utils::vk::Allocation cluster_buffer_allocation_;
+  VkDeviceSize cluster_buffer_range_ = 0;
+  VkDeviceSize cluster_buffer_stride_ = 0;
+
+  VkDescriptorSetLayout cluster_descriptor_layout_;
+  VkPipelineLayout cluster_pipeline_layout_;
+  VkPipeline cluster_pipeline_;
+  VkDescriptorSet cluster_descriptor_set_;
+
+  // The frame pacer value of whichever frame last rendered to each swap chain
+  // image.
+  std::vector<uint64_t> image_rendered_values_;
+
+  // Only used with AppOptions::hot_reload. watched_file_reload_flags_ says
+  // what to rebuild for each file, by its file_watcher_ index.
+  utils::FileWatcher file_watcher_;
+  std::vector<uint32_t> watched_file_reload_flags_;
+  std::vector<int> changed_files_;
+  double last_file_poll_time_ = 0.0;
+
+  // Built by the reload job and swapped with the ones in use once it is done.
+  // Only the pipelines in reload_flags are set.
+  struct ReloadedPipelines {
+    uint32_t reload_flags = 0;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkPipeline depth_prepass_pipeline = VK_NULL_HANDLE;
+    VkPipeline shadow_pipeline = VK_NULL_HANDLE;
+    VkPipeline cull_pipeline = VK_NULL_HANDLE;
+    VkPipeline cluster_pipeline = VK_NULL_HANDLE;
+  };
 
-  std::vector<VkSemaphore> image_ready_semaphores_;
-  std::vector<VkSemaphore> render_complete_semaphores_;
-  std::vector<VkFence> frame_ready_fences_;
-  std::vector<VkFence> image_rendered_fences_;
+  // Not touched outside of the reload jobs while their futures are pending.
+  ReloadedPipelines reloaded_pipelines_;
+  std::future<bool> pipeline_reload_;
+  utils::Model reloaded_model_;
+  std::future<bool> geometry_reload_;
 };
 
 #endif // POINT_LIGHT_APP_H_
\ No newline at end of file
@@ -0,0 +1,32 @@
+#version 450
+
+// Lays down the scene depth before the shaded pass, which then only runs its
+// fragment shader for the visible surface of each pixel. Only reads the
+// positions, like shadow.vert, but has to compute gl_Position exactly like
+// shader.vert so that the depth matches with an equal test.
+
+layout(location = 0) in vec3 vert_pos;
+
+invariant gl_Position;
+
+layout(binding = 0) uniform UniformBufferObject {
+  mat4 view_proj_mat;
+  mat4 view_mat;
+} ubo;
+
+layout(std430, binding = 3) readonly buffer InstanceBuffer {
+  mat4 model_mats[];
+} instances;
+
+// Indices into the instance buffer of the instances that survived culling
+// for this pass, starting at the draw's firstInstance.
+layout(std430, binding = 4) readonly buffer VisibleInstanceBuffer {
+  uint indices[];
+} visible;
+
+void main() {
+  mat4 model_mat = instances.model_mats[visible.indices[gl_InstanceIndex]];
+
+  vec4 world_pos = model_mat * vec4(vert_pos, 1.0);
+  gl_Position = ubo.view_proj_mat * world_pos;
+}
\ No newline at end of file
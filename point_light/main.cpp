@@ -1,18 +1,171 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include <charconv>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <system_error>
 
 #include "app.h"
 
-int main() {
+namespace {
+
+constexpr char kUsage[] =
+    "Usage: point_light [--latency=low|throughput] [--frames-in-flight=N]\n"
+    "                   [--present-mode=fifo|mailbox|immediate]\n"
+    "                   [--gpu-timings] [--gpu-timings-csv=PATH]\n"
+    "                   [--benchmark] [--benchmark-report=PATH]\n"
+    "                   [--headless] [--size=WxH] [--frames=N]\n"
+    "                   [--output-format=raw|png] [--output=PREFIX]\n"
+    "                   [--instances=N] [--shadow-quality=0-4]\n"
+    "                   [--shadow-budget=MS] [--lights=N]\n"
+    "                   [--msaa=1|2|4|8|16|32|64] [--depth-prepass]\n"
+    "                   [--hot-reload] [--lods=1-4]";
+
+// Strips `prefix` off the front of `arg`. Leaves `arg` alone and returns false
+// if it doesn't start with `prefix`.
+bool ConsumePrefix(std::string_view prefix, std::string_view* arg) {
+  if (arg->substr(0, prefix.size()) != prefix)
+    return false;
+
+  arg->remove_prefix(prefix.size());
+  return true;
+}
+
+// Fails unless all of `arg` is a number.
+template<typename T>
+bool ParseNumber(std::string_view arg, T* value) {
+  auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(),
+                                      *value);
+  return error == std::errc() && end == arg.data() + arg.size();
+}
+
+bool ParseOptions(int argc, char** argv, AppOptions* options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+
+    if (ConsumePrefix("--latency=", &arg)) {
+      if (arg == "low") {
+        options->latency_mode = LatencyMode::kLowLatency;
+      } else if (arg == "throughput") {
+        options->latency_mode = LatencyMode::kThroughput;
+      } else {
+        return false;
+      }
+    } else if (ConsumePrefix("--frames-in-flight=", &arg)) {
+      if (!ParseNumber(arg, &options->frames_in_flight))
+        return false;
+    } else if (ConsumePrefix("--present-mode=", &arg)) {
+      if (arg == "fifo") {
+        options->present_mode = VK_PRESENT_MODE_FIFO_KHR;
+      } else if (arg == "mailbox") {
+        options->present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+      } else if (arg == "immediate") {
+        options->present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+      } else {
+        return false;
+      }
+    } else if (arg == "--gpu-timings") {
+      options->print_gpu_timings = true;
+    } else if (ConsumePrefix("--gpu-timings-csv=", &arg)) {
+      if (arg.empty())
+        return false;
+      options->gpu_timings_csv_path = std::string(arg);
+    } else if (arg == "--benchmark") {
+      options->benchmark = true;
+    } else if (ConsumePrefix("--benchmark-report=", &arg)) {
+      if (arg.empty())
+        return false;
+      options->benchmark = true;
+      options->benchmark_report_path = std::string(arg);
+    } else if (arg == "--headless") {
+      options->headless = true;
+    } else if (ConsumePrefix("--size=", &arg)) {
+      size_t separator = arg.find('x');
+      if (separator == std::string_view::npos ||
+          !ParseNumber(arg.substr(0, separator), &options->headless_width) ||
+          !ParseNumber(arg.substr(separator + 1), &options->headless_height) ||
+          options->headless_width == 0 || options->headless_height == 0) {
+        return false;
+      }
+    } else if (ConsumePrefix("--frames=", &arg)) {
+      if (!ParseNumber(arg, &options->headless_frame_count) ||
+          options->headless_frame_count <= 0) {
+        return false;
+      }
+    } else if (ConsumePrefix("--output-format=", &arg)) {
+      if (arg == "raw") {
+        options->output_format = ImageOutputFormat::kRaw;
+      } else if (arg == "png") {
+        options->output_format = ImageOutputFormat::kPng;
+      } else {
+        return false;
+      }
+    } else if (ConsumePrefix("--output=", &arg)) {
+      if (arg.empty())
+        return false;
+      options->output_path = std::string(arg);
+    } else if (ConsumePrefix("--instances=", &arg)) {
+      if (!ParseNumber(arg, &options->instance_count) ||
+          options->instance_count <= 0) {
+        return false;
+      }
+    } else if (ConsumePrefix("--shadow-quality=", &arg)) {
+      if (!ParseNumber(arg, &options->shadow_quality) ||
+          options->shadow_quality < 0 ||
+          options->shadow_quality >= App::kShadowQualityTierCount) {
+        return false;
+      }
+    } else if (ConsumePrefix("--shadow-budget=", &arg)) {
+      if (!ParseNumber(arg, &options->shadow_gpu_budget_ms) ||
+          options->shadow_gpu_budget_ms <= 0.0) {
+        return false;
+      }
+    } else if (ConsumePrefix("--lights=", &arg)) {
+      if (!ParseNumber(arg, &options->light_count) ||
+          options->light_count <= 0) {
+        return false;
+      }
+    } else if (ConsumePrefix("--msaa=", &arg)) {
+      // Sample counts are powers of two.
+      if (!ParseNumber(arg, &options->msaa_sample_count) ||
+          options->msaa_sample_count <= 0 || options->msaa_sample_count > 64 ||
+          (options->msaa_sample_count & (options->msaa_sample_count - 1))) {
+        return false;
+      }
+    } else if (arg == "--depth-prepass") {
+      options->depth_prepass = true;
+    } else if (arg == "--hot-reload") {
+      options->hot_reload = true;
+    } else if (ConsumePrefix("--lods=", &arg)) {
+      if (!ParseNumber(arg, &options->lod_count) || options->lod_count <= 0 ||
+          options->lod_count > App::kMaxLodCount) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  AppOptions options;
+  if (!ParseOptions(argc, argv, &options)) {
+    std::cerr << kUsage << std::endl;
+    return -1;
+  }
+
   App app;
-  if (!app.Init()) {
+  if (!app.Init(options)) {
     std::cerr << "Failed to initialize." << std::endl;
     return -1;
   }
-  app.MainLoop();
+  bool success = app.MainLoop();
   app.Destroy();
 
-  return 0;
+  return success ? 0 : -1;
 }
\ No newline at end of file
@@ -3,35 +3,85 @@
 layout(location = 0) in vec3 frag_world_pos;
 layout(location = 1) in vec3 frag_normal;
 layout(location = 2) flat in uint frag_mtl_idx;
+layout(location = 3) in float frag_view_depth;
 
 layout(location = 0) out vec4 out_color;
 
+// Nothing here writes depth or has side effects, so the depth test can always
+// reject fragments before they are shaded.
+layout(early_fragment_tests) in;
+
+// Have to match the kCluster* constants in app.cpp and cluster.comp.
+const uint kClusterGridX = 16;
+const uint kClusterGridY = 9;
+const uint kClusterGridZ = 24;
+const uint kClusterCount = kClusterGridX * kClusterGridY * kClusterGridZ;
+const uint kMaxLightsPerCluster = 32;
+
 struct Material {
   vec4 ambient_color;
   vec4 diffuse_color;
+
+  // Not used yet, see App::MaterialData.
+  int diffuse_texture_index;
+};
+
+struct Light {
+  // World space position in xyz and radius of influence in w.
+  vec4 position_radius;
+  vec4 color;
+
+  // The light's cubemap in shadow_tex_sampler, or -1 for lights without a
+  // shadow.
+  int shadow_index;
 };
 
 layout(binding = 1, std140) uniform UniformBufferObject {
-  vec4 light_pos;
+  // Turns the fragment coordinates into a tile in xy, and the log of the view
+  // depth into a slice with z * log(depth) + w.
+  vec4 cluster_scale;
+
   float shadow_near_plane;
   float shadow_far_plane;
-  vec2 pad;
-  Material materials[20];
-} ubo;
-
-layout(binding = 2) uniform samplerCube shadow_tex_sampler;
 
-void main() {
-  vec3 light_vec = ubo.light_pos.xyz - frag_world_pos;
+  // 1 is a single compare.
+  int pcf_tap_count;
+  float pcf_radius;
+} ubo;
 
+layout(std430, binding = 5) readonly buffer MaterialBuffer {
+  Material materials[];
+} material_buffer;
+
+layout(std430, binding = 6) readonly buffer LightBuffer {
+  Light lights[];
+} light_buffer;
+
+// The frame's range of the buffer written by cluster.comp.
+layout(std430, binding = 7) readonly buffer ClusterBuffer {
+  uint light_counts[kClusterCount];
+  uint light_indices[kClusterCount * kMaxLightsPerCluster];
+} clusters;
+
+// One cubemap per shadowed light.
+layout(binding = 2) uniform samplerCubeArrayShadow shadow_tex_sampler;
+
+const int kMaxPcfTapCount = 20;
+
+// Directions to the corners, edges and faces of a cube. Any prefix of at
+// least four spreads out in every direction.
+const vec3 kPcfOffsets[kMaxPcfTapCount] = vec3[](
+  vec3(1, 1, 1), vec3(1, -1, -1), vec3(-1, 1, -1), vec3(-1, -1, 1),
+  vec3(-1, -1, -1), vec3(-1, 1, 1), vec3(1, -1, 1), vec3(1, 1, -1),
+  vec3(1, 1, 0), vec3(-1, -1, 0), vec3(1, 0, -1), vec3(-1, 0, 1),
+  vec3(0, 1, -1), vec3(0, -1, 1), vec3(1, -1, 0), vec3(-1, 1, 0),
+  vec3(1, 0, 1), vec3(-1, 0, -1), vec3(0, 1, 1), vec3(0, -1, -1));
+
+// Returns 1 where the fragment is lit by the shadowed light at `light_pos`,
+// whose cubemap is `shadow_index`.
+float SampleShadow(vec3 light_pos, int shadow_index) {
+  vec3 light_vec = light_pos - frag_world_pos;
   vec3 l = normalize(light_vec);
-  vec3 n = normalize(frag_normal);
-
-  vec3 ambient = ubo.materials[frag_mtl_idx].ambient_color.rgb;
-  ambient *= 0.3;
-
-  vec3 diffuse = ubo.materials[frag_mtl_idx].diffuse_color.rgb;
-  diffuse *= clamp(dot(l, n), 0, 1);
 
   float near = ubo.shadow_near_plane;
   float far = ubo.shadow_far_plane;
@@ -50,9 +100,71 @@ void main() {
   // Inverts the x coord because cubemaps use left-handed coordinates.
   cubemap_coord.x *= -1;
 
-  float shadow_tex_depth = texture(shadow_tex_sampler, cubemap_coord).r;
+  // The sampler compares `depth` against the stored depth, returning 1 where
+  // the fragment is lit.
+  int tap_count = clamp(ubo.pcf_tap_count, 1, kMaxPcfTapCount);
+  if (tap_count == 1)
+    return texture(shadow_tex_sampler,
+                   vec4(cubemap_coord, float(shadow_index)), depth);
+
+  float no_shadow = 0;
+  for (int i = 0; i < tap_count; ++i) {
+    vec3 coord = cubemap_coord + kPcfOffsets[i] * ubo.pcf_radius;
+    no_shadow += texture(shadow_tex_sampler,
+                         vec4(coord, float(shadow_index)), depth);
+  }
+  return no_shadow / float(tap_count);
+}
+
+// Falls off smoothly to zero at `radius`, which is where the clusters stop
+// counting the light.
+float GetAttenuation(float distance, float radius) {
+  float x = distance / radius;
+  float falloff = clamp(1 - x * x * x * x, 0, 1);
+  return falloff * falloff;
+}
+
+uint GetCluster() {
+  uvec2 tile = uvec2(gl_FragCoord.xy * ubo.cluster_scale.xy);
+  tile = min(tile, uvec2(kClusterGridX - 1, kClusterGridY - 1));
+
+  float slice = log(max(frag_view_depth, 1e-4)) * ubo.cluster_scale.z +
+      ubo.cluster_scale.w;
+  uint z = min(uint(max(slice, 0)), kClusterGridZ - 1);
+
+  return tile.x + kClusterGridX * (tile.y + kClusterGridY * z);
+}
+
+void main() {
+  vec3 n = normalize(frag_normal);
+
+  Material material = material_buffer.materials[frag_mtl_idx];
+
+  vec3 color = material.ambient_color.rgb * 0.3;
+
+  // Only the lights whose radius reaches into the fragment's cluster.
+  uint cluster = GetCluster();
+  uint light_count = clusters.light_counts[cluster];
+  uint first_index = cluster * kMaxLightsPerCluster;
+
+  for (uint i = 0; i < light_count; ++i) {
+    Light light = light_buffer.lights[clusters.light_indices[first_index + i]];
+
+    vec3 light_vec = light.position_radius.xyz - frag_world_pos;
+    float distance = length(light_vec);
+    float attenuation = GetAttenuation(distance, light.position_radius.w);
+    if (attenuation <= 0)
+      continue;
+
+    vec3 l = light_vec / distance;
+    vec3 diffuse = material.diffuse_color.rgb * light.color.rgb;
+    diffuse *= clamp(dot(l, n), 0, 1) * attenuation;
+
+    if (light.shadow_index >= 0)
+      diffuse *= SampleShadow(light.position_radius.xyz, light.shadow_index);
 
-  float no_shadow = clamp(sign(shadow_tex_depth - depth), 0, 1);
+    color += diffuse;
+  }
 
-  out_color = vec4(ambient + no_shadow * diffuse, 1.0);
+  out_color = vec4(color, 1.0);
 }
\ No newline at end of file
@@ -1,22 +1,54 @@
 #version 450
 
+// Set when the vertices use utils::PackedVertex, whose normal is stored as
+// unsigned normalized 10:10:10:2.
+layout(constant_id = 0) const bool kPackedVertices = false;
+
 layout(location = 0) in vec3 vert_pos;
-layout(location = 1) in vec3 vert_normal;
+layout(location = 1) in vec4 vert_normal;
 layout(location = 2) in uint vert_mtl_idx;
 
 layout(location = 0) out vec3 frag_world_pos;
 layout(location = 1) out vec3 frag_normal;
 layout(location = 2) flat out uint frag_mtl_idx;
 
+// Distance in front of the camera, which picks the cluster's depth slice.
+layout(location = 3) out float frag_view_depth;
+
+// The depth has to match depth_prepass.vert exactly for the equal test.
+invariant gl_Position;
+
 layout(binding = 0) uniform UniformBufferObject {
-  mat4 model_mat;
-  mat4 mvp_mat;
+  mat4 view_proj_mat;
+  mat4 view_mat;
 } ubo;
 
+layout(std430, binding = 3) readonly buffer InstanceBuffer {
+  mat4 model_mats[];
+} instances;
+
+// Indices into the instance buffer of the instances that survived culling
+// for this pass, starting at the draw's firstInstance.
+layout(std430, binding = 4) readonly buffer VisibleInstanceBuffer {
+  uint indices[];
+} visible;
+
 void main() {
-  frag_world_pos = (ubo.model_mat * vec4(vert_pos, 1.0)).xyz;
-  frag_normal = vert_normal;
+  mat4 model_mat = instances.model_mats[visible.indices[gl_InstanceIndex]];
+
+  vec4 world_pos = model_mat * vec4(vert_pos, 1.0);
+  frag_world_pos = world_pos.xyz;
+
+  vec3 normal;
+  if (kPackedVertices) {
+    normal = vert_normal.xyz * 2.0 - 1.0;
+  } else {
+    normal = vert_normal.xyz;
+  }
+  // Instances are only translated, so the upper 3x3 is enough.
+  frag_normal = mat3(model_mat) * normal;
   frag_mtl_idx = vert_mtl_idx;
+  frag_view_depth = -(ubo.view_mat * world_pos).z;
 
-  gl_Position = ubo.mvp_mat * vec4(vert_pos, 1.0);
+  gl_Position = ubo.view_proj_mat * world_pos;
 }
\ No newline at end of file
@@ -6,6 +6,17 @@ layout(push_constant) uniform ConstantBlock {
   mat4 shadow_mat;
 } cb;
 
+layout(std430, binding = 1) readonly buffer InstanceBuffer {
+  mat4 model_mats[];
+} instances;
+
+// Indices into the instance buffer of the instances that survived culling
+// for this pass, starting at the draw's firstInstance.
+layout(std430, binding = 2) readonly buffer VisibleInstanceBuffer {
+  uint indices[];
+} visible;
+
 void main() {
-  gl_Position = cb.shadow_mat * vec4(vert_pos, 1.0);
+  mat4 model_mat = instances.model_mats[visible.indices[gl_InstanceIndex]];
+  gl_Position = cb.shadow_mat * model_mat * vec4(vert_pos, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,32 @@
+#version 450
+#extension GL_EXT_multiview : require
+
+layout(location = 0) in vec3 vert_pos;
+
+// Has to match App::kMaxShadowedLights.
+const uint kMaxShadowedLights = 4;
+
+layout(binding = 0) uniform UniformBufferObject {
+  mat4 shadow_mats[6 * kMaxShadowedLights];
+} ubo;
+
+// Index of the first of the six face matrices of the light being rendered.
+layout(push_constant) uniform PushConstants {
+  uint first_shadow_mat;
+} pc;
+
+layout(std430, binding = 1) readonly buffer InstanceBuffer {
+  mat4 model_mats[];
+} instances;
+
+// Indices into the instance buffer of the instances that survived culling
+// for this pass, starting at the draw's firstInstance.
+layout(std430, binding = 2) readonly buffer VisibleInstanceBuffer {
+  uint indices[];
+} visible;
+
+void main() {
+  mat4 model_mat = instances.model_mats[visible.indices[gl_InstanceIndex]];
+  mat4 shadow_mat = ubo.shadow_mats[pc.first_shadow_mat + uint(gl_ViewIndex)];
+  gl_Position = shadow_mat * model_mat * vec4(vert_pos, 1.0);
+}
\ No newline at end of file
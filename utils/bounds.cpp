@@ -0,0 +1,49 @@
+#include "utils/bounds.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace utils {
+
+namespace {
+
+glm::vec3 ReadPosition(const uint8_t* data) {
+  glm::vec3 position;
+  memcpy(&position, data, sizeof(position));
+  return position;
+}
+
+}  // namespace
+
+BoundingSphere ComputeBoundingSphere(const void* positions, size_t count,
+                                     size_t stride) {
+  BoundingSphere sphere;
+  if (count == 0)
+    return sphere;
+
+  auto data = static_cast<const uint8_t*>(positions);
+
+  glm::vec3 min_pos = ReadPosition(data);
+  glm::vec3 max_pos = min_pos;
+  for (size_t i = 1; i < count; ++i) {
+    glm::vec3 position = ReadPosition(data + i * stride);
+    min_pos = glm::min(min_pos, position);
+    max_pos = glm::max(max_pos, position);
+  }
+  sphere.center = (min_pos + max_pos) * 0.5f;
+
+  float radius_squared = 0.f;
+  for (size_t i = 0; i < count; ++i) {
+    glm::vec3 offset = ReadPosition(data + i * stride) - sphere.center;
+    radius_squared = std::max(radius_squared, glm::dot(offset, offset));
+  }
+  sphere.radius = std::sqrt(radius_squared);
+
+  return sphere;
+}
+
+}  // namespace utils
\ No newline at end of file
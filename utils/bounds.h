@@ -0,0 +1,23 @@
+#ifndef UTILS_BOUNDS_H_
+#define UTILS_BOUNDS_H_
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+
+namespace utils {
+
+struct BoundingSphere {
+  glm::vec3 center = glm::vec3(0.f);
+  float radius = 0.f;
+};
+
+// Sphere around the centre of the bounding box of `count` positions, each
+// starting `stride` bytes after the previous one. Not the tightest sphere,
+// but good enough for culling.
+BoundingSphere ComputeBoundingSphere(const void* positions, size_t count,
+                                     size_t stride);
+
+}  // namespace utils
+
+#endif  // UTILS_BOUNDS_H_
\ No newline at end of file
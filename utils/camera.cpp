@@ -5,14 +5,25 @@
 
 namespace utils {
 
+namespace {
+
+int GetIndex(Camera::Direction direction) {
+  return static_cast<int>(direction);
+}
+
+float GetNetSpeed(const float* speeds, Camera::Direction positive,
+                  Camera::Direction negative) {
+  return speeds[GetIndex(positive)] - speeds[GetIndex(negative)];
+}
+
+}  // namespace
+
 void Camera::StartMovement(Direction direction, float speed) {
-  speeds_[direction] = speed;
+  speeds_[GetIndex(direction)] = speed;
 }
 
 void Camera::StopMovement(Direction direction) {
-  auto it = speeds_.find(direction);
-  if (it != speeds_.end())
-    speeds_.erase(it);
+  speeds_[GetIndex(direction)] = 0.f;
 }
 
 void Camera::MoveByIncrement(Direction direction, float increment) {
@@ -48,22 +59,54 @@ void Camera::MoveByIncrement(Direction direction, float increment) {
       yaw_ -= increment;
       break;
   }
+  view_mat_dirty_ = true;
 }
 
 void Camera::SetPosition(glm::vec3 position) {
   position_ = position;
+  view_mat_dirty_ = true;
 }
 
-glm::mat4 Camera::GetViewMat() {
-  return glm::rotate(glm::mat4(1.f), pitch_, glm::vec3(0.f, 0.f, 1.f)) *
-      glm::rotate(glm::mat4(1.f), yaw_, glm::vec3(0.f, 1.f, 0.f)) *
-      glm::translate(glm::mat4(1.f), -position_);
+const glm::mat4& Camera::GetViewMat() const {
+  if (view_mat_dirty_) {
+    // Same as rotate(pitch) * rotate(yaw) * translate(-position), without
+    // building the translation matrix.
+    glm::mat4 rotation =
+        glm::rotate(glm::mat4(1.f), pitch_, glm::vec3(0.f, 0.f, 1.f)) *
+        glm::rotate(glm::mat4(1.f), yaw_, glm::vec3(0.f, 1.f, 0.f));
+
+    view_mat_ = rotation;
+    view_mat_[3] = glm::vec4(-(glm::mat3(rotation) * position_), 1.f);
+    view_mat_dirty_ = false;
+  }
+  return view_mat_;
 }
 
 void Camera::Tick(float time_delta) {
-  for (auto [direction, speed] : speeds_) {
-    if (speed != 0.f)
-      MoveByIncrement(direction, speed * (time_delta / 1000.f));
+  glm::vec3 velocity(
+      GetNetSpeed(speeds_, Direction::kPosX, Direction::kNegX),
+      GetNetSpeed(speeds_, Direction::kPosY, Direction::kNegY),
+      GetNetSpeed(speeds_, Direction::kPosZ, Direction::kNegZ));
+  float pitch_speed =
+      GetNetSpeed(speeds_, Direction::kPosPitch, Direction::kNegPitch);
+  float yaw_speed =
+      GetNetSpeed(speeds_, Direction::kPosYaw, Direction::kNegYaw);
+
+  if (velocity == glm::vec3(0.f) && pitch_speed == 0.f && yaw_speed == 0.f)
+    return;
+
+  float seconds = time_delta / 1000.f;
+  position_ += velocity * seconds;
+  pitch_ += pitch_speed * seconds;
+  yaw_ += yaw_speed * seconds;
+  view_mat_dirty_ = true;
+}
+
+void TickCameras(Camera* cameras, size_t count, float time_delta,
+                 const glm::mat4& proj_mat, glm::mat4* view_proj_mats) {
+  for (size_t i = 0; i < count; ++i) {
+    cameras[i].Tick(time_delta);
+    view_proj_mats[i] = proj_mat * cameras[i].GetViewMat();
   }
 }
 
@@ -3,7 +3,7 @@
 
 #include <glm/glm.hpp>
 
-#include <unordered_map>
+#include <cstddef>
 
 namespace utils {
 
@@ -17,6 +17,8 @@ public:
     kPosYaw, kNegYaw
   };
 
+  static constexpr int kDirectionCount = 10;
+
   // |speed| should be per second.
   void StartMovement(Direction direction, float speed);
   void StopMovement(Direction direction);
@@ -25,20 +27,31 @@ public:
 
   void SetPosition(glm::vec3 position);
 
-  glm::mat4 GetViewMat();
+  // Only rebuilt after the position, pitch or yaw has changed.
+  const glm::mat4& GetViewMat() const;
 
   // |time_delta| should be in milliseconds.
   void Tick(float time_delta);
 
 private:
-  // Speeds are per second.
-  std::unordered_map<Direction, float> speeds_;
+  // Indexed by Direction. Speeds are per second, and zero when the camera
+  // isn't moving in that direction.
+  float speeds_[kDirectionCount] = {};
 
-  glm::vec3 position_;
+  glm::vec3 position_ = glm::vec3(0.f);
   float pitch_ = 0.f;  // in radians.
   float yaw_ = 0.f;  // in radians.
+
+  mutable glm::mat4 view_mat_ = glm::mat4(1.f);
+  mutable bool view_mat_dirty_ = true;
 };
 
+// Ticks |count| cameras by |time_delta| milliseconds and writes
+// |proj_mat| * view matrix of each one to |view_proj_mats|, laid out back to
+// back as a std140/std430 mat4 array expects.
+void TickCameras(Camera* cameras, size_t count, float time_delta,
+                 const glm::mat4& proj_mat, glm::mat4* view_proj_mats);
+
 }  // namespace utils
 
 #endif  // UTILS_CAMERA_H_
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "utils/cpu_profiler.h"
+
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "utils/timing_stats.h"
+
+namespace utils {
+
+int CpuProfiler::AddPhase(const std::string& name) {
+  Phase phase;
+  phase.name = name;
+  phase.history = SampleHistory(history_size_);
+  phases_.push_back(std::move(phase));
+
+  return GetPhaseCount() - 1;
+}
+
+void CpuProfiler::Clear() {
+  for (Phase& phase : phases_) {
+    phase.history.Clear();
+  }
+}
+
+const std::string& CpuProfiler::GetPhaseName(int phase) const {
+  return phases_[phase].name;
+}
+
+TimingStats CpuProfiler::GetStats(int phase) const {
+  return phases_[phase].history.GetStats();
+}
+
+void CpuProfiler::PrintStats(std::ostream& strm) const {
+  for (const Phase& phase : phases_) {
+    TimingStats stats = phase.history.GetStats();
+    if (stats.sample_count == 0)
+      continue;
+
+    strm << "cpu " << phase.name
+         << " samples=" << stats.sample_count
+         << " mean_ms=" << stats.mean_ms
+         << " p50_ms=" << stats.p50_ms
+         << " p95_ms=" << stats.p95_ms
+         << " p99_ms=" << stats.p99_ms
+         << " max_ms=" << stats.max_ms << "\n";
+  }
+  strm.flush();
+}
+
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef UTILS_CPU_PROFILER_H_
+#define UTILS_CPU_PROFILER_H_
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "utils/timing_stats.h"
+
+namespace utils {
+
+// Collects CPU timings of named phases, for example the parts of a frame.
+// Phases are added up front. Recording a sample is a store into a
+// preallocated ring, so timers can stay enabled in release builds.
+class CpuProfiler {
+public:
+  // Number of samples per phase the statistics are computed over.
+  static constexpr int kDefaultHistorySize = 4096;
+
+  explicit CpuProfiler(int history_size = kDefaultHistorySize)
+      : history_size_(history_size) {}
+
+  // Returns the phase's index.
+  int AddPhase(const std::string& name);
+
+  void Record(int phase, double milliseconds) {
+    phases_[phase].history.Add(milliseconds);
+  }
+
+  // Drops every sample recorded so far, for example the warm-up frames.
+  void Clear();
+
+  int GetPhaseCount() const { return static_cast<int>(phases_.size()); }
+  const std::string& GetPhaseName(int phase) const;
+  TimingStats GetStats(int phase) const;
+
+  // One line per phase with samples.
+  void PrintStats(std::ostream& strm) const;
+
+private:
+  struct Phase {
+    std::string name;
+    SampleHistory history;
+  };
+
+  int history_size_;
+  std::vector<Phase> phases_;
+};
+
+// Records the time between its construction and destruction as a sample of
+// `phase`.
+class ScopedCpuTimer {
+public:
+  ScopedCpuTimer(CpuProfiler* profiler, int phase)
+      : profiler_(profiler), phase_(phase),
+        start_(std::chrono::steady_clock::now()) {}
+
+  ~ScopedCpuTimer() {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    profiler_->Record(phase_, elapsed.count());
+  }
+
+  ScopedCpuTimer(const ScopedCpuTimer&) = delete;
+  ScopedCpuTimer& operator=(const ScopedCpuTimer&) = delete;
+
+private:
+  CpuProfiler* profiler_;
+  int phase_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace utils
+
+#endif  // UTILS_CPU_PROFILER_H_
\ No newline at end of file
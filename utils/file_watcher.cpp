@@ -0,0 +1,56 @@
+#include "utils/file_watcher.h"
+
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace utils {
+
+int FileWatcher::AddFile(const std::string& path) {
+  WatchedFile file;
+  file.path = path;
+  file.reported_stamp = GetFileStamp(path);
+  file.last_stamp = file.reported_stamp;
+
+  files_.push_back(file);
+  return static_cast<int>(files_.size() - 1);
+}
+
+void FileWatcher::Poll(std::vector<int>* changed) {
+  changed->clear();
+
+  for (size_t i = 0; i < files_.size(); ++i) {
+    WatchedFile& file = files_[i];
+
+    FileStamp stamp = GetFileStamp(file.path);
+    bool settled = stamp == file.last_stamp;
+    file.last_stamp = stamp;
+
+    if (!settled || !stamp.exists || stamp == file.reported_stamp)
+      continue;
+
+    file.reported_stamp = stamp;
+    changed->push_back(static_cast<int>(i));
+  }
+}
+
+FileWatcher::FileStamp FileWatcher::GetFileStamp(const std::string& path) {
+  FileStamp stamp;
+
+  std::error_code error;
+  uint64_t file_size = std::filesystem::file_size(path, error);
+  if (error)
+    return stamp;
+
+  auto time = std::filesystem::last_write_time(path, error);
+  if (error)
+    return stamp;
+
+  stamp.exists = true;
+  stamp.file_size = file_size;
+  stamp.write_time = static_cast<int64_t>(time.time_since_epoch().count());
+  return stamp;
+}
+
+}  // namespace utils
\ No newline at end of file
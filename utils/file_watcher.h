@@ -0,0 +1,52 @@
+#ifndef UTILS_FILE_WATCHER_H_
+#define UTILS_FILE_WATCHER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace utils {
+
+// Polls a set of files for changes to their size or modification time. A
+// change is only reported once the file has looked the same for two polls in
+// a row, so that files still being written by a compiler or an exporter
+// aren't picked up half way through.
+class FileWatcher {
+public:
+  // Returns the index Poll() reports the file as. The file doesn't have to
+  // exist yet.
+  int AddFile(const std::string& path);
+
+  // Clears `changed` and fills it with the indices of the files that have
+  // changed since they were last reported. Deleted files are not reported.
+  void Poll(std::vector<int>* changed);
+
+  const std::string& GetPath(int index) const { return files_[index].path; }
+
+private:
+  struct FileStamp {
+    bool exists = false;
+    uint64_t file_size = 0;
+    int64_t write_time = 0;
+
+    bool operator==(const FileStamp& other) const {
+      return exists == other.exists && file_size == other.file_size &&
+             write_time == other.write_time;
+    }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+  };
+
+  struct WatchedFile {
+    std::string path;
+    FileStamp reported_stamp;
+    FileStamp last_stamp;
+  };
+
+  static FileStamp GetFileStamp(const std::string& path);
+
+  std::vector<WatchedFile> files_;
+};
+
+}  // namespace utils
+
+#endif  // UTILS_FILE_WATCHER_H_
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include "utils/image_writer.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace utils {
+
+namespace {
+
+constexpr uint8_t kPngSignature[] = {
+  0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a
+};
+
+// Largest block a stored deflate block can hold.
+constexpr size_t kMaxStoredBlockSize = 65535;
+
+class Crc32 {
+public:
+  Crc32() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t value = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        value = (value & 1) ? 0xedb88320u ^ (value >> 1) : value >> 1;
+      }
+      table_[i] = value;
+    }
+  }
+
+  uint32_t Update(uint32_t crc, const uint8_t* data, size_t size) const {
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+      crc = table_[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+private:
+  uint32_t table_[256];
+};
+
+uint32_t UpdateAdler32(uint32_t adler, const uint8_t* data, size_t size) {
+  uint32_t a = adler & 0xffff;
+  uint32_t b = adler >> 16;
+
+  // 5552 is the most bytes that can be summed before `b` may overflow.
+  while (size > 0) {
+    size_t chunk_size = std::min<size_t>(size, 5552);
+    for (size_t i = 0; i < chunk_size; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+
+    data += chunk_size;
+    size -= chunk_size;
+  }
+  return (b << 16) | a;
+}
+
+void AppendUint32(uint32_t value, std::vector<uint8_t>* bytes) {
+  bytes->push_back(static_cast<uint8_t>(value >> 24));
+  bytes->push_back(static_cast<uint8_t>(value >> 16));
+  bytes->push_back(static_cast<uint8_t>(value >> 8));
+  bytes->push_back(static_cast<uint8_t>(value));
+}
+
+void WriteChunk(const char type[4], const std::vector<uint8_t>& data,
+                std::ofstream* strm) {
+  static const Crc32 kCrc32;
+
+  std::vector<uint8_t> header;
+  AppendUint32(static_cast<uint32_t>(data.size()), &header);
+  header.insert(header.end(), type, type + 4);
+
+  uint32_t crc = kCrc32.Update(0, header.data() + 4, 4);
+  crc = kCrc32.Update(crc, data.data(), data.size());
+
+  std::vector<uint8_t> footer;
+  AppendUint32(crc, &footer);
+
+  strm->write(reinterpret_cast<const char*>(header.data()), header.size());
+  strm->write(reinterpret_cast<const char*>(data.data()), data.size());
+  strm->write(reinterpret_cast<const char*>(footer.data()), footer.size());
+}
+
+}  // namespace
+
+bool WritePng(const std::string& path, uint32_t width, uint32_t height,
+              const uint8_t* pixels) {
+  std::ofstream strm(path, std::ios::binary | std::ios::trunc);
+  if (!strm.is_open())
+    return false;
+
+  strm.write(reinterpret_cast<const char*>(kPngSignature),
+             sizeof(kPngSignature));
+
+  std::vector<uint8_t> header;
+  AppendUint32(width, &header);
+  AppendUint32(height, &header);
+  header.push_back(8);  // Bit depth.
+  header.push_back(6);  // RGBA.
+  header.push_back(0);  // Deflate.
+  header.push_back(0);  // Adaptive filtering.
+  header.push_back(0);  // Not interlaced.
+  WriteChunk("IHDR", header, &strm);
+
+  // Every row is prefixed with filter type 0, so the filtered data is just
+  // the rows with one extra byte each.
+  size_t row_size = size_t{width} * 4;
+  std::vector<uint8_t> filtered;
+  filtered.reserve((row_size + 1) * height);
+  for (uint32_t y = 0; y < height; ++y) {
+    filtered.push_back(0);
+    filtered.insert(filtered.end(), pixels + y * row_size,
+                    pixels + (y + 1) * row_size);
+  }
+
+  size_t block_count =
+      std::max<size_t>(1, (filtered.size() + kMaxStoredBlockSize - 1) /
+                              kMaxStoredBlockSize);
+
+  // zlib stream made of stored deflate blocks.
+  std::vector<uint8_t> data;
+  data.reserve(filtered.size() + block_count * 5 + 6);
+  data.push_back(0x78);
+  data.push_back(0x01);
+
+  size_t offset = 0;
+  for (size_t i = 0; i < block_count; ++i) {
+    size_t block_size =
+        std::min(filtered.size() - offset, kMaxStoredBlockSize);
+    uint16_t length = static_cast<uint16_t>(block_size);
+
+    data.push_back(i + 1 == block_count ? 1 : 0);
+    data.push_back(static_cast<uint8_t>(length));
+    data.push_back(static_cast<uint8_t>(length >> 8));
+    data.push_back(static_cast<uint8_t>(~length));
+    data.push_back(static_cast<uint8_t>(~length >> 8));
+    data.insert(data.end(), filtered.begin() + offset,
+                filtered.begin() + offset + block_size);
+
+    offset += block_size;
+  }
+  AppendUint32(UpdateAdler32(1, filtered.data(), filtered.size()), &data);
+
+  WriteChunk("IDAT", data, &strm);
+  WriteChunk("IEND", {}, &strm);
+
+  return static_cast<bool>(strm);
+}
+
+bool WriteRaw(const std::string& path, const uint8_t* data, size_t size) {
+  std::ofstream strm(path, std::ios::binary | std::ios::trunc);
+  if (!strm.is_open())
+    return false;
+
+  strm.write(reinterpret_cast<const char*>(data), size);
+  return static_cast<bool>(strm);
+}
+
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,21 @@
+#ifndef UTILS_IMAGE_WRITER_H_
+#define UTILS_IMAGE_WRITER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace utils {
+
+// Writes tightly packed 8-bit RGBA pixels, top row first, as a PNG file. The
+// image data is stored uncompressed, which makes the files big but keeps
+// writing them about as cheap as writing the raw pixels.
+bool WritePng(const std::string& path, uint32_t width, uint32_t height,
+              const uint8_t* pixels);
+
+// Writes `size` bytes of `data` as they are, with no header.
+bool WriteRaw(const std::string& path, const uint8_t* data, size_t size);
+
+}  // namespace utils
+
+#endif  // UTILS_IMAGE_WRITER_H_
\ No newline at end of file
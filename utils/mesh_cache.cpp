@@ -0,0 +1,391 @@
+#include "utils/mesh_cache.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "utils/model.h"
+
+namespace utils {
+
+namespace {
+
+constexpr char kMagic[8] = { 'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H' };
+
+// Bump whenever the layout of the file or of PackedVertex changes.
+constexpr uint32_t kVersion = 2;
+
+// Every section starts on this boundary, which is enough for any of the
+// element types once the file is mapped at a page boundary.
+constexpr uint64_t kSectionAlignment = 16;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t vertex_size;
+  uint32_t material_size;
+  uint32_t lod_size;
+
+  uint32_t source_count;
+  uint32_t vertex_count;
+  uint32_t index_count;
+  uint32_t index_size;
+  uint32_t material_count;
+  uint32_t lod_count;
+
+  uint64_t sources_offset;
+  uint64_t vertices_offset;
+  uint64_t indices_offset;
+  uint64_t materials_offset;
+  uint64_t lods_offset;
+};
+
+// Followed by `path_size` bytes of path, padded to kSectionAlignment.
+struct SourceRecord {
+  uint64_t file_size;
+  int64_t write_time;
+  uint32_t path_size;
+  uint32_t padding;
+};
+
+uint64_t AlignUp(uint64_t value) {
+  return (value + kSectionAlignment - 1) & ~(kSectionAlignment - 1);
+}
+
+bool GetFileStamp(const std::string& path, uint64_t* file_size,
+                  int64_t* write_time) {
+  std::error_code error;
+  *file_size = std::filesystem::file_size(path, error);
+  if (error)
+    return false;
+
+  auto time = std::filesystem::last_write_time(path, error);
+  if (error)
+    return false;
+
+  *write_time = static_cast<int64_t>(time.time_since_epoch().count());
+  return true;
+}
+
+void WritePadding(std::ofstream* strm) {
+  static const char kZeros[kSectionAlignment] = {};
+
+  uint64_t pos = static_cast<uint64_t>(strm->tellp());
+  strm->write(kZeros, AlignUp(pos) - pos);
+}
+
+}  // namespace
+
+bool WriteMeshCache(const Model& model, const std::string& path) {
+  std::vector<PackedVertex> vertices = PackVertices(model);
+
+  std::vector<uint16_t> indices_16;
+  const void* index_data = model.index_buffer.data();
+  uint32_t index_size = sizeof(uint32_t);
+
+  if (FitsInUint16Indices(model)) {
+    indices_16.assign(model.index_buffer.begin(), model.index_buffer.end());
+    index_data = indices_16.data();
+    index_size = sizeof(uint16_t);
+  }
+
+  std::vector<SourceRecord> sources(model.source_paths.size());
+  uint64_t sources_size = 0;
+
+  for (size_t i = 0; i < sources.size(); ++i) {
+    const std::string& source_path = model.source_paths[i];
+    if (!GetFileStamp(source_path, &sources[i].file_size,
+                      &sources[i].write_time)) {
+      std::cerr << "Could not stat " << source_path << "." << std::endl;
+      return false;
+    }
+    sources[i].path_size = static_cast<uint32_t>(source_path.size());
+    sources[i].padding = 0;
+
+    sources_size += AlignUp(sizeof(SourceRecord) + source_path.size());
+  }
+
+  CacheHeader header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.vertex_size = sizeof(PackedVertex);
+  header.material_size = sizeof(Material);
+  header.lod_size = sizeof(MeshLod);
+  header.source_count = static_cast<uint32_t>(sources.size());
+  header.vertex_count = static_cast<uint32_t>(vertices.size());
+  header.index_count = static_cast<uint32_t>(model.index_buffer.size());
+  header.index_size = index_size;
+  header.material_count = static_cast<uint32_t>(model.materials.size());
+  header.lod_count = static_cast<uint32_t>(model.lods.size());
+
+  header.sources_offset = AlignUp(sizeof(CacheHeader));
+  header.vertices_offset = header.sources_offset + sources_size;
+  header.indices_offset = AlignUp(
+      header.vertices_offset + sizeof(PackedVertex) * vertices.size());
+  header.materials_offset = AlignUp(
+      header.indices_offset + uint64_t{index_size} * header.index_count);
+  header.lods_offset = AlignUp(
+      header.materials_offset + sizeof(Material) * model.materials.size());
+
+  // Written under a temporary name so that a reader never sees a partially
+  // written cache.
+  std::string temp_path = path + ".tmp";
+  {
+    std::ofstream strm(temp_path, std::ios::binary | std::ios::trunc);
+    if (!strm.is_open()) {
+      std::cerr << "Could not open " << temp_path << "." << std::endl;
+      return false;
+    }
+
+    strm.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    WritePadding(&strm);
+
+    for (size_t i = 0; i < sources.size(); ++i) {
+      strm.write(reinterpret_cast<const char*>(&sources[i]),
+                 sizeof(SourceRecord));
+      strm.write(model.source_paths[i].data(), sources[i].path_size);
+      WritePadding(&strm);
+    }
+
+    strm.write(reinterpret_cast<const char*>(vertices.data()),
+               sizeof(PackedVertex) * vertices.size());
+    WritePadding(&strm);
+
+    strm.write(static_cast<const char*>(index_data),
+               uint64_t{index_size} * header.index_count);
+    WritePadding(&strm);
+
+    strm.write(reinterpret_cast<const char*>(model.materials.data()),
+               sizeof(Material) * model.materials.size());
+    WritePadding(&strm);
+
+    strm.write(reinterpret_cast<const char*>(model.lods.data()),
+               sizeof(MeshLod) * model.lods.size());
+
+    if (!strm) {
+      std::cerr << "Could not write " << temp_path << "." << std::endl;
+      return false;
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temp_path, path, error);
+  if (error) {
+    std::cerr << "Could not rename " << temp_path << "." << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+MeshCache::~MeshCache() {
+  Close();
+}
+
+bool MeshCache::Open(const std::string& path) {
+  Close();
+
+  if (!Map(path))
+    return false;
+
+  CacheHeader header;
+  if (size_ < sizeof(header)) {
+    Close();
+    return false;
+  }
+  memcpy(&header, data_, sizeof(header));
+
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion ||
+      header.vertex_size != sizeof(PackedVertex) ||
+      header.material_size != sizeof(Material) ||
+      header.lod_size != sizeof(MeshLod) ||
+      (header.index_size != sizeof(uint16_t) &&
+       header.index_size != sizeof(uint32_t))) {
+    Close();
+    return false;
+  }
+
+  uint64_t lods_end = header.lods_offset +
+      sizeof(MeshLod) * uint64_t{header.lod_count};
+  if (header.vertices_offset + sizeof(PackedVertex) * header.vertex_count >
+          header.indices_offset ||
+      header.indices_offset + uint64_t{header.index_size} * header.index_count >
+          header.materials_offset ||
+      header.materials_offset +
+              sizeof(Material) * uint64_t{header.material_count} >
+          header.lods_offset ||
+      lods_end > size_) {
+    Close();
+    return false;
+  }
+
+  uint64_t offset = header.sources_offset;
+  for (uint32_t i = 0; i < header.source_count; ++i) {
+    SourceRecord record;
+    if (offset + sizeof(record) > header.vertices_offset) {
+      Close();
+      return false;
+    }
+    memcpy(&record, data_ + offset, sizeof(record));
+
+    if (offset + sizeof(record) + record.path_size > header.vertices_offset) {
+      Close();
+      return false;
+    }
+    std::string source_path(
+        reinterpret_cast<const char*>(data_ + offset + sizeof(record)),
+        record.path_size);
+
+    uint64_t file_size;
+    int64_t write_time;
+    if (!GetFileStamp(source_path, &file_size, &write_time) ||
+        file_size != record.file_size || write_time != record.write_time) {
+      Close();
+      return false;
+    }
+
+    source_paths_.push_back(source_path);
+    offset += AlignUp(sizeof(record) + record.path_size);
+  }
+
+  vertices_ = reinterpret_cast<const PackedVertex*>(
+      data_ + header.vertices_offset);
+  vertex_count_ = header.vertex_count;
+
+  indices_ = data_ + header.indices_offset;
+  index_count_ = header.index_count;
+  index_size_ = header.index_size;
+
+  materials_ = reinterpret_cast<const Material*>(
+      data_ + header.materials_offset);
+  material_count_ = header.material_count;
+
+  lods_ = reinterpret_cast<const MeshLod*>(data_ + header.lods_offset);
+  lod_count_ = header.lod_count;
+
+  return true;
+}
+
+#ifdef _WIN32
+
+bool MeshCache::Map(const std::string& path) {
+  file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    file_ = nullptr;
+    return false;
+  }
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file_, &file_size) || file_size.QuadPart == 0) {
+    Close();
+    return false;
+  }
+
+  mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping_ == nullptr) {
+    Close();
+    return false;
+  }
+
+  data_ = static_cast<const uint8_t*>(
+      MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+  if (data_ == nullptr) {
+    Close();
+    return false;
+  }
+  size_ = static_cast<size_t>(file_size.QuadPart);
+
+  return true;
+}
+
+void MeshCache::Close() {
+  if (data_ != nullptr)
+    UnmapViewOfFile(data_);
+  if (mapping_ != nullptr)
+    CloseHandle(mapping_);
+  if (file_ != nullptr)
+    CloseHandle(file_);
+
+  file_ = nullptr;
+  mapping_ = nullptr;
+  data_ = nullptr;
+  size_ = 0;
+
+  vertices_ = nullptr;
+  indices_ = nullptr;
+  materials_ = nullptr;
+  lods_ = nullptr;
+  vertex_count_ = 0;
+  index_count_ = 0;
+  index_size_ = 0;
+  material_count_ = 0;
+  lod_count_ = 0;
+  source_paths_.clear();
+}
+
+#else
+
+bool MeshCache::Map(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void* data = mmap(nullptr, static_cast<size_t>(file_stat.st_size),
+                    PROT_READ, MAP_PRIVATE, fd, 0);
+
+  // The mapping keeps the file alive on its own.
+  close(fd);
+
+  if (data == MAP_FAILED)
+    return false;
+
+  data_ = static_cast<const uint8_t*>(data);
+  size_ = static_cast<size_t>(file_stat.st_size);
+
+  return true;
+}
+
+void MeshCache::Close() {
+  if (data_ != nullptr)
+    munmap(const_cast<uint8_t*>(data_), size_);
+
+  data_ = nullptr;
+  size_ = 0;
+
+  vertices_ = nullptr;
+  indices_ = nullptr;
+  materials_ = nullptr;
+  lods_ = nullptr;
+  vertex_count_ = 0;
+  index_count_ = 0;
+  index_size_ = 0;
+  material_count_ = 0;
+  lod_count_ = 0;
+  source_paths_.clear();
+}
+
+#endif
+
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef UTILS_MESH_CACHE_H_
+#define UTILS_MESH_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "utils/model.h"
+
+namespace utils {
+
+// Writes `model` to `path` in the layout the GPU consumes: PackedVertex
+// vertices, 16-bit indices when they fit and 32-bit otherwise, the material
+// table and the LOD ranges. Records the size and modification time of every
+// file in `model.source_paths` so that stale caches can be detected.
+bool WriteMeshCache(const Model& model, const std::string& path);
+
+// Read-only view of a cache written by WriteMeshCache(). The file is memory
+// mapped, so the data can be copied straight into a staging buffer.
+class MeshCache {
+public:
+  MeshCache() = default;
+  ~MeshCache();
+
+  MeshCache(const MeshCache&) = delete;
+  MeshCache& operator=(const MeshCache&) = delete;
+
+  // Fails if the file is missing, was written by a different version, or any
+  // of the source files it was cooked from has changed since.
+  bool Open(const std::string& path);
+  void Close();
+
+  // The pointers below are only valid until Close().
+  const PackedVertex* GetVertices() const { return vertices_; }
+  uint32_t GetVertexCount() const { return vertex_count_; }
+
+  // Either uint16_t or uint32_t indices, see GetIndexSize().
+  const void* GetIndices() const { return indices_; }
+  uint32_t GetIndexCount() const { return index_count_; }
+  uint32_t GetIndexSize() const { return index_size_; }
+
+  const Material* GetMaterials() const { return materials_; }
+  uint32_t GetMaterialCount() const { return material_count_; }
+
+  const MeshLod* GetLods() const { return lods_; }
+  uint32_t GetLodCount() const { return lod_count_; }
+
+  // The files the cache was cooked from, as in Model::source_paths.
+  const std::vector<std::string>& GetSourcePaths() const {
+    return source_paths_;
+  }
+
+private:
+  bool Map(const std::string& path);
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+
+#ifdef _WIN32
+  void* file_ = nullptr;
+  void* mapping_ = nullptr;
+#endif
+
+  const PackedVertex* vertices_ = nullptr;
+  uint32_t vertex_count_ = 0;
+
+  const void* indices_ = nullptr;
+  uint32_t index_count_ = 0;
+  uint32_t index_size_ = 0;
+
+  const Material* materials_ = nullptr;
+  uint32_t material_count_ = 0;
+
+  const MeshLod* lods_ = nullptr;
+  uint32_t lod_count_ = 0;
+
+  std::vector<std::string> source_paths_;
+};
+
+}  // namespace utils
+
+#endif  // UTILS_MESH_CACHE_H_
\ No newline at end of file
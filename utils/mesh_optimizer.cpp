@@ -0,0 +1,223 @@
+#include "utils/mesh_optimizer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils/model.h"
+
+namespace utils {
+
+namespace {
+
+struct VertexKey {
+  glm::vec3 position;
+  glm::vec3 normal;
+  uint32_t material_idx;
+
+  bool operator==(const VertexKey& other) const {
+    return memcmp(this, &other, sizeof(VertexKey)) == 0;
+  }
+};
+
+struct VertexKeyHash {
+  size_t operator()(const VertexKey& key) const {
+    // FNV-1a over the raw bytes, which matches operator== above.
+    const auto* bytes = reinterpret_cast<const unsigned char*>(&key);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(VertexKey); ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+    return static_cast<size_t>(hash);
+  }
+};
+
+// Moves vertex `old_idx` to `new_idx` for every entry in `remap`.
+void RemapVertices(const std::vector<uint32_t>& remap, uint32_t vertex_count,
+                   Model* model) {
+  std::vector<glm::vec3> positions(vertex_count);
+  std::vector<glm::vec3> normals(vertex_count);
+  std::vector<uint32_t> material_indices(vertex_count);
+
+  for (size_t i = 0; i < remap.size(); ++i) {
+    positions[remap[i]] = model->positions[i];
+    normals[remap[i]] = model->normals[i];
+    material_indices[remap[i]] = model->material_indices[i];
+  }
+
+  model->positions = std::move(positions);
+  model->normals = std::move(normals);
+  model->material_indices = std::move(material_indices);
+
+  for (uint32_t& index : model->index_buffer)
+    index = remap[index];
+}
+
+// Returns the unvisited vertex to fan around next once the current
+// neighbourhood is exhausted, or -1 when every triangle has been emitted.
+int SkipDeadEnd(const std::vector<int>& live_triangles,
+                std::vector<uint32_t>* dead_end_stack, uint32_t* cursor) {
+  while (!dead_end_stack->empty()) {
+    uint32_t vertex = dead_end_stack->back();
+    dead_end_stack->pop_back();
+    if (live_triangles[vertex] > 0)
+      return vertex;
+  }
+
+  while (*cursor < live_triangles.size()) {
+    if (live_triangles[*cursor] > 0)
+      return *cursor;
+    ++(*cursor);
+  }
+  return -1;
+}
+
+}  // namespace
+
+void WeldVertices(Model* model) {
+  std::unordered_map<VertexKey, uint32_t, VertexKeyHash> unique_vertices;
+  unique_vertices.reserve(model->positions.size());
+
+  std::vector<uint32_t> remap(model->positions.size());
+  std::vector<glm::vec3> positions;
+  std::vector<glm::vec3> normals;
+  std::vector<uint32_t> material_indices;
+
+  for (size_t i = 0; i < model->positions.size(); ++i) {
+    VertexKey key{};
+    key.position = model->positions[i];
+    key.normal = model->normals[i];
+    key.material_idx = model->material_indices[i];
+
+    auto [it, inserted] = unique_vertices.try_emplace(
+        key, static_cast<uint32_t>(positions.size()));
+    if (inserted) {
+      positions.push_back(key.position);
+      normals.push_back(key.normal);
+      material_indices.push_back(key.material_idx);
+    }
+    remap[i] = it->second;
+  }
+
+  model->positions = std::move(positions);
+  model->normals = std::move(normals);
+  model->material_indices = std::move(material_indices);
+
+  for (uint32_t& index : model->index_buffer)
+    index = remap[index];
+}
+
+void OptimizeVertexCache(Model* model, int cache_size) {
+  const std::vector<uint32_t>& indices = model->index_buffer;
+  uint32_t vertex_count = static_cast<uint32_t>(model->positions.size());
+  uint32_t triangle_count = static_cast<uint32_t>(indices.size() / 3);
+  if (triangle_count == 0)
+    return;
+
+  // Triangles using each vertex, laid out contiguously per vertex.
+  std::vector<int> live_triangles(vertex_count, 0);
+  for (uint32_t index : indices)
+    live_triangles[index]++;
+
+  std::vector<uint32_t> adjacency_offsets(vertex_count + 1, 0);
+  for (uint32_t i = 0; i < vertex_count; ++i)
+    adjacency_offsets[i + 1] = adjacency_offsets[i] + live_triangles[i];
+
+  std::vector<uint32_t> adjacency(indices.size());
+  std::vector<uint32_t> fill = adjacency_offsets;
+  for (uint32_t i = 0; i < indices.size(); ++i)
+    adjacency[fill[indices[i]]++] = i / 3;
+
+  std::vector<int> cache_timestamps(vertex_count, 0);
+  std::vector<bool> emitted(triangle_count, false);
+  std::vector<uint32_t> dead_end_stack;
+  std::vector<uint32_t> candidates;
+
+  std::vector<uint32_t> output;
+  output.reserve(indices.size());
+
+  int timestamp = cache_size + 1;
+  uint32_t cursor = 0;
+  int fanning_vertex = 0;
+
+  while (fanning_vertex >= 0) {
+    candidates.clear();
+
+    for (uint32_t i = adjacency_offsets[fanning_vertex];
+         i < adjacency_offsets[fanning_vertex + 1]; ++i) {
+      uint32_t triangle = adjacency[i];
+      if (emitted[triangle])
+        continue;
+
+      for (int j = 0; j < 3; ++j) {
+        uint32_t vertex = indices[triangle * 3 + j];
+        output.push_back(vertex);
+        dead_end_stack.push_back(vertex);
+        candidates.push_back(vertex);
+        live_triangles[vertex]--;
+
+        if (timestamp - cache_timestamps[vertex] > cache_size)
+          cache_timestamps[vertex] = timestamp++;
+      }
+      emitted[triangle] = true;
+    }
+
+    // Prefers the candidate that entered the cache earliest, as long as its
+    // remaining triangles can be emitted before it is evicted.
+    int next_vertex = -1;
+    int best_priority = -1;
+    for (uint32_t vertex : candidates) {
+      if (live_triangles[vertex] <= 0)
+        continue;
+
+      int priority = 0;
+      int age = timestamp - cache_timestamps[vertex];
+      if (age + 2 * live_triangles[vertex] <= cache_size)
+        priority = age;
+
+      if (priority > best_priority) {
+        best_priority = priority;
+        next_vertex = vertex;
+      }
+    }
+
+    if (next_vertex == -1)
+      next_vertex = SkipDeadEnd(live_triangles, &dead_end_stack, &cursor);
+
+    fanning_vertex = next_vertex;
+  }
+
+  model->index_buffer = std::move(output);
+}
+
+void OptimizeVertexFetch(Model* model) {
+  constexpr uint32_t kUnassigned = UINT32_MAX;
+
+  std::vector<uint32_t> remap(model->positions.size(), kUnassigned);
+  uint32_t next_index = 0;
+
+  for (uint32_t index : model->index_buffer) {
+    if (remap[index] == kUnassigned)
+      remap[index] = next_index++;
+  }
+
+  // Vertices that no triangle references go at the end.
+  for (uint32_t& new_index : remap) {
+    if (new_index == kUnassigned)
+      new_index = next_index++;
+  }
+
+  RemapVertices(remap, next_index, model);
+}
+
+void OptimizeMesh(Model* model) {
+  WeldVertices(model);
+  OptimizeVertexCache(model);
+  OptimizeVertexFetch(model);
+}
+
+}  // namespace utils
\ No newline at end of file
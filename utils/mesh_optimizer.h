@@ -0,0 +1,26 @@
+#ifndef UTILS_MESH_OPTIMIZER_H_
+#define UTILS_MESH_OPTIMIZER_H_
+
+#include "utils/model.h"
+
+namespace utils {
+
+// Merges vertices whose position, normal and material index are bitwise
+// identical, and rewrites the index buffer to point at the merged vertices.
+void WeldVertices(Model* model);
+
+// Reorders triangles so that vertices are reused while they are still in the
+// post-transform cache. Uses Tipsify (Sander et al., "Fast Triangle
+// Reordering for Vertex Locality and Reduced Overdraw", 2007).
+void OptimizeVertexCache(Model* model, int cache_size = 16);
+
+// Reorders vertices into the order they are first referenced, so that vertex
+// fetches walk through memory mostly linearly.
+void OptimizeVertexFetch(Model* model);
+
+// Runs all of the above, in order.
+void OptimizeMesh(Model* model);
+
+}  // namespace utils
+
+#endif  // UTILS_MESH_OPTIMIZER_H_
\ No newline at end of file
@@ -0,0 +1,426 @@
+#include "utils/mesh_simplifier.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils/mesh_optimizer.h"
+#include "utils/model.h"
+
+namespace utils {
+
+namespace {
+
+// Each level aims for this fraction of the triangles of the one before.
+constexpr float kLodTriangleRatio = 0.5f;
+
+// A level with more than this fraction of the triangles of the one before
+// isn't worth its memory, and ends the chain.
+constexpr float kMaxLodTriangleFraction = 0.8f;
+
+// Sum of the squared distances to a set of planes.
+struct Quadric {
+  double a2 = 0.0, ab = 0.0, ac = 0.0, ad = 0.0;
+  double b2 = 0.0, bc = 0.0, bd = 0.0;
+  double c2 = 0.0, cd = 0.0;
+  double d2 = 0.0;
+
+  // `normal` has to be of unit length.
+  void AddPlane(const glm::dvec3& normal, double d) {
+    a2 += normal.x * normal.x;
+    ab += normal.x * normal.y;
+    ac += normal.x * normal.z;
+    ad += normal.x * d;
+    b2 += normal.y * normal.y;
+    bc += normal.y * normal.z;
+    bd += normal.y * d;
+    c2 += normal.z * normal.z;
+    cd += normal.z * d;
+    d2 += d * d;
+  }
+
+  void Add(const Quadric& other) {
+    a2 += other.a2;
+    ab += other.ab;
+    ac += other.ac;
+    ad += other.ad;
+    b2 += other.b2;
+    bc += other.bc;
+    bd += other.bd;
+    c2 += other.c2;
+    cd += other.cd;
+    d2 += other.d2;
+  }
+
+  double Evaluate(const glm::dvec3& p) const {
+    double error =
+        a2 * p.x * p.x + 2.0 * ab * p.x * p.y + 2.0 * ac * p.x * p.z +
+        2.0 * ad * p.x + b2 * p.y * p.y + 2.0 * bc * p.y * p.z +
+        2.0 * bd * p.y + c2 * p.z * p.z + 2.0 * cd * p.z + d2;
+
+    // Rounding can take it just below zero.
+    return std::max(error, 0.0);
+  }
+};
+
+struct Triangle {
+  uint32_t vertices[3];
+  uint32_t material_idx;
+};
+
+// Moves vertex `from` onto vertex `to`.
+struct Collapse {
+  uint32_t from;
+  uint32_t to;
+  double cost;
+};
+
+// Matches positions bitwise, so that the hash below stays consistent with it.
+struct PositionEqual {
+  bool operator()(const glm::vec3& a, const glm::vec3& b) const {
+    return memcmp(&a, &b, sizeof(glm::vec3)) == 0;
+  }
+};
+
+struct PositionHash {
+  size_t operator()(const glm::vec3& position) const {
+    // FNV-1a over the raw bytes.
+    const auto* bytes = reinterpret_cast<const unsigned char*>(&position);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(glm::vec3); ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+    return static_cast<size_t>(hash);
+  }
+};
+
+// Flat normals and material seams split the model's vertices, so the
+// triangles are connected up again through their positions alone.
+void WeldPositions(const Model& model, std::vector<glm::vec3>* positions,
+                   std::vector<Triangle>* triangles) {
+  std::unordered_map<glm::vec3, uint32_t, PositionHash, PositionEqual>
+      position_indices;
+  std::vector<uint32_t> remap(model.positions.size());
+
+  for (size_t i = 0; i < model.positions.size(); ++i) {
+    auto [it, inserted] = position_indices.try_emplace(
+        model.positions[i], static_cast<uint32_t>(positions->size()));
+    if (inserted)
+      positions->push_back(model.positions[i]);
+    remap[i] = it->second;
+  }
+
+  triangles->resize(model.index_buffer.size() / 3);
+  for (size_t i = 0; i < triangles->size(); ++i) {
+    Triangle& triangle = (*triangles)[i];
+    for (int j = 0; j < 3; ++j)
+      triangle.vertices[j] = remap[model.index_buffer[i * 3 + j]];
+    triangle.material_idx =
+        model.material_indices[model.index_buffer[i * 3]];
+  }
+}
+
+// Locks the vertices of every edge that isn't shared by exactly two
+// triangles of the same material.
+std::vector<bool> FindLockedVertices(size_t vertex_count,
+                                     const std::vector<Triangle>& triangles) {
+  struct EdgeInfo {
+    int triangle_count = 0;
+    uint32_t material_idx = 0;
+    bool mixed_materials = false;
+  };
+
+  std::unordered_map<uint64_t, EdgeInfo> edges;
+  for (const Triangle& triangle : triangles) {
+    for (int i = 0; i < 3; ++i) {
+      uint32_t a = triangle.vertices[i];
+      uint32_t b = triangle.vertices[(i + 1) % 3];
+      uint64_t key = (uint64_t{std::min(a, b)} << 32) | std::max(a, b);
+
+      EdgeInfo& edge = edges[key];
+      if (edge.triangle_count > 0 &&
+          edge.material_idx != triangle.material_idx) {
+        edge.mixed_materials = true;
+      }
+      edge.material_idx = triangle.material_idx;
+      ++edge.triangle_count;
+    }
+  }
+
+  std::vector<bool> locked(vertex_count, false);
+  for (const auto& [key, edge] : edges) {
+    if (edge.triangle_count != 2 || edge.mixed_materials) {
+      locked[static_cast<uint32_t>(key >> 32)] = true;
+      locked[static_cast<uint32_t>(key)] = true;
+    }
+  }
+  return locked;
+}
+
+// The triangles round each vertex, as ranges of `adjacency` starting at
+// `offsets[vertex]`.
+void BuildAdjacency(size_t vertex_count, const std::vector<Triangle>& triangles,
+                    std::vector<uint32_t>* offsets,
+                    std::vector<uint32_t>* adjacency) {
+  offsets->assign(vertex_count + 1, 0);
+  for (const Triangle& triangle : triangles) {
+    for (uint32_t vertex : triangle.vertices)
+      ++(*offsets)[vertex + 1];
+  }
+  for (size_t i = 0; i < vertex_count; ++i)
+    (*offsets)[i + 1] += (*offsets)[i];
+
+  std::vector<uint32_t> next = *offsets;
+  adjacency->resize(triangles.size() * 3);
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    for (uint32_t vertex : triangles[i].vertices)
+      (*adjacency)[next[vertex]++] = static_cast<uint32_t>(i);
+  }
+}
+
+// Whether moving `collapse.from` onto `collapse.to` turns any of the
+// triangles that survive it over, or flattens them to nothing.
+bool FlipsTriangles(const Collapse& collapse,
+                    const std::vector<glm::vec3>& positions,
+                    const std::vector<Triangle>& triangles,
+                    const std::vector<uint32_t>& offsets,
+                    const std::vector<uint32_t>& adjacency) {
+  for (uint32_t i = offsets[collapse.from]; i < offsets[collapse.from + 1];
+       ++i) {
+    const Triangle& triangle = triangles[adjacency[i]];
+
+    bool has_to = false;
+    glm::vec3 before[3];
+    glm::vec3 after[3];
+    for (int j = 0; j < 3; ++j) {
+      uint32_t vertex = triangle.vertices[j];
+      has_to = has_to || vertex == collapse.to;
+      before[j] = positions[vertex];
+      after[j] = vertex == collapse.from ? positions[collapse.to]
+                                         : positions[vertex];
+    }
+
+    // Collapses into the edge and goes away.
+    if (has_to)
+      continue;
+
+    glm::vec3 normal_before =
+        glm::cross(before[1] - before[0], before[2] - before[0]);
+    glm::vec3 normal_after =
+        glm::cross(after[1] - after[0], after[2] - after[0]);
+    if (glm::dot(normal_before, normal_after) <= 0.f)
+      return true;
+  }
+  return false;
+}
+
+// Gives every triangle its own three vertices with the face normal, the way
+// LoadModel() does, for OptimizeMesh() to weld.
+void EmitFlatTriangles(const std::vector<glm::vec3>& positions,
+                       const std::vector<Triangle>& triangles,
+                       Model* out_model) {
+  out_model->positions.resize(triangles.size() * 3);
+  out_model->normals.resize(triangles.size() * 3);
+  out_model->material_indices.resize(triangles.size() * 3);
+  out_model->index_buffer.resize(triangles.size() * 3);
+
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    const Triangle& triangle = triangles[i];
+    const glm::vec3& p0 = positions[triangle.vertices[0]];
+    const glm::vec3& p1 = positions[triangle.vertices[1]];
+    const glm::vec3& p2 = positions[triangle.vertices[2]];
+    glm::vec3 normal = glm::normalize(glm::cross(p1 - p0, p2 - p0));
+
+    for (int j = 0; j < 3; ++j) {
+      size_t vertex = i * 3 + j;
+      out_model->positions[vertex] = positions[triangle.vertices[j]];
+      out_model->normals[vertex] = normal;
+      out_model->material_indices[vertex] = triangle.material_idx;
+      out_model->index_buffer[vertex] = static_cast<uint32_t>(vertex);
+    }
+  }
+}
+
+}  // namespace
+
+float SimplifyModel(const Model& model, float target_ratio,
+                    Model* out_model) {
+  std::vector<glm::vec3> positions;
+  std::vector<Triangle> triangles;
+  WeldPositions(model, &positions, &triangles);
+
+  std::vector<bool> locked = FindLockedVertices(positions.size(), triangles);
+
+  // Each vertex starts out with the planes of the triangles round it.
+  std::vector<Quadric> quadrics(positions.size());
+  for (const Triangle& triangle : triangles) {
+    glm::dvec3 p0(positions[triangle.vertices[0]]);
+    glm::dvec3 p1(positions[triangle.vertices[1]]);
+    glm::dvec3 p2(positions[triangle.vertices[2]]);
+
+    glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+    double length = glm::length(normal);
+    if (length == 0.0)
+      continue;
+    normal /= length;
+
+    for (uint32_t vertex : triangle.vertices)
+      quadrics[vertex].AddPlane(normal, -glm::dot(normal, p0));
+  }
+
+  size_t target_count =
+      static_cast<size_t>(static_cast<float>(triangles.size()) * target_ratio);
+  double max_cost = 0.0;
+
+  std::vector<uint32_t> remap(positions.size());
+  std::vector<bool> touched(positions.size());
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> adjacency;
+  std::vector<Collapse> collapses;
+
+  // Every pass collapses the cheapest edges that don't share a triangle
+  // with each other, so that each one can be checked against the mesh as it
+  // was at the start of the pass.
+  while (triangles.size() > target_count) {
+    BuildAdjacency(positions.size(), triangles, &offsets, &adjacency);
+
+    collapses.clear();
+    for (const Triangle& triangle : triangles) {
+      for (int i = 0; i < 3; ++i) {
+        uint32_t a = triangle.vertices[i];
+        uint32_t b = triangle.vertices[(i + 1) % 3];
+
+        Quadric quadric = quadrics[a];
+        quadric.Add(quadrics[b]);
+
+        if (!locked[a]) {
+          collapses.push_back(
+              { a, b, quadric.Evaluate(glm::dvec3(positions[b])) });
+        }
+        if (!locked[b]) {
+          collapses.push_back(
+              { b, a, quadric.Evaluate(glm::dvec3(positions[a])) });
+        }
+      }
+    }
+    std::sort(collapses.begin(), collapses.end(),
+              [](const Collapse& a, const Collapse& b) {
+                return a.cost < b.cost;
+              });
+
+    for (uint32_t i = 0; i < remap.size(); ++i)
+      remap[i] = i;
+    std::fill(touched.begin(), touched.end(), false);
+
+    // Collapsing an interior edge removes the two triangles on it.
+    size_t collapse_budget = (triangles.size() - target_count + 1) / 2;
+    size_t collapse_count = 0;
+
+    for (const Collapse& collapse : collapses) {
+      if (collapse_count >= collapse_budget)
+        break;
+      if (touched[collapse.from] || touched[collapse.to])
+        continue;
+      if (FlipsTriangles(collapse, positions, triangles, offsets, adjacency))
+        continue;
+
+      remap[collapse.from] = collapse.to;
+      quadrics[collapse.to].Add(quadrics[collapse.from]);
+      max_cost = std::max(max_cost, collapse.cost);
+      ++collapse_count;
+
+      // The triangles round `from` change shape, so none of their vertices
+      // can move again in this pass.
+      for (uint32_t i = offsets[collapse.from];
+           i < offsets[collapse.from + 1]; ++i) {
+        for (uint32_t vertex : triangles[adjacency[i]].vertices)
+          touched[vertex] = true;
+      }
+    }
+
+    if (collapse_count == 0)
+      break;
+
+    // Drops the triangles that collapsed into edges.
+    size_t live_count = 0;
+    for (Triangle triangle : triangles) {
+      for (uint32_t& vertex : triangle.vertices)
+        vertex = remap[vertex];
+
+      if (triangle.vertices[0] == triangle.vertices[1] ||
+          triangle.vertices[1] == triangle.vertices[2] ||
+          triangle.vertices[2] == triangle.vertices[0]) {
+        continue;
+      }
+      triangles[live_count++] = triangle;
+    }
+    triangles.resize(live_count);
+  }
+
+  *out_model = Model();
+  EmitFlatTriangles(positions, triangles, out_model);
+  OptimizeMesh(out_model);
+
+  return static_cast<float>(std::sqrt(max_cost));
+}
+
+void GenerateLods(Model* model, int max_lod_count) {
+  model->lods.clear();
+
+  MeshLod full_lod{};
+  full_lod.first_index = 0;
+  full_lod.index_count = static_cast<uint32_t>(model->index_buffer.size());
+  full_lod.vertex_offset = 0;
+  full_lod.error = 0.f;
+  model->lods.push_back(full_lod);
+
+  Model previous;
+  previous.positions = model->positions;
+  previous.normals = model->normals;
+  previous.material_indices = model->material_indices;
+  previous.index_buffer = model->index_buffer;
+
+  while (static_cast<int>(model->lods.size()) < max_lod_count) {
+    Model lod_model;
+    float error = SimplifyModel(previous, kLodTriangleRatio, &lod_model);
+
+    if (lod_model.index_buffer.empty() ||
+        static_cast<float>(lod_model.index_buffer.size()) >
+            static_cast<float>(previous.index_buffer.size()) *
+                kMaxLodTriangleFraction) {
+      break;
+    }
+
+    MeshLod lod{};
+    lod.first_index = static_cast<uint32_t>(model->index_buffer.size());
+    lod.index_count = static_cast<uint32_t>(lod_model.index_buffer.size());
+    lod.vertex_offset = static_cast<int32_t>(model->positions.size());
+
+    // Each level is simplified from the one before, so the errors add up.
+    lod.error = model->lods.back().error + error;
+
+    model->positions.insert(model->positions.end(),
+                            lod_model.positions.begin(),
+                            lod_model.positions.end());
+    model->normals.insert(model->normals.end(), lod_model.normals.begin(),
+                          lod_model.normals.end());
+    model->material_indices.insert(model->material_indices.end(),
+                                   lod_model.material_indices.begin(),
+                                   lod_model.material_indices.end());
+    model->index_buffer.insert(model->index_buffer.end(),
+                               lod_model.index_buffer.begin(),
+                               lod_model.index_buffer.end());
+
+    model->lods.push_back(lod);
+    previous = std::move(lod_model);
+  }
+}
+
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef UTILS_MESH_SIMPLIFIER_H_
+#define UTILS_MESH_SIMPLIFIER_H_
+
+#include "utils/model.h"
+
+namespace utils {
+
+// Builds a copy of the mesh in `model` with about `target_ratio` of its
+// triangles, by collapsing edges in order of their quadric error (Garland and
+// Heckbert, "Surface Simplification Using Quadric Error Metrics", 1997).
+// Vertices on open borders and between materials never move, so the outline
+// and the material boundaries survive. `out_model` gets flat normals and is
+// run through OptimizeMesh(). Returns the error of the worst collapse, as a
+// distance in model units.
+float SimplifyModel(const Model& model, float target_ratio, Model* out_model);
+
+// Appends up to `max_lod_count - 1` simplified levels to the mesh in
+// `model`, each from the one before, and fills in Model::lods. Stops early
+// once a level no longer gets noticeably smaller. Expects a model without
+// LODs, after OptimizeMesh().
+void GenerateLods(Model* model, int max_lod_count);
+
+}  // namespace utils
+
+#endif  // UTILS_MESH_SIMPLIFIER_H_
\ No newline at end of file
@@ -1,222 +1,490 @@
 #include "model.h"
 
+#include <algorithm>
+#include <charconv>
+#include <cmath>
 #include <fstream>
+#include <iterator>
 #include <limits>
-#include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
 
-#include <iostream>
+#include "utils/mesh_optimizer.h"
+#include "utils/thread_pool.h"
 
 namespace utils {
 
 namespace {
 
+// Reads the whole file with a single read, so that parsing never goes back to
+// the stream.
+bool ReadFile(const std::string& path, std::string* contents) {
+  std::ifstream strm(path, std::ios::ate | std::ios::binary);
+  if (!strm.is_open())
+    return false;
+
+  size_t file_size = strm.tellg();
+  contents->resize(file_size);
+
+  strm.seekg(0);
+  strm.read(contents->data(), file_size);
+  return static_cast<bool>(strm);
+}
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Returns the line starting at `*pos` with any comment stripped, and moves
+// `*pos` past its newline.
+std::string_view NextLine(std::string_view text, size_t* pos) {
+  size_t end = text.find('\n', *pos);
+  if (end == std::string_view::npos)
+    end = text.size();
+
+  std::string_view line = text.substr(*pos, end - *pos);
+  *pos = end + 1;
+
+  size_t comment = line.find('#');
+  if (comment != std::string_view::npos)
+    line = line.substr(0, comment);
+  return line;
+}
+
+// Removes and returns the next whitespace separated token in `line`.
+std::string_view NextToken(std::string_view* line) {
+  size_t begin = 0;
+  while (begin < line->size() && IsSpace((*line)[begin]))
+    ++begin;
+
+  size_t end = begin;
+  while (end < line->size() && !IsSpace((*line)[end]))
+    ++end;
+
+  std::string_view token = line->substr(begin, end - begin);
+  line->remove_prefix(end);
+  return token;
+}
+
+bool ParseFloat(std::string_view* line, float* value) {
+  std::string_view token = NextToken(line);
+  auto result = std::from_chars(token.data(), token.data() + token.size(),
+                                *value);
+  return result.ec == std::errc() && !token.empty();
+}
+
+bool ParseVec3(std::string_view* line, glm::vec3* value) {
+  return ParseFloat(line, &value->x) && ParseFloat(line, &value->y) &&
+      ParseFloat(line, &value->z);
+}
+
+// Parses the position index of a face vertex. Any texture coordinate and
+// normal indices after a '/' are ignored.
+bool ParseFaceIndex(std::string_view token, int* value) {
+  auto result = std::from_chars(token.data(), token.data() + token.size(),
+                                *value);
+  return result.ec == std::errc() &&
+      (result.ptr == token.data() + token.size() || *result.ptr == '/');
+}
+
 bool LoadMaterialFile(const std::string& path, std::vector<Material>* materials,
                       std::unordered_map<std::string, int>* mtl_name_to_idx) {
   materials->clear();
   mtl_name_to_idx->clear();
 
-  std::ifstream file_strm(path);
-  if (!file_strm.is_open())
+  std::string contents;
+  if (!ReadFile(path, &contents))
     return false;
 
-  std::string line;
-  std::string token;
+  std::string_view text = contents;
+  size_t pos = 0;
 
   Material mtl = {};
-  std::string mtl_name;
+  std::string_view mtl_name;
   bool mtl_pending = false;
 
-  while(std::getline(file_strm, line)) {
-    std::stringstream sstrm(line);
-    while (sstrm >> token) {
-      if (token == "newmtl") {
-        if (mtl_pending) {
-          materials->push_back(mtl);
-          (*mtl_name_to_idx)[mtl_name] = materials->size() - 1;
-          mtl_pending = false;
-        }
-        mtl = {};
-        mtl_name = "";
-        sstrm >> mtl_name;
-        if (mtl_name.empty())
-          return false;
-        mtl_pending = true;
-
-      } else if (token == "Ka") {
-        float f1, f2, f3;
-        sstrm >> f1 >> f2 >> f3;
-        mtl.ambient_color = { f1, f2, f3 };
+  while (pos < text.size()) {
+    std::string_view line = NextLine(text, &pos);
+    std::string_view token = NextToken(&line);
 
-      } else if (token == "Kd") {
-        float f1, f2, f3;
-        sstrm >> f1 >> f2 >> f3;
-        mtl.diffuse_color = { f1, f2, f3 };
+    if (token == "newmtl") {
+      if (mtl_pending) {
+        materials->push_back(mtl);
+        (*mtl_name_to_idx)[std::string(mtl_name)] = materials->size() - 1;
+        mtl_pending = false;
       }
+      mtl = {};
+      mtl_name = NextToken(&line);
+      if (mtl_name.empty())
+        return false;
+      mtl_pending = true;
+
+    } else if (token == "Ka") {
+      if (!ParseVec3(&line, &mtl.ambient_color))
+        return false;
+
+    } else if (token == "Kd") {
+      if (!ParseVec3(&line, &mtl.diffuse_color))
+        return false;
     }
   }
 
   if (mtl_pending) {
     materials->push_back(mtl);
-    (*mtl_name_to_idx)[mtl_name] = materials->size() - 1;
+    (*mtl_name_to_idx)[std::string(mtl_name)] = materials->size() - 1;
     mtl_pending = false;
   }
 
   return true;
 }
 
-}  // namespace
+// Files smaller than this are parsed as a single chunk.
+constexpr size_t kMinChunkSize = 1 << 20;
 
-bool LoadModel(const std::string& obj_path, Model* out_model) {
-  Model model;
-  std::string mtl_path;
+constexpr size_t kNormalGrainSize = 1 << 16;
 
-  std::ifstream file_strm(obj_path);
-  if (!file_strm.is_open())
-    return false;
+// A face corner as written in the file. Negative OBJ indices are stored
+// relative to the first vertex of the chunk, since the number of vertices in
+// earlier chunks is only known once they have all been parsed.
+struct FaceCorner {
+  int index;
+  bool is_relative;
+};
 
-  std::string line;
-  std::string token;
+struct Face {
+  FaceCorner corners[4];
+  int corner_count;
 
-  std::vector<Material> materials;
-  std::unordered_map<std::string, int> mtl_name_to_idx;
+  // Index into ChunkResult::usemtl_names of the material in effect, or -1 if
+  // it carries over from an earlier chunk.
+  int usemtl_slot;
+};
+
+struct ChunkResult {
+  bool ok = true;
 
   std::vector<glm::vec3> positions;
-  std::vector<int> face_pos_indices;
-  std::vector<int> face_normal_indices;
-
-  uint16_t current_idx = 0;
-  std::string mtl_name;
-  int mtl_idx;
-
-  while (std::getline(file_strm, line)) {
-    std::stringstream sstrm(line);
-    while (sstrm >> token) {
-      if (token[0] == '#')
-        break;
-
-      if (token == "mtllib")  {
-        sstrm >> mtl_path;
-        if (mtl_path.empty())
-          return false;
+  std::vector<Face> faces;
+  std::vector<std::string_view> usemtl_names;
+  std::vector<std::string_view> mtllib_paths;
+
+  size_t triangle_count = 0;
+
+  // Filled in by the merge step.
+  size_t vertex_offset = 0;
+  size_t triangle_offset = 0;
+  std::vector<uint32_t> usemtl_indices;
+  uint32_t inherited_mtl_idx = 0;
+};
+
+// Parses the `v`, `f`, `usemtl` and `mtllib` records of a run of whole lines.
+void ParseChunk(std::string_view text, ChunkResult* chunk) {
+  size_t pos = 0;
+  int usemtl_slot = -1;
+
+  while (pos < text.size()) {
+    std::string_view line = NextLine(text, &pos);
+    std::string_view token = NextToken(&line);
+
+    if (token == "v") {
+      glm::vec3 position;
+      if (!ParseVec3(&line, &position)) {
+        chunk->ok = false;
+        return;
+      }
+      chunk->positions.push_back(position);
+
+    } else if (token == "f") {
+      Face face{};
+      face.usemtl_slot = usemtl_slot;
+
+      for (std::string_view index_token = NextToken(&line);
+           !index_token.empty(); index_token = NextToken(&line)) {
+        int idx;
+        if (face.corner_count == 4 || !ParseFaceIndex(index_token, &idx)) {
+          chunk->ok = false;
+          return;
+        }
 
-        if (!LoadMaterialFile(mtl_path, &materials, &mtl_name_to_idx))
-          return false;
+        // OBJ indices are 1-based, and negative ones count back from the
+        // most recent vertex.
+        FaceCorner& corner = face.corners[face.corner_count++];
+        corner.is_relative = idx < 0;
+        corner.index = idx < 0 ?
+            static_cast<int>(chunk->positions.size()) + idx : idx - 1;
+      }
 
-      } else if (token == "usemtl") {
-        mtl_name = "";
-        sstrm >> mtl_name;
-        if (mtl_name.empty())
-          return false;
+      if (face.corner_count < 3) {
+        chunk->ok = false;
+        return;
+      }
 
-        auto it = mtl_name_to_idx.find(mtl_name);
-        if (it == mtl_name_to_idx.end())
-          return false;
-        mtl_idx = it->second;
+      chunk->faces.push_back(face);
+      chunk->triangle_count += face.corner_count - 2;
 
-      } else if (token == "v") {
-        float f1, f2, f3;
-        sstrm >> f1 >> f2 >> f3;
-        positions.push_back({ f1, f2, f3 });
+    } else if (token == "usemtl") {
+      std::string_view mtl_name = NextToken(&line);
+      if (mtl_name.empty()) {
+        chunk->ok = false;
+        return;
+      }
+      usemtl_slot = static_cast<int>(chunk->usemtl_names.size());
+      chunk->usemtl_names.push_back(mtl_name);
+
+    } else if (token == "mtllib") {
+      std::string_view mtl_path = NextToken(&line);
+      if (mtl_path.empty()) {
+        chunk->ok = false;
+        return;
+      }
+      chunk->mtllib_paths.push_back(mtl_path);
+    }
+  }
+}
 
-      } else if (token == "f") {
-        face_pos_indices.clear();
-        face_normal_indices.clear();
+// Splits `text` into about `chunk_count` pieces, each ending on a line break.
+std::vector<std::string_view> SplitIntoChunks(std::string_view text,
+                                              size_t chunk_count) {
+  std::vector<std::string_view> chunks;
+  size_t chunk_size = text.size() / chunk_count + 1;
 
-        int i;
-        while (sstrm >> i)
-          face_pos_indices.push_back(i);
+  size_t begin = 0;
+  while (begin < text.size()) {
+    size_t end = std::min(begin + chunk_size, text.size());
+    end = text.find('\n', end);
+    end = end == std::string_view::npos ? text.size() : end + 1;
 
-        int top_pos_idx = positions.size();
-        for (int i = 0; i < face_pos_indices.size(); ++i) {
-          if (face_pos_indices[i] < 0)
-            face_pos_indices[i] = top_pos_idx + face_pos_indices[i];
+    chunks.push_back(text.substr(begin, end - begin));
+    begin = end;
+  }
+  return chunks;
+}
 
-          if (face_pos_indices[i] < 0)
-            return false;
-        }
+// Resolves face indices and materials against the earlier chunks. Has to run
+// over the chunks in file order.
+bool MergeChunks(std::vector<ChunkResult>* chunks,
+                 std::vector<Material>* materials,
+                 std::vector<std::string>* source_paths) {
+  std::unordered_map<std::string, int> mtl_name_to_idx;
 
-        if (face_pos_indices.size() == 3) {
-          model.positions.push_back(positions[face_pos_indices[0]]);
-          model.positions.push_back(positions[face_pos_indices[1]]);
-          model.positions.push_back(positions[face_pos_indices[2]]);
-
-          if (face_normal_indices.empty()) {
-            glm::vec3 n1 = glm::cross(positions[face_pos_indices[1]] -
-                                          positions[face_pos_indices[0]],
-                                      positions[face_pos_indices[2]] -
-                                          positions[face_pos_indices[0]]);
-            n1 = glm::normalize(n1);
-            model.normals.push_back(n1);
-            model.normals.push_back(n1);
-            model.normals.push_back(n1);
-          }
-
-          model.material_indices.push_back(mtl_idx);
-          model.material_indices.push_back(mtl_idx);
-          model.material_indices.push_back(mtl_idx);
-
-          model.index_buffer.push_back(current_idx);
-          model.index_buffer.push_back(current_idx + 1);
-          model.index_buffer.push_back(current_idx + 2);
-
-          current_idx += 3;
-        } else if (face_pos_indices.size() == 4) {
-          model.positions.push_back(positions[face_pos_indices[0]]);
-          model.positions.push_back(positions[face_pos_indices[1]]);
-          model.positions.push_back(positions[face_pos_indices[2]]);
-          model.positions.push_back(positions[face_pos_indices[0]]);
-          model.positions.push_back(positions[face_pos_indices[2]]);
-          model.positions.push_back(positions[face_pos_indices[3]]);
-
-          if (face_normal_indices.empty()) {
-            glm::vec3 n1 = glm::cross(positions[face_pos_indices[1]] -
-                                          positions[face_pos_indices[0]],
-                                      positions[face_pos_indices[2]] -
-                                          positions[face_pos_indices[0]]);
-            glm::vec3 n2 = glm::cross(positions[face_pos_indices[2]] -
-                                          positions[face_pos_indices[0]],
-                                      positions[face_pos_indices[3]] -
-                                          positions[face_pos_indices[0]]);
-            n1 = glm::normalize(n1);
-            n2 = glm::normalize(n2);
-            model.normals.push_back(n1);
-            model.normals.push_back(n1);
-            model.normals.push_back(n1);
-            model.normals.push_back(n2);
-            model.normals.push_back(n2);
-            model.normals.push_back(n2);
-          }
-
-          model.material_indices.push_back(mtl_idx);
-          model.material_indices.push_back(mtl_idx);
-          model.material_indices.push_back(mtl_idx);
-          model.material_indices.push_back(mtl_idx);
-          model.material_indices.push_back(mtl_idx);
-          model.material_indices.push_back(mtl_idx);
-
-          model.index_buffer.push_back(current_idx);
-          model.index_buffer.push_back(current_idx + 1);
-          model.index_buffer.push_back(current_idx + 2);
-          model.index_buffer.push_back(current_idx + 3);
-          model.index_buffer.push_back(current_idx + 4);
-          model.index_buffer.push_back(current_idx + 5);
-
-          current_idx += 6;
-        } else {
+  size_t vertex_count = 0;
+  size_t triangle_count = 0;
+  uint32_t current_mtl_idx = 0;
+
+  for (ChunkResult& chunk : *chunks) {
+    if (!chunk.ok)
+      return false;
+
+    // Material libraries only affect later usemtl records, but every usemtl
+    // name is resolved against the final table, so they can be loaded up
+    // front.
+    for (std::string_view mtl_path : chunk.mtllib_paths) {
+      source_paths->emplace_back(mtl_path);
+      if (!LoadMaterialFile(std::string(mtl_path), materials,
+                            &mtl_name_to_idx)) {
+        return false;
+      }
+    }
+
+    chunk.vertex_offset = vertex_count;
+    chunk.triangle_offset = triangle_count;
+    vertex_count += chunk.positions.size();
+    triangle_count += chunk.triangle_count;
+  }
+
+  for (ChunkResult& chunk : *chunks) {
+    chunk.inherited_mtl_idx = current_mtl_idx;
+
+    for (std::string_view mtl_name : chunk.usemtl_names) {
+      auto it = mtl_name_to_idx.find(std::string(mtl_name));
+      if (it == mtl_name_to_idx.end())
+        return false;
+      chunk.usemtl_indices.push_back(it->second);
+    }
+    if (!chunk.usemtl_indices.empty())
+      current_mtl_idx = chunk.usemtl_indices.back();
+
+    for (Face& face : chunk.faces) {
+      for (int i = 0; i < face.corner_count; ++i) {
+        FaceCorner& corner = face.corners[i];
+        if (corner.is_relative)
+          corner.index += static_cast<int>(chunk.vertex_offset);
+
+        if (corner.index < 0 ||
+            corner.index >= static_cast<int>(vertex_count)) {
           return false;
         }
       }
     }
   }
+  return true;
+}
+
+// Finds file-wide vertex `index`, which can live in any of the chunks.
+const glm::vec3& LookUpPosition(const std::vector<ChunkResult>& chunks,
+                                const std::vector<size_t>& chunk_starts,
+                                int index) {
+  auto it = std::upper_bound(chunk_starts.begin(), chunk_starts.end(),
+                             static_cast<size_t>(index));
+  size_t chunk_idx = std::distance(chunk_starts.begin(), it) - 1;
+  return chunks[chunk_idx].positions[index - chunk_starts[chunk_idx]];
+}
+
+// Writes the triangles of one chunk into its slice of the model. Normals are
+// generated separately.
+void EmitChunkTriangles(const std::vector<ChunkResult>& chunks,
+                        const std::vector<size_t>& chunk_starts,
+                        size_t chunk_idx, Model* model) {
+  const ChunkResult& chunk = chunks[chunk_idx];
+  size_t vertex = chunk.triangle_offset * 3;
+
+  auto position_at = [&](const FaceCorner& corner) -> const glm::vec3& {
+    size_t index = static_cast<size_t>(corner.index);
+    if (index >= chunk.vertex_offset &&
+        index < chunk.vertex_offset + chunk.positions.size()) {
+      return chunk.positions[index - chunk.vertex_offset];
+    }
+    return LookUpPosition(chunks, chunk_starts, corner.index);
+  };
+
+  for (const Face& face : chunk.faces) {
+    uint32_t mtl_idx = face.usemtl_slot < 0 ?
+        chunk.inherited_mtl_idx : chunk.usemtl_indices[face.usemtl_slot];
+
+    // Quads are split into (0, 1, 2) and (0, 2, 3).
+    for (int i = 2; i < face.corner_count; ++i) {
+      const FaceCorner* corners[] = {
+        &face.corners[0], &face.corners[i - 1], &face.corners[i]
+      };
+      for (const FaceCorner* corner : corners) {
+        model->positions[vertex] = position_at(*corner);
+        model->material_indices[vertex] = mtl_idx;
+        model->index_buffer[vertex] = static_cast<uint32_t>(vertex);
+        ++vertex;
+      }
+    }
+  }
+}
+
+// Flat normals for the triangles in [begin, end).
+void GenerateFlatNormals(size_t begin, size_t end, Model* model) {
+  for (size_t i = begin; i < end; ++i) {
+    const glm::vec3& p0 = model->positions[i * 3];
+    const glm::vec3& p1 = model->positions[i * 3 + 1];
+    const glm::vec3& p2 = model->positions[i * 3 + 2];
+
+    glm::vec3 normal = glm::normalize(glm::cross(p1 - p0, p2 - p0));
+    model->normals[i * 3] = normal;
+    model->normals[i * 3 + 1] = normal;
+    model->normals[i * 3 + 2] = normal;
+  }
+}
+
+// Maps each component from [-1, 1] onto 10 unsigned normalized bits.
+uint32_t PackNormal(const glm::vec3& normal) {
+  uint32_t packed = 0;
+  for (int i = 0; i < 3; ++i) {
+    float unorm = std::clamp(normal[i] * 0.5f + 0.5f, 0.f, 1.f);
+    packed |= static_cast<uint32_t>(std::lround(unorm * 1023.f)) << (i * 10);
+  }
+  return packed;
+}
 
-  model.materials = std::move(materials);
+}  // namespace
+
+bool LoadModel(const std::string& obj_path, Model* out_model,
+               bool optimize_mesh, ThreadPool* thread_pool) {
+  std::string contents;
+  if (!ReadFile(obj_path, &contents))
+    return false;
+
+  std::string_view text = contents;
+
+  size_t chunk_count = 1;
+  if (thread_pool != nullptr) {
+    chunk_count = std::clamp<size_t>(text.size() / kMinChunkSize, 1,
+                                     thread_pool->GetThreadCount());
+  }
+
+  std::vector<std::string_view> chunk_texts =
+      SplitIntoChunks(text, chunk_count);
+  std::vector<ChunkResult> chunks(chunk_texts.size());
+
+  auto parse_chunks = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      ParseChunk(chunk_texts[i], &chunks[i]);
+  };
+  if (thread_pool != nullptr) {
+    thread_pool->ParallelFor(chunks.size(), 1, parse_chunks);
+  } else {
+    parse_chunks(0, chunks.size());
+  }
+
+  Model model;
+  model.source_paths.push_back(obj_path);
+  if (!MergeChunks(&chunks, &model.materials, &model.source_paths))
+    return false;
+
+  std::vector<size_t> chunk_starts;
+  size_t triangle_count = 0;
+  for (const ChunkResult& chunk : chunks) {
+    chunk_starts.push_back(chunk.vertex_offset);
+    triangle_count += chunk.triangle_count;
+  }
+
+  model.positions.resize(triangle_count * 3);
+  model.normals.resize(triangle_count * 3);
+  model.material_indices.resize(triangle_count * 3);
+  model.index_buffer.resize(triangle_count * 3);
+
+  auto emit_chunks = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      EmitChunkTriangles(chunks, chunk_starts, i, &model);
+  };
+  auto generate_normals = [&](size_t begin, size_t end) {
+    GenerateFlatNormals(begin, end, &model);
+  };
+
+  if (thread_pool != nullptr) {
+    thread_pool->ParallelFor(chunks.size(), 1, emit_chunks);
+    thread_pool->ParallelFor(triangle_count, kNormalGrainSize,
+                             generate_normals);
+  } else {
+    emit_chunks(0, chunks.size());
+    generate_normals(0, triangle_count);
+  }
+
+  if (optimize_mesh)
+    OptimizeMesh(&model);
 
   *out_model = std::move(model);
 
   return true;
 }
 
+std::vector<PackedVertex> PackVertices(const Model& model) {
+  std::vector<PackedVertex> vertices(model.positions.size());
+
+  for (size_t i = 0; i < vertices.size(); ++i) {
+    vertices[i].position = model.positions[i];
+    vertices[i].normal = PackNormal(model.normals[i]);
+    vertices[i].material_idx =
+        static_cast<uint16_t>(model.material_indices[i]);
+    vertices[i].padding = 0;
+  }
+  return vertices;
+}
+
+bool FitsInUint16Indices(const Model& model) {
+  // The indices of each LOD are relative to its own vertices, so the vertex
+  // count can be larger.
+  for (uint32_t index : model.index_buffer) {
+    if (index > std::numeric_limits<uint16_t>::max())
+      return false;
+  }
+  return true;
+}
+
 }  // namespace utils
\ No newline at end of file
@@ -9,22 +9,61 @@
 
 namespace utils {
 
+class ThreadPool;
+
 struct Material {
   glm::vec3 ambient_color;
   glm::vec3 diffuse_color;
 };
 
+// Range of a level of detail in Model::index_buffer. Its indices are
+// relative to `vertex_offset`, as with VkDrawIndexedIndirectCommand.
+struct MeshLod {
+  uint32_t first_index;
+  uint32_t index_count;
+  int32_t vertex_offset;
+
+  // How far the level strays from the full detail mesh, in model units.
+  float error;
+};
+
 struct Model {
   std::vector<glm::vec3> positions;
   std::vector<glm::vec3> normals;
-  std::vector<uint16_t> index_buffer;
+  std::vector<uint32_t> index_buffer;
 
   std::vector<uint32_t> material_indices;
 
   std::vector<Material> materials;
+
+  // Finest first, see GenerateLods(). Empty if the whole mesh is a single
+  // level.
+  std::vector<MeshLod> lods;
+
+  // Files the model was read from, the OBJ file first.
+  std::vector<std::string> source_paths;
+};
+
+// Interleaved vertex layout. The normal is packed as A2B10G10R10_UNORM and the
+// material index as R16_UINT, for 20 bytes per vertex instead of 28 across
+// three streams.
+struct PackedVertex {
+  glm::vec3 position;
+  uint32_t normal;
+  uint16_t material_idx;
+  uint16_t padding;
 };
 
-bool LoadModel(const std::string& obj_path, Model* out_model);
+// With `optimize_mesh` set, identical vertices are welded and the mesh is
+// reordered for the vertex cache (see mesh_optimizer.h). Large files are
+// parsed in parallel on `thread_pool` when one is given.
+bool LoadModel(const std::string& obj_path, Model* out_model,
+               bool optimize_mesh = false, ThreadPool* thread_pool = nullptr);
+
+std::vector<PackedVertex> PackVertices(const Model& model);
+
+// Whether every index in the model fits in a 16-bit index buffer.
+bool FitsInUint16Indices(const Model& model);
 
 }  // namespace utils
 
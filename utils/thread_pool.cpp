@@ -0,0 +1,74 @@
+#include "utils/thread_pool.h"
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utils {
+
+ThreadPool::ThreadPool(int thread_count) {
+  if (thread_count <= 0)
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+  threads_.reserve(thread_count);
+  for (int i = 0; i < thread_count; ++i)
+    threads_.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  condition_.notify_all();
+
+  for (std::thread& thread : threads_)
+    thread.join();
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grain_size,
+                             const std::function<void(size_t, size_t)>& fn) {
+  if (count == 0)
+    return;
+
+  grain_size = std::max<size_t>(grain_size, 1);
+
+  // Not worth a round trip through the queue.
+  if (count <= grain_size) {
+    fn(0, count);
+    return;
+  }
+
+  std::vector<std::future<void>> futures;
+  futures.reserve((count + grain_size - 1) / grain_size);
+
+  for (size_t begin = 0; begin < count; begin += grain_size) {
+    size_t end = std::min(begin + grain_size, count);
+    futures.push_back(Submit([&fn, begin, end]() { fn(begin, end); }));
+  }
+
+  for (std::future<void>& future : futures)
+    future.get();
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+
+      if (stopping_ && tasks_.empty())
+        return;
+
+      task = std::move(tasks_.front());
+      tasks_.pop();
+    }
+    task();
+  }
+}
+
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef UTILS_THREAD_POOL_H_
+#define UTILS_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace utils {
+
+// Fixed set of worker threads pulling tasks off a shared FIFO queue.
+class ThreadPool {
+public:
+  // Zero picks one thread per hardware thread.
+  explicit ThreadPool(int thread_count = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  template<typename F>
+  std::future<std::invoke_result_t<F>> Submit(F&& task) {
+    using Result = std::invoke_result_t<F>;
+
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(
+        std::forward<F>(task));
+    std::future<Result> future = packaged->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.emplace([packaged]() { (*packaged)(); });
+    }
+    condition_.notify_one();
+    return future;
+  }
+
+  // Splits [0, count) into ranges of at most `grain_size` and calls
+  // fn(begin, end) for each of them on the pool. Returns once all of them
+  // have finished. Must not be called from one of the pool's own tasks.
+  void ParallelFor(size_t count, size_t grain_size,
+                   const std::function<void(size_t, size_t)>& fn);
+
+  int GetThreadCount() const { return static_cast<int>(threads_.size()); }
+
+private:
+  void WorkerLoop();
+
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::queue<std::function<void()>> tasks_;
+  bool stopping_ = false;
+};
+
+}  // namespace utils
+
+#endif  // UTILS_THREAD_POOL_H_
\ No newline at end of file
@@ -0,0 +1,67 @@
+#include "utils/timing_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace utils {
+
+namespace {
+
+double Percentile(const std::vector<double>& sorted_samples,
+                  double percentile) {
+  size_t rank = static_cast<size_t>(
+      std::ceil(percentile * static_cast<double>(sorted_samples.size())));
+  return sorted_samples[std::clamp<size_t>(rank, 1, sorted_samples.size()) -
+                        1];
+}
+
+}  // namespace
+
+SampleHistory::SampleHistory(int capacity)
+    : capacity_(static_cast<size_t>(std::max(capacity, 0))) {
+  samples_.reserve(capacity_);
+}
+
+void SampleHistory::Add(double milliseconds) {
+  if (capacity_ == 0)
+    return;
+
+  if (samples_.size() < capacity_) {
+    samples_.push_back(milliseconds);
+  } else {
+    samples_[next_sample_] = milliseconds;
+  }
+  next_sample_ = (next_sample_ + 1) % capacity_;
+}
+
+void SampleHistory::Clear() {
+  samples_.clear();
+  next_sample_ = 0;
+}
+
+TimingStats SampleHistory::GetStats() const {
+  TimingStats stats;
+  if (samples_.empty())
+    return stats;
+
+  std::vector<double> sorted_samples = samples_;
+  std::sort(sorted_samples.begin(), sorted_samples.end());
+
+  double sum = 0.0;
+  for (double sample : sorted_samples) {
+    sum += sample;
+  }
+
+  stats.sample_count = static_cast<int>(sorted_samples.size());
+  stats.mean_ms = sum / static_cast<double>(sorted_samples.size());
+  stats.p50_ms = Percentile(sorted_samples, 0.5);
+  stats.p95_ms = Percentile(sorted_samples, 0.95);
+  stats.p99_ms = Percentile(sorted_samples, 0.99);
+  stats.max_ms = sorted_samples.back();
+
+  return stats;
+}
+
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef UTILS_TIMING_STATS_H_
+#define UTILS_TIMING_STATS_H_
+
+#include <cstddef>
+#include <vector>
+
+namespace utils {
+
+struct TimingStats {
+  int sample_count = 0;
+  double mean_ms = 0.0;
+  double p50_ms = 0.0;
+  double p95_ms = 0.0;
+  double p99_ms = 0.0;
+  double max_ms = 0.0;
+};
+
+// Ring of the most recent `capacity` timing samples, in milliseconds. The
+// storage is allocated up front, so adding a sample never allocates.
+class SampleHistory {
+public:
+  explicit SampleHistory(int capacity = 0);
+
+  void Add(double milliseconds);
+  void Clear();
+
+  // Percentiles are nearest rank.
+  TimingStats GetStats() const;
+
+private:
+  std::vector<double> samples_;
+  size_t capacity_;
+  size_t next_sample_ = 0;
+};
+
+}  // namespace utils
+
+#endif  // UTILS_TIMING_STATS_H_
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef UTILS_TRIPLE_BUFFER_H_
+#define UTILS_TRIPLE_BUFFER_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace utils {
+
+// Hands the latest value from one producer thread to one consumer thread
+// without locks. The producer always has a buffer of its own to write and the
+// consumer always has one to read, so neither ever waits for the other. Values
+// the consumer doesn't get to before the next Publish() are dropped.
+template<typename T>
+class TripleBuffer {
+public:
+  TripleBuffer() = default;
+
+  TripleBuffer(const TripleBuffer&) = delete;
+  TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+  // Producer only. The buffer to fill in before the next Publish().
+  T& GetWriteBuffer() { return buffers_[write_index_]; }
+
+  // Producer only. Makes the write buffer the latest value.
+  void Publish() {
+    uint8_t previous = shared_.exchange(write_index_ | kFreshBit,
+                                        std::memory_order_acq_rel);
+    write_index_ = previous & kIndexMask;
+  }
+
+  // Consumer only. Returns the latest published value, which stays valid and
+  // unchanged until the next call. Returns a default constructed T until the
+  // first Publish().
+  const T& Read() {
+    if (shared_.load(std::memory_order_relaxed) & kFreshBit) {
+      uint8_t previous = shared_.exchange(read_index_,
+                                          std::memory_order_acq_rel);
+      read_index_ = previous & kIndexMask;
+    }
+    return buffers_[read_index_];
+  }
+
+private:
+  static constexpr uint8_t kIndexMask = 0x3;
+
+  // Set on the shared index when it holds a value the consumer hasn't seen.
+  static constexpr uint8_t kFreshBit = 0x4;
+
+  T buffers_[3] = {};
+
+  // The buffer that is neither being written nor read.
+  std::atomic<uint8_t> shared_ = 1;
+
+  uint8_t write_index_ = 0;
+  uint8_t read_index_ = 2;
+};
+
+}  // namespace utils
+
+#endif  // UTILS_TRIPLE_BUFFER_H_
\ No newline at end of file
@@ -135,10 +135,20 @@ bool CreateShaderModulesFromFiles(const std::vector<std::string>& file_paths,
                                   std::vector<VkShaderModule>* shader_modules) {
   shader_modules->clear();
 
+  // Leaves nothing behind on failure.
+  auto destroy_modules = [device, shader_modules]() {
+    for (VkShaderModule shader_module : *shader_modules) {
+      vkDestroyShaderModule(device, shader_module, nullptr);
+    }
+    shader_modules->clear();
+  };
+
   for (const std::string& path : file_paths) {
     std::vector<char> data = LoadShaderFile(path);
-    if (data.empty())
+    if (data.empty()) {
+      destroy_modules();
       return false;
+    }
 
     VkShaderModuleCreateInfo shader_module_info{};
     shader_module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -148,6 +158,7 @@ bool CreateShaderModulesFromFiles(const std::vector<std::string>& file_paths,
     VkShaderModule shader_module;
     if (vkCreateShaderModule(device, &shader_module_info, nullptr,
                              &shader_module) != VK_SUCCESS) {
+      destroy_modules();
       return false;
     }
 
@@ -211,5 +222,46 @@ bool CreateBuffer(const VkBufferCreateInfo& buffer_info,
   return true;
 }
 
+bool CreateImage(const VkImageCreateInfo& image_info,
+                 VkMemoryPropertyFlags mem_properties, VkDevice device,
+                 MemoryAllocator* allocator, VkImage& image,
+                 Allocation& allocation) {
+  if (vkCreateImage(device, &image_info, nullptr, &image) != VK_SUCCESS)
+    return false;
+
+  VkMemoryRequirements mem_requirements;
+  vkGetImageMemoryRequirements(device, image, &mem_requirements);
+
+  bool is_linear = image_info.tiling == VK_IMAGE_TILING_LINEAR;
+  if (!allocator->Allocate(mem_requirements, mem_properties, is_linear,
+                           &allocation)) {
+    vkDestroyImage(device, image, nullptr);
+    return false;
+  }
+  vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+
+  return true;
+}
+
+bool CreateBuffer(const VkBufferCreateInfo& buffer_info,
+                  VkMemoryPropertyFlags mem_properties, VkDevice device,
+                  MemoryAllocator* allocator, VkBuffer& buffer,
+                  Allocation& allocation) {
+  if (vkCreateBuffer(device, &buffer_info, nullptr, &buffer) != VK_SUCCESS)
+    return false;
+
+  VkMemoryRequirements mem_requirements;
+  vkGetBufferMemoryRequirements(device, buffer, &mem_requirements);
+
+  if (!allocator->Allocate(mem_requirements, mem_properties, true,
+                           &allocation)) {
+    vkDestroyBuffer(device, buffer, nullptr);
+    return false;
+  }
+  vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+
+  return true;
+}
+
 }  // namespace vk
 }  // namespace utils
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <string>
 #include <vector>
 
+#include "utils/vk_allocator.h"
+
 namespace utils {
 namespace vk {
 
@@ -44,6 +46,19 @@ bool CreateBuffer(const VkBufferCreateInfo& buffer_info,
                   VkPhysicalDevice physical_device, VkDevice device,
                   VkBuffer& buffer, VkDeviceMemory& memory);
 
+// Same as above, but the memory is sub-allocated from `allocator`. The
+// allocation has to be handed back to MemoryAllocator::Free after the
+// resource is destroyed.
+bool CreateImage(const VkImageCreateInfo& image_info,
+                 VkMemoryPropertyFlags mem_properties, VkDevice device,
+                 MemoryAllocator* allocator, VkImage& image,
+                 Allocation& allocation);
+
+bool CreateBuffer(const VkBufferCreateInfo& buffer_info,
+                  VkMemoryPropertyFlags mem_properties, VkDevice device,
+                  MemoryAllocator* allocator, VkBuffer& buffer,
+                  Allocation& allocation);
+
 }  // namespace vk
 }  // namespace utils
 
@@ -0,0 +1,287 @@
+#include "utils/vk_allocator.h"
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace utils {
+namespace vk {
+
+struct MemoryBlock {
+  struct Range {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+  };
+
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize size = 0;
+  uint32_t memory_type_index = 0;
+  bool is_linear = false;
+  bool is_dedicated = false;
+  void* mapped_data = nullptr;
+
+  // Sorted by offset. Adjacent ranges are always merged.
+  std::vector<Range> free_ranges;
+
+  VkDeviceSize bytes_used = 0;
+  uint32_t allocation_count = 0;
+};
+
+namespace {
+
+VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+  if (alignment == 0)
+    return value;
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// First fit. The padding in front of the aligned offset stays in the free
+// list.
+bool AllocateFromBlock(MemoryBlock* block, VkDeviceSize size,
+                       VkDeviceSize alignment, VkDeviceSize* offset) {
+  for (auto it = block->free_ranges.begin(); it != block->free_ranges.end();
+       ++it) {
+    VkDeviceSize aligned_offset = AlignUp(it->offset, alignment);
+    VkDeviceSize padding = aligned_offset - it->offset;
+    if (padding + size > it->size)
+      continue;
+
+    MemoryBlock::Range tail{aligned_offset + size, it->size - padding - size};
+
+    if (padding > 0) {
+      it->size = padding;
+      if (tail.size > 0)
+        block->free_ranges.insert(std::next(it), tail);
+    } else if (tail.size > 0) {
+      *it = tail;
+    } else {
+      block->free_ranges.erase(it);
+    }
+
+    *offset = aligned_offset;
+    return true;
+  }
+  return false;
+}
+
+void FreeToBlock(MemoryBlock* block, VkDeviceSize offset, VkDeviceSize size) {
+  auto& ranges = block->free_ranges;
+  auto next = std::upper_bound(
+      ranges.begin(), ranges.end(), offset,
+      [](VkDeviceSize value, const MemoryBlock::Range& range) {
+        return value < range.offset;
+      });
+  auto it = ranges.insert(next, MemoryBlock::Range{offset, size});
+
+  auto after = std::next(it);
+  if (after != ranges.end() && it->offset + it->size == after->offset) {
+    it->size += after->size;
+    ranges.erase(after);
+  }
+
+  if (it != ranges.begin()) {
+    auto before = std::prev(it);
+    if (before->offset + before->size == it->offset) {
+      before->size += it->size;
+      ranges.erase(it);
+    }
+  }
+}
+
+}  // namespace
+
+MemoryAllocator::MemoryAllocator() = default;
+
+MemoryAllocator::~MemoryAllocator() = default;
+
+bool MemoryAllocator::Init(VkPhysicalDevice physical_device, VkDevice device,
+                           VkDeviceSize block_size) {
+  device_ = device;
+  block_size_ = block_size;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props_);
+  return true;
+}
+
+void MemoryAllocator::Destroy() {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  for (auto& block : blocks_) {
+    if (block->mapped_data != nullptr)
+      vkUnmapMemory(device_, block->memory);
+    vkFreeMemory(device_, block->memory, nullptr);
+  }
+  blocks_.clear();
+}
+
+bool MemoryAllocator::Allocate(const VkMemoryRequirements& mem_requirements,
+                               VkMemoryPropertyFlags mem_properties,
+                               bool is_linear, Allocation* allocation) {
+  uint32_t memory_type_index;
+  if (!FindMemoryType(mem_requirements.memoryTypeBits, mem_properties,
+                      &memory_type_index)) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  MemoryBlock* block = nullptr;
+  VkDeviceSize offset = 0;
+
+  if (mem_requirements.size > block_size_) {
+    block = CreateBlock(memory_type_index, mem_requirements.size, is_linear,
+                        true);
+    if (block == nullptr)
+      return false;
+    block->free_ranges.clear();
+  } else {
+    for (auto& candidate : blocks_) {
+      if (candidate->is_dedicated ||
+          candidate->memory_type_index != memory_type_index ||
+          candidate->is_linear != is_linear) {
+        continue;
+      }
+      if (AllocateFromBlock(candidate.get(), mem_requirements.size,
+                            mem_requirements.alignment, &offset)) {
+        block = candidate.get();
+        break;
+      }
+    }
+
+    if (block == nullptr) {
+      block = CreateBlock(memory_type_index, block_size_, is_linear, false);
+      if (block == nullptr)
+        return false;
+      AllocateFromBlock(block, mem_requirements.size,
+                        mem_requirements.alignment, &offset);
+    }
+  }
+
+  block->bytes_used += mem_requirements.size;
+  block->allocation_count++;
+
+  allocation->memory = block->memory;
+  allocation->offset = offset;
+  allocation->size = mem_requirements.size;
+  allocation->mapped_data = nullptr;
+  if (block->mapped_data != nullptr) {
+    allocation->mapped_data =
+        static_cast<char*>(block->mapped_data) + offset;
+  }
+  allocation->block = block;
+
+  return true;
+}
+
+void MemoryAllocator::Free(const Allocation& allocation) {
+  MemoryBlock* block = allocation.block;
+  if (block == nullptr)
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  block->bytes_used -= allocation.size;
+  block->allocation_count--;
+
+  if (block->is_dedicated) {
+    DestroyBlock(block);
+    return;
+  }
+
+  FreeToBlock(block, allocation.offset, allocation.size);
+
+  if (block->allocation_count > 0)
+    return;
+
+  for (const auto& other : blocks_) {
+    if (other.get() != block && !other->is_dedicated &&
+        other->allocation_count == 0 &&
+        other->memory_type_index == block->memory_type_index &&
+        other->is_linear == block->is_linear) {
+      DestroyBlock(block);
+      return;
+    }
+  }
+}
+
+MemoryStats MemoryAllocator::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  MemoryStats stats;
+  for (const auto& block : blocks_) {
+    stats.bytes_used += block->bytes_used;
+    stats.bytes_reserved += block->size;
+    stats.allocation_count += block->allocation_count;
+    stats.block_count++;
+  }
+  return stats;
+}
+
+bool MemoryAllocator::FindMemoryType(uint32_t memory_type_bits,
+                                     VkMemoryPropertyFlags mem_properties,
+                                     uint32_t* memory_type_index) const {
+  for (uint32_t i = 0; i < mem_props_.memoryTypeCount; i++) {
+    if ((memory_type_bits & (1 << i)) &&
+        (mem_props_.memoryTypes[i].propertyFlags & mem_properties)
+             == mem_properties) {
+      *memory_type_index = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+MemoryBlock* MemoryAllocator::CreateBlock(uint32_t memory_type_index,
+                                          VkDeviceSize size, bool is_linear,
+                                          bool is_dedicated) {
+  VkMemoryAllocateInfo mem_alloc_info{};
+  mem_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  mem_alloc_info.allocationSize = size;
+  mem_alloc_info.memoryTypeIndex = memory_type_index;
+
+  auto block = std::make_unique<MemoryBlock>();
+  if (vkAllocateMemory(device_, &mem_alloc_info, nullptr, &block->memory)
+          != VK_SUCCESS) {
+    return nullptr;
+  }
+
+  block->size = size;
+  block->memory_type_index = memory_type_index;
+  block->is_linear = is_linear;
+  block->is_dedicated = is_dedicated;
+  block->free_ranges.push_back(MemoryBlock::Range{0, size});
+
+  VkMemoryPropertyFlags flags =
+      mem_props_.memoryTypes[memory_type_index].propertyFlags;
+  if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    if (vkMapMemory(device_, block->memory, 0, VK_WHOLE_SIZE, 0,
+                    &block->mapped_data) != VK_SUCCESS) {
+      vkFreeMemory(device_, block->memory, nullptr);
+      return nullptr;
+    }
+  }
+
+  blocks_.push_back(std::move(block));
+  return blocks_.back().get();
+}
+
+void MemoryAllocator::DestroyBlock(MemoryBlock* block) {
+  auto it = std::find_if(blocks_.begin(), blocks_.end(),
+                         [block](const std::unique_ptr<MemoryBlock>& b) {
+                           return b.get() == block;
+                         });
+  if (it == blocks_.end())
+    return;
+
+  if (block->mapped_data != nullptr)
+    vkUnmapMemory(device_, block->memory);
+  vkFreeMemory(device_, block->memory, nullptr);
+
+  blocks_.erase(it);
+}
+
+}  // namespace vk
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,88 @@
+#ifndef UTILS_VK_ALLOCATOR_H_
+#define UTILS_VK_ALLOCATOR_H_
+
+#include <vulkan/vulkan.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace utils {
+namespace vk {
+
+struct MemoryBlock;
+
+// A range of a VkDeviceMemory block handed out by MemoryAllocator.
+struct Allocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+
+  // Points at the start of the allocation if its memory is host visible.
+  // Blocks are mapped once for their whole lifetime, so vkMapMemory must not
+  // be called on `memory`.
+  void* mapped_data = nullptr;
+
+  MemoryBlock* block = nullptr;
+};
+
+struct MemoryStats {
+  // Bytes handed out to live allocations. The alignment padding in front of
+  // an allocation stays free, so it isn't counted.
+  VkDeviceSize bytes_used = 0;
+  // Bytes allocated from the driver with vkAllocateMemory.
+  VkDeviceSize bytes_reserved = 0;
+
+  uint32_t allocation_count = 0;
+  uint32_t block_count = 0;
+};
+
+// Sub-allocates buffers and images out of large VkDeviceMemory blocks, one
+// set of blocks per memory type.
+//
+// Linear resources (buffers and linear images) and optimal images never share
+// a block, so bufferImageGranularity never has to be considered within a
+// block. Requests bigger than the block size get a dedicated block that is
+// released as soon as it is freed. Blocks left empty are released too, except
+// for one per memory type and kind of resource, which is kept so that a
+// resource that is freed and created again doesn't go back to the driver.
+// Thread safe.
+class MemoryAllocator {
+public:
+  static constexpr VkDeviceSize kDefaultBlockSize = 64ull * 1024 * 1024;
+
+  MemoryAllocator();
+  ~MemoryAllocator();
+
+  bool Init(VkPhysicalDevice physical_device, VkDevice device,
+            VkDeviceSize block_size = kDefaultBlockSize);
+  void Destroy();
+
+  bool Allocate(const VkMemoryRequirements& mem_requirements,
+                VkMemoryPropertyFlags mem_properties, bool is_linear,
+                Allocation* allocation);
+  void Free(const Allocation& allocation);
+
+  MemoryStats GetStats() const;
+
+private:
+  bool FindMemoryType(uint32_t memory_type_bits,
+                      VkMemoryPropertyFlags mem_properties,
+                      uint32_t* memory_type_index) const;
+
+  MemoryBlock* CreateBlock(uint32_t memory_type_index, VkDeviceSize size,
+                           bool is_linear, bool is_dedicated);
+  void DestroyBlock(MemoryBlock* block);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties mem_props_{};
+  VkDeviceSize block_size_ = kDefaultBlockSize;
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<MemoryBlock>> blocks_;
+};
+
+}  // namespace vk
+}  // namespace utils
+
+#endif  // UTILS_VK_ALLOCATOR_H_
\ No newline at end of file
@@ -0,0 +1,53 @@
+#include "utils/vk_frame_pacer.h"
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+
+namespace utils {
+namespace vk {
+
+bool FramePacer::Init(VkDevice device) {
+  device_ = device;
+  next_value_ = 1;
+
+  wait_semaphores_ = reinterpret_cast<PFN_vkWaitSemaphoresKHR>(
+      vkGetDeviceProcAddr(device_, "vkWaitSemaphoresKHR"));
+  if (wait_semaphores_ == nullptr)
+    return false;
+
+  VkSemaphoreTypeCreateInfoKHR semaphore_type_info{};
+  semaphore_type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+  semaphore_type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+  semaphore_type_info.initialValue = 0;
+
+  VkSemaphoreCreateInfo semaphore_info{};
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphore_info.pNext = &semaphore_type_info;
+
+  return vkCreateSemaphore(device_, &semaphore_info, nullptr, &semaphore_) ==
+      VK_SUCCESS;
+}
+
+void FramePacer::Destroy() {
+  WaitIdle();
+
+  vkDestroySemaphore(device_, semaphore_, nullptr);
+  semaphore_ = VK_NULL_HANDLE;
+}
+
+bool FramePacer::Wait(uint64_t value) {
+  if (value == 0)
+    return true;
+
+  VkSemaphoreWaitInfoKHR wait_info{};
+  wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &semaphore_;
+  wait_info.pValues = &value;
+
+  return wait_semaphores_(device_, &wait_info, UINT64_MAX) == VK_SUCCESS;
+}
+
+}  // namespace vk
+}  // namespace utils
\ No newline at end of file
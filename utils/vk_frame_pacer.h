@@ -0,0 +1,51 @@
+#ifndef UTILS_VK_FRAME_PACER_H_
+#define UTILS_VK_FRAME_PACER_H_
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+
+namespace utils {
+namespace vk {
+
+// Tracks frame completion with a single timeline semaphore
+// (VK_KHR_timeline_semaphore) instead of one fence per frame.
+//
+// Every frame submission signals the next value of the timeline, so "frame N
+// has finished on the GPU" is just "the timeline has reached N". Any number of
+// frames or swap chain images can wait on the same semaphore by remembering
+// the value of the submission they depend on. Needs the timelineSemaphore
+// feature to be enabled on `device`.
+class FramePacer {
+public:
+  bool Init(VkDevice device);
+  void Destroy();
+
+  VkSemaphore GetSemaphore() const { return semaphore_; }
+
+  // The value the next frame submission has to signal. Call AdvanceValue()
+  // once that submission has been made.
+  uint64_t GetNextValue() const { return next_value_; }
+  void AdvanceValue() { ++next_value_; }
+
+  // Blocks until the submission that signals `value` has completed. Returns
+  // straight away for 0, which no submission signals.
+  bool Wait(uint64_t value);
+
+  // Blocks until every submission made so far has completed.
+  bool WaitIdle() { return Wait(next_value_ - 1); }
+
+private:
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkSemaphore semaphore_ = VK_NULL_HANDLE;
+
+  // The entry point of an extension, so it has to be looked up.
+  PFN_vkWaitSemaphoresKHR wait_semaphores_ = nullptr;
+
+  uint64_t next_value_ = 1;
+};
+
+}  // namespace vk
+}  // namespace utils
+
+#endif  // UTILS_VK_FRAME_PACER_H_
\ No newline at end of file
@@ -0,0 +1,167 @@
+#include "utils/vk_pipeline_cache.h"
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace utils {
+namespace vk {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x43504b56;  // "VKPC"
+
+// Bump whenever the layout of FileHeader changes.
+constexpr uint32_t kVersion = 1;
+
+// Written in front of the blob returned by vkGetPipelineCacheData(). The blob
+// carries its own header with the vendor, device and cache UUID, but not the
+// driver version, and nothing that catches a truncated or corrupted file.
+struct FileHeader {
+  uint32_t magic;
+  uint32_t version;
+
+  uint32_t vendor_id;
+  uint32_t device_id;
+  uint32_t driver_version;
+  uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+
+  uint64_t data_size;
+  uint64_t data_hash;
+};
+
+uint64_t HashData(const uint8_t* data, size_t size) {
+  // FNV-1a.
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+void FillFileHeader(const VkPhysicalDeviceProperties& properties,
+                    FileHeader* header) {
+  memset(header, 0, sizeof(FileHeader));
+  header->magic = kMagic;
+  header->version = kVersion;
+  header->vendor_id = properties.vendorID;
+  header->device_id = properties.deviceID;
+  header->driver_version = properties.driverVersion;
+  memcpy(header->pipeline_cache_uuid, properties.pipelineCacheUUID,
+         VK_UUID_SIZE);
+}
+
+// Returns the cache data in the file, or nothing if it doesn't match
+// `properties`.
+std::vector<uint8_t> LoadCacheData(
+    const std::string& path, const VkPhysicalDeviceProperties& properties) {
+  std::vector<uint8_t> data;
+
+  std::ifstream strm(path, std::ios::ate | std::ios::binary);
+  if (!strm.is_open())
+    return data;
+
+  size_t file_size = strm.tellg();
+  FileHeader header;
+  if (file_size < sizeof(header))
+    return data;
+
+  strm.seekg(0);
+  strm.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+  FileHeader expected;
+  FillFileHeader(properties, &expected);
+
+  if (header.magic != expected.magic ||
+      header.version != expected.version ||
+      header.vendor_id != expected.vendor_id ||
+      header.device_id != expected.device_id ||
+      header.driver_version != expected.driver_version ||
+      memcmp(header.pipeline_cache_uuid, expected.pipeline_cache_uuid,
+             VK_UUID_SIZE) != 0 ||
+      header.data_size != file_size - sizeof(header)) {
+    return data;
+  }
+
+  data.resize(header.data_size);
+  strm.read(reinterpret_cast<char*>(data.data()), data.size());
+
+  if (!strm || HashData(data.data(), data.size()) != header.data_hash)
+    data.clear();
+
+  return data;
+}
+
+}  // namespace
+
+bool CreatePipelineCacheFromFile(const std::string& path,
+                                 VkPhysicalDevice physical_device,
+                                 VkDevice device,
+                                 VkPipelineCache* pipeline_cache) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+  std::vector<uint8_t> data = LoadCacheData(path, properties);
+
+  VkPipelineCacheCreateInfo cache_info{};
+  cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  cache_info.initialDataSize = data.size();
+  cache_info.pInitialData = data.empty() ? nullptr : data.data();
+
+  return vkCreatePipelineCache(device, &cache_info, nullptr,
+                               pipeline_cache) == VK_SUCCESS;
+}
+
+bool SavePipelineCacheToFile(const std::string& path,
+                             VkPhysicalDevice physical_device,
+                             VkDevice device, VkPipelineCache pipeline_cache) {
+  size_t data_size = 0;
+  if (vkGetPipelineCacheData(device, pipeline_cache, &data_size,
+                             nullptr) != VK_SUCCESS) {
+    return false;
+  }
+
+  std::vector<uint8_t> data(data_size);
+  if (vkGetPipelineCacheData(device, pipeline_cache, &data_size,
+                             data.data()) != VK_SUCCESS) {
+    return false;
+  }
+  data.resize(data_size);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+  FileHeader header;
+  FillFileHeader(properties, &header);
+  header.data_size = data.size();
+  header.data_hash = HashData(data.data(), data.size());
+
+  // Written under a temporary name so that a crash half way through never
+  // leaves a truncated cache behind.
+  std::string temp_path = path + ".tmp";
+  {
+    std::ofstream strm(temp_path, std::ios::binary | std::ios::trunc);
+    if (!strm.is_open())
+      return false;
+
+    strm.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    strm.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+    if (!strm)
+      return false;
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temp_path, path, error);
+  return !error;
+}
+
+}  // namespace vk
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef UTILS_VK_PIPELINE_CACHE_H_
+#define UTILS_VK_PIPELINE_CACHE_H_
+
+#include <vulkan/vulkan.h>
+
+#include <string>
+
+namespace utils {
+namespace vk {
+
+// Creates a pipeline cache seeded with the data saved at `path`. The saved
+// data is only used if it was written for the same device, driver version
+// and pipeline cache UUID and is intact; otherwise the cache starts out
+// empty. Only fails if the cache itself cannot be created.
+bool CreatePipelineCacheFromFile(const std::string& path,
+                                 VkPhysicalDevice physical_device,
+                                 VkDevice device,
+                                 VkPipelineCache* pipeline_cache);
+
+// Writes the contents of `pipeline_cache` to `path` for
+// CreatePipelineCacheFromFile() to pick up on the next run.
+bool SavePipelineCacheToFile(const std::string& path,
+                             VkPhysicalDevice physical_device,
+                             VkDevice device, VkPipelineCache pipeline_cache);
+
+}  // namespace vk
+}  // namespace utils
+
+#endif  // UTILS_VK_PIPELINE_CACHE_H_
\ No newline at end of file
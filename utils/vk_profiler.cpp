@@ -0,0 +1,186 @@
+#include "utils/vk_profiler.h"
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils/timing_stats.h"
+
+namespace utils {
+namespace vk {
+
+int GpuProfiler::AddScope(const std::string& name) {
+  Scope scope;
+  scope.name = name;
+  scopes_.push_back(std::move(scope));
+
+  return static_cast<int>(scopes_.size()) - 1;
+}
+
+bool GpuProfiler::Init(VkPhysicalDevice physical_device, VkDevice device,
+                       uint32_t queue_family_index, int slot_count,
+                       int history_size) {
+  device_ = device;
+
+  uint32_t family_count;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+                                           nullptr);
+
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+                                           families.data());
+
+  uint32_t valid_bits = families[queue_family_index].timestampValidBits;
+  if (valid_bits == 0 || scopes_.empty())
+    return false;
+
+  timestamp_mask_ = valid_bits >= 64 ?
+      ~uint64_t{0} : (uint64_t{1} << valid_bits) - 1;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  timestamp_period_ = properties.limits.timestampPeriod;
+
+  for (Scope& scope : scopes_) {
+    scope.history = SampleHistory(history_size);
+  }
+
+  uint32_t query_count = static_cast<uint32_t>(scopes_.size()) * 2;
+  results_.resize(query_count * 2);
+
+  VkQueryPoolCreateInfo query_pool_info{};
+  query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  query_pool_info.queryCount = query_count;
+
+  for (int i = 0; i < slot_count; ++i) {
+    VkQueryPool query_pool;
+    if (vkCreateQueryPool(device_, &query_pool_info, nullptr, &query_pool)
+            != VK_SUCCESS) {
+      Destroy();
+      return false;
+    }
+    query_pools_.push_back(query_pool);
+  }
+
+  return true;
+}
+
+void GpuProfiler::Destroy() {
+  for (VkQueryPool query_pool : query_pools_) {
+    vkDestroyQueryPool(device_, query_pool, nullptr);
+  }
+  query_pools_.clear();
+
+  csv_strm_.close();
+}
+
+void GpuProfiler::ResetSlot(VkCommandBuffer command_buffer, int slot) {
+  if (!IsEnabled())
+    return;
+
+  vkCmdResetQueryPool(command_buffer, query_pools_[slot], 0,
+                      static_cast<uint32_t>(scopes_.size()) * 2);
+}
+
+void GpuProfiler::BeginScope(VkCommandBuffer command_buffer, int slot,
+                             int scope) {
+  if (!IsEnabled())
+    return;
+
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                      query_pools_[slot], scope * 2);
+}
+
+void GpuProfiler::EndScope(VkCommandBuffer command_buffer, int slot,
+                           int scope) {
+  if (!IsEnabled())
+    return;
+
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                      query_pools_[slot], scope * 2 + 1);
+}
+
+double GpuProfiler::Collect(int slot, uint64_t frame) {
+  if (!IsEnabled())
+    return 0.0;
+
+  uint32_t query_count = static_cast<uint32_t>(scopes_.size()) * 2;
+
+  // Without VK_QUERY_RESULT_WAIT_BIT, so scopes the submission didn't write
+  // just come back unavailable.
+  VkResult result = vkGetQueryPoolResults(
+      device_, query_pools_[slot], 0, query_count,
+      results_.size() * sizeof(uint64_t), results_.data(),
+      sizeof(uint64_t) * 2,
+      VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  if (result != VK_SUCCESS && result != VK_NOT_READY)
+    return 0.0;
+
+  double total_milliseconds = 0.0;
+  for (size_t i = 0; i < scopes_.size(); ++i) {
+    const uint64_t* begin = &results_[i * 4];
+    const uint64_t* end = &results_[i * 4 + 2];
+    if (begin[1] == 0 || end[1] == 0)
+      continue;
+
+    uint64_t ticks = (end[0] - begin[0]) & timestamp_mask_;
+    double milliseconds =
+        static_cast<double>(ticks) * timestamp_period_ / 1000000.0;
+
+    Scope& scope = scopes_[i];
+    scope.history.Add(milliseconds);
+    total_milliseconds += milliseconds;
+
+    if (csv_strm_.is_open())
+      csv_strm_ << frame << "," << scope.name << "," << milliseconds << "\n";
+  }
+  return total_milliseconds;
+}
+
+const std::string& GpuProfiler::GetScopeName(int scope) const {
+  return scopes_[scope].name;
+}
+
+void GpuProfiler::ClearStats() {
+  for (Scope& scope : scopes_) {
+    scope.history.Clear();
+  }
+}
+
+TimingStats GpuProfiler::GetStats(int scope) const {
+  return scopes_[scope].history.GetStats();
+}
+
+void GpuProfiler::PrintStats(std::ostream& strm) const {
+  for (int i = 0; i < GetScopeCount(); ++i) {
+    TimingStats stats = GetStats(i);
+    if (stats.sample_count == 0)
+      continue;
+
+    strm << "gpu " << scopes_[i].name
+         << " samples=" << stats.sample_count
+         << " mean_ms=" << stats.mean_ms
+         << " p50_ms=" << stats.p50_ms
+         << " p95_ms=" << stats.p95_ms
+         << " p99_ms=" << stats.p99_ms
+         << " max_ms=" << stats.max_ms << "\n";
+  }
+  strm.flush();
+}
+
+bool GpuProfiler::OpenCsv(const std::string& path) {
+  csv_strm_.open(path, std::ios::trunc);
+  if (!csv_strm_.is_open())
+    return false;
+
+  csv_strm_ << "frame,scope,milliseconds\n";
+  return true;
+}
+
+}  // namespace vk
+}  // namespace utils
\ No newline at end of file
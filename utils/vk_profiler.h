@@ -0,0 +1,96 @@
+#ifndef UTILS_VK_PROFILER_H_
+#define UTILS_VK_PROFILER_H_
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "utils/timing_stats.h"
+
+namespace utils {
+namespace vk {
+
+// Measures GPU time spent in named scopes with timestamp queries.
+//
+// Queries are grouped in slots, each with its own query pool holding a begin
+// and end timestamp for every scope. A command buffer resets the slot it
+// writes to with ResetSlot() before any of its scopes, so a slot should be
+// owned by whatever is submitted as a unit, usually a frame in flight.
+// Results are read back with Collect() once the submission is known to have
+// completed, which for a frame in flight is when its slot is about to be
+// reused, so reading them never stalls.
+//
+// All recording functions are no-ops unless Init() succeeded.
+class GpuProfiler {
+public:
+  // Number of samples per scope the statistics are computed over.
+  static constexpr int kDefaultHistorySize = 512;
+
+  // Scopes have to be added before Init(). Returns the scope's index.
+  int AddScope(const std::string& name);
+
+  // Fails if queues of `queue_family_index` don't support timestamps.
+  bool Init(VkPhysicalDevice physical_device, VkDevice device,
+            uint32_t queue_family_index, int slot_count,
+            int history_size = kDefaultHistorySize);
+  void Destroy();
+
+  bool IsEnabled() const { return !query_pools_.empty(); }
+
+  // Must be recorded outside of a render pass. Scopes shouldn't be recorded
+  // inside a multiview render pass either, since timestamps there take up one
+  // query per view.
+  void ResetSlot(VkCommandBuffer command_buffer, int slot);
+  void BeginScope(VkCommandBuffer command_buffer, int slot, int scope);
+  void EndScope(VkCommandBuffer command_buffer, int slot, int scope);
+
+  // Adds the scopes written by the last submission that used `slot` to the
+  // statistics. That submission must have completed, and `frame` is only
+  // used to label the CSV rows. Returns the summed milliseconds of the
+  // scopes it found, which assumes they don't nest.
+  double Collect(int slot, uint64_t frame);
+
+  // Drops every sample collected so far, for example the warm-up frames.
+  void ClearStats();
+
+  int GetScopeCount() const { return static_cast<int>(scopes_.size()); }
+  const std::string& GetScopeName(int scope) const;
+  TimingStats GetStats(int scope) const;
+
+  // One line per scope with samples.
+  void PrintStats(std::ostream& strm) const;
+
+  // Every sample collected from now on is also appended to `path` as a
+  // frame,scope,milliseconds row.
+  bool OpenCsv(const std::string& path);
+
+private:
+  struct Scope {
+    std::string name;
+    SampleHistory history;
+  };
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  std::vector<VkQueryPool> query_pools_;
+
+  // Nanoseconds per timestamp tick.
+  double timestamp_period_ = 1.0;
+  uint64_t timestamp_mask_ = ~uint64_t{0};
+
+  std::vector<Scope> scopes_;
+
+  // Scratch space for Collect(), holding a value and an availability word for
+  // every query.
+  std::vector<uint64_t> results_;
+
+  std::ofstream csv_strm_;
+};
+
+}  // namespace vk
+}  // namespace utils
+
+#endif  // UTILS_VK_PROFILER_H_
\ No newline at end of file
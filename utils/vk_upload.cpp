@@ -0,0 +1,223 @@
+#include "utils/vk_upload.h"
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "utils/vk.h"
+#include "utils/vk_allocator.h"
+
+namespace utils {
+namespace vk {
+
+namespace {
+
+constexpr VkDeviceSize kStagingAlignment = 16;
+
+VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace
+
+bool UploadManager::Init(VkDevice device, MemoryAllocator* allocator,
+                         uint32_t queue_family_index, VkQueue queue,
+                         VkDeviceSize staging_size) {
+  device_ = device;
+  allocator_ = allocator;
+  queue_ = queue;
+  staging_size_ = staging_size;
+  staging_head_ = 0;
+  current_batch_ = 0;
+
+  VkCommandPoolCreateInfo command_pool_info{};
+  command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  command_pool_info.queueFamilyIndex = queue_family_index;
+  command_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+      VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+  if (vkCreateCommandPool(device_, &command_pool_info, nullptr, &command_pool_)
+          != VK_SUCCESS) {
+    return false;
+  }
+
+  VkCommandBufferAllocateInfo command_buffer_info{};
+  command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  command_buffer_info.commandPool = command_pool_;
+  command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  command_buffer_info.commandBufferCount = 1;
+
+  VkFenceCreateInfo fence_info{};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  for (Batch& batch : batches_) {
+    if (vkAllocateCommandBuffers(device_, &command_buffer_info,
+                                 &batch.command_buffer) != VK_SUCCESS ||
+        vkCreateFence(device_, &fence_info, nullptr, &batch.fence)
+            != VK_SUCCESS) {
+      return false;
+    }
+  }
+
+  VkBufferCreateInfo staging_buffer_info{};
+  staging_buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  staging_buffer_info.size = staging_size_;
+  staging_buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  staging_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (!CreateBuffer(staging_buffer_info,
+                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                    device_, allocator_, staging_buffer_,
+                    staging_allocation_)) {
+    return false;
+  }
+
+  return true;
+}
+
+void UploadManager::Destroy() {
+  Wait();
+
+  for (Batch& batch : batches_) {
+    vkDestroyFence(device_, batch.fence, nullptr);
+    vkFreeCommandBuffers(device_, command_pool_, 1, &batch.command_buffer);
+  }
+  vkDestroyCommandPool(device_, command_pool_, nullptr);
+
+  vkDestroyBuffer(device_, staging_buffer_, nullptr);
+  allocator_->Free(staging_allocation_);
+}
+
+bool UploadManager::UploadToBuffer(const void* data, VkDeviceSize size,
+                                   VkBuffer buffer,
+                                   VkDeviceSize buffer_offset) {
+  const char* src = static_cast<const char*>(data);
+
+  while (size > 0) {
+    VkDeviceSize chunk_size = std::min(size, staging_size_);
+
+    VkDeviceSize staging_offset;
+    if (!ReserveStaging(chunk_size, &staging_offset))
+      return false;
+
+    memcpy(static_cast<char*>(staging_allocation_.mapped_data) +
+               staging_offset,
+           src, static_cast<size_t>(chunk_size));
+
+    VkBufferCopy copy_info{};
+    copy_info.srcOffset = staging_offset;
+    copy_info.dstOffset = buffer_offset;
+    copy_info.size = chunk_size;
+    vkCmdCopyBuffer(batches_[current_batch_].command_buffer, staging_buffer_,
+                    buffer, 1, &copy_info);
+
+    src += chunk_size;
+    buffer_offset += chunk_size;
+    size -= chunk_size;
+  }
+  return true;
+}
+
+bool UploadManager::Flush() {
+  Batch& batch = batches_[current_batch_];
+  if (!batch.recording)
+    return true;
+
+  if (vkEndCommandBuffer(batch.command_buffer) != VK_SUCCESS)
+    return false;
+
+  VkSubmitInfo submit_info{};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &batch.command_buffer;
+
+  vkResetFences(device_, 1, &batch.fence);
+  if (vkQueueSubmit(queue_, 1, &submit_info, batch.fence) != VK_SUCCESS)
+    return false;
+
+  batch.recording = false;
+  batch.submitted = true;
+
+  // The next batch reuses its command buffer, so it has to be done.
+  current_batch_ = (current_batch_ + 1) % kBatchCount;
+  return WaitForBatch(&batches_[current_batch_]);
+}
+
+bool UploadManager::Wait() {
+  if (!Flush())
+    return false;
+
+  for (Batch& batch : batches_) {
+    if (!WaitForBatch(&batch))
+      return false;
+  }
+  return true;
+}
+
+bool UploadManager::ReserveStaging(VkDeviceSize size, VkDeviceSize* offset) {
+  VkDeviceSize staging_offset = AlignUp(staging_head_, kStagingAlignment);
+
+  // A batch never wraps around the end of the ring, so that its range stays
+  // contiguous.
+  if (staging_offset + size > staging_size_) {
+    if (!Flush())
+      return false;
+    staging_offset = 0;
+  }
+
+  Batch& batch = batches_[current_batch_];
+
+  // Earlier batches may still be reading from this part of the ring.
+  for (Batch& other : batches_) {
+    if (&other == &batch || !other.submitted)
+      continue;
+    if (staging_offset < other.staging_end &&
+        other.staging_begin < staging_offset + size) {
+      if (!WaitForBatch(&other))
+        return false;
+    }
+  }
+
+  if (!batch.recording) {
+    if (!BeginBatch(&batch))
+      return false;
+    batch.staging_begin = staging_offset;
+  }
+  batch.staging_end = staging_offset + size;
+
+  staging_head_ = batch.staging_end;
+  *offset = staging_offset;
+  return true;
+}
+
+bool UploadManager::BeginBatch(Batch* batch) {
+  vkResetCommandBuffer(batch->command_buffer, 0);
+
+  VkCommandBufferBeginInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  if (vkBeginCommandBuffer(batch->command_buffer, &begin_info) != VK_SUCCESS)
+    return false;
+
+  batch->recording = true;
+  return true;
+}
+
+bool UploadManager::WaitForBatch(Batch* batch) {
+  if (!batch->submitted)
+    return true;
+
+  if (vkWaitForFences(device_, 1, &batch->fence, VK_TRUE, UINT64_MAX)
+          != VK_SUCCESS) {
+    return false;
+  }
+
+  batch->submitted = false;
+  return true;
+}
+
+}  // namespace vk
+}  // namespace utils
\ No newline at end of file
@@ -0,0 +1,74 @@
+#ifndef UTILS_VK_UPLOAD_H_
+#define UTILS_VK_UPLOAD_H_
+
+#include <vulkan/vulkan.h>
+
+#include "utils/vk_allocator.h"
+
+namespace utils {
+namespace vk {
+
+// Batches buffer uploads through one persistently mapped staging ring.
+//
+// Uploads are copied into the ring straight away and recorded into the
+// current batch's command buffer. Flush() submits the batch with a fence and
+// returns without waiting, so the next batch can be filled while the previous
+// one is still being copied. Destination buffers used on a different queue
+// family from `queue` need VK_SHARING_MODE_CONCURRENT.
+class UploadManager {
+public:
+  static constexpr VkDeviceSize kDefaultStagingSize = 16ull * 1024 * 1024;
+
+  bool Init(VkDevice device, MemoryAllocator* allocator,
+            uint32_t queue_family_index, VkQueue queue,
+            VkDeviceSize staging_size = kDefaultStagingSize);
+  void Destroy();
+
+  // `data` can be released as soon as this returns. Uploads bigger than the
+  // staging ring are split across several batches.
+  bool UploadToBuffer(const void* data, VkDeviceSize size, VkBuffer buffer,
+                      VkDeviceSize buffer_offset = 0);
+
+  // Submits everything uploaded since the last flush.
+  bool Flush();
+
+  // Flushes, then blocks until every submitted upload has completed.
+  bool Wait();
+
+private:
+  static constexpr int kBatchCount = 2;
+
+  struct Batch {
+    VkCommandBuffer command_buffer;
+    VkFence fence;
+
+    // Range of the staging ring used by the batch.
+    VkDeviceSize staging_begin = 0;
+    VkDeviceSize staging_end = 0;
+
+    bool recording = false;
+    bool submitted = false;
+  };
+
+  bool ReserveStaging(VkDeviceSize size, VkDeviceSize* offset);
+  bool BeginBatch(Batch* batch);
+  bool WaitForBatch(Batch* batch);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  MemoryAllocator* allocator_ = nullptr;
+  VkQueue queue_ = VK_NULL_HANDLE;
+
+  VkCommandPool command_pool_ = VK_NULL_HANDLE;
+  Batch batches_[kBatchCount];
+  int current_batch_ = 0;
+
+  VkBuffer staging_buffer_ = VK_NULL_HANDLE;
+  Allocation staging_allocation_;
+  VkDeviceSize staging_size_ = 0;
+  VkDeviceSize staging_head_ = 0;
+};
+
+}  // namespace vk
+}  // namespace utils
+
+#endif  // UTILS_VK_UPLOAD_H_
\ No newline at end of file